@@ -0,0 +1,35 @@
+/* bench.h--helpers shared by the benchmarks in this directory.
+ *
+ * each benchmark is a standalone program, linked with the mysock objects
+ * (see the Makefile's bench targets), that prints one line per result.
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef MIN
+    #define MIN(x,y)  ((x) <= (y) ? (x) : (y))
+#endif
+#ifndef MAX
+    #define MAX(x,y)  ((x) >= (y) ? (x) : (y))
+#endif
+
+/* monotonic time in seconds */
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* integer argument k of the command line, or def if it's missing */
+static int bench_arg(int argc, char *argv[], int k, int def)
+{
+    return (argc > k) ? atoi(argv[k]) : def;
+}
+
+#endif  /* __BENCH_H__ */
@@ -0,0 +1,103 @@
+/* connclose_bench.c--rate of short-lived connections.
+ *
+ * a child process opens a connection to the parent, writes a few bytes and
+ * closes it, over and over; the parent accepts each connection, reads it to
+ * EOF and closes it too.  reports the rate of complete connect/close cycles
+ * as seen by the client.  every cycle takes a mysocket context on each side
+ * and gives it back, so this is what the context pool (see mysock.c) is
+ * for; set STCP_CONTEXT_POOL_MAX=0 to run without it.
+ *
+ * usage: connclose_bench [connections]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mysock.h"
+#include "bench.h"
+
+
+#define CONNCLOSE_MESSAGE       "0123456789"
+#define CONNCLOSE_MESSAGE_LEN   (sizeof(CONNCLOSE_MESSAGE) - 1)
+
+static void run_client(struct sockaddr_in *server_addr, int num_conns)
+{
+    double start, elapsed;
+    int k, failed = 0;
+
+    start = bench_now();
+    for (k = 0; k < num_conns; ++k)
+    {
+        mysocket_t sd = mysocket(TRUE);
+
+        if (myconnect(sd, (struct sockaddr *) server_addr,
+                      sizeof(*server_addr)) < 0)
+        {
+            perror("myconnect");
+            exit(1);
+        }
+        if (mywrite(sd, CONNCLOSE_MESSAGE, CONNCLOSE_MESSAGE_LEN) !=
+                CONNCLOSE_MESSAGE_LEN ||
+            myclose(sd) < 0)
+            ++failed;
+    }
+    elapsed = bench_now() - start;
+
+    printf("%d connect/close cycles in %.3fs (%.0f/s), pool max %s, "
+           "%d failed\n", num_conns, elapsed, num_conns / elapsed,
+           getenv("STCP_CONTEXT_POOL_MAX") ? getenv("STCP_CONTEXT_POOL_MAX")
+                                           : "default", failed);
+    fflush(stdout);
+    exit(failed ? 1 : 0);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in server_addr;
+    socklen_t addr_len = sizeof(server_addr);
+    mysocket_t listen_sd;
+    int num_conns, k, status;
+    pid_t pid;
+
+    num_conns = bench_arg(argc, argv, 1, 2000);
+
+    listen_sd = mysocket(TRUE);
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    if (mybind(listen_sd, (struct sockaddr *) &server_addr,
+               sizeof(server_addr)) < 0 ||
+        mylisten(listen_sd, -1) < 0 ||
+        mygetsockname(listen_sd, (struct sockaddr *) &server_addr,
+                      &addr_len) < 0)
+    {
+        perror("listen");
+        return 1;
+    }
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    if ((pid = fork()) == 0)
+        run_client(&server_addr, num_conns);
+
+    for (k = 0; k < num_conns; ++k)
+    {
+        mysocket_t sd = myaccept(listen_sd, NULL, NULL);
+        char buf[64];
+
+        if (sd < 0)
+        {
+            perror("myaccept");
+            break;
+        }
+        while (myread(sd, buf, sizeof(buf)) > 0)
+            ;
+        myclose(sd);
+    }
+
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
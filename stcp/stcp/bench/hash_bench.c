@@ -0,0 +1,102 @@
+/* hash_bench.c--mysock_hash.h throughput at high load factors.
+ *
+ * fills a table of 2^20 slots to each of several load factors, up to just
+ * under the 7/8 at which it would grow, and times inserts, lookups of keys
+ * that are present and absent, and deletes, per operation.  also reports
+ * the mean probe length for a present key.  keys are either sequential (as
+ * mysocket descriptors tend to be) or random.
+ *
+ * usage: hash_bench [log2_slots]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "mysock_hash.h"
+#include "bench.h"
+
+
+#define MISS_BIT    0x80000000U     /* set only in keys that are absent */
+
+HASH_TABLE_DECLARE(bench_table, uint32_t, void *, 8);
+
+static uint32_t *keys;
+static volatile uintptr_t sink;
+
+
+static uint32_t xorshift32(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void run(const char *key_kind, unsigned int capacity, double load)
+{
+    unsigned int n = (unsigned int) (capacity * load), k;
+    double start, insert_ns, hit_ns, miss_ns, delete_ns;
+    unsigned long probes = 0;
+
+    start = bench_now();
+    for (k = 0; k < n; ++k)
+        HASH_INSERT(bench_table, keys[k], (void *) (uintptr_t) (k + 1));
+    insert_ns = (bench_now() - start) * 1e9 / n;
+    assert(bench_table.capacity == capacity && bench_table.count == n);
+
+    start = bench_now();
+    for (k = 0; k < n; ++k)
+        sink += (uintptr_t) HASH_LOOKUP_PTR(bench_table, keys[k]);
+    hit_ns = (bench_now() - start) * 1e9 / n;
+
+    start = bench_now();
+    for (k = 0; k < n; ++k)
+        sink += (uintptr_t) HASH_LOOKUP_PTR(bench_table, keys[k] ^ MISS_BIT);
+    miss_ns = (bench_now() - start) * 1e9 / n;
+
+    for (k = 0; k < capacity; ++k)
+        probes += bench_table.slots[k].dist;
+
+    start = bench_now();
+    for (k = 0; k < n; ++k)
+        HASH_DELETE(bench_table, keys[k]);
+    delete_ns = (bench_now() - start) * 1e9 / n;
+    assert(bench_table.count == 0);
+
+    printf("%-10s load %.3f: insert %5.1f ns, hit %5.1f ns, miss %5.1f ns, "
+           "delete %5.1f ns, mean probe %.2f\n", key_kind, load, insert_ns,
+           hit_ns, miss_ns, delete_ns, (double) probes / n);
+}
+
+int main(int argc, char *argv[])
+{
+    static const double loads[] = { 0.5, 0.75, 0.85, 0.875 };
+    unsigned int capacity = 1U << bench_arg(argc, argv, 1, 20), k, l;
+    uint32_t state = 2463534242U;
+
+    keys = (uint32_t *) malloc(capacity * sizeof(uint32_t));
+    assert(keys);
+
+    /* grow the table to its full size once, so no run includes a resize */
+    for (k = 0; k < capacity * 7 / 8; ++k)
+        HASH_INSERT(bench_table, k, NULL);
+    for (k = 0; k < capacity * 7 / 8; ++k)
+        HASH_DELETE(bench_table, k);
+    printf("%u slots\n", bench_table.capacity);
+
+    for (k = 0; k < capacity; ++k)
+        keys[k] = k;
+    for (l = 0; l < sizeof(loads) / sizeof(loads[0]); ++l)
+        run("sequential", capacity, loads[l]);
+
+    for (k = 0; k < capacity; ++k)
+        keys[k] = xorshift32(&state) & ~MISS_BIT;
+    for (l = 0; l < sizeof(loads) / sizeof(loads[0]); ++l)
+        run("random", capacity, loads[l]);
+
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,191 @@
+/* ring_bench.c--cost of passing packets through the network receive queue.
+ *
+ * compares the packet_ring_t used for network_recv_queue with the queue it
+ * replaced:  a linked list under data_ready_lock, with a calloc() and a
+ * malloc() per packet and a condition broadcast on every enqueue (which is
+ * reproduced here).  each is timed with the producer and consumer on one
+ * thread (enqueue a packet, dequeue it), which gives the per-packet
+ * overhead, and on two threads, as in the stack.  also reports what the
+ * ring adds to each mysocket context, which only has slots once a packet
+ * has arrived.
+ *
+ * usage: ring_bench [packets [packet_len]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "mysock_impl.h"
+#include "bench.h"
+
+
+#define BENCH_BATCH 16
+
+/* the queue network_recv_queue used to be */
+typedef struct list_node
+{
+    char             *data;
+    size_t            data_len;
+    struct list_node *next;
+} list_node_t;
+
+typedef struct
+{
+    list_node_t *head, *tail;
+} list_queue_t;
+
+static mysock_context_t *ctx;
+static list_queue_t list_queue;
+static unsigned int num_packets;
+static size_t packet_len;
+
+
+static void list_enqueue(const void *packet, size_t len)
+{
+    list_node_t *node = (list_node_t *) calloc(1, sizeof(list_node_t));
+
+    assert(node);
+    node->data = (char *) malloc(len);
+    assert(node->data);
+    memcpy(node->data, packet, len);
+    node->data_len = len;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if (!list_queue.head)
+        list_queue.head = list_queue.tail = node;
+    else
+        list_queue.tail = list_queue.tail->next = node;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+}
+
+static size_t list_dequeue(void *dst, size_t max_len)
+{
+    list_node_t *node;
+    size_t len;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    while (!(node = list_queue.head))
+        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+                                       &ctx->data_ready_lock));
+    if (!(list_queue.head = node->next))
+        list_queue.tail = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    len = node->data_len;
+    memcpy(dst, node->data, MIN(max_len, len));
+    free(node->data);
+    free(node);
+    return len;
+}
+
+static void ring_enqueue(const void *packet, size_t len)
+{
+    while (!_mysock_ring_enqueue(ctx, &ctx->network_recv_queue, packet, len))
+        sched_yield();
+}
+
+static void *list_producer(void *arg)
+{
+    char packet[MAX_IP_PAYLOAD_LEN];
+    unsigned int k;
+
+    memset(packet, 0x5a, sizeof(packet));
+    for (k = 0; k < num_packets; ++k)
+        list_enqueue(packet, packet_len);
+    return NULL;
+}
+
+static void *ring_producer(void *arg)
+{
+    char packet[MAX_IP_PAYLOAD_LEN];
+    unsigned int k;
+
+    memset(packet, 0x5a, sizeof(packet));
+    for (k = 0; k < num_packets; ++k)
+        ring_enqueue(packet, packet_len);
+    return NULL;
+}
+
+static void report(const char *name, double elapsed)
+{
+    printf("%-28s %8.1f ns/packet  %6.2f Mpkt/s\n", name,
+           elapsed * 1e9 / num_packets, num_packets / elapsed / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+    static char batch[BENCH_BATCH][MAX_IP_PAYLOAD_LEN];
+    char packet[MAX_IP_PAYLOAD_LEN];
+    size_t lens[BENCH_BATCH];
+    unsigned int k, n;
+    pthread_t producer;
+    double start;
+
+    num_packets = (unsigned int) bench_arg(argc, argv, 1, 2000000);
+    packet_len = (size_t) MIN(bench_arg(argc, argv, 2, 1448),
+                              MAX_IP_PAYLOAD_LEN);
+
+    ctx = (mysock_context_t *) calloc(1, sizeof(*ctx));
+    assert(ctx);
+    PTHREAD_CALL(pthread_mutex_init(&ctx->data_ready_lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&ctx->data_ready_cond, NULL));
+    memset(packet, 0x5a, sizeof(packet));
+
+    printf("%u packets of %u bytes\n", num_packets, (unsigned) packet_len);
+
+    start = bench_now();
+    for (k = 0; k < num_packets; ++k)
+    {
+        list_enqueue(packet, packet_len);
+        (void) list_dequeue(batch[0], sizeof(batch[0]));
+    }
+    report("list, one thread", bench_now() - start);
+
+    start = bench_now();
+    for (k = 0; k < num_packets; ++k)
+    {
+        ring_enqueue(packet, packet_len);
+        (void) _mysock_ring_dequeue(ctx, &ctx->network_recv_queue,
+                                    batch[0], sizeof(batch[0]));
+    }
+    report("ring, one thread", bench_now() - start);
+
+    start = bench_now();
+    for (k = 0; k < num_packets; k += BENCH_BATCH)
+    {
+        for (n = 0; n < BENCH_BATCH; ++n)
+            ring_enqueue(packet, packet_len);
+        n = _mysock_ring_dequeue_batch(ctx, &ctx->network_recv_queue, batch,
+                                       sizeof(batch[0]), lens, BENCH_BATCH);
+        assert(n == BENCH_BATCH);
+    }
+    report("ring, one thread, batch 16", bench_now() - start);
+
+    start = bench_now();
+    PTHREAD_CALL(pthread_create(&producer, NULL, list_producer, NULL));
+    for (k = 0; k < num_packets; ++k)
+        (void) list_dequeue(batch[0], sizeof(batch[0]));
+    PTHREAD_CALL(pthread_join(producer, NULL));
+    report("list, two threads", bench_now() - start);
+
+    start = bench_now();
+    PTHREAD_CALL(pthread_create(&producer, NULL, ring_producer, NULL));
+    for (k = 0; k < num_packets; k += n)
+        n = _mysock_ring_dequeue_batch(ctx, &ctx->network_recv_queue, batch,
+                                       sizeof(batch[0]), lens, BENCH_BATCH);
+    PTHREAD_CALL(pthread_join(producer, NULL));
+    report("ring, two threads, batch 16", bench_now() - start);
+
+    printf("mysock_context_t %u bytes, plus %u bytes of ring slots once a "
+           "packet arrives\n", (unsigned) sizeof(mysock_context_t),
+           (unsigned) (PACKET_RING_SLOTS * sizeof(packet_ring_slot_t)));
+
+    free(ctx->network_recv_queue.slots);
+    free(ctx);
+    return 0;
+}
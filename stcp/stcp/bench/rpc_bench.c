@@ -0,0 +1,168 @@
+/* rpc_bench.c--request/response latency, polled vs threaded stack.
+ *
+ * a client process sends fixed-size requests to a server process over
+ * loopback, one at a time, and the server echoes each back.  the round trip
+ * times are measured by the client.  this is done once with the stack in
+ * each mode (see mystack_set_mode()):  MYSTACK_THREADED, where each packet
+ * crosses from the receive engine thread to a transport worker and on to
+ * the application, and MYSTACK_POLLED, where the application's own thread
+ * does all of it.  each mode is run in a fresh pair of processes, as the
+ * mode can't be changed once the stack has started.
+ *
+ * usage: rpc_bench [requests [request_len]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mysock.h"
+#include "bench.h"
+
+
+#define RPC_MAX_LEN 4096
+
+static int num_requests, request_len;
+
+
+/* read exactly len bytes; returns FALSE on EOF or error */
+static bool_t read_all(mysocket_t sd, char *buf, int len)
+{
+    int got = 0, rc;
+
+    while (got < len && (rc = myread(sd, buf + got, len - got)) > 0)
+        got += rc;
+    return got == len;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void run_client(struct sockaddr_in *server_addr,
+                       const char *mode_name)
+{
+    char buf[RPC_MAX_LEN];
+    double *rtts, sum = 0, start;
+    mysocket_t sd = mysocket(TRUE);
+    int k;
+
+    rtts = (double *) malloc(num_requests * sizeof(double));
+    assert(rtts);
+
+    if (myconnect(sd, (struct sockaddr *) server_addr,
+                  sizeof(*server_addr)) < 0)
+    {
+        perror("myconnect");
+        exit(1);
+    }
+
+    memset(buf, 'r', sizeof(buf));
+    for (k = 0; k < num_requests; ++k)
+    {
+        start = bench_now();
+        if (mywrite(sd, buf, request_len) != request_len ||
+            !read_all(sd, buf, request_len))
+        {
+            fprintf(stderr, "request %d failed\n", k);
+            exit(1);
+        }
+        sum += (rtts[k] = bench_now() - start);
+    }
+
+    qsort(rtts, num_requests, sizeof(double), compare_doubles);
+    printf("%-8s %d x %d bytes: rtt mean %.1fus, p50 %.1fus, p99 %.1fus, "
+           "max %.1fus\n", mode_name, num_requests, request_len,
+           sum / num_requests * 1e6, rtts[num_requests / 2] * 1e6,
+           rtts[(int) (num_requests * 0.99)] * 1e6,
+           rtts[num_requests - 1] * 1e6);
+    fflush(stdout);
+
+    myclose(sd);
+    free(rtts);
+    exit(0);
+}
+
+static void run_mode(int mode, const char *mode_name)
+{
+    struct sockaddr_in server_addr;
+    socklen_t addr_len = sizeof(server_addr);
+    mysocket_t listen_sd, sd;
+    char buf[RPC_MAX_LEN];
+    struct linger linger;
+    int status;
+    pid_t pid;
+
+    if (mystack_set_mode(mode) < 0)
+    {
+        perror("mystack_set_mode");
+        exit(1);
+    }
+
+    listen_sd = mysocket(TRUE);
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    if (mybind(listen_sd, (struct sockaddr *) &server_addr,
+               sizeof(server_addr)) < 0 ||
+        mylisten(listen_sd, 1) < 0 ||
+        mygetsockname(listen_sd, (struct sockaddr *) &server_addr,
+                      &addr_len) < 0)
+    {
+        perror("listen");
+        exit(1);
+    }
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    if ((pid = fork()) == 0)
+        run_client(&server_addr, mode_name);
+
+    if ((sd = myaccept(listen_sd, NULL, NULL)) < 0)
+    {
+        perror("myaccept");
+        exit(1);
+    }
+    while (read_all(sd, buf, request_len))
+    {
+        if (mywrite(sd, buf, request_len) != request_len)
+            break;
+    }
+
+    /* in polled mode, nothing would finish the close while we're waiting
+     * for the client to exit, so linger until it's done.
+     */
+    linger.l_onoff = 1;
+    linger.l_linger = 5;
+    (void) mysetsockopt(sd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    myclose(sd);
+    waitpid(pid, &status, 0);
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+int main(int argc, char *argv[])
+{
+    int status, failed = 0;
+    pid_t pid;
+
+    num_requests = bench_arg(argc, argv, 1, 20000);
+    request_len = MIN(MAX(bench_arg(argc, argv, 2, 64), 1), RPC_MAX_LEN);
+
+    if ((pid = fork()) == 0)
+        run_mode(MYSTACK_THREADED, "threaded");
+    waitpid(pid, &status, 0);
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+
+    if ((pid = fork()) == 0)
+        run_mode(MYSTACK_POLLED, "polled");
+    waitpid(pid, &status, 0);
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+
+    return failed;
+}
@@ -0,0 +1,204 @@
+/* sched_bench.c--transport worker scheduling under heavy-tailed load.
+ *
+ * opens the given number of connections within one process, and runs a
+ * number of rounds over them.  in each round, every connection carries one
+ * flow, whose size is drawn from a Pareto distribution (so most flows are
+ * small, and a few are very large); all the flows start together, and a
+ * round ends when the last one has been received.  the sizes are the same
+ * from run to run.  reports the throughput over all rounds, and the
+ * completion times of the small flows, which are what suffer when they're
+ * stuck behind a large one on a busy worker.
+ *
+ * run it with STCP_TRANSPORT_STEAL=0 for static hashing of connections to
+ * workers, and STCP_TRANSPORT_THREADS to set the number of workers.
+ *
+ * usage: sched_bench [connections [rounds]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mysock.h"
+#include "bench.h"
+
+
+#define SCHED_MIN_FLOW      (4 * 1024)
+#define SCHED_MAX_FLOW      (4 * 1024 * 1024)
+#define SCHED_PARETO_ALPHA  1.2
+#define SCHED_SMALL_FLOW    (64 * 1024)  /* largest flow counted as small */
+
+static int num_conns, num_rounds;
+static long *flow_sizes;        /* num_rounds x num_conns */
+static double *flow_done;       /* completion times, as flow_sizes */
+static double round_start;
+static struct sockaddr_in server_addr;
+static pthread_barrier_t round_barrier;
+
+
+static void *client_func(void *arg)
+{
+    static char buf[64 * 1024];
+    int k = (int) (long) arg, round, rc;
+    mysocket_t sd = mysocket(TRUE);
+
+    if (myconnect(sd, (struct sockaddr *) &server_addr,
+                  sizeof(server_addr)) < 0 ||
+        mywrite(sd, &k, sizeof(k)) != sizeof(k))
+    {
+        perror("client");
+        exit(1);
+    }
+
+    for (round = 0; round < num_rounds; ++round)
+    {
+        long len = flow_sizes[round * num_conns + k], sent = 0;
+
+        pthread_barrier_wait(&round_barrier);
+        while (sent < len &&
+               (rc = mywrite(sd, buf, MIN((long) sizeof(buf), len - sent))) > 0)
+            sent += rc;
+        pthread_barrier_wait(&round_barrier);
+    }
+
+    return NULL;
+}
+
+static void *server_func(void *arg)
+{
+    char buf[8192];
+    mysocket_t sd = (mysocket_t) (long) arg;
+    int k, round, rc, got_len = 0;
+
+    while (got_len < (int) sizeof(k) &&
+           (rc = myread(sd, (char *) &k + got_len, sizeof(k) - got_len)) > 0)
+        got_len += rc;
+    assert(got_len == sizeof(k) && k >= 0 && k < num_conns);
+
+    for (round = 0; round < num_rounds; ++round)
+    {
+        long len = flow_sizes[round * num_conns + k], got = 0;
+
+        pthread_barrier_wait(&round_barrier);
+        while (got < len &&
+               (rc = myread(sd, buf, MIN((long) sizeof(buf), len - got))) > 0)
+            got += rc;
+        if (got != len)
+        {
+            fprintf(stderr, "flow %d/%d: got %ld of %ld bytes\n",
+                    round, k, got, len);
+            exit(1);
+        }
+        flow_done[round * num_conns + k] = bench_now() - round_start;
+        pthread_barrier_wait(&round_barrier);
+    }
+
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    socklen_t addr_len = sizeof(server_addr);
+    pthread_t *threads;
+    double *small_times, elapsed = 0, round_time;
+    long total_len = 0;
+    int k, round, num_flows, num_small = 0;
+    unsigned int seed = 1;
+    mysocket_t listen_sd;
+
+    num_conns = bench_arg(argc, argv, 1, 32);
+    num_rounds = bench_arg(argc, argv, 2, 5);
+    num_flows = num_conns * num_rounds;
+
+    flow_sizes = (long *) malloc(num_flows * sizeof(long));
+    flow_done = (double *) malloc(num_flows * sizeof(double));
+    small_times = (double *) malloc(num_flows * sizeof(double));
+    threads = (pthread_t *) malloc(2 * num_conns * sizeof(pthread_t));
+    assert(flow_sizes && flow_done && small_times && threads);
+
+    for (k = 0; k < num_flows; ++k)
+    {
+        double u = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+
+        flow_sizes[k] = (long) MIN(SCHED_MIN_FLOW *
+                                   pow(u, -1.0 / SCHED_PARETO_ALPHA),
+                                   (double) SCHED_MAX_FLOW);
+        total_len += flow_sizes[k];
+    }
+
+    listen_sd = mysocket(TRUE);
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    if (mybind(listen_sd, (struct sockaddr *) &server_addr,
+               sizeof(server_addr)) < 0 ||
+        mylisten(listen_sd, num_conns) < 0 ||
+        mygetsockname(listen_sd, (struct sockaddr *) &server_addr,
+                      &addr_len) < 0)
+    {
+        perror("listen");
+        return 1;
+    }
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    /* the clients, the servers, and us */
+    pthread_barrier_init(&round_barrier, NULL, 2 * num_conns + 1);
+
+    for (k = 0; k < num_conns; ++k)
+        pthread_create(&threads[k], NULL, client_func,
+                       (void *) (long) k);
+    for (k = 0; k < num_conns; ++k)
+    {
+        mysocket_t sd = myaccept(listen_sd, NULL, NULL);
+
+        assert(sd >= 0);
+        pthread_create(&threads[num_conns + k], NULL,
+                       server_func, (void *) (long) sd);
+    }
+
+    for (round = 0; round < num_rounds; ++round)
+    {
+        round_start = bench_now();
+        pthread_barrier_wait(&round_barrier);
+        pthread_barrier_wait(&round_barrier);
+
+        for (k = 0, round_time = 0; k < num_conns; ++k)
+            round_time = MAX(round_time, flow_done[round * num_conns + k]);
+        elapsed += round_time;
+    }
+
+    for (k = 0; k < num_flows; ++k)
+    {
+        if (flow_sizes[k] <= SCHED_SMALL_FLOW)
+            small_times[num_small++] = flow_done[k];
+    }
+    qsort(small_times, num_small, sizeof(double), compare_doubles);
+
+    printf("%d connections x %d rounds, %.1f MB, steal %s, %s workers: "
+           "%.2f MB/s\n", num_conns, num_rounds, total_len / 1048576.0,
+           getenv("STCP_TRANSPORT_STEAL") ? getenv("STCP_TRANSPORT_STEAL")
+                                          : "default",
+           getenv("STCP_TRANSPORT_THREADS") ? getenv("STCP_TRANSPORT_THREADS")
+                                            : "default",
+           total_len / elapsed / 1048576.0);
+    if (num_small > 0)
+        printf("%d small flows: completion p50 %.2fms, p99 %.2fms, "
+               "max %.2fms\n", num_small,
+               small_times[num_small / 2] * 1e3,
+               small_times[(int) (num_small * 0.99)] * 1e3,
+               small_times[num_small - 1] * 1e3);
+
+    fflush(stdout);
+    _exit(0);
+}
@@ -0,0 +1,123 @@
+/* storm_bench.c--accepting a storm of connections.
+ *
+ * forks the given number of client processes, each of which opens
+ * connections to the parent as fast as it can, writes a few bytes on each,
+ * and holds them all open.  the parent accepts every connection and reads
+ * its bytes.  reports the time until the last connection was accepted, and
+ * the accept rate; with many connections arriving at once, this is bound by
+ * how the listening socket's backlog handles SYNs and completed handshakes.
+ *
+ * usage: storm_bench [clients [connections_per_client [backlog]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <assert.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mysock.h"
+#include "bench.h"
+
+
+#define STORM_MESSAGE       "0123456789"
+#define STORM_MESSAGE_LEN   (sizeof(STORM_MESSAGE) - 1)
+
+static void run_client(struct sockaddr_in *server_addr, int num_conns)
+{
+    int k;
+
+    for (k = 0; k < num_conns; ++k)
+    {
+        mysocket_t sd = mysocket(TRUE);
+
+        if (myconnect(sd, (struct sockaddr *) server_addr,
+                      sizeof(*server_addr)) < 0 ||
+            mywrite(sd, STORM_MESSAGE, STORM_MESSAGE_LEN) !=
+                STORM_MESSAGE_LEN)
+        {
+            perror("client");
+            _exit(1);
+        }
+    }
+
+    /* hold the connections open until we're killed */
+    for (;;)
+        pause();
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in server_addr;
+    socklen_t addr_len = sizeof(server_addr);
+    int num_clients, conns_per_client, backlog, total, k;
+    mysocket_t listen_sd;
+    double start, elapsed;
+    pid_t *pids;
+
+    num_clients = bench_arg(argc, argv, 1, 16);
+    conns_per_client = bench_arg(argc, argv, 2, 200);
+    backlog = bench_arg(argc, argv, 3, 4096);
+
+    pids = (pid_t *) malloc(num_clients * sizeof(pid_t));
+    assert(pids);
+
+    listen_sd = mysocket(TRUE);
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    if (mybind(listen_sd, (struct sockaddr *) &server_addr,
+               sizeof(server_addr)) < 0 ||
+        mylisten(listen_sd, backlog) < 0 ||
+        mygetsockname(listen_sd, (struct sockaddr *) &server_addr,
+                      &addr_len) < 0)
+    {
+        perror("listen");
+        return 1;
+    }
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    start = bench_now();
+    for (k = 0; k < num_clients; ++k)
+    {
+        if ((pids[k] = fork()) == 0)
+            run_client(&server_addr, conns_per_client);
+    }
+
+    for (total = 0; total < num_clients * conns_per_client; ++total)
+    {
+        mysocket_t sd = myaccept(listen_sd, NULL, NULL);
+        char buf[STORM_MESSAGE_LEN];
+        int got = 0, rc;
+
+        if (sd < 0)
+        {
+            perror("myaccept");
+            break;
+        }
+        while (got < (int) STORM_MESSAGE_LEN &&
+               (rc = myread(sd, buf + got, STORM_MESSAGE_LEN - got)) > 0)
+            got += rc;
+        if (got != (int) STORM_MESSAGE_LEN)
+        {
+            fprintf(stderr, "connection %d: short read (%d bytes)\n",
+                    total, got);
+            break;
+        }
+    }
+    elapsed = bench_now() - start;
+
+    printf("%d clients x %d connections, backlog %d: accepted %d in %.3fs "
+           "(%.0f/s)\n", num_clients, conns_per_client, backlog, total,
+           elapsed, total / elapsed);
+    fflush(stdout);
+
+    for (k = 0; k < num_clients; ++k)
+        kill(pids[k], SIGKILL);
+    while (wait(NULL) > 0)
+        ;
+    _exit(total == num_clients * conns_per_client ? 0 : 1);
+}
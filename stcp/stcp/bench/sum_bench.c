@@ -0,0 +1,165 @@
+/* sum_bench.c--speed of the checksum summation loops.
+ *
+ * this includes tcp_sum.c itself, as tcp_sum_test.c does, so that its
+ * static loops can be called directly, and is linked with every object but
+ * tcp_sum.o.  each loop this CPU supports (the portable scalar one, SSE2
+ * and AVX2) is timed summing, and copying and summing, buffers of typical
+ * segment lengths at several source alignments.  the baseline is the loop
+ * tcp_sum.c had before them, which added up one 16-bit word at a time
+ * (skipping th_sum) and needed an even address; its copy is memcpy()
+ * followed by that loop.  reports the time per call and the throughput.
+ *
+ * usage: sum_bench [megabytes_per_run]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tcp_sum.c"
+#include "bench.h"
+
+
+#define SUM_MAX_LEN     1460
+#define SUM_MAX_ALIGN   64
+
+typedef struct
+{
+    const char *name;
+    checksum_sum_fn_t sum;
+    checksum_copy_fn_t copy;
+    bool_t even_only;   /* can't be given an odd address */
+} sum_impl_t;
+
+static volatile uint64_t sink;
+
+
+/* the summation loop from before the vectorised ones, less the pseudo
+ * header
+ */
+static uint64_t old_sum(const void *buf, size_t len)
+{
+    unsigned int k;
+    uint32_t sum = 0;
+
+    for (k = 0; k < (len >> 1); ++k)
+    {
+        if (k == (offsetof(struct tcphdr, th_sum) >> 1))
+            continue;   /* th_sum == 0 during checksum computation */
+        sum += ((const uint16_t *) buf)[k];
+    }
+
+    if (len & 1)
+    {
+        uint16_t tmp = 0;
+        *(uint8_t *) &tmp = ((const uint8_t *) buf)[len - 1];
+        sum += tmp;
+    }
+
+    return sum;
+}
+
+static uint64_t old_copy_sum(void *dst, const void *src, size_t len)
+{
+    memcpy(dst, src, len);
+    return old_sum(src, len);
+}
+
+/* seconds per call of impl's sum (or, if copy is TRUE, copy) loop */
+static double time_impl(const sum_impl_t *impl, bool_t copy,
+                        uint8_t *dst, const uint8_t *src, size_t len,
+                        long iterations)
+{
+    double start;
+    long k;
+
+    start = bench_now();
+    for (k = 0; k < iterations; ++k)
+    {
+        /* stop the compiler from treating the loops as pure, and hoisting
+         * them out of this one.
+         */
+        __asm__ __volatile__ ("" : : "r" (src), "r" (dst) : "memory");
+        sink += copy ? impl->copy(dst, src, len) : impl->sum(src, len);
+    }
+    return (bench_now() - start) / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t lengths[] = { 20, 64, 576, 1460 };
+    static const size_t aligns[] = { 0, 1, 2, 4 };
+    sum_impl_t impls[4];
+    int n_impls = 0, k;
+    long megabytes = bench_arg(argc, argv, 1, 64);
+    uint8_t *src_base, *dst;
+    size_t l, a, j;
+
+    impls[n_impls].name      = "old";
+    impls[n_impls].sum       = old_sum;
+    impls[n_impls].copy      = old_copy_sum;
+    impls[n_impls].even_only = TRUE;
+    ++n_impls;
+    impls[n_impls].name      = "scalar";
+    impls[n_impls].sum       = _mysock_sum_scalar;
+    impls[n_impls].copy      = _mysock_copy_sum_scalar;
+    impls[n_impls].even_only = FALSE;
+    ++n_impls;
+#ifdef CHECKSUM_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+    {
+        impls[n_impls].name      = "sse2";
+        impls[n_impls].sum       = _mysock_sum_sse2;
+        impls[n_impls].copy      = _mysock_copy_sum_sse2;
+        impls[n_impls].even_only = FALSE;
+        ++n_impls;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        impls[n_impls].name      = "avx2";
+        impls[n_impls].sum       = _mysock_sum_avx2;
+        impls[n_impls].copy      = _mysock_copy_sum_avx2;
+        impls[n_impls].even_only = FALSE;
+        ++n_impls;
+    }
+#endif
+
+    src_base = (uint8_t *) malloc(SUM_MAX_ALIGN + SUM_MAX_LEN);
+    dst = (uint8_t *) malloc(SUM_MAX_LEN);
+    assert(src_base && dst);
+    for (j = 0; j < SUM_MAX_ALIGN + SUM_MAX_LEN; ++j)
+        src_base[j] = (uint8_t) rand();
+
+    for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l)
+    {
+        long iterations = megabytes * 1048576 / (long) lengths[l];
+
+        for (a = 0; a < sizeof(aligns) / sizeof(aligns[0]); ++a)
+        {
+            const uint8_t *src = src_base + aligns[a];
+
+            for (k = 0; k < n_impls; ++k)
+            {
+                double sum_time, copy_time;
+
+                if (impls[k].even_only && (aligns[a] & 1))
+                    continue;
+
+                sum_time = time_impl(&impls[k], FALSE, dst, src,
+                                     lengths[l], iterations);
+                copy_time = time_impl(&impls[k], TRUE, dst, src,
+                                      lengths[l], iterations);
+                printf("%4u bytes, align %u: %-6s sum %6.1f ns "
+                       "(%5.2f GB/s), copy+sum %6.1f ns (%5.2f GB/s)\n",
+                       (unsigned) lengths[l], (unsigned) aligns[a],
+                       impls[k].name, sum_time * 1e9,
+                       lengths[l] / sum_time / 1e9, copy_time * 1e9,
+                       lengths[l] / copy_time / 1e9);
+            }
+        }
+    }
+
+    free(src_base);
+    free(dst);
+    return 0;
+}
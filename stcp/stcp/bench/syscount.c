@@ -0,0 +1,131 @@
+/* syscount.c--counts the socket calls a process makes, for the benchmarks.
+ *
+ * this is built as a shared library to be preloaded into any program using
+ * the stack, e.g.
+ *
+ *     LD_PRELOAD=bench/syscount.so bench/xfer_bench
+ *
+ * it wraps the socket I/O calls the network layer uses (and the local
+ * address lookups it used to make for every segment), counting them, and
+ * prints the counts to stderr when each process exits.  as the counting is
+ * done in the process rather than by tracing it, it works on any build of
+ * the stack, old or new.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+
+#define SYSCOUNT_CALLS \
+    X(recv) X(recvfrom) X(recvmsg) X(recvmmsg) \
+    X(send) X(sendto) X(sendmsg) X(sendmmsg) X(writev) \
+    X(getsockname) X(gethostname) X(gethostbyname_r)
+
+enum
+{
+#define X(name) SYSCOUNT_##name,
+    SYSCOUNT_CALLS
+#undef X
+    SYSCOUNT_NUM
+};
+
+static const char *syscount_names[SYSCOUNT_NUM] =
+{
+#define X(name) #name,
+    SYSCOUNT_CALLS
+#undef X
+};
+
+static unsigned long syscount_counts[SYSCOUNT_NUM];
+
+
+/* defines a wrapper for the given call, which counts it and then calls the
+ * real one.
+ */
+#define SYSCOUNT_WRAP(ret, name, params, args) \
+    ret name params \
+    { \
+        static ret (*real) params; \
+        if (!real) \
+            real = (ret (*) params) dlsym(RTLD_NEXT, #name); \
+        __atomic_add_fetch(&syscount_counts[SYSCOUNT_##name], 1, \
+                           __ATOMIC_RELAXED); \
+        return real args; \
+    }
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+SYSCOUNT_WRAP(ssize_t, recv,
+              (int fd, void *buf, size_t len, int flags),
+              (fd, buf, len, flags))
+SYSCOUNT_WRAP(ssize_t, recvfrom,
+              (int fd, void *buf, size_t len, int flags,
+               struct sockaddr *addr, socklen_t *addr_len),
+              (fd, buf, len, flags, addr, addr_len))
+SYSCOUNT_WRAP(ssize_t, recvmsg,
+              (int fd, struct msghdr *msg, int flags),
+              (fd, msg, flags))
+SYSCOUNT_WRAP(int, recvmmsg,
+              (int fd, struct mmsghdr *msgs, unsigned int vlen, int flags,
+               struct timespec *timeout),
+              (fd, msgs, vlen, flags, timeout))
+SYSCOUNT_WRAP(ssize_t, send,
+              (int fd, const void *buf, size_t len, int flags),
+              (fd, buf, len, flags))
+SYSCOUNT_WRAP(ssize_t, sendto,
+              (int fd, const void *buf, size_t len, int flags,
+               const struct sockaddr *addr, socklen_t addr_len),
+              (fd, buf, len, flags, addr, addr_len))
+SYSCOUNT_WRAP(ssize_t, sendmsg,
+              (int fd, const struct msghdr *msg, int flags),
+              (fd, msg, flags))
+SYSCOUNT_WRAP(int, sendmmsg,
+              (int fd, struct mmsghdr *msgs, unsigned int vlen, int flags),
+              (fd, msgs, vlen, flags))
+SYSCOUNT_WRAP(ssize_t, writev,
+              (int fd, const struct iovec *iov, int iovcnt),
+              (fd, iov, iovcnt))
+SYSCOUNT_WRAP(int, getsockname,
+              (int fd, struct sockaddr *addr, socklen_t *addr_len),
+              (fd, addr, addr_len))
+SYSCOUNT_WRAP(int, gethostname,
+              (char *name, size_t len),
+              (name, len))
+SYSCOUNT_WRAP(int, gethostbyname_r,
+              (const char *name, struct hostent *ret, char *buf,
+               size_t buf_len, struct hostent **result, int *h_errnop),
+              (name, ret, buf, buf_len, result, h_errnop))
+
+#ifdef __cplusplus
+}
+#endif
+
+
+/* print the counts; the destructor runs when the process calls exit() */
+__attribute__ ((destructor))
+static void syscount_report(void)
+{
+    char line[1024];
+    size_t len;
+    int k;
+
+    len = (size_t) snprintf(line, sizeof(line), "syscount[%d]:", (int) getpid());
+    for (k = 0; k < SYSCOUNT_NUM; ++k)
+    {
+        if (syscount_counts[k] && len < sizeof(line))
+            len += (size_t) snprintf(line + len, sizeof(line) - len, " %s %lu",
+                                     syscount_names[k], syscount_counts[k]);
+    }
+    if (len >= sizeof(line))
+        len = sizeof(line) - 1;
+    line[len++] = '\n';
+    (void) write(STDERR_FILENO, line, len);
+}
@@ -0,0 +1,106 @@
+/* xfer_bench.c--per-segment cost of a bulk transfer.
+ *
+ * a child process connects to the parent over loopback and writes the
+ * given number of megabytes; the parent reads it all.  reports the elapsed
+ * time, and the CPU time both processes spent per data segment (STCP_MSS
+ * bytes), which is what batching the receive path (see NETWORK_BATCH_SIZE
+ * in transport.c) is meant to cut.  the Makefile also links this with a
+ * transport built with NETWORK_BATCH_SIZE=1, as xfer_bench_nobatch, for
+ * comparison.
+ *
+ * usage: xfer_bench [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mysock.h"
+#include "transport.h"
+#include "bench.h"
+
+
+static double cpu_seconds(int who)
+{
+    struct rusage ru;
+
+    getrusage(who, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    long total_len, got = 0;
+    mysocket_t listen_sd, sd;
+    double start, elapsed, cpu;
+    char buf[8192];
+    int rc, status;
+    pid_t pid;
+
+    total_len = (long) bench_arg(argc, argv, 1, 16) * 1024 * 1024;
+
+    listen_sd = mysocket(TRUE);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (mybind(listen_sd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+        mylisten(listen_sd, 1) < 0 ||
+        mygetsockname(listen_sd, (struct sockaddr *) &sin, &sin_len) < 0)
+    {
+        perror("listen");
+        return 1;
+    }
+    sin.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    start = bench_now();
+    cpu = cpu_seconds(RUSAGE_SELF);
+
+    if ((pid = fork()) == 0)
+    {
+        long sent = 0;
+
+        sd = mysocket(TRUE);
+        if (myconnect(sd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+        {
+            perror("myconnect");
+            exit(1);
+        }
+
+        memset(buf, 'x', sizeof(buf));
+        while (sent < total_len &&
+               (rc = mywrite(sd, buf, MIN((long) sizeof(buf),
+                                          total_len - sent))) > 0)
+            sent += rc;
+        myclose(sd);
+        exit(sent == total_len ? 0 : 1);
+    }
+
+    if ((sd = myaccept(listen_sd, NULL, NULL)) < 0)
+    {
+        perror("myaccept");
+        return 1;
+    }
+    while ((rc = myread(sd, buf, sizeof(buf))) > 0)
+        got += rc;
+    myclose(sd);
+    waitpid(pid, &status, 0);
+
+    elapsed = bench_now() - start;
+    cpu = cpu_seconds(RUSAGE_SELF) - cpu + cpu_seconds(RUSAGE_CHILDREN);
+
+    printf("%ld bytes in %.3fs (%.2f MB/s), %.2f us CPU per %d-byte "
+           "segment%s\n", got, elapsed, got / elapsed / (1024 * 1024),
+           cpu * 1e6 / (got / STCP_MSS), STCP_MSS,
+           (got == total_len && WIFEXITED(status) && !WEXITSTATUS(status))
+               ? "" : " (transfer FAILED)");
+    return 0;
+}
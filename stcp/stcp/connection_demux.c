@@ -6,11 +6,15 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include "mysock_impl.h"
 #include "mysock_hash.h"
 #include "network_io.h"
 #include "transport.h"
 #include "connection_demux.h"
+#include "tcp_sum.h"
 
 
 
@@ -26,14 +30,14 @@ typedef struct
 
     /* network layer data associated with connection request */
     void *user_data;
-} connect_request_t;
 
-/* queue entry for a completed connection */
-typedef struct completed_connect
-{
-    connect_request_t        *request;
-    struct completed_connect *next;
-} completed_connect_t;
+    /* index of the next entry on the free list or the completed queue (or
+     * -1 if it's the last); unused while the connection is being set up.
+     */
+    int next;
+
+    bool_t completed;   /* handshake finished, waiting for myaccept() */
+} connect_request_t;
 
 /* connection backlog maintained per listening socket */
 typedef struct
@@ -41,13 +45,17 @@ typedef struct
     unsigned int         local_port;    /* host byte order */
     unsigned int         max_len;       /* # of allowed pending requests */
     unsigned int         cur_len;       /* curent # of pending requests */
+    unsigned int         num_half_open; /* # still in the handshake */
 
     /* connection_queue contains up to max_len pending connections that
-     * have not been accepted by the application yet.  completed entries in
-     * the queue are pointed to by completed_queue.
+     * have not been accepted by the application yet.  unused entries are
+     * linked from free_head, and completed ones, in the order they
+     * completed, from completed_head to completed_tail (-1 if none).
+     * these, cur_len and num_half_open are protected by connection_lock.
      */
     connect_request_t   *connection_queue;
-    completed_connect_t *completed_queue;
+    int                  free_head;
+    int                  completed_head, completed_tail;
     pthread_cond_t       connection_cond;
     pthread_mutex_t      connection_lock;
 } listen_queue_t;
@@ -58,26 +66,166 @@ typedef struct
         (r)->sd = -1; \
     }
 
+/* the connection queue entries in use, indexed by listening socket and
+ * peer address, so a retransmitted SYN is recognized without searching
+ * the queue.  entries are added and removed under the queue's
+ * connection_lock, and pending_lock as well, as the table is shared by
+ * all the queues.
+ */
+typedef struct
+{
+    mysocket_t listen_sd;
+    uint32_t   addr;        /* network byte order */
+    uint16_t   port;        /* network byte order */
+} pending_key_t;
+
+static bool_t _pending_key_equal(pending_key_t a, pending_key_t b)
+{
+    return a.listen_sd == b.listen_sd && a.addr == b.addr &&
+           a.port == b.port;
+}
+
+static uint32_t _pending_key_hash(pending_key_t key)
+{
+    return _hash_mix32(key.addr ^
+                       _hash_mix32(((uint32_t) key.port << 16) ^
+                                   (uint32_t) key.listen_sd));
+}
+
+HASH_TABLE_DECLARE_EXTENDED(pending_table, pending_key_t,
+                            connect_request_t *, _pending_key_hash,
+                            _pending_key_equal, 64);
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* maintains queue of pending connections per listening socket.
  * there is one entry in listen_table per passive (listening) socket.
  */
+#define LISTEN_TABLE_SIZE 16 /* initially; it grows as needed */
+
 HASH_TABLE_DECLARE(listen_table, mysocket_t, listen_queue_t *,
-                   MAX_NUM_CONNECTIONS);
+                   LISTEN_TABLE_SIZE);
 static pthread_rwlock_t listen_lock; /* XXX: see notes in network_io_vns.c */
 
+/* SYN cookies.  once a listening socket's queue is under pressure (at least
+ * half of it taken by connections still in the handshake, as in a SYN
+ * flood), a SYN is answered here with a SYN-ACK whose sequence number
+ * encodes the connection, rather than queued.  neither a queue entry nor a
+ * mysocket is taken for it; a mysocket is only set up if the peer's ACK
+ * comes back carrying a valid cookie, at which point the transport starts
+ * as if it had sent the SYN-ACK itself (see stcp_get_syn_ack_sent()).
+ *
+ * this is only stateless as far as this file goes.  the network layer
+ * still keeps whatever it needs to reach the peer and hear its ACK:  with
+ * the socket-based layer (network_io_socket.c), that's the kernel socket
+ * the SYN arrived on and a pending watch for it, both held until the ACK
+ * arrives, the peer closes, or the listening socket's closed.
+ *
+ * the cookie is SipHash-2-4 of the connection's addresses and ports, the
+ * SYN's sequence number and a coarse counter, keyed with 128 random bits;
+ * the counter's low bits are also kept in the cookie's upper bits, so old
+ * cookies expire.  the key is replaced every SYN_COOKIE_REKEY_TICKS ticks,
+ * and the one before is kept for checking cookies sent just before that.
+ *
+ * STCP_SYN_COOKIES in the environment sets when they're used:  0 never,
+ * 1 under pressure (the default), or 2 for every SYN the queue has room
+ * for.
+ */
+#define SYN_COOKIES_NEVER       0
+#define SYN_COOKIES_ON_PRESSURE 1
+#define SYN_COOKIES_ALWAYS      2
+
+#define SYN_COOKIE_PERIOD       64  /* seconds per counter tick */
+#define SYN_COOKIE_TICKS        2   /* a cookie's good for this many ticks */
+#define SYN_COOKIE_TICK_SHIFT   28
+#define SYN_COOKIE_TICK_MASK    0x7
+#define SYN_COOKIE_HASH_MASK    0x0fffffff
+#define SYN_COOKIE_REKEY_TICKS  4   /* at least SYN_COOKIE_TICKS - 1 */
+
+/* the window advertised in a cookie's SYN-ACK, as the transport's own does;
+ * the transport advertises its actual window once the connection's
+ * established.
+ */
+#define SYN_COOKIE_WINDOW       3072
+
+/* a cookie key, for the ticks from epoch * SYN_COOKIE_REKEY_TICKS on */
+typedef struct
+{
+    bool_t   valid;
+    uint32_t epoch;
+    uint64_t key[2];
+} syn_cookie_key_t;
+
+static int syn_cookie_mode = SYN_COOKIES_ON_PRESSURE;
+static syn_cookie_key_t syn_cookie_keys[2];     /* indexed by epoch % 2 */
+static pthread_mutex_t syn_cookie_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t syn_cookie_once = PTHREAD_ONCE_INIT;
+
 static listen_queue_t *_get_connection_queue(mysock_context_t *ctx);
+static void _syn_cookie_init(void);
+static bool_t _use_syn_cookie(const listen_queue_t *q);
+static bool_t _syn_cookie_key(uint32_t tick, bool_t create, uint64_t key[2]);
+static bool_t _syn_cookie(const mysock_context_t *ctx,
+                          const struct sockaddr  *peer_addr,
+                          uint32_t                syn_seq,
+                          uint32_t                tick,
+                          bool_t                  create,
+                          uint32_t               *cookie);
+static bool_t _send_syn_cookie(mysock_context_t      *ctx,
+                               const struct tcphdr   *syn,
+                               const struct sockaddr *peer_addr,
+                               int                    peer_addr_len,
+                               void                  *user_data);
+static bool_t _check_syn_cookie(const mysock_context_t *ctx,
+                                const struct tcphdr    *ack,
+                                const struct sockaddr  *peer_addr);
+static mysocket_t _start_passive_connection(mysock_context_t      *ctx,
+                                            listen_queue_t        *q,
+                                            pending_key_t          key,
+                                            const void            *packet,
+                                            size_t                 packet_len,
+                                            const struct sockaddr *peer_addr,
+                                            int                    peer_addr_len,
+                                            void                  *user_data,
+                                            bool_t                 cookie);
+static pending_key_t _pending_key(mysocket_t             listen_sd,
+                                  const struct sockaddr *peer_addr);
+static void _release_connect_request(listen_queue_t    *q,
+                                     mysocket_t         listen_sd,
+                                     connect_request_t *r);
 
 
 /* called by myaccept() to grab the first completed connection off the
- * given mysocket's connection queue, or block until one completes.
+ * given mysocket's connection queue, or block until one completes.  if
+ * block is FALSE and no connection has completed, this returns FALSE
+ * immediately.
+ */
+bool_t _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
+                                  mysock_context_t **new_ctx,
+                                  bool_t             block)
+{
+    if (_mysock_dequeue_connections(accept_ctx, new_ctx, 1, block) == 0)
+    {
+        *new_ctx = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* as _mysock_dequeue_connection(), but takes up to max_conns completed
+ * connections off the queue at once, in the order they completed, into
+ * new_ctxs.  returns the number taken; this is only 0 if block is FALSE
+ * and none had completed.
  */
-void _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
-                                mysock_context_t **new_ctx)
+unsigned int _mysock_dequeue_connections(mysock_context_t  *accept_ctx,
+                                         mysock_context_t **new_ctxs,
+                                         unsigned int       max_conns,
+                                         bool_t             block)
 {
     listen_queue_t *q;
-    completed_connect_t *r;
+    connect_request_t *r;
+    unsigned int num_conns = 0;
 
-    assert(accept_ctx && new_ctx);
+    assert(accept_ctx && new_ctxs && max_conns > 0);
     assert(accept_ctx->listening && accept_ctx->bound);
 
     DEBUG_LOG(("waiting for new connection...\n"));
@@ -86,35 +234,40 @@ void _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
     assert(q);
 
     PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
-    while (!q->completed_queue)
+    while (q->completed_head < 0)
     {
-        PTHREAD_CALL(pthread_cond_wait(&q->connection_cond,
-                                       &q->connection_lock));
-    }
+        if (!block)
+        {
+            PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
+            PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+            return 0;
+        }
 
-    r = q->completed_queue;
-    q->completed_queue = q->completed_queue->next;
+        _mysock_stack_wait(&q->connection_cond, &q->connection_lock);
+    }
 
-    DEBUG_LOG(("dequeueing established connection from %s:%hu\n",
-               inet_ntoa(((struct sockaddr_in *)
-                          &r->request->peer_addr)->sin_addr),
-               ntohs(((struct sockaddr_in *)
-                      &r->request->peer_addr)->sin_port)));
+    do
+    {
+        r = &q->connection_queue[q->completed_head];
+        if ((q->completed_head = r->next) < 0)
+            q->completed_tail = -1;
 
-    assert(r->request);
-    *new_ctx = _mysock_get_context(r->request->sd);
-    assert(*new_ctx);
+        DEBUG_LOG(("dequeueing established connection from %s:%hu\n",
+                   inet_ntoa(((struct sockaddr_in *) &r->peer_addr)->sin_addr),
+                   ntohs(((struct sockaddr_in *) &r->peer_addr)->sin_port)));
 
-    /* free up this entry from the listen queue */
-    INVALIDATE_CONNECT_REQUEST(r->request);
-    memset(r, 0, sizeof(*r));
-    free(r);
+        new_ctxs[num_conns] = _mysock_get_context(r->sd);
+        assert(new_ctxs[num_conns]);
+        ++num_conns;
 
-    assert(q->cur_len > 0);
-    --q->cur_len;
+        /* free up this entry from the listen queue */
+        _release_connect_request(q, accept_ctx->my_sd, r);
+    } while (num_conns < max_conns && q->completed_head >= 0);
 
+    _mysock_set_accept_ready(accept_ctx, q->completed_head >= 0);
     PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
     PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+    return num_conns;
 }
 
 static void _debug_print_connection(const char *msg, const char *reason,
@@ -135,7 +288,9 @@ static void _debug_print_connection(const char *msg, const char *reason,
  * corresponding listen queue if one exists and there's sufficient
  * space, or dropped otherwise.  ctx is the context associated with
  * a mysocket for which myaccept() will be called (i.e., a listening
- * socket).
+ * socket).  if the queue's under pressure, a SYN is instead answered with
+ * a SYN cookie, and the connection's only queued once the peer's ACK of
+ * that arrives here in turn.
  *
  * returns TRUE if the new connection has been queued, FALSE otherwise.
  */
@@ -147,162 +302,278 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
                                   void                  *user_data)
 {
     listen_queue_t *q;
-    connect_request_t *queue_entry = NULL;
-    unsigned int k;
+    const struct tcphdr *hdr = (const struct tcphdr *) packet;
+    pending_key_t key;
+    mysocket_t new_sd = -1;
+    bool_t retransmission;
 
     assert(ctx && ctx->listening && ctx->bound);
     assert(packet && peer_addr);
-    assert(peer_addr_len > 0);
+    assert(peer_addr_len > 0 && peer_addr->sa_family == AF_INET);
 
 #define DEBUG_CONNECTION_MSG(msg, reason) \
     _debug_print_connection(msg, reason, ctx, peer_addr)
 
+    PTHREAD_CALL(pthread_once(&syn_cookie_once, _syn_cookie_init));
+
     PTHREAD_CALL(pthread_rwlock_rdlock(&listen_lock));
     if (packet_len < sizeof(struct tcphdr) ||
-        !(((struct tcphdr *) packet)->th_flags & TH_SYN))
+        (!(hdr->th_flags & TH_SYN) &&
+         (!(hdr->th_flags & TH_ACK) || syn_cookie_mode == SYN_COOKIES_NEVER)))
     {
         DEBUG_CONNECTION_MSG("received non-SYN packet", "(ignoring)");
         goto done;  /* not a connection setup request */
     }
 
+    if (!_mysock_accept_packet(ctx, peer_addr, packet, packet_len))
+    {
+        DEBUG_CONNECTION_MSG("dropping SYN packet", "(bad checksum)");
+        goto done;
+    }
+
     if (!(q = _get_connection_queue(ctx)))
     {
         DEBUG_CONNECTION_MSG("dropping SYN packet", "(socket not listening)");
         goto done;  /* the socket was closed or not listening */
     }
 
+    PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
+
     /* see if this is a retransmission of an existing request */
-    for (k = 0; k < q->max_len; ++k)
-    {
-        connect_request_t *r = &q->connection_queue[k];
+    key = _pending_key(ctx->my_sd, peer_addr);
+    PTHREAD_CALL(pthread_mutex_lock(&pending_lock));
+    retransmission = HASH_ENTRY_EXISTS(pending_table, key);
+    PTHREAD_CALL(pthread_mutex_unlock(&pending_lock));
 
-        assert(r->sd == -1 ||
-               peer_addr_len == r->peer_addr_len);  /* both are sockaddr_in */
-        if (!memcmp(&r->peer_addr, peer_addr, peer_addr_len))
-        {
-            DEBUG_CONNECTION_MSG("dropping SYN packet",
-                                 "(retransmission of queued request)");
-            goto done;  /* retransmission */
-        }
+    if (retransmission)
+    {
+        DEBUG_CONNECTION_MSG("dropping SYN packet",
+                             "(retransmission of queued request)");
     }
-
-    /* if it's not a retransmission, find an empty slot in the incomplete
-     * connection table
-     */
-    if (q->cur_len < q->max_len)
+    else if (!(hdr->th_flags & TH_SYN))
     {
-        for (k = 0; k < q->max_len && !queue_entry; ++k)
+        /* an ACK with no connection for it; see if it's the peer's answer
+         * to a SYN cookie.
+         */
+        if (!_check_syn_cookie(ctx, hdr, peer_addr))
         {
-            if (q->connection_queue[k].sd < 0)
-                queue_entry = &q->connection_queue[k];
+            DEBUG_CONNECTION_MSG("received non-SYN packet",
+                                 "(no valid SYN cookie; ignoring)");
         }
-
-        assert(queue_entry);
-        ++q->cur_len;
-    }
-
-    if (queue_entry)
-    {
-        mysock_context_t *new_ctx;
-
-        /* establish the connection */
-        assert(queue_entry->sd == -1);
-        if ((queue_entry->sd =
-             _mysock_new_mysocket(ctx->network_state.is_reliable)) < 0)
+        else if (q->free_head < 0)
         {
-            DEBUG_CONNECTION_MSG("dropping SYN packet",
-                                 "(couldn't allocate new mysocket)");
-            INVALIDATE_CONNECT_REQUEST(queue_entry);
-            --q->cur_len;
-            queue_entry = NULL;
-            goto done;
+            DEBUG_CONNECTION_MSG("dropping SYN cookie ACK", "(queue full)");
         }
+        else
+        {
+            DEBUG_CONNECTION_MSG("received valid SYN cookie ACK", "");
+            new_sd = _start_passive_connection(ctx, q, key,
+                                               packet, packet_len,
+                                               peer_addr, peer_addr_len,
+                                               user_data, TRUE);
+        }
+    }
+    else if (_use_syn_cookie(q))
+    {
+        /* no mysocket is set up until the cookie comes back, although
+         * the network layer keeps its channel to the peer until then.
+         */
+        if (_send_syn_cookie(ctx, hdr, peer_addr, peer_addr_len, user_data))
+            DEBUG_CONNECTION_MSG("answered SYN packet", "(with SYN cookie)");
+        else
+            DEBUG_CONNECTION_MSG("dropping SYN packet", "(send failed)");
+    }
+    else if (q->free_head < 0)
+    {
+        /* the packet is dropped (maximum backlog reached) */
+        DEBUG_CONNECTION_MSG("dropping SYN packet", "(queue full)");
+    }
+    else
+    {
+        new_sd = _start_passive_connection(ctx, q, key, packet, packet_len,
+                                           peer_addr, peer_addr_len,
+                                           user_data, FALSE);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
 
-        new_ctx = _mysock_get_context(queue_entry->sd);
-        new_ctx->listen_sd = ctx->my_sd;
+    /* the transport may complete the connection at any moment after this,
+     * which takes the queue's lock.
+     */
+    if (new_sd >= 0)
+        _mysock_transport_init(new_sd, FALSE);
 
-        new_ctx->network_state.peer_addr       = *peer_addr;
-        new_ctx->network_state.peer_addr_len   = peer_addr_len;
-        new_ctx->network_state.peer_addr_valid = TRUE;
+done:
+    PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+    return (new_sd >= 0);
 
-        queue_entry->peer_addr     = *peer_addr;
-        queue_entry->peer_addr_len = peer_addr_len;
-        queue_entry->user_data     = (void *) user_data;
+#undef DEBUG_CONNECTION_MSG
+}
 
-        DEBUG_CONNECTION_MSG("establishing connection", "");
+/* take a free entry in the connection queue for a new connection from
+ * peer_addr, and set up its mysocket.  packet is the first packet for the
+ * transport:  the SYN, or if cookie is TRUE, the ACK of a SYN cookie, in
+ * which case the SYN-ACK has already been sent.  returns the new mysocket
+ * (not yet started), or -1 if it couldn't be set up.  the caller holds the
+ * queue's connection_lock.
+ */
+static mysocket_t _start_passive_connection(mysock_context_t      *ctx,
+                                            listen_queue_t        *q,
+                                            pending_key_t          key,
+                                            const void            *packet,
+                                            size_t                 packet_len,
+                                            const struct sockaddr *peer_addr,
+                                            int                    peer_addr_len,
+                                            void                  *user_data,
+                                            bool_t                 cookie)
+{
+    connect_request_t *queue_entry;
+    mysock_context_t *new_ctx;
 
-        /* update any additional network layer state based on the initial
-         * packet, e.g. remapped sequence numbers, etc.
-         */
-        _network_update_passive_state(&new_ctx->network_state,
-                                      &ctx->network_state,
-                                      user_data, packet, packet_len);
+    assert(ctx && q && packet && peer_addr);
+    assert(q->free_head >= 0);
 
-        _mysock_transport_init(queue_entry->sd, FALSE);
+    queue_entry = &q->connection_queue[q->free_head];
+    q->free_head = queue_entry->next;
+    ++q->cur_len;
+    ++q->num_half_open;
 
-        /* pass the SYN packet on to the main STCP code */
-        _mysock_enqueue_buffer(new_ctx, &new_ctx->network_recv_queue,
-                               packet, packet_len);
+    /* establish the connection */
+    assert(queue_entry->sd == -1);
+    if ((queue_entry->sd =
+         _mysock_new_mysocket(ctx->network_state.is_reliable)) < 0)
+    {
+        _debug_print_connection("dropping SYN packet",
+                                "(couldn't allocate new mysocket)",
+                                ctx, peer_addr);
+        _release_connect_request(q, ctx->my_sd, queue_entry);
+        return -1;
     }
-    else
+
+    new_ctx = _mysock_get_context(queue_entry->sd);
+    new_ctx->listen_sd    = ctx->my_sd;
+    new_ctx->listen_index = (int) (queue_entry - q->connection_queue);
+
+    if (cookie)
     {
-        /* the packet is dropped (maximum backlog reached) */
-        DEBUG_CONNECTION_MSG("dropping SYN packet", "(queue full)");
+        const struct tcphdr *ack = (const struct tcphdr *) packet;
+
+        new_ctx->syn_ack_sent = TRUE;
+        new_ctx->syn_seq      = ntohl(ack->th_seq) - 1;
+        new_ctx->syn_ack_seq  = ntohl(ack->th_ack) - 1;
     }
 
-done:
-    PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
-    return (queue_entry != NULL);
+    /* as with TCP, the new socket inherits the listener's options */
+    new_ctx->app_recv_queue.capacity_limit =
+        ctx->app_recv_queue.capacity_limit;
+    new_ctx->linger = ctx->linger;
 
-#undef DEBUG_CONNECTION_MSG
+    new_ctx->network_state.peer_addr       = *peer_addr;
+    new_ctx->network_state.peer_addr_len   = peer_addr_len;
+    new_ctx->network_state.peer_addr_valid = TRUE;
+
+    queue_entry->peer_addr     = *peer_addr;
+    queue_entry->peer_addr_len = peer_addr_len;
+    queue_entry->user_data     = (void *) user_data;
+    queue_entry->next          = -1;
+
+    PTHREAD_CALL(pthread_mutex_lock(&pending_lock));
+    HASH_INSERT(pending_table, key, queue_entry);
+    PTHREAD_CALL(pthread_mutex_unlock(&pending_lock));
+
+    _debug_print_connection("establishing connection", "", ctx, peer_addr);
+
+    /* update any additional network layer state based on the initial
+     * packet, e.g. remapped sequence numbers, etc.
+     */
+    _network_update_passive_state(&new_ctx->network_state,
+                                  &ctx->network_state,
+                                  user_data, packet, packet_len);
+
+    /* pass the initial packet on to the main STCP code.  this is queued
+     * before the network receive engine starts watching the new
+     * connection, as the engine thread watching it must be the ring's
+     * only producer from then on.
+     */
+    (void) _mysock_ring_enqueue(new_ctx, &new_ctx->network_recv_queue,
+                                packet, packet_len);
+    return queue_entry->sd;
 }
 
+/* queue a passive connection for myaccept() once its handshake completes
+ * (or it fails).  nothing's queued if its listening socket has been closed
+ * meanwhile, as the connection is then closing too.
+ */
 void _mysock_passive_connection_complete(mysock_context_t *ctx)
 {
+    mysock_context_t *listen_ctx;
     listen_queue_t *q;
 
     assert(ctx);
 
     PTHREAD_CALL(pthread_rwlock_rdlock(&listen_lock));
-    assert(ctx->listen_sd >= 0);
-    if ((q = _get_connection_queue(_mysock_get_context(ctx->listen_sd))))
+    if ((listen_ctx = _mysock_get_context(ctx->listen_sd)) &&
+        (q = _get_connection_queue(listen_ctx)))
     {
-        completed_connect_t *tail, *new_entry;
-        connect_request_t *connection_req = NULL;
-        unsigned int k;
-
-        /* find this connection in the incomplete connection queue */
-        for (k = 0; k < q->max_len && !connection_req; ++k)
-        {
-            if (q->connection_queue[k].sd == ctx->my_sd)
-                connection_req = &q->connection_queue[k];
-        }
-
-        assert(connection_req);
-
-        new_entry = (completed_connect_t *)malloc(sizeof(completed_connect_t));
-        assert(new_entry);
-
-        new_entry->request = connection_req;
-        new_entry->next = NULL;
+        int k = ctx->listen_index;
 
         PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
+        assert(k >= 0 && (unsigned int) k < q->max_len);
+        assert(q->connection_queue[k].sd == ctx->my_sd);
 
         /* add established connection to tail of completed connection queue */
-        for (tail = q->completed_queue; tail && tail->next; tail = tail->next)
-            ;
-
-        if (tail)
-            tail->next = new_entry;
+        assert(!q->connection_queue[k].completed);
+        assert(q->num_half_open > 0);
+        q->connection_queue[k].completed = TRUE;
+        q->connection_queue[k].next = -1;
+        --q->num_half_open;
+        if (q->completed_tail >= 0)
+            q->connection_queue[q->completed_tail].next = k;
         else
-            q->completed_queue = new_entry;
+            q->completed_head = k;
+        q->completed_tail = k;
 
+        _mysock_set_accept_ready(listen_ctx, TRUE);
         PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
         PTHREAD_CALL(pthread_cond_signal(&q->connection_cond));
     }
     PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
 }
 
+/* called once a passive connection's handshake completes.  returns TRUE,
+ * with the deadline for it, if its listening socket defers accepts (see
+ * MYTCP_DEFER_ACCEPT) and the peer hasn't sent anything yet.
+ */
+bool_t _mysock_should_defer_accept(mysock_context_t *ctx,
+                                   struct timespec  *deadline)
+{
+    mysock_context_t *listen_ctx;
+    bool_t defer = FALSE;
+    int secs;
+
+    assert(ctx && deadline);
+    assert(!ctx->is_active);
+
+    PTHREAD_CALL(pthread_rwlock_rdlock(&listen_lock));
+    if ((listen_ctx = _mysock_get_context(ctx->listen_sd)) &&
+        _get_connection_queue(listen_ctx) &&
+        (secs = __atomic_load_n(&listen_ctx->defer_accept,
+                                __ATOMIC_RELAXED)) > 0)
+    {
+        struct timeval now;
+
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        defer = (ctx->app_send_queue.len == 0 && !ctx->app_send_queue.eof);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+        gettimeofday(&now, NULL);
+        deadline->tv_sec  = now.tv_sec + secs;
+        deadline->tv_nsec = now.tv_usec * 1000;
+    }
+    PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+
+    return defer;
+}
+
 /* called by mylisten() to specify the number of pending connection
  * requests permitted for a listening socket.  a backlog of zero
  * specifies at most one pending connection is permitted for the socket.
@@ -328,7 +599,9 @@ void _mysock_set_backlog(mysock_context_t *ctx, unsigned int backlog)
         q = (listen_queue_t *) calloc(1, sizeof(listen_queue_t));
         assert(q);
 
-        q->local_port = local_port;
+        q->local_port     = local_port;
+        q->free_head      = -1;
+        q->completed_head = q->completed_tail = -1;
 
         PTHREAD_CALL(pthread_cond_init(&q->connection_cond, NULL));
         PTHREAD_CALL(pthread_mutex_init(&q->connection_lock, NULL));
@@ -345,20 +618,43 @@ void _mysock_set_backlog(mysock_context_t *ctx, unsigned int backlog)
                     max_len * sizeof(connect_request_t));
         assert(q->connection_queue);
 
-        memset(q->connection_queue + q->max_len, 0,
-               (max_len - q->max_len) * sizeof(connect_request_t));
-    }
+        /* the entries in use may have moved */
+        PTHREAD_CALL(pthread_mutex_lock(&pending_lock));
+        for (k = 0; k < q->max_len; ++k)
+        {
+            connect_request_t *r = &q->connection_queue[k];
+
+            if (r->peer_addr_len > 0)
+            {
+                HASH_SET_ENTRY(pending_table,
+                               _pending_key(ctx->my_sd, &r->peer_addr), r);
+            }
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&pending_lock));
 
-    for (k = q->max_len; k < max_len; ++k)
-        q->connection_queue[k].sd = -1;
-    q->max_len = max_len;
+        /* the new entries go on the free list, lowest first */
+        for (k = max_len; k-- > q->max_len; )
+        {
+            INVALIDATE_CONNECT_REQUEST(&q->connection_queue[k]);
+            q->connection_queue[k].next = q->free_head;
+            q->free_head = (int) k;
+        }
+        q->max_len = max_len;
+    }
 
     PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
 }
 
-/* called by myclose() on a passive socket */
+/* called by myclose() on a passive socket.  the connections queued on it
+ * that haven't been passed up to the user via myaccept() are detached from
+ * it, and closed once the listen table's unlocked, as their workers may
+ * need it meanwhile.  they're closed without lingering, since the
+ * application never had them.
+ */
 void _mysock_close_passive_socket(mysock_context_t *ctx)
 {
+    mysocket_t *orphans = NULL;
+    unsigned int k, num_orphans = 0;
     listen_queue_t *q;
 
     assert(ctx && ctx->listening && ctx->bound);
@@ -366,27 +662,33 @@ void _mysock_close_passive_socket(mysock_context_t *ctx)
     PTHREAD_CALL(pthread_rwlock_wrlock(&listen_lock));
     if ((q = _get_connection_queue(ctx)) != NULL)
     {
-        /* close any queued connections that haven't been passed up to the
-         * user via myaccept()...
-         */
-        unsigned int k;
-        completed_connect_t *connect_iter;
+        orphans = (mysocket_t *) malloc(q->max_len * sizeof(*orphans));
+        assert(orphans || q->max_len == 0);
 
         for (k = 0; k < q->max_len; ++k)
         {
-            if (q->connection_queue[k].sd != -1)
-                myclose(q->connection_queue[k].sd);
+            connect_request_t *r = &q->connection_queue[k];
+            mysock_context_t *child_ctx;
+
+            if (r->sd == -1)
+                continue;
+
+            PTHREAD_CALL(pthread_mutex_lock(&pending_lock));
+            HASH_DELETE(pending_table,
+                        _pending_key(ctx->my_sd, &r->peer_addr));
+            PTHREAD_CALL(pthread_mutex_unlock(&pending_lock));
+
+            if ((child_ctx = _mysock_get_context(r->sd)) != NULL)
+            {
+                child_ctx->listen_sd = -1;
+                __atomic_store_n(&child_ctx->accept_deferred, FALSE,
+                                 __ATOMIC_RELEASE);
+                child_ctx->linger.l_onoff = 0;
+                orphans[num_orphans++] = r->sd;
+            }
         }
         free(q->connection_queue);
 
-        for (connect_iter = q->completed_queue; connect_iter; )
-        {
-            /* note: socket was closed by the preceding loop */
-            completed_connect_t *next = connect_iter->next;
-            free(connect_iter);
-            connect_iter = next;
-        }
-
         PTHREAD_CALL(pthread_cond_destroy(&q->connection_cond));
         PTHREAD_CALL(pthread_mutex_destroy(&q->connection_lock));
 
@@ -395,6 +697,10 @@ void _mysock_close_passive_socket(mysock_context_t *ctx)
         free(q);
     }
     PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+
+    for (k = 0; k < num_orphans; ++k)
+        (void) myclose(orphans[k]);
+    free(orphans);
 }
 
 /* assumes calling code has locked the listen table */
@@ -404,3 +710,304 @@ static listen_queue_t *_get_connection_queue(mysock_context_t *ctx)
     return HASH_LOOKUP_PTR(listen_table, ctx->my_sd);
 }
 
+static pending_key_t _pending_key(mysocket_t             listen_sd,
+                                  const struct sockaddr *peer_addr)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) peer_addr;
+    pending_key_t key;
+
+    assert(peer_addr && peer_addr->sa_family == AF_INET);
+
+    memset(&key, 0, sizeof(key));
+    key.listen_sd = listen_sd;
+    key.addr      = sin->sin_addr.s_addr;
+    key.port      = sin->sin_port;
+    return key;
+}
+
+/* return a connection queue entry to the free list, once its connection
+ * has been accepted or failed to start.  the caller holds the queue's
+ * connection_lock.
+ */
+static void _release_connect_request(listen_queue_t    *q,
+                                     mysocket_t         listen_sd,
+                                     connect_request_t *r)
+{
+    assert(q && r);
+
+    if (r->peer_addr_len > 0)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&pending_lock));
+        HASH_DELETE(pending_table, _pending_key(listen_sd, &r->peer_addr));
+        PTHREAD_CALL(pthread_mutex_unlock(&pending_lock));
+    }
+
+    if (!r->completed)
+    {
+        assert(q->num_half_open > 0);
+        --q->num_half_open;
+    }
+
+    INVALIDATE_CONNECT_REQUEST(r);
+    r->next = q->free_head;
+    q->free_head = (int) (r - q->connection_queue);
+
+    assert(q->cur_len > 0);
+    --q->cur_len;
+}
+
+/* read STCP_SYN_COOKIES */
+static void _syn_cookie_init(void)
+{
+    const char *mode = getenv("STCP_SYN_COOKIES");
+
+    if (mode && *mode)
+    {
+        syn_cookie_mode = atoi(mode);
+        if (syn_cookie_mode < SYN_COOKIES_NEVER ||
+            syn_cookie_mode > SYN_COOKIES_ALWAYS)
+            syn_cookie_mode = SYN_COOKIES_ON_PRESSURE;
+    }
+}
+
+/* returns TRUE if a new SYN on the given queue should be answered with a
+ * SYN cookie.  a queue that's full of completed connections, waiting for
+ * the application to accept them, isn't helped by cookies:  the peer's ACK
+ * would find no room either, and as STCP has no way to refuse a connection
+ * once the peer thinks it's established, the SYN is better dropped so the
+ * peer retries it.  the caller holds the queue's connection_lock.
+ */
+static bool_t _use_syn_cookie(const listen_queue_t *q)
+{
+    assert(q);
+
+    switch (syn_cookie_mode)
+    {
+    case SYN_COOKIES_NEVER:
+        return FALSE;
+    case SYN_COOKIES_ALWAYS:
+        return q->free_head >= 0;
+    default:
+        return q->free_head >= 0 && 2 * q->num_half_open >= q->max_len;
+    }
+}
+
+static uint32_t _syn_cookie_tick(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) (now.tv_sec / SYN_COOKIE_PERIOD);
+}
+
+#define SIPHASH_ROTL(x, b)  (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPHASH_ROUND(v) \
+    do { \
+        v[0] += v[1]; v[1] = SIPHASH_ROTL(v[1], 13); v[1] ^= v[0]; \
+        v[0] = SIPHASH_ROTL(v[0], 32); \
+        v[2] += v[3]; v[3] = SIPHASH_ROTL(v[3], 16); v[3] ^= v[2]; \
+        v[0] += v[3]; v[3] = SIPHASH_ROTL(v[3], 21); v[3] ^= v[0]; \
+        v[2] += v[1]; v[1] = SIPHASH_ROTL(v[1], 17); v[1] ^= v[2]; \
+        v[2] = SIPHASH_ROTL(v[2], 32); \
+    } while (0)
+
+/* SipHash-2-4 of the len bytes at data, with the given 128-bit key */
+static uint64_t _siphash24(const uint64_t key[2],
+                           const unsigned char *data, size_t len)
+{
+    uint64_t v[4], m;
+    size_t k, j;
+
+    v[0] = key[0] ^ 0x736f6d6570736575ULL;
+    v[1] = key[1] ^ 0x646f72616e646f6dULL;
+    v[2] = key[0] ^ 0x6c7967656e657261ULL;
+    v[3] = key[1] ^ 0x7465646279746573ULL;
+
+    /* the message is taken in little-endian words, the last of them padded
+     * with zeros and holding the length in its top byte.
+     */
+    for (k = 0; k <= len; k += 8)
+    {
+        m = (k + 8 > len) ? (uint64_t) len << 56 : 0;
+        for (j = 0; j < 8 && k + j < len; ++j)
+            m |= (uint64_t) data[k + j] << (8 * j);
+
+        v[3] ^= m;
+        SIPHASH_ROUND(v);
+        SIPHASH_ROUND(v);
+        v[0] ^= m;
+    }
+
+    v[2] ^= 0xff;
+    for (k = 0; k < 4; ++k)
+        SIPHASH_ROUND(v);
+
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+#undef SIPHASH_ROUND
+#undef SIPHASH_ROTL
+
+/* fill key with random bits */
+static void _syn_cookie_random_key(uint64_t key[2])
+{
+    struct timespec now;
+    bool_t ok = FALSE;
+    int fd;
+
+    if ((fd = open("/dev/urandom", O_RDONLY)) >= 0)
+    {
+        ok = (read(fd, key, 2 * sizeof(uint64_t)) ==
+              (ssize_t) (2 * sizeof(uint64_t)));
+        close(fd);
+    }
+
+    if (!ok)
+    {
+        /* this is guessable, but it's all there is without /dev/urandom */
+        clock_gettime(CLOCK_REALTIME, &now);
+        key[0] = ((uint64_t) _hash_mix32((uint32_t) now.tv_nsec) << 32) |
+                 _hash_mix32((uint32_t) now.tv_sec ^ (uint32_t) getpid());
+        key[1] = ((uint64_t) _hash_mix32((uint32_t) key[0]) << 32) |
+                 _hash_mix32((uint32_t) (key[0] >> 32) ^
+                             (uint32_t) (uintptr_t) &now);
+    }
+}
+
+/* copy the key for cookies during the given tick to key.  if create is
+ * TRUE, a new key's picked once the tick's reached a new epoch (only the
+ * current tick is passed then, so this never replaces a newer key); if
+ * not, FALSE is returned unless the key's still kept.
+ */
+static bool_t _syn_cookie_key(uint32_t tick, bool_t create, uint64_t key[2])
+{
+    uint32_t epoch = tick / SYN_COOKIE_REKEY_TICKS;
+    syn_cookie_key_t *entry = &syn_cookie_keys[epoch % 2];
+    bool_t found;
+
+    PTHREAD_CALL(pthread_mutex_lock(&syn_cookie_lock));
+    if (create && (!entry->valid || entry->epoch != epoch))
+    {
+        _syn_cookie_random_key(entry->key);
+        entry->epoch = epoch;
+        entry->valid = TRUE;
+    }
+    if ((found = (entry->valid && entry->epoch == epoch)))
+        memcpy(key, entry->key, sizeof(entry->key));
+    PTHREAD_CALL(pthread_mutex_unlock(&syn_cookie_lock));
+
+    return found;
+}
+
+/* set *cookie to the SYN-ACK sequence number for a SYN from peer_addr to
+ * ctx with sequence number syn_seq, during the given counter tick.  the
+ * top bit's always clear, so the connection's sequence numbers don't wrap
+ * early on.  returns FALSE if the tick's key is no longer kept; create is
+ * as for _syn_cookie_key().
+ */
+static bool_t _syn_cookie(const mysock_context_t *ctx,
+                          const struct sockaddr  *peer_addr,
+                          uint32_t                syn_seq,
+                          uint32_t                tick,
+                          bool_t                  create,
+                          uint32_t               *cookie)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) peer_addr;
+    const struct sockaddr_in *local_sin =
+        (const struct sockaddr_in *) &ctx->network_state.local_addr;
+    unsigned char message[20];
+    uint16_t local_port;
+    uint64_t key[2];
+
+    assert(ctx && peer_addr && peer_addr->sa_family == AF_INET && cookie);
+
+    if (!_syn_cookie_key(tick, create, key))
+        return FALSE;
+
+    /* the listening socket's bound address, which may be INADDR_ANY, and
+     * its port stand for the local end.
+     */
+    local_port = (uint16_t) _network_get_port(
+        (network_context_t *) &ctx->network_state);
+
+    memcpy(&message[0],  &local_sin->sin_addr.s_addr, 4);
+    memcpy(&message[4],  &sin->sin_addr.s_addr, 4);
+    memcpy(&message[8],  &local_port, 2);
+    memcpy(&message[10], &sin->sin_port, 2);
+    memcpy(&message[12], &syn_seq, 4);
+    memcpy(&message[16], &tick, 4);
+
+    *cookie = ((tick & SYN_COOKIE_TICK_MASK) << SYN_COOKIE_TICK_SHIFT) |
+              ((uint32_t) _siphash24(key, message, sizeof(message)) &
+               SYN_COOKIE_HASH_MASK);
+    return TRUE;
+}
+
+/* answer the given SYN with a SYN-ACK carrying a cookie for it.  returns
+ * TRUE if it was sent.
+ */
+static bool_t _send_syn_cookie(mysock_context_t      *ctx,
+                               const struct tcphdr   *syn,
+                               const struct sockaddr *peer_addr,
+                               int                    peer_addr_len,
+                               void                  *user_data)
+{
+    struct tcphdr syn_ack;
+    uint32_t syn_seq, cookie;
+
+    assert(ctx && syn && peer_addr);
+
+    syn_seq = ntohl(syn->th_seq);
+    if (!_syn_cookie(ctx, peer_addr, syn_seq, _syn_cookie_tick(), TRUE,
+                     &cookie))
+        return FALSE;
+
+    memset(&syn_ack, 0, sizeof(syn_ack));
+    syn_ack.th_sport = (uint16_t) _network_get_port(&ctx->network_state);
+    syn_ack.th_dport = ((const struct sockaddr_in *) peer_addr)->sin_port;
+    syn_ack.th_seq   = htonl(cookie);
+    syn_ack.th_ack   = htonl(syn_seq + 1);
+    syn_ack.th_off   = sizeof(struct tcphdr) / 4;
+    syn_ack.th_flags = TH_SYN | TH_ACK;
+    syn_ack.th_win   = htons(SYN_COOKIE_WINDOW);
+
+    if (_mysock_checksum_required(ctx))
+        _mysock_set_checksum_to_peer(peer_addr, &syn_ack, sizeof(syn_ack));
+
+    return _network_reply_passive(&ctx->network_state, user_data,
+                                  peer_addr, peer_addr_len,
+                                  &syn_ack, sizeof(syn_ack)) ==
+           (ssize_t) sizeof(syn_ack);
+}
+
+/* returns TRUE if the given ACK acknowledges a SYN-ACK sent by
+ * _send_syn_cookie() within the last SYN_COOKIE_TICKS ticks.  the peer's
+ * ACK carries the sequence number following its SYN's.
+ */
+static bool_t _check_syn_cookie(const mysock_context_t *ctx,
+                                const struct tcphdr    *ack,
+                                const struct sockaddr  *peer_addr)
+{
+    uint32_t cookie, syn_seq, tick, expected;
+    unsigned int k;
+
+    assert(ctx && ack && peer_addr);
+
+    if (!(ack->th_flags & TH_ACK) || (ack->th_flags & (TH_SYN | TH_RST)))
+        return FALSE;
+
+    cookie  = ntohl(ack->th_ack) - 1;
+    syn_seq = ntohl(ack->th_seq) - 1;
+    tick    = _syn_cookie_tick();
+
+    for (k = 0; k < SYN_COOKIE_TICKS; ++k)
+    {
+        if (((tick - k) & SYN_COOKIE_TICK_MASK) ==
+            (cookie >> SYN_COOKIE_TICK_SHIFT) &&
+            _syn_cookie(ctx, peer_addr, syn_seq, tick - k, FALSE,
+                        &expected) &&
+            expected == cookie)
+            return TRUE;
+    }
+    return FALSE;
+}
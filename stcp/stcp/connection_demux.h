@@ -7,8 +7,13 @@
 
 struct mysock_context;
 
-void _mysock_dequeue_connection(struct mysock_context  *accept_ctx,
-                                struct mysock_context **new_ctx);
+bool_t _mysock_dequeue_connection(struct mysock_context  *accept_ctx,
+                                  struct mysock_context **new_ctx,
+                                  bool_t                  block);
+unsigned int _mysock_dequeue_connections(struct mysock_context  *accept_ctx,
+                                         struct mysock_context **new_ctxs,
+                                         unsigned int            max_conns,
+                                         bool_t                  block);
 
 bool_t _mysock_enqueue_connection(struct mysock_context *ctx,
                                   const void            *packet,
@@ -21,6 +26,8 @@ void _mysock_set_backlog(struct mysock_context *ctx, unsigned int backlog);
 void _mysock_close_passive_socket(struct mysock_context *ctx);
 
 void _mysock_passive_connection_complete(struct mysock_context *new_ctx);
+bool_t _mysock_should_defer_accept(struct mysock_context *new_ctx,
+                                   struct timespec       *deadline);
 
 #endif  /* __CONNECTION_DEMUX_H__ */
 
@@ -1,6 +1,7 @@
 /* mysock.c--socket layer implementation */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
@@ -10,36 +11,90 @@
 #include "mysock.h"
 #include "mysock_impl.h"
 #include "network_io.h"
+#include "network.h"
 #include "stcp_api.h"
 #include "transport.h"
 
 
-#ifdef NDEBUG
-    #define ASSERT_VALID_MYSOCKET_DESCRIPTOR(ctx, sd)
-#else
-    #define ASSERT_VALID_MYSOCKET_DESCRIPTOR(ctx, sd) \
-        verify_mysocket_descriptor(ctx, sd)
-#endif  /*NDEBUG*/
+/* mysocket descriptor table, one entry per STCP connection.
+ *
+ * the table is allocated in chunks as it grows, and a chunk never moves or
+ * goes away once allocated, so _mysock_get_context() can look descriptors
+ * up without locking.  free entries are kept on a list, so allocating a
+ * descriptor takes constant time.
+ *
+ * the low bits of a mysocket descriptor index the table; the rest hold
+ * the entry's generation, which changes each time the entry is freed, so a
+ * descriptor that's used after it's closed is caught even if its entry
+ * has been reused since.
+ */
+#define SD_INDEX_BITS       20
+#define SD_GENERATION_MASK  ((1U << (31 - SD_INDEX_BITS)) - 1)
+#define SD_INDEX(sd)        ((unsigned int) (sd) & (MAX_NUM_CONNECTIONS - 1))
+#define SD_GENERATION(sd)   ((unsigned int) (sd) >> SD_INDEX_BITS)
+#define SD_MAKE(index, generation) \
+    ((mysocket_t) (((generation) << SD_INDEX_BITS) | (index)))
 
+#define SD_CHUNK_SIZE       1024
+#define SD_NUM_CHUNKS       (MAX_NUM_CONNECTIONS / SD_CHUNK_SIZE)
 
-/* helper functions to start transport layer and network receive threads */
-static void *transport_thread_func(void *arg);
+#if MAX_NUM_CONNECTIONS != (1 << SD_INDEX_BITS)
+    #error SD_INDEX_BITS does not match MAX_NUM_CONNECTIONS
+#endif
 
-static void verify_mysocket_descriptor(mysock_context_t *comp_ctx,
-                                       mysocket_t        my_sd);
-static mysock_context_t *_mysock_allocate_context(void);
-static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq);
+typedef struct
+{
+    mysock_context_t *ctx;          /* NULL if the entry is free */
+    unsigned int      generation;
+    int               next_free;    /* next free entry's index, or -1 */
+} mysock_descriptor_t;
+
+static mysock_descriptor_t *descriptor_chunks[SD_NUM_CHUNKS];
+static unsigned int num_descriptor_chunks;
+static int first_free_descriptor = -1;
+static pthread_mutex_t descriptor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* contexts of closed mysockets, kept for reuse by new ones.  setting up a
+ * context from scratch means zeroing all of it, initialising its locks, and
+ * allocating its network layer state.  a pooled context keeps its locks,
+ * its network layer allocation, its packet ring's slots, and its byte ring
+ * buffers (up to CONTEXT_POOL_KEEP_BUFFER bytes each), so only its socket
+ * is created afresh.  sockets that have been connected
+ * can't be reused, nor can myeventfd() descriptors, which the application
+ * may still have registered elsewhere, so those are closed as before.
+ *
+ * STCP_CONTEXT_POOL gives the number of contexts set up ahead of time, when
+ * the first mysocket is created (0 by default), and STCP_CONTEXT_POOL_MAX
+ * the most kept in the pool (CONTEXT_POOL_DEFAULT_MAX by default); any more
+ * are freed on close.  setting the latter to 0 turns the pool off.
+ */
+#define CONTEXT_POOL_DEFAULT_MAX    64
+#define CONTEXT_POOL_KEEP_BUFFER    MYSOCK_DEFAULT_SNDBUF
+
+static mysock_context_t *context_pool;  /* linked by pool_next */
+static unsigned int context_pool_len;
+static unsigned int context_pool_max = CONTEXT_POOL_DEFAULT_MAX;
+static pthread_mutex_t context_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t context_pool_once = PTHREAD_ONCE_INIT;
 
 
-/* mysocket descriptor table, one entry per STCP connection */
-static mysock_context_t *global_ctx[MAX_NUM_CONNECTIONS];
+static mysock_context_t *_mysock_allocate_context(void);
+static mysock_context_t *_mysock_create_context(void);
+static void _mysock_destroy_context(mysock_context_t *ctx);
+static void _mysock_reset_context(mysock_context_t *ctx);
+static void _mysock_byte_ring_reset(byte_ring_t *ring);
+static void _mysock_context_pool_init(void);
+static bool_t _mysock_context_pool_reserve(void);
+static void _mysock_context_pool_put(mysock_context_t *ctx);
+static mysock_descriptor_t *_mysock_get_descriptor(unsigned int index);
+static mysocket_t _mysock_allocate_descriptor(mysock_context_t *ctx);
+static void _mysock_release_descriptor(mysock_context_t *ctx);
 
 
 /* create a new mysocket, and find space in our mysocket descriptor table */
 mysocket_t _mysock_new_mysocket(bool_t is_reliable)
 {
     mysock_context_t *connection_context = _mysock_allocate_context();
-    int k;
 
     if (!connection_context)
     {
@@ -48,32 +103,51 @@ mysocket_t _mysock_new_mysocket(bool_t is_reliable)
     }
 
     /* propagates down to new connections arriving on a listening socket */
-    connection_context->network_state.is_reliable = is_reliable;
+    _network_set_reliability(&connection_context->network_state, is_reliable);
 
-    /* search for a free mysocket descriptor */
-    for (k = 0; k < MAX_NUM_CONNECTIONS; ++k)
+    if (_mysock_allocate_descriptor(connection_context) < 0)
     {
-        if (!global_ctx[k])
-        {
-            global_ctx[k] = connection_context;
-            connection_context->my_sd = k;
-            return k;
-        }
+        _mysock_free_context(connection_context);
+        errno = EMFILE;
+        return -1;
     }
 
-    _mysock_free_context(connection_context);
-    errno = EMFILE;
-    return -1;
+    return connection_context->my_sd;
 }
 
 /* obtain a pointer to the connection context for the given mysocket
- * descriptor.
+ * descriptor.  returns NULL if the descriptor isn't open.
  */
 mysock_context_t *_mysock_get_context(mysocket_t sd)
 {
-    ASSERT_VALID_MYSOCKET_DESCRIPTOR(NULL, sd);
-    return (sd >= 0 && sd < (int)ARRAY_DIM(global_ctx))
-        ? global_ctx[sd] : NULL;
+    mysock_descriptor_t *d;
+    mysock_context_t *ctx;
+
+    if (sd < 0 || !(d = _mysock_get_descriptor(SD_INDEX(sd))))
+        return NULL;
+
+    /* the entry's cleared before its generation changes when it's freed */
+    ctx = __atomic_load_n(&d->ctx, __ATOMIC_ACQUIRE);
+    if (!ctx ||
+        __atomic_load_n(&d->generation, __ATOMIC_ACQUIRE) != SD_GENERATION(sd))
+        return NULL;
+
+    assert(ctx->my_sd == sd);
+    return ctx;
+}
+
+/* as _mysock_get_context(), for the application's mysock calls.  a mysocket
+ * that's been passed to myclose() isn't open any more as far as they're
+ * concerned, although its descriptor stays in use until the connection has
+ * finished closing.
+ */
+mysock_context_t *_mysock_get_open_context(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    if (ctx && __atomic_load_n(&ctx->app_closed, __ATOMIC_ACQUIRE))
+        return NULL;
+    return ctx;
 }
 
 /* initiate a new STCP connection; called by myconnect() and myaccept() */
@@ -84,35 +158,49 @@ void _mysock_transport_init(mysocket_t sd, bool_t is_active)
     assert(!connection_context->listening);
     connection_context->is_active = is_active;
 
-    /* start a new network thread; this handles incoming data, passing it
-     * up to the transport layer.  (the network input is threaded so we can
-     * keep track of timeouts/when data arrives, in a portable manner
-     * independent of the underlying network I/O functionality).
+    /* start receiving network packets; the network layer passes incoming
+     * data up to the transport layer as it arrives.  (the network input is
+     * queued so we can keep track of timeouts/when data arrives, in a
+     * portable manner independent of the underlying network I/O
+     * functionality).
      */
-    if (_network_start_recv_thread(connection_context) < 0)
+    if (_network_start_recv(connection_context) < 0)
     {
         assert(0);
         abort();
     }
 
-    /* start a new transport layer thread */
-    connection_context->transport_thread = _mysock_create_thread(
-        transport_thread_func,
-        connection_context,
-        FALSE);
-    connection_context->transport_thread_started = TRUE;
+    /* hand the connection to its transport worker */
+    _mysock_worker_start(connection_context);
 }
 
-int _mysock_wait_for_connection(mysock_context_t *ctx)
+/* wait until the connection on the given mysocket is established, or
+ * fails.  returns 0 if it's established, or -1 with errno set to the
+ * error.  if block is FALSE and the connection is still in progress, this
+ * returns -1 immediately, with errno set to EAGAIN.
+ */
+int _mysock_wait_for_connection(mysock_context_t *ctx, bool_t block)
 {
     assert(ctx);
 
+    if (!ctx->transport_started)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
     /* block until we either connect to the peer, or hit an error */
     PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
     while (ctx->blocking)
     {
-        PTHREAD_CALL(pthread_cond_wait(&ctx->blocking_cond,
-                                       &ctx->blocking_lock));
+        if (!block)
+        {
+            PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+            errno = EAGAIN;
+            return -1;
+        }
+
+        _mysock_stack_wait(&ctx->blocking_cond, &ctx->blocking_lock);
     }
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
 
@@ -120,157 +208,457 @@ int _mysock_wait_for_connection(mysock_context_t *ctx)
 }
 
 
-/* add an incoming buffer (packet) to a queue for this connection; it will be
- * dequeued by stcp_network_recv() or myread() when the transport layer or
- * application is ready to use it, depending on the queue to which
- * the buffer (or packet) is added.
- *
- * in the interest of simplicity (and since we aren't writing a high
- * performance TCP stack), this just copies the specified buffer for its own
- * use, so the calling code can do whatever it wants with the packet
- * afterwards.  the copied buffer is freed later by dequeue_buffer().
+/* returns the number of bytes that can be read from the given byte ring
+ * without wrapping, and sets *span to point to the first of them.
  */
-void _mysock_enqueue_buffer(mysock_context_t *ctx,
-                            packet_queue_t   *pq,
-                            const void       *packet,
-                            size_t            packet_len)
+size_t _mysock_byte_ring_read_span(const byte_ring_t *ring,
+                                  const char       **span)
+{
+    assert(ring && span);
+
+    *span = ring->data + ring->head;
+    return MIN(ring->len, ring->capacity - ring->head);
+}
+
+/* discard len bytes from the front of the byte ring, e.g. once they've been
+ * read through _mysock_byte_ring_read_span().
+ */
+void _mysock_byte_ring_consume(byte_ring_t *ring, size_t len)
 {
-    packet_queue_node_t *node;
+    assert(ring && len <= ring->len);
 
-    assert(ctx && pq && (packet || !packet_len));
+    ring->len -= len;
+    ring->head = ring->len ? (ring->head + len) & (ring->capacity - 1) : 0;
+}
 
-    node = (packet_queue_node_t *) calloc(1, sizeof(packet_queue_node_t));
-    assert(node);
+/* returns the number of bytes that can be written to the given byte ring
+ * without wrapping, and sets *span to point to the first of them.
+ */
+size_t _mysock_byte_ring_write_span(byte_ring_t *ring, char **span)
+{
+    size_t tail;
 
-    node->data = (char *) malloc(packet_len * sizeof(char));
-    assert(node->data);
+    assert(ring && span);
 
-    if (packet_len > 0)
-        memcpy(node->data, packet, packet_len);
-    node->data_len = packet_len;
+    tail = (ring->head + ring->len) & (ring->capacity - 1);
+    *span = ring->data + tail;
+    return (tail < ring->head || ring->len == ring->capacity)
+        ? ring->capacity - ring->len
+        : ring->capacity - tail;
+}
 
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    if (!pq->head)
+/* append len bytes, previously written through _mysock_byte_ring_write_span(),
+ * to the byte ring.
+ */
+void _mysock_byte_ring_commit(byte_ring_t *ring, size_t len)
+{
+    assert(ring && ring->len + len <= ring->capacity);
+    ring->len += len;
+}
+
+/* make room for len more bytes in the byte ring, growing it (by doubling) if
+ * needed.  returns FALSE if that would exceed its capacity limit.
+ */
+bool_t _mysock_byte_ring_reserve(byte_ring_t *ring, size_t len)
+{
+    size_t new_capacity;
+    char *new_data;
+
+    assert(ring);
+
+    if (ring->len + len <= ring->capacity)
+        return TRUE;
+
+    for (new_capacity = ring->capacity ? ring->capacity
+                                       : BYTE_RING_MIN_CAPACITY;
+         new_capacity < ring->len + len; new_capacity <<= 1)
+        ;
+
+    if (ring->capacity_limit && new_capacity > ring->capacity_limit)
+        return FALSE;
+
+    new_data = (char *) malloc(new_capacity);
+    assert(new_data);
+
+    /* move the buffered data to the start of the new allocation */
+    if (ring->len > 0)
     {
-        assert(!pq->tail);
-        pq->head = pq->tail = node;
+        size_t first = MIN(ring->len, ring->capacity - ring->head);
+
+        memcpy(new_data, ring->data + ring->head, first);
+        memcpy(new_data + first, ring->data, ring->len - first);
     }
-    else
+
+    free(ring->data);
+    ring->data     = new_data;
+    ring->capacity = new_capacity;
+    ring->head     = 0;
+    return TRUE;
+}
+
+void _mysock_byte_ring_free(byte_ring_t *ring)
+{
+    assert(ring);
+
+    free(ring->data);
+    ring->data = NULL;
+    ring->capacity = ring->head = ring->len = 0;
+}
+
+/* append data to a byte ring for this connection; it will be read by
+ * stcp_app_recv() or myread() when the transport layer or application is
+ * ready to use it, depending on the ring to which the data is added.  the
+ * data is copied, so the calling code can do whatever it wants with it
+ * afterwards.
+ *
+ * if the ring has a capacity limit, only as much data as fits is queued.
+ * if block is TRUE, this then waits for the reader to free space, until
+ * all the data is queued.  returns the number of bytes queued; this is
+ * short only if block is FALSE, or if the ring's eof flag is set (i.e.,
+ * the reader has gone away).  if nothing at all could be queued, this
+ * returns -1, with errno set to EAGAIN or EPIPE respectively.
+ */
+ssize_t _mysock_enqueue_bytes(mysock_context_t *ctx,
+                              byte_ring_t      *ring,
+                              const void       *src,
+                              size_t            src_len,
+                              bool_t            block)
+{
+    bool_t eof;
+    const char *p = (const char *) src;
+    size_t queued = 0;
+
+    assert(ctx && ring && (src || !src_len));
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    while (queued < src_len && !ring->eof)
     {
-        assert(pq->tail);
-        assert(!pq->tail->next);
-        assert(!node->next);
-        pq->tail->next = node;
-        pq->tail = node;
+        size_t room = src_len - queued;
+
+        if (ring->capacity_limit)
+        {
+            room = (ring->len < ring->capacity_limit)
+                ? MIN(room, ring->capacity_limit - ring->len) : 0;
+        }
+
+        if (room == 0)
+        {
+            if (!block)
+                break;
+
+            ring->writer_waiting = TRUE;
+            _mysock_stack_wait(&ctx->data_ready_cond, &ctx->data_ready_lock);
+            continue;
+        }
+
+        if (!_mysock_byte_ring_reserve(ring, room))
+        {
+            assert(0);
+            abort();
+        }
+
+        queued += room;
+        while (room > 0)
+        {
+            char *span;
+            size_t span_len = MIN(room,
+                                  _mysock_byte_ring_write_span(ring, &span));
+
+            memcpy(span, p, span_len);
+            _mysock_byte_ring_commit(ring, span_len);
+            p    += span_len;
+            room -= span_len;
+        }
+
+        /* wake the reader now, as we may be about to wait for it */
+        PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+        if (ring == &ctx->app_recv_queue)
+            _mysock_schedule_transport(ctx);
     }
+    eof = ring->eof;
+    if (queued > 0)
+        _mysock_notify_locked(ctx);
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+
+    if (queued == 0 && src_len > 0)
+    {
+        errno = eof ? EPIPE : EAGAIN;
+        return -1;
+    }
+
+    return queued;
 }
 
-/* remove one packet from the head of the waiting packet queue, copying the
- * packet's payload into the specified buffer.  returns the number of bytes
- * copied.  if remove_partial is true, and there is insufficient room in the
- * destination buffer for the packet at the head of the queue, it is only
- * partially dequeued, and the remaining contents remain at the queue's head
- * for a subsequent call to dequeue_buffer().
+/* read up to max_len bytes from the front of a byte ring.  if block is
+ * TRUE, this waits until data is available, or until the ring's eof flag is
+ * set, in which case it returns 0; otherwise, if neither is the case, it
+ * returns -1 with errno set to EAGAIN.  returns the number of bytes copied.
  */
-size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
-                              packet_queue_t   *pq,
+ssize_t _mysock_dequeue_bytes(mysock_context_t *ctx,
+                              byte_ring_t      *ring,
                               void             *dst,
                               size_t            max_len,
-                              bool_t            remove_partial)
+                              bool_t            block)
 {
-    packet_queue_node_t *node;
-    size_t               packet_len;
+    size_t len = 0;
 
-    assert(ctx && pq && dst);
+    assert(ctx && ring && dst);
 
-    /* block until queue is non-empty */
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    while (!pq->head)
+    while (!ring->len && !ring->eof)
     {
-        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
-                                       &ctx->data_ready_lock));
+        if (!block)
+        {
+            PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+            errno = EAGAIN;
+            return -1;
+        }
+
+        _mysock_stack_wait(&ctx->data_ready_cond, &ctx->data_ready_lock);
     }
 
-    node = pq->head;
-    assert(node && node->data);
+    /* at most two spans, if the data wraps around the end of the ring */
+    while (len < max_len && ring->len > 0)
+    {
+        const char *span;
+        size_t span_len = MIN(max_len - len,
+                              _mysock_byte_ring_read_span(ring, &span));
+
+        memcpy((char *) dst + len, span, span_len);
+        _mysock_byte_ring_consume(ring, span_len);
+        len += span_len;
+    }
 
-    if (node->data_len > max_len && remove_partial)
+    /* let any blocked writer fill the space we've just freed */
+    if (len > 0 && ring->writer_waiting)
     {
-        /* remove only a portion of the packet at the head of the queue,
-         * leaving the rest around for the next call to dequeue_buffer().
-         */
-        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        ring->writer_waiting = FALSE;
+        PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+    }
+
+    if (len > 0)
+        _mysock_notify_locked(ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    return len;
+}
+
+/* mark the end of the data in a byte ring; once the data already buffered
+ * is read, _mysock_dequeue_bytes() returns 0.
+ */
+void _mysock_set_eof(mysock_context_t *ctx, byte_ring_t *ring)
+{
+    assert(ctx && ring);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ring->eof = TRUE;
+    _mysock_notify_locked(ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+}
+
+/* add a packet arriving from the network to the given ring.  this must
+ * only be called from the network receive engine thread watching the
+ * connection (the single producer).  if the ring is full, the packet is dropped, as a NIC would;
+ * so it is if the ring's slots can't be allocated.  returns TRUE if the
+ * packet was queued.
+ */
+bool_t _mysock_ring_enqueue(mysock_context_t *ctx,
+                            packet_ring_t    *ring,
+                            const void       *packet,
+                            size_t            packet_len)
+{
+    packet_ring_slot_t *slot;
+    unsigned int tail;
+
+    assert(ctx && ring && packet);
+    assert(packet_len <= sizeof(slot->data));
 
-        memcpy(dst, node->data, max_len);
-        memcpy(node->data, node->data + max_len, node->data_len - max_len);
-        node->data_len -= max_len;
-        packet_len = max_len;
+    tail = ring->tail;  /* only we write this */
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+        PACKET_RING_SLOTS)
+    {
+        ++ring->drops;
+        DEBUG_LOG(("network receive ring full, dropping packet (%lu so far)\n",
+                   ring->drops));
+        return FALSE;
     }
-    else
+
+    if (!ring->slots &&
+        !(ring->slots = (packet_ring_slot_t *)
+              malloc(PACKET_RING_SLOTS * sizeof(packet_ring_slot_t))))
     {
-        /* dequeue the entire packet at the head of the queue */
-        if (!(pq->head = pq->head->next))
-        {
-            assert(pq->tail == node);
-            pq->tail = NULL;
-        }
+        ++ring->drops;
+        return FALSE;
+    }
+
+    slot = &ring->slots[tail & (PACKET_RING_SLOTS - 1)];
+    memcpy(slot->data, packet, packet_len);
+    slot->data_len = packet_len;
+
+    /* publish the slot, then see if the consumer has gone to sleep.  both
+     * this and the consumer's store to consumer_waiting are sequentially
+     * consistent, so at least one side sees the other's update and the
+     * wakeup can't be lost.
+     */
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->consumer_waiting, __ATOMIC_SEQ_CST))
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
         PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        _mysock_schedule_transport(ctx);
+    }
+
+    return TRUE;
+}
+
+/* called by the consumer, with data_ready_lock held, before it waits on
+ * data_ready_cond (or, for the transport, goes idle) for packets on the
+ * given ring.  returns TRUE if the ring
+ * is non-empty, in which case the consumer shouldn't wait.  either way,
+ * _mysock_ring_finish_wait() must be called once the consumer is done
+ * waiting.
+ */
+bool_t _mysock_ring_prepare_wait(packet_ring_t *ring)
+{
+    assert(ring);
+
+    __atomic_store_n(&ring->consumer_waiting, TRUE, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != ring->head;
+}
 
-        memcpy(dst, node->data, MIN(max_len, node->data_len));
-        packet_len = node->data_len;
+void _mysock_ring_finish_wait(packet_ring_t *ring)
+{
+    assert(ring);
+    __atomic_store_n(&ring->consumer_waiting, FALSE, __ATOMIC_RELAXED);
+}
 
-        free(node->data);
+/* block the consumer until the given ring is non-empty */
+static void _mysock_ring_wait(mysock_context_t *ctx, packet_ring_t *ring)
+{
+    /* don't bother with the lock if there's a packet waiting already */
+    if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head)
+        return;
 
-        memset(node, 0, sizeof(*node));
-        free(node);
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    while (!_mysock_ring_prepare_wait(ring))
+    {
+        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+                                       &ctx->data_ready_lock));
     }
+    _mysock_ring_finish_wait(ring);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
+/* remove one packet from the given ring, copying it into the specified
+ * buffer (truncated to max_len bytes).  this blocks until a packet is
+ * available, and must only be called from the connection's transport worker
+ * (the single consumer).  returns the length of the packet.
+ */
+size_t _mysock_ring_dequeue(mysock_context_t *ctx,
+                            packet_ring_t    *ring,
+                            void             *dst,
+                            size_t            max_len)
+{
+    size_t packet_len;
 
-    return packet_len;
+    assert(ctx && ring && dst);
+    return (_mysock_ring_dequeue_batch(ctx, ring, dst, max_len,
+                                       &packet_len, 1) == 1) ? packet_len : 0;
 }
 
-/* free any last buffers in the specified queue, discarding the contents.
- * this is called only when the mysocket context is being deallocated, so
- * there are no concerns about thread safety here.  returns TRUE if
- * non-zero-length buffers were deallocated, FALSE otherwise.
+/* remove up to max_packets packets from the given ring.  packet k is copied
+ * to dst + k * dst_stride (truncated to dst_stride bytes), and its length
+ * stored in packet_lens[k].  like _mysock_ring_dequeue(), this blocks until
+ * the ring is non-empty.  returns the number of packets dequeued.
  */
-static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq)
+unsigned int _mysock_ring_dequeue_batch(mysock_context_t *ctx,
+                                        packet_ring_t    *ring,
+                                        void             *dst,
+                                        size_t            dst_stride,
+                                        size_t           *packet_lens,
+                                        unsigned int      max_packets)
 {
-    packet_queue_node_t *node;
-    bool_t result = FALSE;
+    unsigned int head, tail, num_packets;
 
-    assert(ctx && pq);
-    result = (pq->head != NULL);
-    for (node = pq->head; node; )
-    {
-        packet_queue_node_t *next = node->next;
+    assert(ctx && ring && dst && packet_lens && max_packets > 0);
+
+    _mysock_ring_wait(ctx, ring);
+
+    /* the acquire load of tail orders the producer's writes to the slots
+     * before our reads of them.
+     */
+    head = ring->head;  /* only we write this */
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    assert(tail != head);
 
-        if (node->data_len > 0)
-            result = TRUE;
+    for (num_packets = 0; num_packets < max_packets && head != tail;
+         ++num_packets, ++head)
+    {
+        const packet_ring_slot_t *slot =
+            &ring->slots[head & (PACKET_RING_SLOTS - 1)];
 
-        free(node->data);
-        free(node);
-        node = next;
+        memcpy((char *) dst + num_packets * dst_stride, slot->data,
+               MIN(dst_stride, slot->data_len));
+        packet_lens[num_packets] = slot->data_len;
     }
 
-    pq->head = pq->tail = NULL;
-    return result;
+    /* hand the slots back to the producer */
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    return num_packets;
 }
 
 /* allocate a new connection context.  this keeps track of the working state
  * between the transport and network layers for a particular connection.  the
- * context is subsequently freed on the network layer's exit.
+ * context is subsequently freed on the network layer's exit.  it's taken
+ * from the context pool if there's one there.
  */
 static mysock_context_t *_mysock_allocate_context(void)
 {
-    mysock_context_t *ctx = 0;
+    mysock_context_t *ctx;
 
-    ctx = (mysock_context_t *) calloc(1, sizeof(mysock_context_t));
-    assert(ctx);
+    PTHREAD_CALL(pthread_once(&context_pool_once, _mysock_context_pool_init));
+
+    PTHREAD_CALL(pthread_mutex_lock(&context_pool_lock));
+    if ((ctx = context_pool) != NULL)
+    {
+        context_pool = ctx->pool_next;
+        --context_pool_len;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&context_pool_lock));
+
+    if (ctx)
+    {
+        ctx->pool_next = NULL;
+        if (_network_reinit(ctx, &ctx->network_state) < 0)
+        {
+            _mysock_destroy_context(ctx);
+            return NULL;
+        }
+    }
+    else if (!(ctx = _mysock_create_context()))
+    {
+        return NULL;
+    }
 
     /* by default, sockets are active */
     ctx->listen_sd = -1;
+    ctx->event_fd = ctx->event_fd_write = -1;
+
+    ctx->blocking = TRUE;   /* we unblock once we're connected */
+
+    ctx->app_recv_queue.capacity_limit = MYSOCK_DEFAULT_SNDBUF;
+    return ctx;
+}
+
+/* set up a context from scratch */
+static mysock_context_t *_mysock_create_context(void)
+{
+    mysock_context_t *ctx = 0;
+
+    ctx = (mysock_context_t *) calloc(1, sizeof(mysock_context_t));
+    assert(ctx);
 
     /* initialise connection condition variable.  this is signaled when the
      * connection is established, i.e. myconnect() or myaccept() should
@@ -285,8 +673,6 @@ static mysock_context_t *_mysock_allocate_context(void)
     PTHREAD_CALL(pthread_cond_init(&ctx->data_ready_cond, NULL));
     PTHREAD_CALL(pthread_mutex_init(&ctx->data_ready_lock, NULL));
 
-    ctx->blocking = TRUE;   /* we unblock once we're connected */
-
 
     /* initialise underlying network state.  this includes creating the actual
      * socket used for communication to the peer--this is analogous to the
@@ -294,21 +680,44 @@ static mysock_context_t *_mysock_allocate_context(void)
      */
     if (_network_init(ctx, &ctx->network_state) < 0)
     {
-        _mysock_free_context(ctx);
+        _mysock_destroy_context(ctx);
         return NULL;
     }
 
     return ctx;
 }
 
-/* destroy a connection context previously created with allocate_context().
- * this is invoked only if and when the network and transport threads are
- * done.
+/* release a connection context previously created with allocate_context().
+ * this is invoked only if and when the network receive engine and the
+ * transport are done with it.  it goes back to the context pool if there's
+ * room.
  */
 void _mysock_free_context(mysock_context_t *ctx)
 {
-    int sd;
+    assert(ctx);
+
+    /* clear mysocket descriptor table entry first, so the descriptor stops
+     * finding the context before it's torn down.
+     */
+    _mysock_release_descriptor(ctx);
 
+    /* drop the mysocket from any myepoll instance watching it */
+    _mysock_poll_forget(ctx);
+
+    if (ctx->network_state.impl_data && _mysock_context_pool_reserve())
+    {
+        _network_recycle(&ctx->network_state);
+        _mysock_reset_context(ctx);
+        _mysock_context_pool_put(ctx);
+    }
+    else
+    {
+        _mysock_destroy_context(ctx);
+    }
+}
+
+static void _mysock_destroy_context(mysock_context_t *ctx)
+{
     assert(ctx);
 
     PTHREAD_CALL(pthread_cond_destroy(&ctx->blocking_cond));
@@ -317,97 +726,202 @@ void _mysock_free_context(mysock_context_t *ctx)
     PTHREAD_CALL(pthread_cond_destroy(&ctx->data_ready_cond));
     PTHREAD_CALL(pthread_mutex_destroy(&ctx->data_ready_lock));
 
-    /* free any last buffers that might be lying around (e.g. retransmitted
-     * packets from the peer).  normally, the application from/to queues
-     * should be empty by this point; the network receive queue may
-     * legitimately have retransmitted packets, so silently discard these.
+    /* free the application data buffers, and the network receive ring's
+     * slots.  the ring may legitimately hold retransmitted packets from the
+     * peer, but they're simply dropped with it.
      */
-    (void) _mysock_free_queue(ctx, &ctx->network_recv_queue);
-    (void) _mysock_free_queue(ctx, &ctx->app_recv_queue);
-    (void) _mysock_free_queue(ctx, &ctx->app_send_queue);
-
-    _network_close(&ctx->network_state);
+    _mysock_byte_ring_free(&ctx->app_recv_queue);
+    _mysock_byte_ring_free(&ctx->app_send_queue);
+    free(ctx->network_recv_queue.slots);
 
-    /* clear mysocket descriptor table entry */
-    sd = ctx->my_sd;
-    if (global_ctx[sd] == ctx)
-        global_ctx[sd] = 0;
+    if (ctx->network_state.impl_data)
+        _network_close(&ctx->network_state);
 
     memset(ctx, 0, sizeof(*ctx));
     free(ctx);
 }
 
-/* transport layer thread; transport_init() should not return until the
- * transport layer finishes (i.e. the connection is over).
+/* zero the context's fields from first up to (but not including) end */
+#define ZERO_CONTEXT_FIELDS(ctx, first, end) \
+    memset(&(ctx)->first, 0, offsetof(mysock_context_t, end) - \
+                             offsetof(mysock_context_t, first))
+
+/* return a closed mysocket's context to the state _mysock_create_context()
+ * left it in, for the pool.  the pthread objects are left as they are, as
+ * is the network layer's state, which _network_recycle() has dealt with.
+ * the packet ring keeps its slots, which needn't be cleared, as they're
+ * always written before they're read.
  */
-static void *transport_thread_func(void *arg_ptr)
+static void _mysock_reset_context(mysock_context_t *ctx)
 {
-    mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
-    char eof_packet;
+    void *network_impl = ctx->network_state.impl_data;
 
     assert(ctx);
-    ASSERT_VALID_MYSOCKET_DESCRIPTOR(ctx, ctx->my_sd);
-
-    /* enter the STCP control loop.  transport_init() doesn't return until the
-     * connection's finished.  that function should first signal establishment
-     * of the connection after SYN/SYN-ACK (or an error condition if the
-     * connection couldn't be established) to the application by using
-     * stcp_unblock_application(); as the name suggests, this unblocks the
-     * calling code.  transport_init() then handles the connection,
-     * returning only after the connection is closed.
-     */
-    transport_init(ctx->my_sd, ctx->is_active);
 
-    /* transport_init() has returned; both sides have closed the connection,
-     * do some final cleanup here...
-     */
+    ZERO_CONTEXT_FIELDS(ctx, is_active, blocking_cond);
+    ZERO_CONTEXT_FIELDS(ctx, blocking, data_ready_cond);
+    ZERO_CONTEXT_FIELDS(ctx, close_requested, network_recv_queue);
+    ctx->network_state.impl_data = network_impl;
 
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
-    if (ctx->blocking)
+    memset(&ctx->network_recv_queue, 0, offsetof(packet_ring_t, slots));
+    _mysock_byte_ring_reset(&ctx->app_send_queue);
+    _mysock_byte_ring_reset(&ctx->app_recv_queue);
+
+    memset(&ctx->last_header, 0,
+           sizeof(*ctx) - offsetof(mysock_context_t, last_header));
+}
+
+/* empty a byte ring for reuse, keeping its buffer unless it's grown large */
+static void _mysock_byte_ring_reset(byte_ring_t *ring)
+{
+    assert(ring);
+
+    if (ring->capacity > CONTEXT_POOL_KEEP_BUFFER)
+        _mysock_byte_ring_free(ring);
+
+    ring->head = ring->len = 0;
+    ring->capacity_limit = 0;
+    ring->eof = ring->writer_waiting = FALSE;
+}
+
+/* read the pool's settings, and fill it with STCP_CONTEXT_POOL contexts */
+static void _mysock_context_pool_init(void)
+{
+    const char *value;
+    unsigned int k, num_contexts = 0;
+
+    if ((value = getenv("STCP_CONTEXT_POOL_MAX")) && *value)
+        context_pool_max = (unsigned int) MAX(atoi(value), 0);
+    if ((value = getenv("STCP_CONTEXT_POOL")) && *value)
+        num_contexts = MIN((unsigned int) MAX(atoi(value), 0),
+                           context_pool_max);
+
+    for (k = 0; k < num_contexts; ++k)
     {
-        /* if we're still blocked, STCP must not have indicated the
-         * connection completed.  pass the error up to the application.
-         */
-        if (errno == 0 || errno == EINTR)
+        mysock_context_t *ctx = _mysock_create_context();
+
+        if (!ctx || !_mysock_context_pool_reserve())
         {
-            /* this is a bit of a kludge--this should really be set by STCP
-             * itself, but it's a reasonable guess if for some reason (e.g.
-             * oversight) the transport layer hasn't announced why it
-             * bailed out...
-             */
-            errno = (ctx->is_active) ? ECONNREFUSED : ECONNABORTED;
+            if (ctx)
+                _mysock_destroy_context(ctx);
+            break;
         }
-        PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
-        stcp_unblock_application(ctx->my_sd);
-    }
-    else
-    {
-        PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+
+        _network_recycle(&ctx->network_state);
+        _mysock_context_pool_put(ctx);
     }
+}
 
-    /* force final myread() to return 0 bytes (this should have been done
-     * by the transport layer already in response to the peer's FIN).
-     */
-    _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, &eof_packet, 0);
-    return NULL;
+/* returns TRUE if there's room for another context in the pool, which is
+ * then set aside for _mysock_context_pool_put().
+ */
+static bool_t _mysock_context_pool_reserve(void)
+{
+    bool_t room;
+
+    PTHREAD_CALL(pthread_mutex_lock(&context_pool_lock));
+    if ((room = (context_pool_len < context_pool_max)))
+        ++context_pool_len;
+    PTHREAD_CALL(pthread_mutex_unlock(&context_pool_lock));
+
+    return room;
 }
 
+static void _mysock_context_pool_put(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&context_pool_lock));
+    ctx->pool_next = context_pool;
+    context_pool = ctx;
+    PTHREAD_CALL(pthread_mutex_unlock(&context_pool_lock));
+}
 
-/* perform some basic sanity checks on the given mysocket descriptor.  if
- * comp_ctx is non-NULL, it is checked against the context found for the given
- * descriptor to make sure they match.
+/* returns the descriptor table entry with the given index, or NULL if the
+ * table hasn't grown that far.
  */
-static void verify_mysocket_descriptor(mysock_context_t *comp_ctx,
-                                       mysocket_t        my_sd)
+static mysock_descriptor_t *_mysock_get_descriptor(unsigned int index)
 {
-    mysock_context_t *ctx;
+    mysock_descriptor_t *chunk;
+
+    assert(index < MAX_NUM_CONNECTIONS);
+    chunk = __atomic_load_n(&descriptor_chunks[index / SD_CHUNK_SIZE],
+                            __ATOMIC_ACQUIRE);
+    return chunk ? &chunk[index % SD_CHUNK_SIZE] : NULL;
+}
 
-    assert(my_sd >= 0 && my_sd < (int)ARRAY_DIM(global_ctx));
-    ctx = global_ctx[my_sd];
+/* give the context a free descriptor table entry, growing the table if
+ * there aren't any.  returns the new mysocket descriptor (also stored in
+ * ctx->my_sd), or -1 if the table is full.
+ */
+static mysocket_t _mysock_allocate_descriptor(mysock_context_t *ctx)
+{
+    mysock_descriptor_t *d;
+    int index;
 
     assert(ctx);
-    assert(ctx->my_sd == my_sd);
-    assert(!comp_ctx || comp_ctx == ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&descriptor_lock));
+    if (first_free_descriptor < 0)
+    {
+        mysock_descriptor_t *chunk;
+        int k;
+
+        if (num_descriptor_chunks == SD_NUM_CHUNKS)
+        {
+            PTHREAD_CALL(pthread_mutex_unlock(&descriptor_lock));
+            return -1;
+        }
+
+        chunk = (mysock_descriptor_t *)
+            calloc(SD_CHUNK_SIZE, sizeof(mysock_descriptor_t));
+        assert(chunk);
+
+        /* lowest indices first */
+        for (k = SD_CHUNK_SIZE - 1; k >= 0; --k)
+        {
+            chunk[k].next_free = first_free_descriptor;
+            first_free_descriptor =
+                (int) (num_descriptor_chunks * SD_CHUNK_SIZE) + k;
+        }
+        __atomic_store_n(&descriptor_chunks[num_descriptor_chunks++], chunk,
+                         __ATOMIC_RELEASE);
+    }
+
+    index = first_free_descriptor;
+    d = _mysock_get_descriptor((unsigned int) index);
+    first_free_descriptor = d->next_free;
+
+    ctx->my_sd = SD_MAKE((unsigned int) index, d->generation);
+    __atomic_store_n(&d->ctx, ctx, __ATOMIC_RELEASE);
+    PTHREAD_CALL(pthread_mutex_unlock(&descriptor_lock));
+
+    return ctx->my_sd;
+}
+
+/* free the context's descriptor table entry, if it has one.  its
+ * generation is advanced, so the old descriptor no longer finds it.
+ */
+static void _mysock_release_descriptor(mysock_context_t *ctx)
+{
+    mysock_descriptor_t *d;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&descriptor_lock));
+    d = _mysock_get_descriptor(SD_INDEX(ctx->my_sd));
+    if (d && d->ctx == ctx)
+    {
+        __atomic_store_n(&d->ctx, (mysock_context_t *) NULL,
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&d->generation,
+                         (d->generation + 1) & SD_GENERATION_MASK,
+                         __ATOMIC_RELEASE);
+
+        d->next_free = first_free_descriptor;
+        first_free_descriptor = (int) SD_INDEX(ctx->my_sd);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&descriptor_lock));
 }
 
 /* obtain ephemeral port for the given mysocket */
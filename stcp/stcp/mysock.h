@@ -27,26 +27,149 @@ typedef int bool_t;
 typedef int mysocket_t;     /* mysocket descriptor */
 
 
-/* maximum number of mysockets per process */
-#define MAX_NUM_CONNECTIONS 64
+/* maximum number of mysockets per process.  the descriptor table starts
+ * small and grows as needed, up to this size.
+ */
+#define MAX_NUM_CONNECTIONS (1 << 20)
 
 #if (MAX_NUM_CONNECTIONS & (MAX_NUM_CONNECTIONS - 1)) != 0
     #error MAX_NUM_CONNECTIONS should be a power of two
 #endif
 
 
+/* largest connection backlog mylisten() allows; as with SOMAXCONN, larger
+ * (or negative) values are reduced to this.
+ */
+#define MYSOMAXCONN 4096
+
+/* mysetsockopt() option, at level IPPROTO_TCP, for a listening mysocket:
+ * an int number of seconds for which a new connection is held back from
+ * myaccept() after its handshake completes, until the peer sends data (or
+ * closes its end).  once that long has passed, the connection is passed on
+ * to myaccept() anyway.  0 (the default) turns this off.  this is modelled
+ * on Linux's TCP_DEFER_ACCEPT, and has the same value.
+ */
+#define MYTCP_DEFER_ACCEPT 9
+
 extern mysocket_t mysocket(bool_t is_reliable);
 extern int mybind(mysocket_t sd, struct sockaddr *addr, int addrlen);
 extern int mylisten(mysocket_t sd, int backlog);
 extern int myconnect(mysocket_t sd, struct sockaddr* name, int namelen);
 extern int myaccept(mysocket_t sd, struct sockaddr* addr, int *addrlen);
+
+/* accept up to max_conns connections on a listening mysocket in one call,
+ * taking at most MYACCEPT_BATCH_MAX.  the new mysockets are stored in sds,
+ * in the order their connections completed, and if addrs and addrlens
+ * aren't NULL, the peers' addresses in the corresponding entries there.
+ * returns the number accepted.  as with myaccept(), this blocks until at
+ * least one connection completes, unless the listening mysocket is
+ * non-blocking or flags has MYACCEPT_DONTWAIT, in which case it fails with
+ * EAGAIN instead.
+ */
+#define MYACCEPT_BATCH_MAX  64
+#define MYACCEPT_DONTWAIT   0x1
+
+extern int myaccept_batch(mysocket_t sd, mysocket_t *sds,
+                          struct sockaddr *addrs, int *addrlens,
+                          int max_conns, int flags);
 extern int myclose(mysocket_t sd);
 extern int myread(mysocket_t sd, void *buffer, size_t length);
 extern int mywrite(mysocket_t sd, const void *buffer, size_t length);
+extern int myfcntl(mysocket_t sd, int cmd, ...);
 extern int mygetsockname(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
 extern int mygetpeername(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
+extern int mysetsockopt(mysocket_t sd, int level, int optname,
+                        const void *optval, socklen_t optlen);
+extern int mygetsockopt(mysocket_t sd, int level, int optname,
+                        void *optval, socklen_t *optlen);
+
+/* readiness events for mypoll() and myepoll_wait().  these have the same
+ * values as the corresponding poll(2) flags.  a mysocket is readable
+ * (MYPOLLIN) once data or EOF is waiting for myread(), or a listening
+ * mysocket once a connection is waiting for myaccept().  it's writable
+ * (MYPOLLOUT) once mywrite() has room for more data.  MYPOLLERR means the
+ * connection failed, and MYPOLLHUP that it's over.
+ */
+#define MYPOLLIN    0x001
+#define MYPOLLOUT   0x004
+#define MYPOLLERR   0x008
+#define MYPOLLHUP   0x010
+#define MYPOLLNVAL  0x020
+
+/* requests edge-triggered notification from myepoll_ctl() */
+#define MYEPOLLET   (1U << 31)
+
+/* myepoll_ctl() operations */
+#define MYEPOLL_CTL_ADD 1
+#define MYEPOLL_CTL_DEL 2
+#define MYEPOLL_CTL_MOD 3
+
+struct mypollfd
+{
+    mysocket_t sd;          /* ignored if negative */
+    short      events;      /* requested events */
+    short      revents;     /* returned events */
+};
+
+typedef union myepoll_data
+{
+    void     *ptr;
+    int       fd;
+    uint32_t  u32;
+    uint64_t  u64;
+} myepoll_data_t;
+
+struct myepoll_event
+{
+    uint32_t       events;
+    myepoll_data_t data;
+};
+
+extern int mypoll(struct mypollfd *fds, unsigned int nfds, int timeout);
+extern int myepoll_create(void);
+extern int myepoll_ctl(int epd, int op, mysocket_t sd,
+                       struct myepoll_event *event);
+extern int myepoll_wait(int epd, struct myepoll_event *events,
+                        int max_events, int timeout);
+extern int myepoll_close(int epd);
+extern int myeventfd(mysocket_t sd);
+
+/* how the stack is run.  by default (MYSTACK_THREADED), internal threads
+ * receive network input and run the transport layer for each connection.
+ * in MYSTACK_POLLED mode there are no internal threads; instead, the
+ * application drives the whole stack from one thread by calling
+ * mystack_poll(), which receives network input, runs the transport for
+ * each connection with events to handle, and fires any timers that are
+ * due.  mysock calls that block (e.g. myread(), or mypoll() with a nonzero
+ * timeout) call mystack_poll() themselves while they wait, but nothing
+ * happens on any connection between calls; in particular, myeventfd()
+ * descriptors are only signaled from within mystack_poll().
+ *
+ * mystack_set_mode() must be called before any other mysock call, and
+ * fails with EBUSY once the stack has started.  mystack_poll() waits up to
+ * timeout milliseconds (-1 for no limit, 0 not to wait) for network input
+ * if nothing is ready to run, and returns the number of times a transport
+ * was run, or -1 (with errno EINVAL) if the stack isn't in MYSTACK_POLLED
+ * mode.
+ */
+#define MYSTACK_THREADED    0
+#define MYSTACK_POLLED      1
+
+extern int mystack_set_mode(int mode);
+extern int mystack_poll(int timeout);
+
+/* connections that close actively spend a while in TIME_WAIT afterwards,
+ * during which only a small record of each is kept (see
+ * mysock_time_wait.c).  this returns the memory those records take across
+ * the process, in bytes, and sets *num_conns (unless it's NULL) to the
+ * number of connections in TIME_WAIT.  the memory doesn't include the
+ * channel each of those connections keeps open to its peer until it leaves
+ * TIME_WAIT:  with the socket-based network layer, that's a kernel TCP
+ * socket, a file descriptor and a receive engine slot per connection.
+ */
+extern size_t mystack_time_wait_memory(unsigned int *num_conns);
 
 /* return IP address of interface on which packets to/from peer_addr are
  * delivered.  peer_addr is in network byte order.
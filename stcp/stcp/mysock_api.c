@@ -1,10 +1,13 @@
 /* mysock_api.c--application interface to the mysocket layer */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -30,7 +33,7 @@ mysocket_t mysocket(bool_t is_reliable)
 /* simply a wrapper around bind() */
 int mybind(mysocket_t sd, struct sockaddr *addr, int addrlen)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
+    mysock_context_t *ctx = _mysock_get_open_context(sd);
     assert(addr);
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
@@ -43,12 +46,16 @@ int mybind(mysocket_t sd, struct sockaddr *addr, int addrlen)
     return _network_bind(&ctx->network_state, addr, addrlen);
 }
 
-/* connect to the address specified in name on the mysocket sd */
+/* connect to the address specified in name on the mysocket sd.  for a
+ * non-blocking mysocket, this returns EINPROGRESS once the SYN is on its
+ * way; the outcome is then available through SO_ERROR (see mygetsockopt()).
+ */
 int myconnect(mysocket_t sd, struct sockaddr *name, int namelen)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
+    mysock_context_t *ctx = _mysock_get_open_context(sd);
 
     MYSOCK_CHECK(ctx != NULL, EINVAL);
+    MYSOCK_CHECK(!ctx->transport_started || !ctx->blocking, EALREADY);
     MYSOCK_CHECK((ctx->network_state.peer_addr_len == 0), EISCONN);
 
 #ifdef DEBUG
@@ -81,12 +88,13 @@ int myconnect(mysocket_t sd, struct sockaddr *name, int namelen)
     _mysock_transport_init(sd, TRUE);
 
     /* block until connection is established, or we hit an error */
-    return _mysock_wait_for_connection(ctx);
+    MYSOCK_CHECK(!ctx->nonblocking, EINPROGRESS);
+    return _mysock_wait_for_connection(ctx, TRUE);
 }
 
 mysocket_t myaccept(mysocket_t sd, struct sockaddr *addr, int *addrlen)
 {
-    mysock_context_t *accept_ctx = _mysock_get_context(sd);
+    mysock_context_t *accept_ctx = _mysock_get_open_context(sd);
     mysock_context_t *ctx;
 
     MYSOCK_CHECK(accept_ctx != NULL, EBADF);
@@ -102,7 +110,9 @@ mysocket_t myaccept(mysocket_t sd, struct sockaddr *addr, int *addrlen)
     /* the new socket is created on an incoming SYN.  block here until we
      * establish a connection, or STCP indicates an error condition.
      */
-    _mysock_dequeue_connection(accept_ctx, &ctx);
+    MYSOCK_CHECK(_mysock_dequeue_connection(accept_ctx, &ctx,
+                                            !accept_ctx->nonblocking),
+                 EAGAIN);
     assert(ctx);
 
     if (!ctx->stcp_errno)
@@ -122,16 +132,69 @@ mysocket_t myaccept(mysocket_t sd, struct sockaddr *addr, int *addrlen)
     return (errno = ctx->stcp_errno) ? -1 : ctx->my_sd;
 }
 
+/* accept up to max_conns connections at once; see mysock.h.  connections
+ * that failed before they were accepted are closed and left out, as there's
+ * no way to report their errors individually.
+ */
+int myaccept_batch(mysocket_t sd, mysocket_t *sds,
+                   struct sockaddr *addrs, int *addrlens,
+                   int max_conns, int flags)
+{
+    mysock_context_t *accept_ctx = _mysock_get_open_context(sd);
+    mysock_context_t *ctxs[MYACCEPT_BATCH_MAX];
+    unsigned int num_ctxs, k;
+    int num_conns = 0, stcp_errno = 0;
+
+    MYSOCK_CHECK(accept_ctx != NULL, EBADF);
+    MYSOCK_CHECK(accept_ctx->listening, EINVAL);
+    MYSOCK_CHECK(sds != NULL, EFAULT);
+    MYSOCK_CHECK(max_conns > 0 && !(flags & ~MYACCEPT_DONTWAIT), EINVAL);
+
+    num_ctxs = _mysock_dequeue_connections(
+        accept_ctx, ctxs, (unsigned int) MIN(max_conns, MYACCEPT_BATCH_MAX),
+        !accept_ctx->nonblocking && !(flags & MYACCEPT_DONTWAIT));
+    MYSOCK_CHECK(num_ctxs > 0, EAGAIN);
+
+    for (k = 0; k < num_ctxs; ++k)
+    {
+        mysock_context_t *ctx = ctxs[k];
+
+        assert(ctx && ctx->listen_sd == sd);
+        if (ctx->stcp_errno)
+        {
+            stcp_errno = ctx->stcp_errno;
+            (void) myclose(ctx->my_sd);
+            continue;
+        }
+
+        assert(ctx->network_state.peer_addr_len > 0);
+        if (addrs && addrlens)
+        {
+            addrs[num_conns]    = ctx->network_state.peer_addr;
+            addrlens[num_conns] = ctx->network_state.peer_addr_len;
+        }
+        sds[num_conns++] = ctx->my_sd;
+    }
+
+    DEBUG_LOG(("***myaccept_batch(%d) returning %d new sds***\n",
+               sd, num_conns));
+    MYSOCK_CHECK(num_conns > 0, stcp_errno);
+    return num_conns;
+}
+
 /* in this implementation, mylisten() is assumed to follow mybind() */
 int mylisten(mysocket_t sd, int backlog)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
+    mysock_context_t *ctx = _mysock_get_open_context(sd);
 
     assert(ctx->bound);
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(ctx->bound, EINVAL);
 
+    if (backlog < 0 || backlog > MYSOMAXCONN)
+        backlog = MYSOMAXCONN;
+
     /* set up the socket for demultiplexing */
     ctx->listening = TRUE;
     _mysock_set_backlog(ctx, backlog);
@@ -144,7 +207,7 @@ int mylisten(mysocket_t sd, int backlog)
      * _mysock_transport_init() is never called for such sockets), we
      * begin receiving network packets here...
      */
-    if (_network_start_recv_thread(ctx) < 0)
+    if (_network_start_recv(ctx) < 0)
     {
         assert(0);
         return -1;
@@ -153,34 +216,92 @@ int mylisten(mysocket_t sd, int backlog)
     return 0;
 }
 
-/* close the given mysocket.  note that the semantics of myclose() differ
- * slightly from a regular close(); STCP doesn't implement TIME_WAIT, so
- * myclose() simply discards all knowledge of the connection once the
- * connection is terminated.
+/* close the given mysocket.  as with close(), this returns at once, and
+ * the connection's closed in the background:  the transport sends any data
+ * still queued and then its FIN, and the connection is freed once the
+ * transport's done with it.  the descriptor can't be used by the
+ * application after this, but isn't reused until then.  since the stack
+ * runs in this process, exit() waits a while for background closes to
+ * finish (see mysock_worker.c), but _exit() doesn't; use SO_LINGER if the
+ * process might leave that way.
+ *
+ * if SO_LINGER is set with a non-zero l_linger, myclose() waits for the
+ * transport to finish instead, for at most that many seconds.  it fails
+ * with EWOULDBLOCK if the time runs out first (the close then carries on
+ * in the background), or with ETIMEDOUT if the transport gave up on the
+ * peer.  STCP has no RST to abort a connection with, so an l_linger of 0
+ * is treated as SO_LINGER being off.
  */
 int myclose(mysocket_t sd)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
+    mysock_context_t *ctx = _mysock_get_open_context(sd);
+    int stcp_errno = 0;
 
     DEBUG_LOG(("***myclose(%d)***\n", sd));
     MYSOCK_CHECK(ctx != NULL, EBADF);
+    __atomic_store_n(&ctx->app_closed, TRUE, __ATOMIC_RELEASE);
 
-    /* stcp_wait_for_event() needs to wake up on a socket close request */
+    /* the transport needs to be told of a socket close request */
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     ctx->close_requested = TRUE;
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
     PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
 
-    /* block until STCP thread exits */
-    if (ctx->transport_thread_started)
+    if (ctx->transport_started)
     {
+        bool_t linger = ctx->linger.l_onoff && ctx->linger.l_linger > 0;
+        struct timespec deadline;
+
         assert(!ctx->listening);
-        assert(ctx->is_active || ctx->listen_sd != -1);
-        PTHREAD_CALL(pthread_join(ctx->transport_thread, NULL));
-        ctx->transport_thread_started = FALSE;
+
+        if (linger)
+        {
+            struct timeval now;
+
+            gettimeofday(&now, NULL);
+            deadline.tv_sec  = now.tv_sec + ctx->linger.l_linger;
+            deadline.tv_nsec = now.tv_usec * 1000;
+        }
+
+        /* the application's done with any myepoll instance or myeventfd()
+         * descriptor watching the mysocket, even if the transport isn't.
+         */
+        _mysock_poll_forget(ctx);
+
+        _mysock_schedule_transport(ctx);
+        if (_mysock_detach_transport(ctx, linger ? &deadline : NULL))
+        {
+            /* the worker frees the connection once the transport's done */
+            DEBUG_LOG(("myclose(%d) returning, closing...\n", sd));
+            MYSOCK_CHECK(!linger, EWOULDBLOCK);
+            return 0;
+        }
+        ctx->transport_started = FALSE;
+
+        if (linger && ctx->stcp_errno == ETIMEDOUT)
+            stcp_errno = ETIMEDOUT;
     }
 
-    _network_stop_recv_thread(ctx);
+    _mysock_close_context(ctx);
+
+    DEBUG_LOG(("myclose(%d) returning...\n", sd));
+    MYSOCK_CHECK(stcp_errno == 0, stcp_errno);
+    return 0;
+}
+
+/* free all resources associated with a mysocket, once the transport (if
+ * any) is done with it.  this is called by myclose(), or by the mysocket's
+ * transport worker if myclose() has returned already.  a connection that
+ * closed in TIME_WAIT leaves just a small record of itself behind.
+ */
+void _mysock_close_context(mysock_context_t *ctx)
+{
+    assert(ctx && (!ctx->transport_started || ctx->transport_finished));
+
+    _network_stop_recv(ctx);
+
+    if (ctx->time_wait)
+        _mysock_time_wait_add(ctx);
 
     if (ctx->listening)
     {
@@ -188,48 +309,183 @@ int myclose(mysocket_t sd)
         _mysock_close_passive_socket(ctx);
     }
 
-    /* free all resources associated with this mysocket */
     _mysock_free_context(ctx);
-
-    DEBUG_LOG(("myclose(%d) returning...\n", sd));
-    return 0;
 }
 
+/* queue data for the transport layer to send.  at most SO_SNDBUF bytes
+ * are buffered; beyond that, this blocks until the transport layer takes
+ * more data (i.e., as the peer acknowledges what was already sent).  a
+ * non-blocking mysocket instead queues what fits, failing with EAGAIN if
+ * that's nothing.  the transport layer stops taking data only once the
+ * connection's over, after which this fails with EPIPE.
+ */
 int mywrite(mysocket_t sd, const void *buf, size_t buf_len)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
+    mysock_context_t *ctx = _mysock_get_open_context(sd);
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(!ctx->listening, EINVAL);
 
     assert(!ctx->close_requested);
-    _mysock_enqueue_buffer(ctx, &ctx->app_recv_queue, buf, buf_len);
+    if (_mysock_wait_for_connection(ctx, !ctx->nonblocking) < 0)
+        return -1;
 
-    /* XXX: all bytes are queued, irrespective of current sender window */
-    return buf_len;
+    return _mysock_enqueue_bytes(ctx, &ctx->app_recv_queue,
+                                 buf, buf_len, !ctx->nonblocking);
 }
 
+/* read data passed up by the transport layer.  this blocks until data is
+ * available, or fails with EAGAIN for a non-blocking mysocket.  once the
+ * peer has finished writing, repeated calls return 0.
+ */
 int myread(mysocket_t sd, void *buf, size_t buf_len)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
-    int len;
+    mysock_context_t *ctx = _mysock_get_open_context(sd);
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(!ctx->listening, EINVAL);
 
     assert(!ctx->close_requested);
+    if (_mysock_wait_for_connection(ctx, !ctx->nonblocking) < 0)
+        return -1;
 
-    if (ctx->eof)
+    return _mysock_dequeue_bytes(ctx, &ctx->app_send_queue,
+                                 buf, buf_len, !ctx->nonblocking);
+}
+
+/* a small subset of fcntl():  F_GETFL and F_SETFL, where the only flag
+ * understood is O_NONBLOCK.  in non-blocking mode, myread(), mywrite() and
+ * myaccept() fail with EAGAIN rather than waiting, and myconnect() returns
+ * EINPROGRESS.  as with TCP, mysockets returned by myaccept() start out in
+ * blocking mode.
+ */
+int myfcntl(mysocket_t sd, int cmd, ...)
+{
+    mysock_context_t *ctx = _mysock_get_open_context(sd);
+    va_list ap;
+    int flags;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+
+    switch (cmd)
+    {
+    case F_GETFL:
+        return O_RDWR | (ctx->nonblocking ? O_NONBLOCK : 0);
+
+    case F_SETFL:
+        va_start(ap, cmd);
+        flags = va_arg(ap, int);
+        va_end(ap);
+
+        ctx->nonblocking = (flags & O_NONBLOCK) != 0;
+        return 0;
+
+    default:
+        MYSOCK_ERROR_EXIT(EINVAL);
+    }
+}
+
+/* set a mysocket option.  SO_SNDBUF (an int) bounds the data mywrite() may
+ * queue; it's rounded up to a power of two.  SO_LINGER (a struct linger)
+ * makes myclose() wait for the connection to close.  as with TCP, these
+ * are inherited by the connections a listening mysocket accepts.
+ * MYTCP_DEFER_ACCEPT is also supported; see mysock.h.
+ */
+int mysetsockopt(mysocket_t sd, int level, int optname,
+                 const void *optval, socklen_t optlen)
+{
+    mysock_context_t *ctx = _mysock_get_open_context(sd);
+    size_t limit;
+    int value;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK((level == SOL_SOCKET &&
+                  (optname == SO_SNDBUF || optname == SO_LINGER)) ||
+                 (level == IPPROTO_TCP && optname == MYTCP_DEFER_ACCEPT),
+                 ENOPROTOOPT);
+    MYSOCK_CHECK(optval != NULL, EFAULT);
+
+    if (level == SOL_SOCKET && optname == SO_LINGER)
+    {
+        struct linger linger;
+
+        MYSOCK_CHECK(optlen == sizeof(linger), EINVAL);
+        memcpy(&linger, optval, sizeof(linger));
+        MYSOCK_CHECK(linger.l_linger >= 0, EINVAL);
+        ctx->linger = linger;
+        return 0;
+    }
+    MYSOCK_CHECK(optlen == sizeof(int), EINVAL);
+
+    memcpy(&value, optval, sizeof(value));
+    if (level == IPPROTO_TCP)
+    {
+        MYSOCK_CHECK(value >= 0, EINVAL);
+        __atomic_store_n(&ctx->defer_accept, value, __ATOMIC_RELAXED);
+        return 0;
+    }
+    MYSOCK_CHECK(value > 0, EINVAL);
+
+    for (limit = BYTE_RING_MIN_CAPACITY; limit < (size_t) value; limit <<= 1)
+        ;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->app_recv_queue.capacity_limit = limit;
+    _mysock_notify_locked(ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    /* a larger buffer may let a blocked mywrite() proceed */
+    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+    return 0;
+}
+
+/* get a mysocket option; see mysetsockopt().  SO_ERROR is also supported,
+ * giving the outcome of a non-blocking myconnect():  0 if the connection
+ * is established or still in progress, or the error that ended it.
+ */
+int mygetsockopt(mysocket_t sd, int level, int optname,
+                 void *optval, socklen_t *optlen)
+{
+    mysock_context_t *ctx = _mysock_get_open_context(sd);
+    int value;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK((level == SOL_SOCKET &&
+                  (optname == SO_SNDBUF || optname == SO_ERROR ||
+                   optname == SO_LINGER)) ||
+                 (level == IPPROTO_TCP && optname == MYTCP_DEFER_ACCEPT),
+                 ENOPROTOOPT);
+    MYSOCK_CHECK(optval != NULL && optlen != NULL, EFAULT);
+
+    if (level == SOL_SOCKET && optname == SO_LINGER)
+    {
+        MYSOCK_CHECK(*optlen >= sizeof(ctx->linger), EINVAL);
+        memcpy(optval, &ctx->linger, sizeof(ctx->linger));
+        *optlen = sizeof(ctx->linger);
         return 0;
+    }
+    MYSOCK_CHECK(*optlen >= sizeof(int), EINVAL);
 
-    if ((len = _mysock_dequeue_buffer(ctx, &ctx->app_send_queue,
-                                      buf, buf_len, TRUE)) == 0)
+    if (level == IPPROTO_TCP)
+    {
+        value = __atomic_load_n(&ctx->defer_accept, __ATOMIC_RELAXED);
+    }
+    else if (optname == SO_ERROR)
     {
-        /* make sure repeated calls to myread() return 0 on EOF */
-        ctx->eof = TRUE;
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
+        value = ctx->blocking ? 0 : ctx->stcp_errno;
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+    }
+    else
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        value = (int) ctx->app_recv_queue.capacity_limit;
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
     }
 
-    return len;
+    memcpy(optval, &value, sizeof(value));
+    *optlen = sizeof(value);
+    return 0;
 }
 
 /* fills in addr with current port associated with the mysocket descriptor.
@@ -238,7 +494,7 @@ int myread(mysocket_t sd, void *buf, size_t buf_len)
  */
 int mygetsockname(mysocket_t sd, struct sockaddr *addr, socklen_t *addrlen)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
+    mysock_context_t *ctx = _mysock_get_open_context(sd);
 
     assert(addr && addrlen);
 
@@ -267,7 +523,7 @@ int mygetsockname(mysocket_t sd, struct sockaddr *addr, socklen_t *addrlen)
 
 int mygetpeername(mysocket_t sd, struct sockaddr *name, socklen_t *namelen)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
+    mysock_context_t *ctx = _mysock_get_open_context(sd);
 
     assert(name && namelen);
     MYSOCK_CHECK(name != NULL && namelen != NULL, EFAULT);
@@ -16,23 +16,35 @@
  * HASH_TABLE_DECLARE and HASH_TABLE_DECLARE_EXTENDED must be invoked in
  * the global namespace, before any use of the hash table.  HASH_INSERT,
  * HASH_DELETE, and HASH_LOOKUP perform the usual insertion, delete, and
- * lookup operations, using chaining for conflict resolution.  data items
- * are copied into the hash table; this is a shallow copy for pointers.
- * insertion does not check for duplicates; HASH_LOOKUP is valid for a key
- * only if HASH_ENTRY_EXISTS returns true for the corresponding key.
- * HASH_LOOKUP_PTR is a special version of HASH_LOOKUP for the case where
- * the data type stored in the hash is a pointer; it permits queries
- * without checking for key existence first, and returns NULL on a key's
- * absence from the table.  (if the key exists, it behaves identically to
- * HASH_LOOKUP).
+ * lookup operations.  data items are copied into the hash table; this is a
+ * shallow copy for pointers.  insertion does not check for duplicates;
+ * HASH_LOOKUP is valid for a key only if HASH_ENTRY_EXISTS returns true for
+ * the corresponding key.  HASH_LOOKUP_PTR is a special version of
+ * HASH_LOOKUP for the case where the data type stored in the hash is a
+ * pointer; it permits queries without checking for key existence first,
+ * and returns NULL on a key's absence from the table.  (if the key exists,
+ * it behaves identically to HASH_LOOKUP).
+ *
+ * the table uses open addressing with linear probing, in a single array
+ * of entries whose size is a power of two, so nothing is allocated per
+ * insertion.  it's kept at most 7/8 full, and doubles in size once it would
+ * be fuller than that; the size given in the declaration is just the
+ * initial size.  entries are placed by robin hood hashing:  an insertion
+ * takes the slot of any entry that's closer to its home slot than the new
+ * entry is to its own, and moves that one along instead, so probe lengths
+ * stay short even when the table is nearly full.  deletion shifts the
+ * following entries back rather than leaving a tombstone.
+ *
+ * the hash function must return a well-mixed 32-bit value, as its low bits
+ * pick the home slot.  HASH_DEFAULT_HASH_FN does this for integer keys.
  *
  * example usage, to map uint16_t -> mysock_context_t * using a hash
- * function unsigned int port_hash(uint16_t key, unsigned int table_size):
+ * function uint32_t port_hash(uint16_t key):
  *
  * static __inline bool_t key_equal(uint16_t a, uint16_t b)
  *   { return (a) == (b); }
- * static __inline unsigned int port_hash(uint16_t key, unsigned int size)
- *   { return (key) % (size); }
+ * static __inline uint32_t port_hash(uint16_t key)
+ *   { return _hash_mix32(key); }
  *
  * HASH_TABLE_DECLARE_EXTENDED(port_table, uint16_t, mysock_context_t *,
  *                             port_hash, key_equal, 1024);
@@ -56,41 +68,87 @@
 #define HASH_TABLE_DECLARE_EXTENDED(tbl,keytype,datatype,hashfn,keyequal,size)\
 typedef struct tbl##_entry \
 { \
-    keytype             key; \
-    datatype            data; \
-    struct tbl##_entry *next; \
+    keytype      key; \
+    datatype     data; \
+    unsigned int dist;  /* 1 + distance from home slot; 0 if empty */ \
 } __##tbl##_entry_t; \
-static __##tbl##_entry_t *tbl[size]; \
+typedef struct \
+{ \
+    __##tbl##_entry_t *slots; \
+    unsigned int       capacity;    /* power of two, or 0 */ \
+    unsigned int       count; \
+} __##tbl##_table_t; \
+static __##tbl##_table_t tbl; \
 \
 static __##tbl##_entry_t *_hash_get_entry_##tbl(keytype key) \
 { \
-    __##tbl##_entry_t *e; \
-    unsigned int ndx; \
+    unsigned int mask = tbl.capacity - 1, ndx, dist; \
     \
-    ndx = hashfn(key, size); \
-    assert(ndx < size); \
+    if (!tbl.count) \
+        return NULL; \
     \
-    for (e = tbl[ndx]; e && !keyequal(e->key, key); e = e->next) ; \
-    return (e && keyequal(e->key, key)) ? e : NULL; \
+    /* an entry further from home than ours would have been displaced */ \
+    ndx = (unsigned int) hashfn(key) & mask; \
+    for (dist = 1; tbl.slots[ndx].dist >= dist; ++dist) \
+    { \
+        if (tbl.slots[ndx].dist == dist && keyequal(tbl.slots[ndx].key, key))\
+            return &tbl.slots[ndx]; \
+        ndx = (ndx + 1) & mask; \
+    } \
+    return NULL; \
 } \
 \
-static void _hash_insert_##tbl(keytype key, datatype data) \
+static void _hash_place_##tbl(__##tbl##_entry_t e) \
 { \
-    unsigned int ndx; \
-    __##tbl##_entry_t *old_head; \
+    unsigned int mask = tbl.capacity - 1, ndx; \
     \
-    ndx = hashfn(key, size); \
-    assert(ndx < size); \
-    old_head = tbl[ndx]; \
+    ndx = (unsigned int) hashfn(e.key) & mask; \
+    for (e.dist = 1; tbl.slots[ndx].dist; ++e.dist) \
+    { \
+        if (tbl.slots[ndx].dist < e.dist) \
+        { \
+            __##tbl##_entry_t displaced = tbl.slots[ndx]; \
+            tbl.slots[ndx] = e; \
+            e = displaced; \
+        } \
+        ndx = (ndx + 1) & mask; \
+    } \
+    tbl.slots[ndx] = e; \
+} \
+\
+static void _hash_grow_##tbl(void) \
+{ \
+    __##tbl##_entry_t *old_slots = tbl.slots; \
+    unsigned int old_capacity = tbl.capacity, k; \
     \
-    tbl[ndx] = (__##tbl##_entry_t *) malloc(sizeof(__##tbl##_entry_t)); \
-    assert(tbl[ndx]); \
+    if (!tbl.capacity) \
+        for (tbl.capacity = 8; tbl.capacity < (size); tbl.capacity *= 2) ; \
+    else \
+        tbl.capacity *= 2; \
     \
-    tbl[ndx]->key  = key; \
-    tbl[ndx]->data = data; \
-    tbl[ndx]->next = old_head; \
+    tbl.slots = (__##tbl##_entry_t *) \
+        calloc(tbl.capacity, sizeof(__##tbl##_entry_t)); \
+    assert(tbl.slots); \
     \
-    assert(_hash_get_entry_##tbl(key) == tbl[ndx]); \
+    for (k = 0; k < old_capacity; ++k) \
+    { \
+        if (old_slots[k].dist) \
+            _hash_place_##tbl(old_slots[k]); \
+    } \
+    free(old_slots); \
+} \
+\
+static void _hash_insert_##tbl(keytype key, datatype data) \
+{ \
+    __##tbl##_entry_t e; \
+    \
+    if (8 * (tbl.count + 1) > 7 * tbl.capacity) \
+        _hash_grow_##tbl(); \
+    \
+    e.key  = key; \
+    e.data = data; \
+    _hash_place_##tbl(e); \
+    ++tbl.count; \
 } \
 \
 static datatype _hash_lookup_##tbl(keytype key) \
@@ -123,24 +181,25 @@ static void _hash_set_entry_##tbl(keytype key, datatype data) \
 \
 static void _hash_delete_##tbl(keytype key) \
 { \
-    __##tbl##_entry_t *prev = 0, *e; \
-    unsigned int ndx; \
+    __##tbl##_entry_t *e = _hash_get_entry_##tbl(key); \
+    unsigned int mask = tbl.capacity - 1, ndx, next; \
     \
-    ndx = hashfn(key, size); \
-    assert(ndx < size); \
+    if (!e) \
+        return; \
     \
-    for (e = tbl[ndx]; e; e = e->next) \
+    /* shift the entries after it back a slot, up to the first that's \
+     * empty or already at home. \
+     */ \
+    ndx = (unsigned int) (e - tbl.slots); \
+    for (next = (ndx + 1) & mask; tbl.slots[next].dist > 1; \
+         next = (next + 1) & mask) \
     { \
-        if (keyequal(e->key, key)) \
-        { \
-            *((e == tbl[ndx]) ? &tbl[ndx] : &prev->next) = e->next; \
-            break; \
-        } \
-        prev = e; \
+        tbl.slots[ndx] = tbl.slots[next]; \
+        --tbl.slots[ndx].dist; \
+        ndx = next; \
     } \
-    \
-    free(e); \
-    assert(!_hash_get_entry_##tbl(key)); \
+    tbl.slots[ndx].dist = 0; \
+    --tbl.count; \
 }
 
 
@@ -151,8 +210,19 @@ static void _hash_delete_##tbl(keytype key) \
 #define HASH_LOOKUP(tbl,key)            _hash_lookup_##tbl(key)
 #define HASH_LOOKUP_PTR(tbl,key)        _hash_lookup_ptr_##tbl(key)
 
+/* murmur3's 32-bit finalizer; every input bit affects every output bit */
+static uint32_t _hash_mix32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x85ebca6bU;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35U;
+    x ^= x >> 16;
+    return x;
+}
+
 #define HASH_DEFAULT_KEY_EQUALS(a,b)    ((a) == (b))
-#define HASH_DEFAULT_HASH_FN(key,size)  ((key) % (size))
+#define HASH_DEFAULT_HASH_FN(key)       _hash_mix32((uint32_t) (key))
 
 #define HASH_TABLE_DECLARE(tbl,keytype,datatype,size) \
     HASH_TABLE_DECLARE_EXTENDED(tbl, keytype, datatype, \
@@ -161,4 +231,3 @@ static void _hash_delete_##tbl(keytype key) \
 
 
 #endif  /* __MYSOCK_HASH_H__ */
-
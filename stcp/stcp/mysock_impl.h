@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <pthread.h>
+#include <time.h>
 #include "mysock.h"
 #include "network_io.h"
 
@@ -48,24 +49,85 @@ static INLINE void _pthread_call(int pthread_retval)
 #endif
 
 
-/* packet/buffer queue */
-typedef struct packet_queue_node
+/* byte stream buffer, used for data passing between the application and
+ * the transport layer.  this is a ring over a single allocation, so reads
+ * and writes of any size take constant time besides the copy itself.  it's
+ * protected by the owning context's data_ready_lock.  if it has a capacity
+ * limit, writers block (or write short) once that many bytes are buffered.
+ */
+#define BYTE_RING_MIN_CAPACITY  4096
+
+/* default limit on data queued by mywrite() but not yet taken by the
+ * transport layer; see SO_SNDBUF in mysetsockopt().
+ */
+#define MYSOCK_DEFAULT_SNDBUF   (64 * 1024)
+
+typedef struct
+{
+    char   *data;           /* capacity bytes, allocated on first write */
+    size_t  capacity;       /* size of data; always a power of two */
+    size_t  capacity_limit; /* capacity may not grow past this; 0 = none */
+    size_t  head;           /* offset of the first unread byte */
+    size_t  len;            /* number of bytes buffered */
+    bool_t  eof;            /* TRUE once no more data will be written */
+    bool_t  writer_waiting; /* a writer is blocked waiting for space */
+} byte_ring_t;
+
+/* bounded single-producer/single-consumer packet ring.  this is used for
+ * packets arriving from the network, which are enqueued only by the network
+ * receive engine thread watching the connection and dequeued only by the
+ * connection's transport worker, so no lock is needed to pass a packet between
+ * them.  packets are copied into fixed
+ * size slots, so nothing is allocated per packet.  the slots themselves
+ * (nearly 100KB of them) are allocated when the first packet arrives, so
+ * listening sockets and mysockets that never connect don't carry them.
+ */
+#define PACKET_RING_SLOTS 64
+
+#if (PACKET_RING_SLOTS & (PACKET_RING_SLOTS - 1)) != 0
+    #error PACKET_RING_SLOTS should be a power of two
+#endif
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct
 {
-    char                     *data;
-    size_t                    data_len;
-    struct packet_queue_node *next;
-} packet_queue_node_t;
+    size_t data_len;
+    char   data[MAX_IP_PAYLOAD_LEN];
+} packet_ring_slot_t;
 
 typedef struct
 {
-    packet_queue_node_t *head;
-    packet_queue_node_t *tail;
-} packet_queue_t;
-
-/* mysocket context (and the arguments provided to the transport layer
- * thread).  most of this is mysock/network layer working state, with STCP
- * working state maintained separately by the student.  there is one instance
- * of this structure per mysocket.
+    /* free-running slot counters; the ring is empty when head == tail, and
+     * full when tail - head == PACKET_RING_SLOTS.  head is written only by
+     * the consumer and tail only by the producer, so they're kept on
+     * separate cache lines.
+     */
+    unsigned int head;
+    char         head_pad[CACHE_LINE_SIZE - sizeof(unsigned int)];
+    unsigned int tail;
+    char         tail_pad[CACHE_LINE_SIZE - sizeof(unsigned int)];
+
+    /* set by the consumer (under data_ready_lock) just before it sleeps on
+     * data_ready_cond.  the producer only takes the lock to wake it if this
+     * is set.
+     */
+    int consumer_waiting;
+
+    unsigned long drops;    /* packets dropped because the ring was full */
+
+    /* PACKET_RING_SLOTS slots, allocated by the producer on first use (and
+     * kept if the context is pooled).  the consumer only reads this once
+     * it's seen a slot published, so it needs no further synchronisation.
+     */
+    packet_ring_slot_t *slots;
+} packet_ring_t;
+
+/* mysocket context.  most of this is mysock/network layer working state,
+ * with STCP working state maintained separately by the student.  there is
+ * one instance of this structure per mysocket.  contexts are reused from a
+ * pool (see mysock.c); _mysock_reset_context() clears everything but the
+ * pthread objects and the buffers, so it needs updating if those move.
  */
 typedef struct mysock_context
 {
@@ -84,9 +146,30 @@ typedef struct mysock_context
     mysocket_t my_sd;
 
     /* for passive sockets, mysocket descriptor of listening socket from
-     * whence we came.  this is unused for active sockets.
+     * whence we came (-1 if it's closed before we're accepted), and the
+     * index of our entry in its connection queue.  these are unused for
+     * active sockets.  listen_sd is protected by the listen table's lock.
      */
     mysocket_t listen_sd;
+    int        listen_index;
+
+    /* for passive sockets set up from a SYN cookie (see connection_demux.c),
+     * the listening socket has already answered the peer's SYN; these are
+     * the sequence numbers of that SYN and of the SYN-ACK sent in reply.
+     */
+    bool_t     syn_ack_sent;
+    uint32_t   syn_seq, syn_ack_seq;
+
+    /* for listening sockets, MYTCP_DEFER_ACCEPT in seconds (or 0).  for
+     * passive sockets, accept_deferred is set once the handshake completes
+     * if the connection's held back from myaccept() until the peer sends
+     * something, or until accept_deadline.  it's used only by the worker
+     * running the connection, except that closing the listening socket
+     * clears it (atomically), along with listen_sd.
+     */
+    int             defer_accept;
+    bool_t          accept_deferred;
+    struct timespec accept_deadline;
 
     /* block application until connected (or an error) */
     pthread_cond_t  blocking_cond;
@@ -94,24 +177,90 @@ typedef struct mysock_context
     bool_t          blocking;
     int             stcp_errno;
 
-    /* STCP thread */
-    pthread_t       transport_thread;
-    bool_t          transport_thread_started;
+    /* set with myfcntl(); mysock calls return EAGAIN instead of blocking */
+    bool_t          nonblocking;
+
+    /* SO_LINGER, set with mysetsockopt(); see myclose() */
+    struct linger   linger;
+
+    /* STCP transport.  this is run by a transport worker (see
+     * mysock_worker.c); transport_finished is set, under both blocking_lock
+     * and the worker's lock, once the transport is done with the
+     * connection.
+     */
+    struct mysock_worker *worker;
+    bool_t          transport_started;
+    bool_t          transport_finished;
+    bool_t          transport_over;     /* stcp_transport_done() called */
+
+    /* app_closed is set once myclose() is called, after which the
+     * application can't use the descriptor.  close_detached is set, under
+     * blocking_lock, if myclose() returns before the transport's finished;
+     * its worker then frees the connection (see mysock_worker.c).
+     */
+    bool_t          app_closed;
+    bool_t          close_detached;
+
+    /* set by stcp_time_wait() if the connection closes in TIME_WAIT; it's
+     * then kept as a TIME_WAIT record once it's freed (see
+     * mysock_time_wait.c), with our next sequence number and the one after
+     * the peer's FIN.
+     */
+    bool_t          time_wait;
+    uint32_t        time_wait_local_seq, time_wait_remote_seq;
+
+    /* transport worker scheduling state.  everything from run_queued to
+     * timer_fired is protected by the (home) worker's lock; the rest is
+     * used only by the worker running the connection, which is only ever
+     * one at a time.
+     */
+    bool_t          run_queued;
+    struct mysock_context *run_prev, *run_next;
+    bool_t          running;            /* being run by some worker */
+    bool_t          run_again;          /* became runnable while running */
+    struct timespec timer_deadline;     /* earliest of the deadlines below */
+    int             timer_index;        /* in the worker's timer heap */
+    bool_t          transport_timer;    /* transport asked for a timeout */
+    struct timespec transport_deadline;
+    bool_t          timer_fired;
+    bool_t          transport_init_pending;
+    unsigned int    wait_flags;         /* see stcp_request_event() */
 
     /* is data ready from either network or the app? */
     pthread_cond_t  data_ready_cond;
     pthread_mutex_t data_ready_lock;
     bool_t          close_requested;    /* myclose() called by app? */
-    bool_t          eof;                /* true once peer finishes writing */
+
+    /* myepoll instances watching this mysocket; see mysock_poll.c */
+    struct mysock_watch *watches;
+    bool_t          accept_ready;   /* completed connection to myaccept()? */
+
+    /* descriptor returned by myeventfd(), or -1.  it's signaled when any
+     * of event_fd_revents, the events last seen, is newly set.
+     */
+    int             event_fd;
+    int             event_fd_write;
+    uint32_t        event_fd_revents;
 
     /* data sent to peer is sent immediately, so no queue is needed for that
      * case.  we keep a queue for the other three cases:  data coming from
      * peer, data sent to the app for consumption with myread(), and data
-     * coming from the app via mywrite().
+     * coming from the app via mywrite().  app_send_queue's eof flag is set
+     * once the peer finishes writing.
+     */
+    packet_ring_t   network_recv_queue; /* data coming from peer */
+    byte_ring_t     app_send_queue; /* data to be passed up to app */
+    byte_ring_t     app_recv_queue; /* data coming from app */
+
+    /* the last header-only segment (e.g. an ACK) sent to the peer, and the
+     * pseudo-header sum used for its checksum.  the checksum of the next
+     * one is updated incrementally from this.
      */
-    packet_queue_t  network_recv_queue; /* data coming from peer */
-    packet_queue_t  app_send_queue; /* data to be passed up to app */
-    packet_queue_t  app_recv_queue; /* data coming from app */
+    uint16_t        last_header[10];
+    uint32_t        last_header_pseudo_sum;
+    bool_t          last_header_valid;
+
+    struct mysock_context *pool_next;   /* in the context pool */
 } mysock_context_t;
 
 
@@ -119,26 +268,92 @@ typedef struct mysock_context
 mysocket_t _mysock_new_mysocket(bool_t is_reliable);
 
 mysock_context_t *_mysock_get_context(mysocket_t sd);
+mysock_context_t *_mysock_get_open_context(mysocket_t sd);
 
 void _mysock_transport_init(mysocket_t sd, bool_t is_active);
 
-int _mysock_wait_for_connection(mysock_context_t *ctx);
+int _mysock_wait_for_connection(mysock_context_t *ctx, bool_t block);
 
 void _mysock_free_context(mysock_context_t *ctx);
 
-void _mysock_enqueue_buffer(mysock_context_t *ctx,
-                            packet_queue_t   *pq,
+size_t _mysock_byte_ring_read_span(const byte_ring_t *ring,
+                                  const char       **span);
+void _mysock_byte_ring_consume(byte_ring_t *ring, size_t len);
+size_t _mysock_byte_ring_write_span(byte_ring_t *ring, char **span);
+void _mysock_byte_ring_commit(byte_ring_t *ring, size_t len);
+bool_t _mysock_byte_ring_reserve(byte_ring_t *ring, size_t len);
+void _mysock_byte_ring_free(byte_ring_t *ring);
+
+ssize_t _mysock_enqueue_bytes(mysock_context_t *ctx,
+                              byte_ring_t      *ring,
+                              const void       *src,
+                              size_t            src_len,
+                              bool_t            block);
+
+ssize_t _mysock_dequeue_bytes(mysock_context_t *ctx,
+                              byte_ring_t      *ring,
+                              void             *dst,
+                              size_t            max_len,
+                              bool_t            block);
+
+void _mysock_set_eof(mysock_context_t *ctx, byte_ring_t *ring);
+
+bool_t _mysock_ring_enqueue(mysock_context_t *ctx,
+                            packet_ring_t    *ring,
                             const void       *packet,
                             size_t            packet_len);
 
-size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
-                              packet_queue_t   *pq,
-                              void             *dst,
-                              size_t            max_len,
-                              bool_t            remove_partial);
+size_t _mysock_ring_dequeue(mysock_context_t *ctx,
+                            packet_ring_t    *ring,
+                            void             *dst,
+                            size_t            max_len);
+
+unsigned int _mysock_ring_dequeue_batch(mysock_context_t *ctx,
+                                        packet_ring_t    *ring,
+                                        void             *dst,
+                                        size_t            dst_stride,
+                                        size_t           *packet_lens,
+                                        unsigned int      max_packets);
+
+bool_t _mysock_ring_prepare_wait(packet_ring_t *ring);
+void _mysock_ring_finish_wait(packet_ring_t *ring);
 
 int _mysock_bind_ephemeral(mysock_context_t *ctx);
 
+/* mysock_api.c */
+void _mysock_close_context(mysock_context_t *ctx);
+
+/* mysock_worker.c */
+void _mysock_worker_start(mysock_context_t *ctx);
+void _mysock_schedule_transport(mysock_context_t *ctx);
+void _mysock_request_event(mysock_context_t      *ctx,
+                           unsigned int           flags,
+                           const struct timespec *abstime);
+bool_t _mysock_detach_transport(mysock_context_t      *ctx,
+                                const struct timespec *deadline);
+bool_t _mysock_stack_polled(void);
+void _mysock_stack_wait(pthread_cond_t *cond, pthread_mutex_t *lock);
+int _mysock_stack_timedwait(pthread_cond_t        *cond,
+                            pthread_mutex_t       *lock,
+                            const struct timespec *abstime);
+void _mysock_defer_accept(mysock_context_t      *ctx,
+                          const struct timespec *deadline);
+void _mysock_end_accept_deferral(mysock_context_t *ctx);
+
+/* mysock_poll.c */
+void _mysock_notify_locked(mysock_context_t *ctx);
+void _mysock_notify(mysock_context_t *ctx);
+void _mysock_set_accept_ready(mysock_context_t *ctx, bool_t accept_ready);
+void _mysock_poll_forget(mysock_context_t *ctx);
+
+/* mysock_time_wait.c */
+void _mysock_time_wait_add(mysock_context_t *ctx);
+void _mysock_time_wait_input(network_time_wait_t *tw,
+                             const void *header, size_t header_len,
+                             size_t packet_len);
+int _mysock_time_wait_timeout(int timeout);
+void _mysock_time_wait_expire(void);
+
 pthread_t _mysock_create_thread(void *(*start)(void *args), void *args,                                         bool_t create_detached);
 
 #endif  /* __MYSOCK_INTERNAL_H__ */
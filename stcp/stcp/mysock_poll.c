@@ -0,0 +1,762 @@
+/* mysock_poll.c--readiness notification across many mysockets.
+ *
+ * each myepoll instance keeps a list of the mysockets it watches that are
+ * currently ready.  rather than polling every mysocket on each wait, the
+ * mysocket layer calls _mysock_notify_locked() whenever the state of a
+ * mysocket's queues changes; this recomputes its readiness and updates the
+ * ready list of every instance watching it, so myepoll_wait() only ever
+ * looks at mysockets with something to report.  mypoll() is built on a
+ * temporary instance.  the same notification also drives the file
+ * descriptor returned by myeventfd(), for applications with their own
+ * event loop.
+ *
+ * locking order:  poll_table_lock, then a mysocket's data_ready_lock, then
+ * an instance's lock.  watches are only added or removed with the first two
+ * held, so they may be followed from either the mysocket or the instance
+ * under poll_table_lock.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#if defined(LINUX)
+#include <sys/eventfd.h>
+#endif
+#include "mysock.h"
+#include "mysock_impl.h"
+
+
+/* a single mysocket watched by a myepoll instance */
+typedef struct mysock_watch
+{
+    struct myepoll      *ep;
+    mysock_context_t    *ctx;
+    uint32_t             events;    /* interest set, including MYEPOLLET */
+    myepoll_data_t       data;      /* returned to the app with events */
+
+    /* protected by the instance's lock */
+    uint32_t             revents;   /* events of interest last reported */
+    bool_t               on_ready_list;
+    struct mysock_watch *ready_prev, *ready_next;
+
+    /* protected by poll_table_lock (and the mysocket's data_ready_lock, for
+     * ctx_next)
+     */
+    struct mysock_watch *ctx_next;
+    struct mysock_watch *ep_prev, *ep_next;
+} mysock_watch_t;
+
+typedef struct myepoll
+{
+    pthread_mutex_t  lock;
+    pthread_cond_t   ready_cond;    /* signaled when a watch becomes ready */
+    mysock_watch_t  *ready_head, *ready_tail;
+    mysock_watch_t  *watches;       /* every mysocket watched */
+} myepoll_t;
+
+/* events that are always reported, whether requested or not */
+#define MYPOLL_ALWAYS   (MYPOLLERR | MYPOLLHUP)
+
+/* myepoll descriptor table */
+#define MAX_NUM_EPOLL   64
+
+static myepoll_t *epoll_table[MAX_NUM_EPOLL];
+static pthread_mutex_t poll_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void _myepoll_init(myepoll_t *ep);
+static void _myepoll_destroy(myepoll_t *ep);
+static bool_t _myepoll_add(myepoll_t *ep, mysock_context_t *ctx,
+                           uint32_t events, myepoll_data_t data);
+static void _myepoll_remove(mysock_watch_t *w);
+static void _myepoll_update(mysock_watch_t *w, uint32_t revents);
+static int _myepoll_wait(myepoll_t *ep, struct myepoll_event *events,
+                         int max_events, int timeout);
+static uint32_t _mysock_poll_events_locked(mysock_context_t *ctx);
+static int _mysock_open_event_fd(mysock_context_t *ctx);
+static void _mysock_signal_event_fd(mysock_context_t *ctx);
+
+
+/* recompute the readiness of the given mysocket, and update the ready list
+ * of every myepoll instance watching it.  the caller holds the mysocket's
+ * data_ready_lock.
+ */
+void _mysock_notify_locked(mysock_context_t *ctx)
+{
+    mysock_watch_t *w;
+    uint32_t revents;
+
+    assert(ctx);
+
+    if (!ctx->watches && ctx->event_fd < 0)
+        return;
+
+    revents = _mysock_poll_events_locked(ctx);
+    for (w = ctx->watches; w; w = w->ctx_next)
+        _myepoll_update(w, revents);
+
+    if (ctx->event_fd >= 0)
+    {
+        /* signal only on new events, so a stream of packets arriving at a
+         * mysocket that's already readable costs no system calls.
+         */
+        if (revents & ~ctx->event_fd_revents)
+            _mysock_signal_event_fd(ctx);
+        ctx->event_fd_revents = revents;
+    }
+}
+
+/* as _mysock_notify_locked(), for a caller not holding data_ready_lock */
+void _mysock_notify(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    _mysock_notify_locked(ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
+/* called by the connection demultiplexing code when the completed
+ * connection queue of a listening mysocket becomes empty or non-empty.
+ */
+void _mysock_set_accept_ready(mysock_context_t *ctx, bool_t accept_ready)
+{
+    assert(ctx && ctx->listening);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->accept_ready = accept_ready;
+    _mysock_notify_locked(ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
+/* called when a mysocket is closed; as with epoll, it's dropped from any
+ * myepoll instance still watching it.  its myeventfd() descriptor is
+ * closed too.
+ */
+void _mysock_poll_forget(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_table_lock));
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    while (ctx->watches)
+        _myepoll_remove(ctx->watches);
+
+    if (ctx->event_fd >= 0)
+    {
+        if (ctx->event_fd_write != ctx->event_fd)
+            close(ctx->event_fd_write);
+        close(ctx->event_fd);
+        ctx->event_fd = ctx->event_fd_write = -1;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_table_lock));
+}
+
+/* returns a file descriptor that becomes readable whenever the given
+ * mysocket gets a new event:  data or EOF arriving for myread(), space
+ * freeing up for mywrite(), a connection completing on a listening
+ * mysocket, or the connection failing or finishing.  it can be added to
+ * the application's own poll(), select() or epoll set.
+ *
+ * the descriptor is signaled once per new event, not once per packet, so
+ * it's edge-triggered:  after it fires, read it to reset it (its contents
+ * are meaningless), then call myread()/mywrite()/myaccept() until they
+ * fail with EAGAIN, before waiting on it again.  calling myeventfd() again
+ * signals the descriptor at once if any event is pending.
+ *
+ * the descriptor belongs to the mysocket, and is closed by myclose().
+ */
+int myeventfd(mysocket_t sd)
+{
+    mysock_context_t *ctx = (sd >= 0) ? _mysock_get_open_context(sd) : NULL;
+    int fd;
+
+    if (!ctx)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if (ctx->event_fd < 0 && _mysock_open_event_fd(ctx) < 0)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        return -1;
+    }
+
+    /* report whatever is pending now as new */
+    ctx->event_fd_revents = 0;
+    _mysock_notify_locked(ctx);
+    fd = ctx->event_fd;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    return fd;
+}
+
+/* create the descriptor for myeventfd().  this is an eventfd where
+ * available, or a pipe otherwise.  the caller holds data_ready_lock.
+ */
+static int _mysock_open_event_fd(mysock_context_t *ctx)
+{
+    assert(ctx && ctx->event_fd < 0);
+
+#if defined(LINUX)
+    if ((ctx->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+    ctx->event_fd_write = ctx->event_fd;
+#else
+    {
+        int fds[2], k;
+
+        if (pipe(fds) < 0)
+            return -1;
+
+        for (k = 0; k < 2; ++k)
+        {
+            (void) fcntl(fds[k], F_SETFL, O_NONBLOCK);
+            (void) fcntl(fds[k], F_SETFD, FD_CLOEXEC);
+        }
+
+        ctx->event_fd       = fds[0];
+        ctx->event_fd_write = fds[1];
+    }
+#endif
+
+    return 0;
+}
+
+/* make the myeventfd() descriptor readable.  if it's already full (i.e.,
+ * the app hasn't read it since it was last signaled), the write fails
+ * harmlessly.
+ */
+static void _mysock_signal_event_fd(mysock_context_t *ctx)
+{
+#if defined(LINUX)
+    uint64_t one = 1;
+#else
+    char one = 1;
+#endif
+
+    assert(ctx && ctx->event_fd_write >= 0);
+    (void) write(ctx->event_fd_write, &one, sizeof(one));
+}
+
+/* returns the events currently pending on the given mysocket.  the caller
+ * holds its data_ready_lock.
+ */
+static uint32_t _mysock_poll_events_locked(mysock_context_t *ctx)
+{
+    uint32_t revents = 0;
+
+    assert(ctx);
+
+    if (ctx->listening)
+        return ctx->accept_ready ? MYPOLLIN : 0;
+
+    if (!ctx->transport_started)
+        return MYPOLLHUP;   /* never connected */
+
+    if (ctx->blocking)
+        return 0;           /* connection in progress */
+
+    if (ctx->stcp_errno)
+        return MYPOLLERR | MYPOLLHUP;
+
+    if (ctx->app_send_queue.len > 0 || ctx->app_send_queue.eof)
+        revents |= MYPOLLIN;
+
+    if (ctx->app_recv_queue.eof)
+    {
+        /* the transport layer has finished with the connection */
+        revents |= MYPOLLHUP;
+    }
+    else if (!ctx->app_recv_queue.capacity_limit ||
+             ctx->app_recv_queue.len < ctx->app_recv_queue.capacity_limit)
+    {
+        revents |= MYPOLLOUT;
+    }
+
+    return revents;
+}
+
+
+/* create a new myepoll instance; returns its descriptor */
+int myepoll_create(void)
+{
+    myepoll_t *ep;
+    int k;
+
+    ep = (myepoll_t *) malloc(sizeof(myepoll_t));
+    assert(ep);
+    _myepoll_init(ep);
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_table_lock));
+    for (k = 0; k < MAX_NUM_EPOLL; ++k)
+    {
+        if (!epoll_table[k])
+        {
+            epoll_table[k] = ep;
+            PTHREAD_CALL(pthread_mutex_unlock(&poll_table_lock));
+            return k;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_table_lock));
+
+    _myepoll_destroy(ep);
+    free(ep);
+    errno = EMFILE;
+    return -1;
+}
+
+/* add (MYEPOLL_CTL_ADD), change (MYEPOLL_CTL_MOD) or remove
+ * (MYEPOLL_CTL_DEL) the given mysocket from the set watched by a myepoll
+ * instance.  event->events is a mask of MYPOLLIN/MYPOLLOUT, optionally with
+ * MYEPOLLET; MYPOLLERR and MYPOLLHUP are always reported.  event->data is
+ * returned by myepoll_wait() along with any events.
+ */
+int myepoll_ctl(int epd, int op, mysocket_t sd, struct myepoll_event *event)
+{
+    mysock_context_t *ctx;
+    mysock_watch_t *w;
+    myepoll_t *ep;
+    int rc = 0;
+
+    if (op != MYEPOLL_CTL_DEL && !event)
+    {
+        errno = EFAULT;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_table_lock));
+    ep  = (epd >= 0 && epd < MAX_NUM_EPOLL) ? epoll_table[epd] : NULL;
+    ctx = (sd >= 0) ? _mysock_get_open_context(sd) : NULL;
+    if (!ep || !ctx)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&poll_table_lock));
+        errno = EBADF;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    for (w = ctx->watches; w && w->ep != ep; w = w->ctx_next)
+        ;
+
+    switch (op)
+    {
+    case MYEPOLL_CTL_ADD:
+        if (w)
+            rc = EEXIST;
+        else
+            (void) _myepoll_add(ep, ctx, event->events, event->data);
+        break;
+
+    case MYEPOLL_CTL_MOD:
+        if (!w)
+        {
+            rc = ENOENT;
+            break;
+        }
+
+        /* report the mysocket afresh under its new interest set */
+        PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+        w->events  = event->events;
+        w->data    = event->data;
+        w->revents = 0;
+        PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+        _myepoll_update(w, _mysock_poll_events_locked(ctx));
+        break;
+
+    case MYEPOLL_CTL_DEL:
+        if (w)
+            _myepoll_remove(w);
+        else
+            rc = ENOENT;
+        break;
+
+    default:
+        rc = EINVAL;
+        break;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_table_lock));
+
+    if (rc)
+    {
+        errno = rc;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* wait for events on the mysockets watched by a myepoll instance.  up to
+ * max_events are returned in events.  timeout is in milliseconds; -1 waits
+ * indefinitely, and 0 returns immediately.  a level-triggered mysocket is
+ * reported on every call for as long as it's ready; an edge-triggered one
+ * (MYEPOLLET) only when it becomes ready for an event again.  returns the
+ * number of entries filled in events, or -1 on error.
+ */
+int myepoll_wait(int epd, struct myepoll_event *events, int max_events,
+                 int timeout)
+{
+    myepoll_t *ep;
+
+    if (!events || max_events <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_table_lock));
+    ep = (epd >= 0 && epd < MAX_NUM_EPOLL) ? epoll_table[epd] : NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_table_lock));
+
+    if (!ep)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    return _myepoll_wait(ep, events, max_events, timeout);
+}
+
+/* destroy a myepoll instance.  this must not be called while another
+ * thread is waiting on it.
+ */
+int myepoll_close(int epd)
+{
+    myepoll_t *ep;
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_table_lock));
+    ep = (epd >= 0 && epd < MAX_NUM_EPOLL) ? epoll_table[epd] : NULL;
+    if (!ep)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&poll_table_lock));
+        errno = EBADF;
+        return -1;
+    }
+
+    epoll_table[epd] = NULL;
+    _myepoll_destroy(ep);
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_table_lock));
+
+    free(ep);
+    return 0;
+}
+
+/* the mysocket equivalent of poll(2).  fds[k].events is a mask of
+ * MYPOLLIN/MYPOLLOUT; MYPOLLERR and MYPOLLHUP are always reported, and
+ * MYPOLLNVAL is reported for a descriptor that isn't open.  negative
+ * descriptors are ignored.  timeout is as for myepoll_wait().  returns the
+ * number of entries in fds with non-zero revents.
+ */
+int mypoll(struct mypollfd *fds, unsigned int nfds, int timeout)
+{
+    struct myepoll_event event;
+    myepoll_t ep;
+    unsigned int k;
+    int num_ready = 0;
+
+    if (!fds && nfds > 0)
+    {
+        errno = EFAULT;
+        return -1;
+    }
+
+    /* watch every mysocket through a temporary myepoll instance, so we can
+     * sleep until any of them is ready.
+     */
+    _myepoll_init(&ep);
+    memset(&event.data, 0, sizeof(event.data));
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_table_lock));
+    for (k = 0; k < nfds; ++k)
+    {
+        mysock_context_t *ctx;
+
+        if (fds[k].sd < 0 || !(ctx = _mysock_get_open_context(fds[k].sd)))
+            continue;
+
+        /* a mysocket may appear more than once in fds */
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        if (!_myepoll_add(&ep, ctx, fds[k].events, event.data))
+        {
+            mysock_watch_t *w;
+
+            for (w = ctx->watches; w->ep != &ep; w = w->ctx_next)
+                ;
+
+            w->events |= fds[k].events;
+            _myepoll_update(w, _mysock_poll_events_locked(ctx));
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_table_lock));
+
+    (void) _myepoll_wait(&ep, &event, 1, timeout);
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_table_lock));
+    _myepoll_destroy(&ep);
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_table_lock));
+
+    /* report the state of each mysocket now */
+    for (k = 0; k < nfds; ++k)
+    {
+        mysock_context_t *ctx;
+
+        fds[k].revents = 0;
+        if (fds[k].sd < 0)
+            continue;
+
+        if (!(ctx = _mysock_get_open_context(fds[k].sd)))
+        {
+            fds[k].revents = MYPOLLNVAL;
+        }
+        else
+        {
+            PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+            fds[k].revents = (short) (_mysock_poll_events_locked(ctx) &
+                                      (fds[k].events | MYPOLL_ALWAYS));
+            PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        }
+
+        if (fds[k].revents)
+            ++num_ready;
+    }
+
+    return num_ready;
+}
+
+
+static void _myepoll_init(myepoll_t *ep)
+{
+    assert(ep);
+
+    memset(ep, 0, sizeof(*ep));
+    PTHREAD_CALL(pthread_mutex_init(&ep->lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&ep->ready_cond, NULL));
+}
+
+/* stop watching every mysocket, and free the instance's resources.  the
+ * caller holds poll_table_lock.
+ */
+static void _myepoll_destroy(myepoll_t *ep)
+{
+    assert(ep);
+
+    while (ep->watches)
+    {
+        mysock_context_t *ctx = ep->watches->ctx;
+
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        _myepoll_remove(ep->watches);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
+
+    PTHREAD_CALL(pthread_cond_destroy(&ep->ready_cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&ep->lock));
+}
+
+/* start watching the given mysocket.  returns FALSE if the instance is
+ * already watching it.  the caller holds poll_table_lock and the mysocket's
+ * data_ready_lock.
+ */
+static bool_t _myepoll_add(myepoll_t *ep, mysock_context_t *ctx,
+                           uint32_t events, myepoll_data_t data)
+{
+    mysock_watch_t *w;
+
+    assert(ep && ctx);
+
+    for (w = ctx->watches; w; w = w->ctx_next)
+    {
+        if (w->ep == ep)
+            return FALSE;
+    }
+
+    w = (mysock_watch_t *) calloc(1, sizeof(mysock_watch_t));
+    assert(w);
+
+    w->ep     = ep;
+    w->ctx    = ctx;
+    w->events = events;
+    w->data   = data;
+
+    w->ctx_next  = ctx->watches;
+    ctx->watches = w;
+
+    w->ep_next = ep->watches;
+    if (ep->watches)
+        ep->watches->ep_prev = w;
+    ep->watches = w;
+
+    _myepoll_update(w, _mysock_poll_events_locked(ctx));
+    return TRUE;
+}
+
+/* stop watching a mysocket.  the caller holds poll_table_lock and the
+ * mysocket's data_ready_lock.
+ */
+static void _myepoll_remove(mysock_watch_t *w)
+{
+    mysock_watch_t **link;
+    myepoll_t *ep;
+
+    assert(w && w->ep && w->ctx);
+    ep = w->ep;
+
+    for (link = &w->ctx->watches; *link != w; link = &(*link)->ctx_next)
+        assert(*link);
+    *link = w->ctx_next;
+
+    if (w->ep_prev)
+        w->ep_prev->ep_next = w->ep_next;
+    else
+        ep->watches = w->ep_next;
+    if (w->ep_next)
+        w->ep_next->ep_prev = w->ep_prev;
+
+    /* a concurrent _myepoll_wait() only looks at the ready list */
+    _myepoll_update(w, 0);
+
+    memset(w, 0, sizeof(*w));
+    free(w);
+}
+
+/* move a watch onto or off its instance's ready list, given the events now
+ * pending on its mysocket.  the caller holds the mysocket's data_ready_lock.
+ */
+static void _myepoll_update(mysock_watch_t *w, uint32_t revents)
+{
+    myepoll_t *ep;
+    uint32_t gained;
+
+    assert(w && w->ep);
+    ep = w->ep;
+
+    revents &= w->events | MYPOLL_ALWAYS;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+    gained     = revents & ~w->revents;
+    w->revents = revents;
+
+    if (!revents && w->on_ready_list)
+    {
+        /* nothing left to report */
+        if (w->ready_prev)
+            w->ready_prev->ready_next = w->ready_next;
+        else
+            ep->ready_head = w->ready_next;
+
+        if (w->ready_next)
+            w->ready_next->ready_prev = w->ready_prev;
+        else
+            ep->ready_tail = w->ready_prev;
+
+        w->ready_prev = w->ready_next = NULL;
+        w->on_ready_list = FALSE;
+    }
+    else if (revents && !w->on_ready_list &&
+             (!(w->events & MYEPOLLET) || gained))
+    {
+        /* level-triggered watches stay on the ready list while they're
+         * ready; edge-triggered ones are queued only when a new event
+         * arrives.
+         */
+        w->ready_prev = ep->ready_tail;
+        w->ready_next = NULL;
+        if (ep->ready_tail)
+            ep->ready_tail->ready_next = w;
+        else
+            ep->ready_head = w;
+        ep->ready_tail = w;
+        w->on_ready_list = TRUE;
+
+        PTHREAD_CALL(pthread_cond_signal(&ep->ready_cond));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+}
+
+static int _myepoll_wait(myepoll_t *ep, struct myepoll_event *events,
+                         int max_events, int timeout)
+{
+    struct timespec abstime;
+    unsigned int num_listed = 0;
+    mysock_watch_t *w;
+    int num_events = 0;
+
+    assert(ep && events && max_events > 0);
+
+    if (timeout > 0)
+    {
+        struct timeval now;
+
+        gettimeofday(&now, NULL);
+        abstime.tv_sec  = now.tv_sec + timeout / 1000;
+        abstime.tv_nsec = now.tv_usec * 1000 + (timeout % 1000) * 1000000;
+        if (abstime.tv_nsec >= 1000000000)
+        {
+            ++abstime.tv_sec;
+            abstime.tv_nsec -= 1000000000;
+        }
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+    while (!ep->ready_head && timeout != 0)
+    {
+        if (timeout < 0)
+        {
+            _mysock_stack_wait(&ep->ready_cond, &ep->lock);
+        }
+        else if (_mysock_stack_timedwait(&ep->ready_cond, &ep->lock,
+                                         &abstime) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+
+    for (w = ep->ready_head; w; w = w->ready_next)
+        ++num_listed;
+
+    /* level-triggered watches go back on the tail of the ready list, so a
+     * busy mysocket can't starve the others when max_events is small.
+     */
+    while (num_events < max_events && num_listed-- > 0)
+    {
+        w = ep->ready_head;
+        assert(w && w->on_ready_list && w->revents);
+
+        events[num_events].events = w->revents;
+        events[num_events].data   = w->data;
+        ++num_events;
+
+        ep->ready_head = w->ready_next;
+        if (ep->ready_head)
+            ep->ready_head->ready_prev = NULL;
+        else
+            ep->ready_tail = NULL;
+        w->ready_next = NULL;
+
+        if (w->events & MYEPOLLET)
+        {
+            w->on_ready_list = FALSE;
+        }
+        else
+        {
+            w->ready_prev = ep->ready_tail;
+            if (ep->ready_tail)
+                ep->ready_tail->ready_next = w;
+            else
+                ep->ready_head = w;
+            ep->ready_tail = w;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+
+    return num_events;
+}
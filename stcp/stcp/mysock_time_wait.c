@@ -0,0 +1,454 @@
+/* mysock_time_wait.c--TIME_WAIT records.
+ *
+ * a connection that closes actively ends up in TIME_WAIT, in case the ACK
+ * of the peer's FIN is lost; the peer then retransmits its FIN, which has
+ * to be ACKed again.  keeping a closed connection's transport and mysocket
+ * contexts around for that long would be ruinous when connections come and
+ * go quickly, so the transport hands the connection over with
+ * stcp_time_wait() instead, and once its mysocket is freed, all that's left
+ * of it is a small record:  its addresses and ports, the sequence numbers
+ * to ACK with, and when it expires.  the network layer keeps the channel to
+ * the peer open for it (see network_io.h), and passes whatever arrives on
+ * that to _mysock_time_wait_input(), which answers a retransmitted FIN from
+ * the record alone.
+ *
+ * every record lasts equally long, so records expire in the order they're
+ * added, and the table is simply a queue in order of expiry.  a reaper
+ * thread sleeps until the record at its head is due; in MYSTACK_POLLED
+ * mode, mystack_poll() expires records instead.  records are allocated
+ * TIME_WAIT_BLOCK_RECORDS at a time, and kept for reuse; once the table
+ * empties, all but one block are freed.  mystack_time_wait_memory() reports
+ * the memory this takes.  each record also holds its channel open until it
+ * expires, which isn't counted there.
+ *
+ * STCP_TIME_WAIT gives the time connections spend in TIME_WAIT, in seconds
+ * (TIME_WAIT_DEFAULT by default); 0 turns TIME_WAIT off.  at most
+ * STCP_TIME_WAIT_MAX connections (TIME_WAIT_DEFAULT_MAX by default) are
+ * kept in TIME_WAIT; any more skip it.  a child process doesn't inherit its
+ * parent's records after a fork().
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "transport.h"
+#include "tcp_sum.h"
+
+
+#define TIME_WAIT_DEFAULT       60
+#define TIME_WAIT_DEFAULT_MAX   4096
+#define TIME_WAIT_BLOCK_RECORDS 64
+
+/* flags */
+#define TIME_WAIT_CHECKSUM_TRUSTED  0x1 /* accept unchecksummed segments */
+#define TIME_WAIT_CHECKSUM_REQUIRED 0x2 /* checksum what we send */
+
+typedef struct time_wait_record
+{
+    network_time_wait_t channel;    /* must be first; see the input path */
+    struct time_wait_record *next;  /* in the table, or the free list */
+    time_t   expiry;                /* as measured by gettimeofday() */
+
+    /* the connection's 4-tuple, in network byte order */
+    uint32_t local_addr, peer_addr;
+    uint16_t local_port, peer_port;
+
+    /* our next sequence number, and the one after the peer's FIN */
+    uint32_t local_seq, remote_seq;
+    uint16_t flags;
+} time_wait_record_t;
+
+typedef struct time_wait_block
+{
+    struct time_wait_block *next;
+    time_wait_record_t      records[TIME_WAIT_BLOCK_RECORDS];
+} time_wait_block_t;
+
+/* protects everything below.  a record's fields don't change while its
+ * channel is open, so the input path reads them without taking this.
+ */
+static pthread_mutex_t time_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  time_wait_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t  time_wait_once = PTHREAD_ONCE_INIT;
+
+static int          time_wait_secs = TIME_WAIT_DEFAULT;
+static unsigned int time_wait_max  = TIME_WAIT_DEFAULT_MAX;
+
+static time_wait_record_t *time_wait_head, *time_wait_tail;
+static unsigned int        time_wait_count;
+static time_wait_record_t *time_wait_free;
+static time_wait_block_t  *time_wait_blocks;
+static unsigned int        time_wait_num_blocks;
+static bool_t              time_wait_reaper_started;
+
+
+static void _mysock_time_wait_init(void);
+static void _mysock_time_wait_fork_child(void);
+static time_wait_record_t *_mysock_time_wait_alloc_locked(void);
+static void _mysock_time_wait_release_locked(time_wait_record_t *record);
+static void _mysock_time_wait_expire_locked(time_t now);
+static void *time_wait_reaper_func(void *arg_ptr);
+
+
+/* keep a record of a connection that's closed in TIME_WAIT, as its mysocket
+ * is freed.  its receive engine watch must have been stopped already.
+ */
+void _mysock_time_wait_add(mysock_context_t *ctx)
+{
+    network_context_t *net_ctx;
+    time_wait_record_t *record;
+    struct timeval now;
+    uint32_t local_addr;
+    uint16_t local_port;
+    bool_t was_empty;
+
+    assert(ctx && ctx->time_wait);
+
+    PTHREAD_CALL(pthread_once(&time_wait_once, _mysock_time_wait_init));
+
+    net_ctx = &ctx->network_state;
+    if (time_wait_secs <= 0 || time_wait_max == 0 ||
+        !net_ctx->peer_addr_valid || net_ctx->peer_addr.sa_family != AF_INET)
+        return;
+
+    /* these are looked up while the mysocket still has its channel */
+    local_port = (uint16_t) _network_get_port(net_ctx);
+    local_addr = _network_get_local_addr(net_ctx);
+
+    gettimeofday(&now, NULL);
+
+    PTHREAD_CALL(pthread_mutex_lock(&time_wait_lock));
+    _mysock_time_wait_expire_locked(now.tv_sec);
+
+    if (time_wait_count >= time_wait_max ||
+        !(record = _mysock_time_wait_alloc_locked()))
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&time_wait_lock));
+        DEBUG_LOG(("no room for mysocket %d in TIME_WAIT\n", ctx->my_sd));
+        return;
+    }
+
+    record->next       = NULL;
+    record->expiry     = now.tv_sec + time_wait_secs;
+    record->local_addr = local_addr;
+    record->peer_addr  =
+        ((struct sockaddr_in *) &net_ctx->peer_addr)->sin_addr.s_addr;
+    record->local_port = local_port;
+    record->peer_port  = ((struct sockaddr_in *) &net_ctx->peer_addr)->sin_port;
+    record->local_seq  = ctx->time_wait_local_seq;
+    record->remote_seq = ctx->time_wait_remote_seq;
+    record->flags      = 0;
+    if (net_ctx->checksum_trusted)
+        record->flags |= TIME_WAIT_CHECKSUM_TRUSTED;
+    if (_mysock_checksum_required(ctx))
+        record->flags |= TIME_WAIT_CHECKSUM_REQUIRED;
+
+    /* input may arrive as soon as the channel's started */
+    if (_network_time_wait_start(net_ctx, &record->channel) < 0)
+    {
+        _mysock_time_wait_release_locked(record);
+        PTHREAD_CALL(pthread_mutex_unlock(&time_wait_lock));
+        return;
+    }
+
+    was_empty = (time_wait_head == NULL);
+    if (time_wait_tail)
+        time_wait_tail->next = record;
+    else
+        time_wait_head = record;
+    time_wait_tail = record;
+    ++time_wait_count;
+
+    if (!_mysock_stack_polled())
+    {
+        if (!time_wait_reaper_started)
+        {
+            (void) _mysock_create_thread(time_wait_reaper_func, NULL, TRUE);
+            time_wait_reaper_started = TRUE;
+        }
+        else if (was_empty)
+        {
+            PTHREAD_CALL(pthread_cond_signal(&time_wait_cond));
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&time_wait_lock));
+}
+
+/* handle a segment arriving on a TIME_WAIT channel.  header is the start of
+ * the segment, packet_len bytes long in all.  the only thing expected is a
+ * retransmission of the peer's FIN, which is ACKed again; anything else is
+ * dropped.  this is called by the receive engine, without time_wait_lock;
+ * the record can't go away meanwhile (see _network_time_wait_close()).
+ */
+void _mysock_time_wait_input(network_time_wait_t *tw,
+                             const void *header, size_t header_len,
+                             size_t packet_len)
+{
+    const time_wait_record_t *record = (const time_wait_record_t *) tw;
+    struct tcphdr segment, ack;
+    size_t segment_hdr_len;
+
+    assert(tw && header);
+    assert(header_len <= packet_len);
+
+    if (header_len < sizeof(segment))
+        return;
+
+    memcpy(&segment, header, sizeof(segment));
+    segment_hdr_len = segment.th_off * sizeof(uint32_t);
+    if (!(segment.th_flags & TH_FIN) ||
+        segment_hdr_len < sizeof(segment) || segment_hdr_len > packet_len)
+        return;
+
+    /* only the whole segment can be checksummed, which is only kept if
+     * it's short (i.e. a bare FIN).
+     */
+    if (segment.th_sum == 0
+        ? !(record->flags & TIME_WAIT_CHECKSUM_TRUSTED)
+        : (header_len < packet_len ||
+           _mysock_segment_checksum(record->peer_addr, record->local_addr,
+                                    header, packet_len) != segment.th_sum))
+    {
+        DEBUG_LOG(("dropping segment in TIME_WAIT (bad checksum)\n"));
+        return;
+    }
+
+    if (ntohl(segment.th_seq) + (uint32_t) (packet_len - segment_hdr_len) +
+        1 != record->remote_seq)
+        return;
+
+    DEBUG_LOG(("ACKing retransmitted FIN in TIME_WAIT\n"));
+
+    memset(&ack, 0, sizeof(ack));
+    ack.th_sport = record->local_port;
+    ack.th_dport = record->peer_port;
+    ack.th_seq   = htonl(record->local_seq);
+    ack.th_ack   = htonl(record->remote_seq);
+    ack.th_off   = sizeof(ack) / sizeof(uint32_t);
+    ack.th_flags = TH_ACK;
+    ack.th_win   = 0;   /* nothing more can be received */
+
+    if (record->flags & TIME_WAIT_CHECKSUM_REQUIRED)
+        ack.th_sum = _mysock_segment_checksum(record->local_addr,
+                                              record->peer_addr,
+                                              &ack, sizeof(ack));
+
+    (void) _network_time_wait_send(tw, &ack, sizeof(ack));
+}
+
+/* in MYSTACK_POLLED mode, the number of milliseconds mystack_poll() may
+ * wait:  the caller's timeout (-1 for none), or less if a record expires
+ * sooner.
+ */
+int _mysock_time_wait_timeout(int timeout)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&time_wait_lock));
+    if (time_wait_head)
+    {
+        struct timeval now;
+        long ms;
+
+        gettimeofday(&now, NULL);
+        ms = (time_wait_head->expiry - now.tv_sec) * 1000 -
+             now.tv_usec / 1000;
+        ms = (ms < 0) ? 0 : ms;
+        if (timeout < 0 || ms < timeout)
+            timeout = (int) ms;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&time_wait_lock));
+
+    return timeout;
+}
+
+/* in MYSTACK_POLLED mode, drop the records that have expired */
+void _mysock_time_wait_expire(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    PTHREAD_CALL(pthread_mutex_lock(&time_wait_lock));
+    _mysock_time_wait_expire_locked(now.tv_sec);
+    PTHREAD_CALL(pthread_mutex_unlock(&time_wait_lock));
+}
+
+/* returns the memory taken by TIME_WAIT records, in bytes, and sets
+ * *num_conns (if given) to the number of connections in TIME_WAIT.
+ */
+size_t mystack_time_wait_memory(unsigned int *num_conns)
+{
+    size_t memory;
+
+    PTHREAD_CALL(pthread_mutex_lock(&time_wait_lock));
+    memory = time_wait_num_blocks * sizeof(time_wait_block_t);
+    if (num_conns)
+        *num_conns = time_wait_count;
+    PTHREAD_CALL(pthread_mutex_unlock(&time_wait_lock));
+
+    return memory;
+}
+
+
+/* read the table's settings.  the receive engine's fork handler was
+ * registered when the first connection started receiving, so it runs
+ * before ours in a child.
+ */
+static void _mysock_time_wait_init(void)
+{
+    const char *value;
+
+    if ((value = getenv("STCP_TIME_WAIT")) && *value)
+        time_wait_secs = MAX(atoi(value), 0);
+    if ((value = getenv("STCP_TIME_WAIT_MAX")) && *value)
+        time_wait_max = (unsigned int) MAX(atoi(value), 0);
+
+    PTHREAD_CALL(pthread_atfork(NULL, NULL, _mysock_time_wait_fork_child));
+}
+
+/* the child gets copies of its parent's TIME_WAIT channels, which aren't
+ * its to keep open.  it has no reaper either.
+ */
+static void _mysock_time_wait_fork_child(void)
+{
+    time_wait_record_t *record;
+
+    for (record = time_wait_head; record; record = record->next)
+        _network_time_wait_close(&record->channel);
+
+    while (time_wait_blocks)
+    {
+        time_wait_block_t *block = time_wait_blocks;
+
+        time_wait_blocks = block->next;
+        free(block);
+    }
+
+    time_wait_head = time_wait_tail = time_wait_free = NULL;
+    time_wait_count = time_wait_num_blocks = 0;
+    time_wait_reaper_started = FALSE;
+    PTHREAD_CALL(pthread_mutex_init(&time_wait_lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&time_wait_cond, NULL));
+}
+
+/* take a record from the free list, allocating another block if need be */
+static time_wait_record_t *_mysock_time_wait_alloc_locked(void)
+{
+    time_wait_record_t *record;
+
+    if (!time_wait_free)
+    {
+        time_wait_block_t *block =
+            (time_wait_block_t *) malloc(sizeof(time_wait_block_t));
+        unsigned int k;
+
+        if (!block)
+            return NULL;
+
+        for (k = 0; k < TIME_WAIT_BLOCK_RECORDS; ++k)
+        {
+            block->records[k].next = time_wait_free;
+            time_wait_free = &block->records[k];
+        }
+
+        block->next = time_wait_blocks;
+        time_wait_blocks = block;
+        ++time_wait_num_blocks;
+    }
+
+    record = time_wait_free;
+    time_wait_free = record->next;
+    return record;
+}
+
+/* return a record to the free list.  once the table's empty, all its
+ * blocks but one are freed; that one's kept, so a process that only ever
+ * has a few connections in TIME_WAIT doesn't allocate a block for each.
+ */
+static void _mysock_time_wait_release_locked(time_wait_record_t *record)
+{
+    assert(record);
+
+    record->next = time_wait_free;
+    time_wait_free = record;
+
+    if (time_wait_count == 0 && time_wait_num_blocks > 1)
+    {
+        unsigned int k;
+
+        while (time_wait_blocks->next)
+        {
+            time_wait_block_t *block = time_wait_blocks->next;
+
+            time_wait_blocks->next = block->next;
+            free(block);
+        }
+
+        time_wait_free = NULL;
+        for (k = 0; k < TIME_WAIT_BLOCK_RECORDS; ++k)
+        {
+            time_wait_blocks->records[k].next = time_wait_free;
+            time_wait_free = &time_wait_blocks->records[k];
+        }
+        time_wait_num_blocks = 1;
+    }
+}
+
+/* drop the records that have expired by now, from the head of the table */
+static void _mysock_time_wait_expire_locked(time_t now)
+{
+    while (time_wait_head && time_wait_head->expiry <= now)
+    {
+        time_wait_record_t *record = time_wait_head;
+
+        if (!(time_wait_head = record->next))
+            time_wait_tail = NULL;
+        --time_wait_count;
+
+        _network_time_wait_close(&record->channel);
+        _mysock_time_wait_release_locked(record);
+    }
+}
+
+/* TIME_WAIT reaper thread.  this sleeps until the oldest record expires,
+ * or until one's added to an empty table.
+ */
+static void *time_wait_reaper_func(void *arg_ptr)
+{
+    (void) arg_ptr;
+
+    PTHREAD_CALL(pthread_mutex_lock(&time_wait_lock));
+    for (;;)
+    {
+        struct timespec deadline;
+        struct timeval now;
+        int rc;
+
+        if (!time_wait_head)
+        {
+            PTHREAD_CALL(pthread_cond_wait(&time_wait_cond, &time_wait_lock));
+            continue;
+        }
+
+        gettimeofday(&now, NULL);
+        _mysock_time_wait_expire_locked(now.tv_sec);
+        if (!time_wait_head)
+            continue;
+
+        deadline.tv_sec  = time_wait_head->expiry;
+        deadline.tv_nsec = 0;
+        rc = pthread_cond_timedwait(&time_wait_cond, &time_wait_lock,
+                                    &deadline);
+        if (rc != ETIMEDOUT)
+            PTHREAD_CALL(rc);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,1180 @@
+/* mysock_worker.c--transport worker pool.
+ *
+ * rather than each connection having a transport thread of its own, a fixed
+ * pool of worker threads runs every connection's STCP state machine.  the
+ * transport layer never blocks:  it handles one event at a time in
+ * transport_handle_event(), and then says which events it waits for next
+ * with stcp_request_event().  when one of them occurs (data from the
+ * network or the application, a close request, or the connection's timer
+ * expiring), the connection is queued on its worker to be run.
+ *
+ * each connection has a home worker, chosen by hashing its mysocket
+ * descriptor, which queues it when it becomes runnable and keeps its timer,
+ * so its state usually stays in one worker's cache.  each worker keeps the
+ * timers of its connections in a binary heap ordered by deadline, and
+ * sleeps until the earliest one is due if nothing is runnable.
+ *
+ * a few busy connections can still keep their home worker saturated while
+ * others have nothing to do, so the workers also steal work from each
+ * other.  each worker's run queue is a deque:  the worker takes connections
+ * from its front, and a worker that runs out of work of its own takes them
+ * from the back of a busy worker's deque instead of going to sleep.  a
+ * worker that queues a connection while it's busy wakes an idle one to do
+ * this.  a connection being run (ctx->running) is never queued, however,
+ * so its events are handled by only one worker at a time, in order;
+ * anything that arrives meanwhile is picked up once that worker's done
+ * (ctx->run_again).  setting STCP_TRANSPORT_STEAL=0 turns stealing off, so
+ * connections only ever run on their home worker.
+ *
+ * the pool has one worker per online CPU, unless STCP_TRANSPORT_THREADS says
+ * otherwise.  STCP_TRANSPORT_CPUS optionally gives a comma-separated list of
+ * CPUs to bind the workers to; worker k is bound to the k'th CPU listed
+ * (wrapping around if there are more workers than CPUs).  binding is only
+ * supported on Linux, and the list is ignored elsewhere.
+ *
+ * an application can instead run the whole stack from a thread of its own,
+ * by calling mystack_set_mode(MYSTACK_POLLED) before its first mysocket
+ * call.  there's then a single worker with no thread of its own; it's run
+ * by mystack_poll(), which also receives network input (and expires
+ * TIME_WAIT records; see mysock_time_wait.c), and blocking mysock calls call
+ * mystack_poll() themselves while they wait.
+ *
+ * the workers also finish closing connections in the background.  myclose()
+ * doesn't wait for the transport to finish with a connection (unless
+ * SO_LINGER says to); the worker that retires the transport frees the
+ * connection instead.  so that exit() doesn't cut those closes short, it
+ * waits for them first, for at most STCP_EXIT_LINGER seconds
+ * (EXIT_LINGER_DEFAULT by default).  in MYSTACK_POLLED mode, closes only
+ * progress while the application keeps calling mystack_poll().
+ *
+ * as with the network receive engine, a child process doesn't inherit the
+ * workers after a fork(); it starts a pool of its own when first needed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+#ifdef LINUX
+#include <sched.h>
+#endif
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "stcp_api.h"
+#include "transport.h"
+#include "connection_demux.h"
+
+
+#define MYSOCK_MAX_WORKERS     64
+#define MYSOCK_MIN_TIMER_SLOTS 16
+#define NO_TIMER               (-1)
+#define EXIT_LINGER_DEFAULT    10
+
+typedef struct mysock_worker
+{
+    pthread_t       thread;
+    int             cpu;        /* CPU the worker is bound to, or -1 */
+
+    /* protects the run queue and timer heap, and the scheduling state of
+     * the connections whose home this is, wherever they're being run.
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t  run_cond;   /* signaled when a connection is queued */
+    bool_t          idle;       /* waiting on run_cond? */
+
+    /* connections with events to handle, in the order they became
+     * runnable.  the worker takes them from the head, thieves from the
+     * tail.
+     */
+    mysock_context_t *run_head, *run_tail;
+
+    /* connections with a timeout requested, as a binary heap ordered by
+     * deadline.
+     */
+    mysock_context_t **timers;
+    unsigned int       num_timers, max_timers;
+} mysock_worker_t;
+
+static mysock_worker_t workers[MYSOCK_MAX_WORKERS];
+static unsigned int num_workers;
+static pthread_mutex_t worker_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool_t worker_pool_started;
+static bool_t steal_enabled;
+static unsigned int num_idle_workers;   /* updated atomically */
+
+/* MYSTACK_POLLED mode.  the mode is fixed once something depends on it,
+ * i.e. when the worker pool or the network receive engine starts.  calls
+ * to mystack_poll() are serialized by stack_poll_lock.
+ */
+static bool_t stack_polled;
+static bool_t stack_mode_fixed;     /* updated atomically */
+static pthread_mutex_t stack_poll_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* connections myclose() has returned from, that the transport hasn't
+ * finished with yet.  closing_cond is signaled when the count drops to 0.
+ */
+static unsigned int num_closing;
+static pthread_mutex_t closing_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t closing_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t closing_once = PTHREAD_ONCE_INIT;
+
+
+static void _mysock_worker_pool_start(void);
+static void _mysock_worker_pool_init(void);
+static void _mysock_worker_pool_fork_child(void);
+static int _mysock_parse_cpu(const char **list);
+static void _mysock_run_queue_push_locked(mysock_worker_t  *worker,
+                                          mysock_context_t *ctx);
+static void _mysock_run_queue_remove_locked(mysock_worker_t  *worker,
+                                            mysock_context_t *ctx);
+static bool_t _mysock_run_locked(mysock_worker_t  *worker,
+                                 mysock_context_t *ctx);
+static mysock_context_t *_mysock_steal(mysock_worker_t *thief,
+                                       bool_t          *timed_out);
+static void _mysock_wake_thief(mysock_worker_t *busy);
+static bool_t _mysock_timer_before(const struct timespec *a,
+                                   const struct timespec *b);
+static void _mysock_timer_place(mysock_worker_t  *worker,
+                                mysock_context_t *ctx,
+                                int               k);
+static void _mysock_timer_sift(mysock_worker_t *worker, int k);
+static void _mysock_timer_remove(mysock_worker_t  *worker,
+                                 mysock_context_t *ctx);
+static void _mysock_timer_fire_locked(mysock_worker_t *worker);
+static void _mysock_timer_update_locked(mysock_worker_t  *worker,
+                                        mysock_context_t *ctx);
+static bool_t _mysock_timer_expired(mysock_context_t *ctx);
+static unsigned int _mysock_transport_events(mysock_context_t *ctx,
+                                             bool_t            park);
+static void _mysock_run_transport(mysock_context_t *ctx, bool_t timed_out);
+static void _mysock_retire_transport(mysock_context_t *ctx, int stcp_errno);
+static void _mysock_closing_init(void);
+static void _mysock_drain_closing(void);
+static int _mysock_poll_ready(mysock_worker_t *worker);
+static int _mysock_poll_timeout(mysock_worker_t *worker, int timeout);
+static void *transport_worker_func(void *arg_ptr);
+
+
+/* hand a new connection to its transport worker, which calls
+ * transport_init() for it.  called by _mysock_transport_init().
+ */
+void _mysock_worker_start(mysock_context_t *ctx)
+{
+    assert(ctx && !ctx->worker);
+
+    _mysock_worker_pool_start();
+
+    ctx->timer_index = NO_TIMER;
+    ctx->transport_init_pending = TRUE;
+    ctx->transport_started = TRUE;
+    ctx->worker = &workers[((uint32_t) ctx->my_sd * 2654435761U) %
+                           num_workers];
+
+    _mysock_schedule_transport(ctx);
+}
+
+/* queue the connection on its worker, to handle whatever events are
+ * pending.  this does nothing if the connection is queued already, or if
+ * the transport has finished with it.
+ */
+void _mysock_schedule_transport(mysock_context_t *ctx)
+{
+    mysock_worker_t *worker;
+    bool_t busy;
+
+    assert(ctx);
+    if (!(worker = ctx->worker))
+        return; /* transport not started */
+
+    PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+    busy = _mysock_run_locked(worker, ctx) && !worker->idle;
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+
+    /* someone else may be able to run it sooner */
+    if (busy && steal_enabled)
+        _mysock_wake_thief(worker);
+}
+
+/* record the events the transport waits for next on this connection, and
+ * (re)arm or cancel its timer.  called by stcp_request_event(), on the
+ * connection's worker.
+ */
+void _mysock_request_event(mysock_context_t      *ctx,
+                           unsigned int           flags,
+                           const struct timespec *abstime)
+{
+    mysock_worker_t *worker;
+
+    assert(ctx && ctx->worker);
+    worker = ctx->worker;
+
+    ctx->wait_flags = flags;
+
+    PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+    ctx->transport_timer = (abstime != NULL);
+    if (abstime)
+        ctx->transport_deadline = *abstime;
+    _mysock_timer_update_locked(worker, ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+}
+
+/* hold a passive connection whose handshake just completed back from
+ * myaccept() until _mysock_end_accept_deferral(), which is called once the
+ * peer sends something, or by the worker once the deadline passes.  called
+ * on the connection's worker.
+ */
+void _mysock_defer_accept(mysock_context_t      *ctx,
+                          const struct timespec *deadline)
+{
+    mysock_worker_t *worker;
+
+    assert(ctx && ctx->worker && deadline);
+    assert(!ctx->is_active && !ctx->accept_deferred);
+    worker = ctx->worker;
+
+    ctx->accept_deferred = TRUE;
+    ctx->accept_deadline = *deadline;
+
+    PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+    _mysock_timer_update_locked(worker, ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+}
+
+/* pass a deferred connection on to myaccept().  called on the connection's
+ * worker.  the deferral may have been called off meanwhile by the listening
+ * socket closing (see _mysock_close_passive_socket()), in which case
+ * there's nothing to pass on.
+ */
+void _mysock_end_accept_deferral(mysock_context_t *ctx)
+{
+    mysock_worker_t *worker;
+
+    assert(ctx && ctx->worker);
+    worker = ctx->worker;
+
+    if (!__atomic_exchange_n(&ctx->accept_deferred, FALSE, __ATOMIC_ACQ_REL))
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+    _mysock_timer_update_locked(worker, ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+
+    _mysock_passive_connection_complete(ctx);
+}
+
+/* for myclose():  wait until the transport has finished with the
+ * connection, or until deadline (not at all if it's NULL).  returns FALSE if
+ * the transport's finished, so the caller should free the connection.
+ * otherwise, the connection is left to its worker to free once the
+ * transport's done, and TRUE is returned.
+ */
+bool_t _mysock_detach_transport(mysock_context_t      *ctx,
+                                const struct timespec *deadline)
+{
+    bool_t detached;
+
+    assert(ctx && !ctx->close_detached);
+
+    PTHREAD_CALL(pthread_once(&closing_once, _mysock_closing_init));
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
+    while (deadline && !ctx->transport_finished)
+    {
+        if (_mysock_stack_timedwait(&ctx->blocking_cond, &ctx->blocking_lock,
+                                    deadline) == ETIMEDOUT)
+            break;
+    }
+
+    if ((detached = !ctx->transport_finished))
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&closing_lock));
+        ++num_closing;
+        PTHREAD_CALL(pthread_mutex_unlock(&closing_lock));
+        ctx->close_detached = TRUE;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+
+    return detached;
+}
+
+
+/* select how the stack is run; see mysock.h */
+int mystack_set_mode(int mode)
+{
+    bool_t polled = (mode == MYSTACK_POLLED);
+
+    if (mode != MYSTACK_THREADED && mode != MYSTACK_POLLED)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&worker_pool_lock));
+    if (__atomic_load_n(&stack_mode_fixed, __ATOMIC_ACQUIRE) &&
+        polled != stack_polled)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&worker_pool_lock));
+        errno = EBUSY;  /* too late to change it */
+        return -1;
+    }
+    stack_polled = polled;
+    PTHREAD_CALL(pthread_mutex_unlock(&worker_pool_lock));
+    return 0;
+}
+
+/* run the stack once in MYSTACK_POLLED mode; see mysock.h */
+int mystack_poll(int timeout)
+{
+    mysock_worker_t *worker = &workers[0];
+    int num_runs;
+
+    if (!_mysock_stack_polled())
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&stack_poll_lock));
+    _mysock_worker_pool_start();
+
+    /* only wait for network input if there's nothing to do already, and
+     * not past the next timer.
+     */
+    num_runs = _mysock_poll_ready(worker);
+    (void) _network_poll_recv(num_runs ? 0 : _mysock_time_wait_timeout(
+                                  _mysock_poll_timeout(worker, timeout)));
+    num_runs += _mysock_poll_ready(worker);
+    _mysock_time_wait_expire();
+    PTHREAD_CALL(pthread_mutex_unlock(&stack_poll_lock));
+
+    return num_runs;
+}
+
+/* returns TRUE if the stack is in MYSTACK_POLLED mode.  after this is
+ * first called, the mode can't be changed.
+ */
+bool_t _mysock_stack_polled(void)
+{
+    if (!__atomic_load_n(&stack_mode_fixed, __ATOMIC_ACQUIRE))
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&worker_pool_lock));
+        __atomic_store_n(&stack_mode_fixed, TRUE, __ATOMIC_RELEASE);
+        PTHREAD_CALL(pthread_mutex_unlock(&worker_pool_lock));
+    }
+    return stack_polled;
+}
+
+/* wait on cond, as pthread_cond_wait() does, from an application thread.
+ * in MYSTACK_POLLED mode nobody else would ever signal it, so the stack is
+ * run instead until the caller has something to check.
+ */
+void _mysock_stack_wait(pthread_cond_t *cond, pthread_mutex_t *lock)
+{
+    assert(cond && lock);
+
+    if (!_mysock_stack_polled())
+    {
+        PTHREAD_CALL(pthread_cond_wait(cond, lock));
+        return;
+    }
+
+    PTHREAD_CALL(pthread_mutex_unlock(lock));
+    (void) mystack_poll(-1);
+    PTHREAD_CALL(pthread_mutex_lock(lock));
+}
+
+/* as _mysock_stack_wait(), but gives up at abstime (as measured by
+ * gettimeofday()), and returns ETIMEDOUT if so.
+ */
+int _mysock_stack_timedwait(pthread_cond_t        *cond,
+                            pthread_mutex_t       *lock,
+                            const struct timespec *abstime)
+{
+    struct timeval now;
+    long timeout;
+
+    assert(cond && lock && abstime);
+
+    if (!_mysock_stack_polled())
+        return pthread_cond_timedwait(cond, lock, abstime);
+
+    gettimeofday(&now, NULL);
+    timeout = (abstime->tv_sec - now.tv_sec) * 1000 +
+              (abstime->tv_nsec / 1000 - now.tv_usec + 999) / 1000;
+    if (timeout <= 0)
+        return ETIMEDOUT;
+
+    PTHREAD_CALL(pthread_mutex_unlock(lock));
+    (void) mystack_poll((int) MIN(timeout, 60 * 1000));
+    PTHREAD_CALL(pthread_mutex_lock(lock));
+    return 0;
+}
+
+
+/* start the worker pool, if it isn't running yet */
+static void _mysock_worker_pool_start(void)
+{
+    bool_t polled = _mysock_stack_polled();
+
+    PTHREAD_CALL(pthread_mutex_lock(&worker_pool_lock));
+    if (!worker_pool_started)
+    {
+        if (polled)
+        {
+            /* a single worker, run by mystack_poll() */
+            num_workers = 1;
+            PTHREAD_CALL(pthread_mutex_init(&workers[0].lock, NULL));
+            PTHREAD_CALL(pthread_cond_init(&workers[0].run_cond, NULL));
+            workers[0].cpu = -1;
+        }
+        else
+        {
+            _mysock_worker_pool_init();
+        }
+        worker_pool_started = TRUE;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&worker_pool_lock));
+}
+
+/* start the worker threads.  worker_pool_lock must be held. */
+static void _mysock_worker_pool_init(void)
+{
+    const char *num_threads = getenv("STCP_TRANSPORT_THREADS");
+    const char *cpus = getenv("STCP_TRANSPORT_CPUS");
+    const char *steal = getenv("STCP_TRANSPORT_STEAL");
+    static bool_t fork_handler_registered = FALSE;
+    const char *next_cpu = cpus;
+    long num_cpus;
+    unsigned int k;
+
+    if (!fork_handler_registered)
+    {
+        PTHREAD_CALL(pthread_atfork(NULL, NULL,
+                                    _mysock_worker_pool_fork_child));
+        fork_handler_registered = TRUE;
+    }
+
+    num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = (num_cpus > 0) ? (unsigned int) num_cpus : 1;
+    if (num_threads && atoi(num_threads) > 0)
+        num_workers = (unsigned int) atoi(num_threads);
+    num_workers = MIN(num_workers, MYSOCK_MAX_WORKERS);
+
+    steal_enabled = (num_workers > 1);
+    if (steal && !strcmp(steal, "0"))
+        steal_enabled = FALSE;
+
+    for (k = 0; k < num_workers; ++k)
+    {
+        mysock_worker_t *worker = &workers[k];
+
+        PTHREAD_CALL(pthread_mutex_init(&worker->lock, NULL));
+        PTHREAD_CALL(pthread_cond_init(&worker->run_cond, NULL));
+
+        worker->cpu = -1;
+        if (cpus && *cpus)
+        {
+            if (!next_cpu || !*next_cpu)
+                next_cpu = cpus;   /* wrap around */
+            worker->cpu = _mysock_parse_cpu(&next_cpu);
+        }
+
+        worker->thread = _mysock_create_thread(transport_worker_func,
+                                               worker, TRUE);
+    }
+}
+
+/* called in the child after a fork().  the parent's workers don't exist
+ * here, and their locks may have been held when they were copied, so the
+ * pool is discarded without locking.
+ */
+static void _mysock_worker_pool_fork_child(void)
+{
+    unsigned int k;
+
+    for (k = 0; k < num_workers; ++k)
+    {
+        free(workers[k].timers);
+        memset(&workers[k], 0, sizeof(workers[k]));
+    }
+
+    num_workers         = 0;
+    num_idle_workers    = 0;
+    worker_pool_started = FALSE;
+    PTHREAD_CALL(pthread_mutex_init(&worker_pool_lock, NULL));
+    PTHREAD_CALL(pthread_mutex_init(&stack_poll_lock, NULL));
+
+    /* connections closing in the parent are left to it */
+    num_closing = 0;
+    PTHREAD_CALL(pthread_mutex_init(&closing_lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&closing_cond, NULL));
+}
+
+/* parse the next CPU number from a comma-separated list, advancing *list
+ * past it.  returns -1 if there isn't a valid number there.
+ */
+static int _mysock_parse_cpu(const char **list)
+{
+    char *end;
+    long cpu;
+
+    assert(list && *list);
+
+    cpu = strtol(*list, &end, 10);
+    if (end == *list || cpu < 0)
+        cpu = -1;
+
+    *list = strchr(end, ',');
+    *list = *list ? *list + 1 : NULL;
+    return (int) cpu;
+}
+
+/* append the connection to the worker's run queue.  the worker's lock must
+ * be held.
+ */
+static void _mysock_run_queue_push_locked(mysock_worker_t  *worker,
+                                          mysock_context_t *ctx)
+{
+    assert(worker && ctx && !ctx->run_queued);
+
+    ctx->run_next = NULL;
+    ctx->run_prev = worker->run_tail;
+    if (worker->run_tail)
+        worker->run_tail->run_next = ctx;
+    else
+        worker->run_head = ctx;
+    worker->run_tail = ctx;
+    ctx->run_queued = TRUE;
+}
+
+static void _mysock_run_queue_remove_locked(mysock_worker_t  *worker,
+                                            mysock_context_t *ctx)
+{
+    assert(worker && ctx && ctx->run_queued);
+
+    if (ctx->run_prev)
+        ctx->run_prev->run_next = ctx->run_next;
+    else
+        worker->run_head = ctx->run_next;
+    if (ctx->run_next)
+        ctx->run_next->run_prev = ctx->run_prev;
+    else
+        worker->run_tail = ctx->run_prev;
+
+    ctx->run_prev = ctx->run_next = NULL;
+    ctx->run_queued = FALSE;
+}
+
+/* make the connection runnable on its home worker, unless it's queued or
+ * being run already, or the transport has finished with it.  returns TRUE
+ * if it was added to the worker's deque.  the worker's lock must be held.
+ */
+static bool_t _mysock_run_locked(mysock_worker_t  *worker,
+                                 mysock_context_t *ctx)
+{
+    assert(worker && ctx && ctx->worker == worker);
+
+    if (ctx->transport_finished || ctx->run_queued)
+        return FALSE;
+
+    if (ctx->running)
+    {
+        /* whoever is running it queues it again once it's done */
+        ctx->run_again = TRUE;
+        return FALSE;
+    }
+
+    _mysock_run_queue_push_locked(worker, ctx);
+    if (worker->idle)
+        PTHREAD_CALL(pthread_cond_signal(&worker->run_cond));
+    return TRUE;
+}
+
+/* take a connection from the back of a busy worker's deque, if there is
+ * one, and mark it as running.  no locks may be held, as the thief only
+ * tries each worker's lock in turn.
+ */
+static mysock_context_t *_mysock_steal(mysock_worker_t *thief,
+                                       bool_t          *timed_out)
+{
+    unsigned int k;
+
+    for (k = 1; k < num_workers; ++k)
+    {
+        mysock_worker_t *victim =
+            &workers[(thief - workers + k) % num_workers];
+        mysock_context_t *ctx = NULL;
+
+        if (!__atomic_load_n(&victim->run_tail, __ATOMIC_RELAXED) ||
+            pthread_mutex_trylock(&victim->lock) != 0)
+            continue;
+
+        /* an idle worker gets to its own deque soon enough */
+        if (!victim->idle && (ctx = victim->run_tail) != NULL)
+        {
+            _mysock_run_queue_remove_locked(victim, ctx);
+            ctx->running = TRUE;
+            *timed_out = ctx->timer_fired;
+            ctx->timer_fired = FALSE;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&victim->lock));
+
+        if (ctx)
+            return ctx;
+    }
+
+    return NULL;
+}
+
+/* wake an idle worker, if there is one, to steal from the given busy one */
+static void _mysock_wake_thief(mysock_worker_t *busy)
+{
+    unsigned int k;
+
+    for (k = 1;
+         k < num_workers &&
+         __atomic_load_n(&num_idle_workers, __ATOMIC_RELAXED) > 0;
+         ++k)
+    {
+        mysock_worker_t *thief = &workers[(busy - workers + k) % num_workers];
+        bool_t woken = FALSE;
+
+        PTHREAD_CALL(pthread_mutex_lock(&thief->lock));
+        if (thief->idle)
+        {
+            thief->idle = FALSE;    /* so nobody else picks it */
+            PTHREAD_CALL(pthread_cond_signal(&thief->run_cond));
+            woken = TRUE;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&thief->lock));
+
+        if (woken)
+            break;
+    }
+}
+
+static bool_t _mysock_timer_before(const struct timespec *a,
+                                   const struct timespec *b)
+{
+    return (a->tv_sec < b->tv_sec) ||
+           (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void _mysock_timer_place(mysock_worker_t  *worker,
+                                mysock_context_t *ctx,
+                                int               k)
+{
+    worker->timers[k] = ctx;
+    ctx->timer_index  = k;
+}
+
+/* restore the heap ordering around entry k, after its deadline changed or
+ * it was moved.
+ */
+static void _mysock_timer_sift(mysock_worker_t *worker, int k)
+{
+    mysock_context_t *ctx = worker->timers[k];
+    int n = (int) worker->num_timers;
+
+    /* towards the root while it's due before its parent... */
+    while (k > 0 &&
+           _mysock_timer_before(&ctx->timer_deadline,
+                                &worker->timers[(k - 1) / 2]->timer_deadline))
+    {
+        _mysock_timer_place(worker, worker->timers[(k - 1) / 2], k);
+        k = (k - 1) / 2;
+    }
+
+    /* ...or towards the leaves while either child is due before it */
+    for (;;)
+    {
+        int child = 2 * k + 1;
+
+        if (child >= n)
+            break;
+        if (child + 1 < n &&
+            _mysock_timer_before(&worker->timers[child + 1]->timer_deadline,
+                                 &worker->timers[child]->timer_deadline))
+            ++child;
+        if (!_mysock_timer_before(&worker->timers[child]->timer_deadline,
+                                  &ctx->timer_deadline))
+            break;
+
+        _mysock_timer_place(worker, worker->timers[child], k);
+        k = child;
+    }
+
+    _mysock_timer_place(worker, ctx, k);
+}
+
+static void _mysock_timer_remove(mysock_worker_t  *worker,
+                                 mysock_context_t *ctx)
+{
+    int k = ctx->timer_index;
+
+    if (k == NO_TIMER)
+        return;
+
+    ctx->timer_index = NO_TIMER;
+    if (k != (int) --worker->num_timers)
+    {
+        _mysock_timer_place(worker, worker->timers[worker->num_timers], k);
+        _mysock_timer_sift(worker, k);
+    }
+}
+
+/* queue every connection whose timer is due.  the worker's lock must be
+ * held.
+ */
+static void _mysock_timer_fire_locked(mysock_worker_t *worker)
+{
+    struct timeval tv;
+    struct timespec now;
+
+    if (!worker->num_timers)
+        return;
+
+    gettimeofday(&tv, NULL);
+    now.tv_sec  = tv.tv_sec;
+    now.tv_nsec = tv.tv_usec * 1000;
+
+    while (worker->num_timers &&
+           !_mysock_timer_before(&now, &worker->timers[0]->timer_deadline))
+    {
+        mysock_context_t *ctx = worker->timers[0];
+
+        _mysock_timer_remove(worker, ctx);
+        ctx->timer_fired = TRUE;
+        (void) _mysock_run_locked(worker, ctx);
+    }
+}
+
+/* (re)arm or cancel the connection's timer, for the earlier of the
+ * transport's deadline and a deferred accept's, if there's either.  the
+ * worker's lock must be held.
+ */
+static void _mysock_timer_update_locked(mysock_worker_t  *worker,
+                                        mysock_context_t *ctx)
+{
+    if (!ctx->transport_timer && !ctx->accept_deferred)
+    {
+        _mysock_timer_remove(worker, ctx);
+        return;
+    }
+
+    if (!ctx->accept_deferred ||
+        (ctx->transport_timer &&
+         _mysock_timer_before(&ctx->transport_deadline,
+                              &ctx->accept_deadline)))
+        ctx->timer_deadline = ctx->transport_deadline;
+    else
+        ctx->timer_deadline = ctx->accept_deadline;
+
+    if (ctx->timer_index == NO_TIMER)
+    {
+        if (worker->num_timers == worker->max_timers)
+        {
+            worker->max_timers = worker->max_timers
+                ? 2 * worker->max_timers : MYSOCK_MIN_TIMER_SLOTS;
+            worker->timers = (mysock_context_t **)
+                realloc(worker->timers,
+                        worker->max_timers * sizeof(*worker->timers));
+            assert(worker->timers);
+        }
+        _mysock_timer_place(worker, ctx, worker->num_timers++);
+    }
+    _mysock_timer_sift(worker, ctx->timer_index);
+
+    /* if we were stolen, our home worker may be asleep until a later
+     * deadline.
+     */
+    if (ctx->timer_index == 0 && worker->idle)
+        PTHREAD_CALL(pthread_cond_signal(&worker->run_cond));
+}
+
+/* called when the connection's timer has fired, to see which deadline it
+ * was for.  a deferred accept that's due is passed on to myaccept(), and
+ * the timer's rearmed for whatever's left.  returns TRUE if the transport's
+ * own deadline has passed, i.e. it should be told of the timeout.
+ */
+static bool_t _mysock_timer_expired(mysock_context_t *ctx)
+{
+    mysock_worker_t *worker = ctx->worker;
+    struct timeval tv;
+    struct timespec now;
+    bool_t timed_out;
+
+    gettimeofday(&tv, NULL);
+    now.tv_sec  = tv.tv_sec;
+    now.tv_nsec = tv.tv_usec * 1000;
+
+    if (ctx->accept_deferred &&
+        !_mysock_timer_before(&now, &ctx->accept_deadline))
+        _mysock_end_accept_deferral(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+    timed_out = ctx->transport_timer &&
+                !_mysock_timer_before(&now, &ctx->transport_deadline);
+    if (timed_out)
+        ctx->transport_timer = FALSE;
+    _mysock_timer_update_locked(worker, ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+
+    return timed_out;
+}
+
+/* returns the events waiting for the transport on this connection, out of
+ * those it asked for, by the same rules as stcp_request_event() describes.
+ * if park is TRUE, the transport is about to go idle:  the close event
+ * isn't consumed, and the network receive engine is told to schedule the
+ * connection for the next packet.
+ */
+static unsigned int _mysock_transport_events(mysock_context_t *ctx,
+                                             bool_t            park)
+{
+    unsigned int rc = 0;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if ((ctx->wait_flags & APP_DATA) && (ctx->app_recv_queue.len > 0))
+        rc |= APP_DATA;
+
+    if (ctx->wait_flags & NETWORK_DATA)
+    {
+        if (park ? _mysock_ring_prepare_wait(&ctx->network_recv_queue)
+                 : (__atomic_load_n(&ctx->network_recv_queue.tail,
+                                    __ATOMIC_ACQUIRE) !=
+                    ctx->network_recv_queue.head))
+            rc |= NETWORK_DATA;
+    }
+
+    if ((ctx->wait_flags & APP_CLOSE_REQUESTED) &&
+        ctx->close_requested && (ctx->app_recv_queue.len == 0))
+    {
+        /* we should only pass on this event once.  also, we don't pass
+         * the close event down to STCP until we've already passed it all
+         * outstanding data from the app.
+         */
+        if (!park)
+            ctx->close_requested = FALSE;
+        rc |= APP_CLOSE_REQUESTED;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    return rc;
+}
+
+/* run the transport for a connection taken off a worker's deque.
+ * timed_out is TRUE if its timer fired.
+ */
+static void _mysock_run_transport(mysock_context_t *ctx, bool_t timed_out)
+{
+    mysock_worker_t *worker = ctx->worker;
+    unsigned int events;
+
+    /* we're busy with the connection, so new packets needn't wake us */
+    _mysock_ring_finish_wait(&ctx->network_recv_queue);
+
+    if (timed_out)
+        timed_out = _mysock_timer_expired(ctx);
+
+    errno = 0;  /* so we know whether the transport set it */
+    if (ctx->transport_init_pending)
+    {
+        ctx->transport_init_pending = FALSE;
+        transport_init(ctx->my_sd, ctx->is_active);
+    }
+    else if ((events = _mysock_transport_events(ctx, FALSE)) != 0 ||
+             timed_out)
+    {
+        transport_handle_event(ctx->my_sd, events);
+    }
+
+    if (ctx->transport_over)
+    {
+        _mysock_retire_transport(ctx, errno);
+        return;
+    }
+
+    /* go idle, unless more events are waiting already.  anything that
+     * arrived while we were running set run_again instead of queuing the
+     * connection.
+     */
+    events = _mysock_transport_events(ctx, TRUE);
+
+    PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+    ctx->running = FALSE;
+    if (events || ctx->run_again)
+    {
+        ctx->run_again = FALSE;
+        (void) _mysock_run_locked(worker, ctx);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+}
+
+/* the transport has finished with the connection; it's never run again.
+ * stcp_errno is errno as the transport left it.
+ */
+static void _mysock_retire_transport(mysock_context_t *ctx, int stcp_errno)
+{
+    mysock_worker_t *worker = ctx->worker;
+    bool_t detached;
+
+    /* it stays marked as running, so it isn't queued again */
+    PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+    assert(ctx->running && !ctx->run_queued);
+    _mysock_timer_remove(worker, ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
+    if (ctx->blocking)
+    {
+        /* if we're still blocked, STCP must not have indicated the
+         * connection completed.  pass the error up to the application.
+         */
+        if (stcp_errno == 0 || stcp_errno == EINTR)
+        {
+            /* this is a bit of a kludge--this should really be set by STCP
+             * itself, but it's a reasonable guess if for some reason (e.g.
+             * oversight) the transport layer hasn't announced why it
+             * bailed out...
+             */
+            stcp_errno = (ctx->is_active) ? ECONNREFUSED : ECONNABORTED;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+        errno = stcp_errno;
+        stcp_unblock_application(ctx->my_sd);
+    }
+    else
+    {
+        /* the transport gives up on an established connection with
+         * ETIMEDOUT once the peer stops answering.  this is reported by
+         * SO_ERROR, and by a lingering myclose().
+         */
+        if (stcp_errno == ETIMEDOUT)
+            ctx->stcp_errno = stcp_errno;
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+    }
+
+    /* force final myread() to return 0 bytes (this should have been done
+     * by the transport layer already in response to the peer's FIN).  no
+     * more data will be taken from the app either, so fail any mywrite()
+     * blocked waiting for space.
+     */
+    _mysock_set_eof(ctx, &ctx->app_send_queue);
+    _mysock_set_eof(ctx, &ctx->app_recv_queue);
+
+    /* a connection held back from myaccept() is passed on now, so the
+     * application finds out it's over.  its timer's gone already.
+     */
+    if (__atomic_exchange_n(&ctx->accept_deferred, FALSE, __ATOMIC_ACQ_REL))
+        _mysock_passive_connection_complete(ctx);
+
+    /* after this, myclose() may free the connection at any moment, unless
+     * it's returned already, in which case it's up to us.  the worker's
+     * lock is taken too, so _mysock_schedule_transport() sees the
+     * connection is finished.
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
+    PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+    ctx->transport_finished = TRUE;
+    ctx->running = ctx->run_again = FALSE;
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+    detached = ctx->close_detached;
+    PTHREAD_CALL(pthread_cond_broadcast(&ctx->blocking_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+
+    if (detached)
+    {
+        _mysock_close_context(ctx);
+
+        PTHREAD_CALL(pthread_mutex_lock(&closing_lock));
+        assert(num_closing > 0);
+        if (--num_closing == 0)
+            PTHREAD_CALL(pthread_cond_broadcast(&closing_cond));
+        PTHREAD_CALL(pthread_mutex_unlock(&closing_lock));
+    }
+}
+
+static void _mysock_closing_init(void)
+{
+    atexit(_mysock_drain_closing);
+}
+
+/* called on exit():  give connections still closing in the background a
+ * chance to finish, as the process going away would cut them off.
+ */
+static void _mysock_drain_closing(void)
+{
+    const char *value = getenv("STCP_EXIT_LINGER");
+    struct timespec deadline;
+    struct timeval now;
+    int secs = EXIT_LINGER_DEFAULT;
+
+    if (value && *value)
+        secs = atoi(value);
+    if (secs <= 0)
+        return;
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec  = now.tv_sec + secs;
+    deadline.tv_nsec = now.tv_usec * 1000;
+
+    PTHREAD_CALL(pthread_mutex_lock(&closing_lock));
+    while (num_closing > 0)
+    {
+        if (_mysock_stack_timedwait(&closing_cond, &closing_lock,
+                                    &deadline) == ETIMEDOUT)
+            break;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&closing_lock));
+}
+
+/* in MYSTACK_POLLED mode, run each connection that's runnable on the
+ * worker, after firing any timers that are due.  connections that become
+ * runnable again meanwhile are left for the next call, so a connection
+ * that's always runnable can't keep us here.  returns the number of runs.
+ */
+static int _mysock_poll_ready(mysock_worker_t *worker)
+{
+    mysock_context_t *ctx;
+    int num_ready = 0, num_runs;
+
+    PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+    _mysock_timer_fire_locked(worker);
+    for (ctx = worker->run_head; ctx; ctx = ctx->run_next)
+        ++num_ready;
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+
+    for (num_runs = 0; num_runs < num_ready; ++num_runs)
+    {
+        bool_t timed_out;
+
+        PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+        if ((ctx = worker->run_head) != NULL)
+        {
+            _mysock_run_queue_remove_locked(worker, ctx);
+            ctx->running = TRUE;
+            timed_out = ctx->timer_fired;
+            ctx->timer_fired = FALSE;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+
+        if (!ctx)
+            break;
+        _mysock_run_transport(ctx, timed_out);
+    }
+
+    return num_runs;
+}
+
+/* the number of milliseconds mystack_poll() may wait for network input:
+ * the caller's timeout (-1 for none), or less if a timer is due sooner.
+ */
+static int _mysock_poll_timeout(mysock_worker_t *worker, int timeout)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+    if (worker->num_timers)
+    {
+        const struct timespec *deadline = &worker->timers[0]->timer_deadline;
+        struct timeval now;
+        long ms;
+
+        gettimeofday(&now, NULL);
+        ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+             (deadline->tv_nsec / 1000 - now.tv_usec + 999) / 1000;
+        ms = (ms < 0) ? 0 : MIN(ms, 60 * 1000);
+        if (timeout < 0 || ms < timeout)
+            timeout = (int) ms;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+
+    return timeout;
+}
+
+/* transport worker thread.  this runs the connections assigned to the
+ * worker as they become runnable, and fires their timers; when it has
+ * nothing else to do, it runs connections stolen from other workers.
+ */
+static void *transport_worker_func(void *arg_ptr)
+{
+    mysock_worker_t *worker = (mysock_worker_t *) arg_ptr;
+
+    assert(worker);
+
+#ifdef LINUX
+    if (worker->cpu >= 0)
+    {
+        cpu_set_t cpu_set;
+        int rc;
+
+        CPU_ZERO(&cpu_set);
+        CPU_SET(worker->cpu, &cpu_set);
+        if ((rc = pthread_setaffinity_np(pthread_self(),
+                                         sizeof(cpu_set), &cpu_set)) != 0)
+        {
+            DEBUG_LOG(("couldn't bind transport worker to CPU %d: %s\n",
+                       worker->cpu, strerror(rc)));
+        }
+    }
+#endif
+
+    for (;;)
+    {
+        mysock_context_t *ctx;
+        bool_t timed_out = FALSE, tried_stealing = FALSE;
+
+        PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+        for (;;)
+        {
+            _mysock_timer_fire_locked(worker);
+            if ((ctx = worker->run_head) != NULL)
+            {
+                _mysock_run_queue_remove_locked(worker, ctx);
+                ctx->running = TRUE;
+                timed_out = ctx->timer_fired;
+                ctx->timer_fired = FALSE;
+                break;
+            }
+
+            /* out of work of our own; help a busy worker before sleeping */
+            if (steal_enabled && !tried_stealing)
+            {
+                PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+                ctx = _mysock_steal(worker, &timed_out);
+                PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+                if (ctx)
+                    break;
+
+                tried_stealing = TRUE;
+                continue;   /* something may have been queued meanwhile */
+            }
+
+            worker->idle = TRUE;
+            __atomic_add_fetch(&num_idle_workers, 1, __ATOMIC_RELAXED);
+            if (worker->num_timers)
+            {
+                int rc = pthread_cond_timedwait(
+                    &worker->run_cond, &worker->lock,
+                    &worker->timers[0]->timer_deadline);
+                if (rc != ETIMEDOUT && rc != EINTR)
+                    PTHREAD_CALL(rc);
+            }
+            else
+            {
+                PTHREAD_CALL(pthread_cond_wait(&worker->run_cond,
+                                               &worker->lock));
+            }
+            __atomic_sub_fetch(&num_idle_workers, 1, __ATOMIC_RELAXED);
+            worker->idle = FALSE;
+            tried_stealing = FALSE;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+
+        _mysock_run_transport(ctx, timed_out);
+    }
+
+    return NULL;
+}
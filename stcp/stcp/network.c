@@ -9,6 +9,7 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <stddef.h>
 #include <netinet/in.h>
 #include "mysock_impl.h"
 #include "network.h"
@@ -16,69 +17,201 @@
 #include "transport.h"  /* for dprintf() */
 
 
+static int _network_flush_packets(network_context_t *ctx,
+                                  const void *const *bufs,
+                                  const size_t *lens, unsigned int num_bufs);
+static const void *_network_corrupt_packet(network_context_t *ctx,
+                                           const void *buf, size_t len);
 
 
+/* set the delivery mode for a new mysocket.  unreliable mysockets may also
+ * corrupt packets, to exercise checksum verification:  if the environment
+ * variable STCP_CORRUPT_RATE is set to n > 0, about one in every n packets
+ * sent has a bit flipped.
+ */
+void _network_set_reliability(network_context_t *ctx, bool_t is_reliable)
+{
+    const char *corrupt_rate = getenv("STCP_CORRUPT_RATE");
+
+    assert(ctx);
+
+    ctx->is_reliable  = is_reliable;
+    ctx->corrupt_rate = 0;
+    if (!is_reliable && corrupt_rate && atoi(corrupt_rate) > 0)
+        ctx->corrupt_rate = (unsigned int) atoi(corrupt_rate);
+}
+
 /* helper function for stcp_network_send(); this takes care of unreliable
  * delivery simulation, etc, before passing a packet off to
- * _network_send_packet() for actual transmission over the network.
+ * _network_send_packets() for actual transmission over the network.
  */
 int _network_send(mysocket_t sd, const void *buf, size_t len)
+{
+    int rc = _network_send_batch(sd, &buf, &len, 1);
+    return (rc < 0) ? rc : (int) len;
+}
+
+/* helper function for stcp_network_send_batch(); as _network_send(), but
+ * the packets that survive the unreliable delivery simulation are handed to
+ * _network_send_packets() together, so the I/O layer can submit them with
+ * a single system call.  returns the total number of bytes in the given
+ * packets, or -1 on error.
+ */
+int _network_send_batch(mysocket_t sd, const void *const *bufs,
+                        const size_t *lens, unsigned int num_bufs)
 {
     mysock_context_t *sock_ctx = _mysock_get_context(sd);
     network_context_t *ctx;
-
-    assert(sock_ctx && buf);
+    const void *send_bufs[2 * MAX_PACKET_BATCH];
+    size_t send_lens[2 * MAX_PACKET_BATCH];
+    unsigned int num_send = 0, k;
+    bool_t corrupt_queued = FALSE;
+    int total_len = 0;
+
+    assert(sock_ctx && bufs && lens);
+    assert(num_bufs <= MAX_PACKET_BATCH);
     ctx = &sock_ctx->network_state;
 
+#define QUEUE_PACKET(b, l) \
+    { send_bufs[num_send] = (b); send_lens[num_send] = (l); ++num_send; }
 
-    if (!ctx->is_reliable)
+    for (k = 0; k < num_bufs; ++k)
     {
-        switch (rand_r(&ctx->random_seed) & 0x1f)
+        const void *buf = bufs[k];
+        size_t len = lens[k];
+
+        assert(buf);
+        total_len += len;
+
+        if (ctx->corrupt_rate &&
+            (rand_r(&ctx->random_seed) % ctx->corrupt_rate) == 0)
         {
-        case 0:
-            dprintf("====>network_send:dropping the packet\n");
-            /* drop the packet and forget about it. Send nothing */
-            return len;
-
-        case 1:
-            /* send duplicate */
-            dprintf("====>network_send:duplicating the packet\n");
-            _network_send_packet(ctx, buf, len);
-            break;
-
-        case 2:
-            /* store the packet in our queue. Will send it later */
-            dprintf("====>network_send:keeping the packet in our queue\n");
-            assert(len <= sizeof(ctx->copy_buffer));
-            memcpy(&ctx->copy_buffer, buf, len);
-            ctx->copy_buf_len = len;
-            ctx->copied = TRUE;
-            return len;
-
-        case 3:
-            /* forget about this packet, we will send the packet which
-             * we stored sometime back.
+            /* as with the copy buffer below, there's only one corrupt
+             * buffer, so flush any packet already queued from it.
              */
-            if (ctx->copied)
+            if (corrupt_queued)
             {
-                dprintf("====>network_send:sending the packet stored "
-                        "in our queue\n");
-                _network_send_packet(ctx, ctx->copy_buffer, ctx->copy_buf_len);
+                if (_network_flush_packets(ctx, send_bufs, send_lens,
+                                           num_send) < 0)
+                    return -1;
+                num_send = 0;
             }
-            else
+
+            dprintf("====>network_send:corrupting the packet\n");
+            buf = _network_corrupt_packet(ctx, buf, len);
+            corrupt_queued = TRUE;
+        }
+
+        if (!ctx->is_reliable)
+        {
+            switch (rand_r(&ctx->random_seed) & 0x1f)
             {
+            case 0:
+                dprintf("====>network_send:dropping the packet\n");
+                /* drop the packet and forget about it. Send nothing */
+                continue;
+
+            case 1:
+                /* send duplicate */
                 dprintf("====>network_send:duplicating the packet\n");
-                _network_send_packet(ctx, buf, len);
+                QUEUE_PACKET(buf, len);
+                break;
+
+            case 2:
+                /* store the packet in our queue. Will send it later */
+                dprintf("====>network_send:keeping the packet in our queue\n");
+                assert(len <= sizeof(ctx->copy_buffer));
+
+                /* a packet queued earlier in this batch may refer to the
+                 * copy buffer, so push those out before overwriting it.
+                 */
+                if (_network_flush_packets(ctx, send_bufs, send_lens,
+                                           num_send) < 0)
+                    return -1;
+                num_send = 0;
+                corrupt_queued = FALSE;
+
+                memcpy(&ctx->copy_buffer, buf, len);
+                ctx->copy_buf_len = len;
+                ctx->copied = TRUE;
+                continue;
+
+            case 3:
+                /* forget about this packet, we will send the packet which
+                 * we stored sometime back.
+                 */
+                if (ctx->copied)
+                {
+                    dprintf("====>network_send:sending the packet stored "
+                            "in our queue\n");
+                    QUEUE_PACKET(ctx->copy_buffer, ctx->copy_buf_len);
+                }
+                else
+                {
+                    dprintf("====>network_send:duplicating the packet\n");
+                    QUEUE_PACKET(buf, len);
+                }
+                continue;
+
+            default:
+                /* send what we were supposed to send */
+                break;
             }
-            return len;
-
-        default:
-            /* send what we were supposed to send */
-            break;
         }
+
+        QUEUE_PACKET(buf, len);
     }
 
-    return _network_send_packet(ctx, buf, len);
+#undef QUEUE_PACKET
+
+    if (_network_flush_packets(ctx, send_bufs, send_lens, num_send) < 0)
+        return -1;
+
+    return total_len;
+}
+
+/* pass the packets queued by _network_send_batch() to the I/O layer.  a
+ * duplicated packet takes two slots, so this may need two calls.
+ */
+static int _network_flush_packets(network_context_t *ctx,
+                                  const void *const *bufs,
+                                  const size_t *lens, unsigned int num_bufs)
+{
+    unsigned int k;
+
+    for (k = 0; k < num_bufs; k += MAX_PACKET_BATCH)
+    {
+        if (_network_send_packets(ctx, bufs + k, lens + k,
+                                  MIN(num_bufs - k, MAX_PACKET_BATCH)) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* copy the given packet to the corrupt buffer, flipping a random bit.  the
+ * checksum field itself is left alone, as a zero there means the sender
+ * didn't checksum the packet at all.
+ */
+static const void *_network_corrupt_packet(network_context_t *ctx,
+                                           const void *buf, size_t len)
+{
+    unsigned int pos;
+
+    assert(ctx && buf);
+    assert(len > 0 && len <= sizeof(ctx->corrupt_buffer));
+
+    memcpy(ctx->corrupt_buffer, buf, len);
+
+    pos = rand_r(&ctx->random_seed) % len;
+    if (pos == offsetof(struct tcphdr, th_sum) ||
+        pos == offsetof(struct tcphdr, th_sum) + 1)
+    {
+        pos = (pos + 2) % len;
+    }
+
+    ctx->corrupt_buffer[pos] ^= 1 << (rand_r(&ctx->random_seed) & 7);
+    return ctx->corrupt_buffer;
 }
 
 /* helper function for stcp_network_recv() */
@@ -88,9 +221,19 @@ int _network_recv(mysocket_t sd, void *dst, size_t max_len)
     mysock_context_t *ctx = _mysock_get_context(sd);
 
     assert(ctx && dst);
-    len = _mysock_dequeue_buffer(ctx, &ctx->network_recv_queue,
-                                 dst, max_len, FALSE);
+    len = _mysock_ring_dequeue(ctx, &ctx->network_recv_queue, dst, max_len);
 
     return len;
 }
 
+/* helper function for stcp_network_recv_batch() */
+int _network_recv_batch(mysocket_t sd, void *dst, size_t seg_len,
+                        size_t *lens, unsigned int max_segs)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx && dst && lens);
+    return (int) _mysock_ring_dequeue_batch(ctx, &ctx->network_recv_queue,
+                                            dst, seg_len, lens, max_segs);
+}
+
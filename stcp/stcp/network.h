@@ -6,9 +6,15 @@
 #define __NETWORK_H__
 
 #include "mysock.h"
+#include "network_io.h"
 
+void _network_set_reliability(network_context_t *ctx, bool_t is_reliable);
 int _network_send(mysocket_t sd, const void *buf, size_t len);
+int _network_send_batch(mysocket_t sd, const void *const *bufs,
+                        const size_t *lens, unsigned int num_bufs);
 int _network_recv(mysocket_t sd, void *dst, size_t max_len);
+int _network_recv_batch(mysocket_t sd, void *dst, size_t seg_len,
+                        size_t *lens, unsigned int max_segs);
 
 #endif  /* __NETWORK_H__ */
 
@@ -19,13 +19,35 @@
 
 uint32_t _network_get_local_addr(network_context_t *ctx)
 {
+    uint32_t peer_ip;
+
     assert(ctx);
 
     assert(ctx->peer_addr_valid);
     assert(ctx->peer_addr_len > 0);
     assert(ctx->peer_addr.sa_family == AF_INET);
 
-    return _network_get_interface_ip(
-        ((struct sockaddr_in *) &ctx->peer_addr)->sin_addr.s_addr);
+    /* this is called for every packet sent or received, so the interface
+     * lookup is done only once per peer.
+     */
+    peer_ip = ((struct sockaddr_in *) &ctx->peer_addr)->sin_addr.s_addr;
+    if (!ctx->local_ip || ctx->local_ip_peer != peer_ip)
+    {
+        ctx->local_ip      = _network_get_interface_ip(peer_ip);
+        ctx->local_ip_peer = peer_ip;
+        ctx->pseudo_header_sum_valid = FALSE;
+    }
+
+    return ctx->local_ip;
+}
+
+void _network_invalidate_local_info(network_context_t *ctx)
+{
+    assert(ctx);
+
+    ctx->local_port    = 0;
+    ctx->local_ip      = 0;
+    ctx->local_ip_peer = 0;
+    ctx->pseudo_header_sum_valid = FALSE;
 }
 
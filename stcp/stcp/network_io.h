@@ -13,6 +13,9 @@
 
 #define MAX_IP_PAYLOAD_LEN 1500
 
+/* maximum number of packets passed to _network_send_packets() at once */
+#define MAX_PACKET_BATCH 16
+
 
 struct mysock_context;
 
@@ -31,6 +34,29 @@ typedef struct
     socklen_t       peer_addr_len;
     bool_t          peer_addr_valid;
 
+    /* local port and address, resolved on first use once the peer is known
+     * and cached until the mysocket is rebound; zero while unresolved.
+     * local_ip is only valid for the peer address in local_ip_peer.
+     */
+    uint16_t local_port;        /* network byte order */
+    uint32_t local_ip;          /* network byte order */
+    uint32_t local_ip_peer;     /* network byte order */
+
+    /* partial checksum over the TCP pseudo-header's addresses and protocol
+     * (see tcp_sum.c), cached along with local_ip.
+     */
+    uint32_t pseudo_header_sum;
+    bool_t   pseudo_header_sum_valid;
+
+    /* checksum policy.  checksum_trusted is set by the I/O implementation
+     * if it can't corrupt packets (e.g. it runs over TCP); segments are then
+     * sent without an STCP checksum (th_sum is zero), and such segments are
+     * accepted unverified.  a segment carrying a checksum is always
+     * verified, and dropped if it's wrong.
+     */
+    bool_t        checksum_trusted;
+    unsigned long bad_checksums;    /* received segments dropped */
+
     /* additional (opaque) data used by underlying I/O implementation */
     void *impl_data;
 
@@ -39,13 +65,46 @@ typedef struct
     bool_t       copied;
     char         copy_buffer[MAX_IP_PAYLOAD_LEN];
     size_t       copy_buf_len;
+
+    /* packet corruption simulation (see network.c) */
+    unsigned int corrupt_rate;  /* corrupt one in this many; 0 for none */
+    char         corrupt_buffer[MAX_IP_PAYLOAD_LEN];
 } network_context_t;
 
+/* a closed connection's channel to its peer, kept open through TIME_WAIT
+ * (see mysock_time_wait.c) so that a retransmission of the peer's FIN still
+ * reaches us.  there may be a great many of these, so this is kept small.
+ * its fields belong to the network layer.
+ */
+typedef struct
+{
+    int          handle;        /* underlying socket, or -1 once closed */
+    unsigned int slot;          /* in the receive engine, while watched */
+    unsigned int engine_id;     /* engine watching it */
+    bool_t       busy;          /* input being dispatched? */
+
+    /* the start of the packet arriving next.  only a packet's header
+     * matters in TIME_WAIT, so a stream-based implementation reassembles
+     * the first few bytes of each here, and skips the rest.
+     */
+    uint16_t     partial_len;
+    uint16_t     skip_len;
+    char         partial[24];
+} network_time_wait_t;
+
 
 /* open/close network layer resources for a mysocket */
 int _network_init(struct mysock_context *ctx, network_context_t *net_ctx);
 void _network_close(network_context_t *ctx);
 
+/* release a context's network resources (e.g. its socket) once its
+ * mysocket has been closed, but keep its allocations, so it can be set up
+ * again for a new mysocket with _network_reinit() rather than
+ * _network_init().  it's freed with _network_close() as usual.
+ */
+void _network_recycle(network_context_t *ctx);
+int _network_reinit(struct mysock_context *ctx, network_context_t *net_ctx);
+
 /* bind a local port to the given mysocket */
 int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen);
 
@@ -60,6 +119,11 @@ int _network_get_port(network_context_t *ctx);
  */
 uint32_t _network_get_local_addr(network_context_t *ctx);
 
+/* discard the cached local port/address, e.g. when the mysocket is rebound
+ * or its underlying socket is replaced.
+ */
+void _network_invalidate_local_info(network_context_t *ctx);
+
 /* return local address associated with whichever interface delivers
  * packets to/from peer_addr (network byte order).
  */
@@ -69,11 +133,26 @@ uint32_t _network_get_interface_ip(uint32_t peer_addr);
 ssize_t _network_send_packet(network_context_t *ctx,
                              const void *src, size_t len);
 
-/* start/stop per-mysocket network receive thread.  the stop() interface
- * must not return until the network receive thread has exited.
+/* send up to MAX_PACKET_BATCH STCP packets to our peer with as few system
+ * calls as the underlying I/O mechanism allows.  returns the total number
+ * of bytes sent, or -1 on error.
  */
-int _network_start_recv_thread(struct mysock_context *ctx);
-void _network_stop_recv_thread(struct mysock_context *ctx);
+ssize_t _network_send_packets(network_context_t *ctx,
+                              const void *const *srcs, const size_t *lens,
+                              unsigned int num_packets);
+
+/* start/stop receiving network packets for a mysocket.  the stop()
+ * interface must not return until nothing more will be delivered to the
+ * mysocket.
+ */
+int _network_start_recv(struct mysock_context *ctx);
+void _network_stop_recv(struct mysock_context *ctx);
+
+/* in polled mode, wait up to timeout milliseconds (indefinitely if it's
+ * negative) for network input, and dispatch it to the mysockets it's for.
+ * returns the number of sockets that had input.  see mystack_poll().
+ */
+int _network_poll_recv(int timeout);
 
 /* called when a SYN packet is dequeued on a passive socket, to update any
  * state in the network layer.
@@ -83,5 +162,28 @@ void _network_update_passive_state(network_context_t *new_ctx,
                                    void *user_data,
                                    const void *syn_packet, size_t syn_len);
 
+/* send a packet to the peer of a connection request that arrived on the
+ * passive socket accept_ctx, before there's a mysocket for the connection
+ * (e.g. a SYN-ACK carrying a SYN cookie).  user_data and the peer address
+ * are as passed with the request to _mysock_enqueue_connection().
+ */
+ssize_t _network_reply_passive(network_context_t *accept_ctx,
+                               void *user_data,
+                               const struct sockaddr *peer_addr,
+                               int peer_addr_len,
+                               const void *src, size_t len);
+
+/* TIME_WAIT channels.  _network_time_wait_start() takes the channel to the
+ * peer away from a closed mysocket, once it's stopped receiving; input
+ * arriving on it is passed to _mysock_time_wait_input() from then on.  it
+ * returns -1 if there's no channel to keep (e.g. the mysocket never reached
+ * its peer).  the close interface doesn't return while input from the
+ * channel is being dispatched.
+ */
+int _network_time_wait_start(network_context_t *ctx, network_time_wait_t *tw);
+ssize_t _network_time_wait_send(network_time_wait_t *tw,
+                                const void *src, size_t len);
+void _network_time_wait_close(network_time_wait_t *tw);
+
 #endif  /* __NETWORK_IO_H__ */
 
@@ -2,17 +2,23 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <assert.h>
+#ifdef LINUX
+#include <sys/epoll.h>
+#endif
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "network_io_socket.h"
 #include "connection_demux.h"
+#include "tcp_sum.h"
 
 #include <string.h>
 #include <netinet/in.h>
@@ -21,8 +27,76 @@
 
 
 
-#define EXIT_PIPE_READ_INDEX  0
-#define EXIT_PIPE_WRITE_INDEX 1
+/* the network receive engine.  rather than each mysocket having its own
+ * receive thread, a small pool of threads (one, unless STCP_NETWORK_THREADS
+ * says otherwise) waits for input on every mysocket's socket at once, using
+ * epoll where it's available and poll() elsewhere, and dispatches packets to
+ * their mysockets as they arrive.  each socket is watched by a single
+ * thread, which is thus the only producer for its mysocket's
+ * network_recv_queue.
+ *
+ * events refer to a watch by its slot in the thread's table and that slot's
+ * generation, rather than by pointer, as a watch can be removed while an
+ * event for it is still in flight; such an event finds the generation has
+ * changed, and is ignored.
+ *
+ * a child process doesn't inherit the engine's threads, so after a fork()
+ * the child abandons the parent's engine (and with it, the mysockets it
+ * inherited), and starts its own when it's first needed.
+ *
+ * in polled mode (see mystack_set_mode()), the engine has a single thread
+ * structure but no thread; the application runs it with mystack_poll().
+ *
+ * the engine's first thread also watches the channels of connections in
+ * TIME_WAIT (see mysock_time_wait.c).  these take a slot as a watch does,
+ * but have no receive buffer of their own.
+ */
+#define NETWORK_RECV_MAX_THREADS 16
+#define NETWORK_RECV_MAX_EVENTS  64
+#define NETWORK_WATCH_MIN_SLOTS  16
+#define NO_SLOT ((unsigned int) -1)
+
+#define WAKE_PIPE_READ_INDEX  0
+#define WAKE_PIPE_WRITE_INDEX 1
+
+typedef struct
+{
+    network_watch_t     *watch;     /* NULL if the slot is free... */
+    network_time_wait_t *time_wait; /* ...unless it has a TIME_WAIT channel */
+    uint32_t             generation;
+    unsigned int         next_free;
+} network_watch_slot_t;
+
+typedef struct network_recv_thread
+{
+    pthread_t       thread;
+
+    /* protects the slot table and all watches assigned to this thread */
+    pthread_mutex_t lock;
+    pthread_cond_t  idle_cond;  /* signaled when a watch stops being busy */
+
+    network_watch_slot_t *slots;
+    unsigned int          num_slots;
+    unsigned int          free_slot;    /* head of free list, or NO_SLOT */
+
+#ifdef LINUX
+    int             epoll_fd;
+#else
+    int             wake_pipe[2];   /* wakes poll() when a watch is added */
+
+    /* the poll set, rebuilt for each wait */
+    struct pollfd  *fds;
+    uint64_t       *keys;
+    unsigned int    fds_capacity;
+#endif
+} network_recv_thread_t;
+
+static network_recv_thread_t recv_threads[NETWORK_RECV_MAX_THREADS];
+static unsigned int num_recv_threads;
+static unsigned int next_recv_thread;   /* for round-robin assignment */
+static pthread_mutex_t recv_engine_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool_t recv_engine_started;
+static unsigned int recv_engine_id;     /* bumped in a fork()ed child */
 
 #ifndef MAXHOSTNAMELEN
 #ifdef HOST_NAME_MAX
@@ -36,6 +110,24 @@
 static network_context_socket_t *
     _network_alloc_context_socket(int socket_type, size_t ctx_len);
 static void _network_destroy_context_socket(network_context_socket_t *ctx);
+static void _network_recv_engine_start(void);
+static void _network_recv_engine_init(void);
+static void _network_recv_engine_fork_child(void);
+static unsigned int _network_slot_alloc_locked(network_recv_thread_t *thread,
+                                               socket_t               sd);
+static void _network_slot_free_locked(network_recv_thread_t *thread,
+                                      unsigned int           slot,
+                                      socket_t               sd);
+static void _network_watch_locked(network_recv_thread_t *thread,
+                                  network_watch_t       *watch);
+static void _network_unwatch_locked(network_watch_t *watch);
+static void _network_unwatch_time_wait_locked(network_time_wait_t *tw);
+static bool_t _network_watch_busy_locked(const network_watch_t *watch);
+static void _network_recv_event(network_recv_thread_t *thread, uint64_t key);
+static void _network_recv_watch(network_watch_t *watch);
+static void _network_recv_time_wait_input(network_recv_thread_t *thread,
+                                          network_time_wait_t   *tw);
+static int _network_recv_wait(network_recv_thread_t *thread, int timeout);
 static void *network_recv_thread_func(void *arg_ptr);
 
 
@@ -51,7 +143,8 @@ void _network_close_socket(network_context_t *ctx)
 }
 
 /* return the local port associated with the given network layer context, in
- * network byte order, or 0 (reserved) on error.
+ * network byte order, or 0 (reserved) on error.  the port can't change
+ * until the socket is rebound, so it's only looked up once.
  */
 int _network_get_port(network_context_t *ctx)
 {
@@ -61,6 +154,9 @@ int _network_get_port(network_context_t *ctx)
     assert(ctx);
     VERIFY_SOCKET(ctx);
 
+    if (ctx->local_port)
+        return ctx->local_port;
+
     if (getsockname(GET_SOCKET(ctx), (struct sockaddr *) &sin, &sin_len) < 0)
     {
         assert(0);
@@ -68,13 +164,15 @@ int _network_get_port(network_context_t *ctx)
     }
 
     assert(sin.sin_family == AF_INET);
+    ctx->local_port = sin.sin_port;    /* still 0 if the socket is unbound */
     return sin.sin_port;
 }
 
 /* return the address associated with the interface over which packets
- * to/from the given peer (network byte order) are delivered.  this is
- * completely broken for multi-homed hosts; it should consult the local
- * routing table in that case.
+ * to/from the given peer (network byte order) are delivered.  the kernel's
+ * routing table is consulted by connecting a UDP socket to the peer (this
+ * sends nothing); if that fails, we fall back to the address of our own
+ * host name, which is broken for multi-homed hosts.
  */
 uint32_t _network_get_interface_ip(uint32_t peer_addr)
 {
@@ -82,6 +180,27 @@ uint32_t _network_get_interface_ip(uint32_t peer_addr)
     struct hostent *h, result;
     int err_rc;
     char buf[1024];
+    socket_t route_sd;
+
+    if ((route_sd = socket(AF_INET, SOCK_DGRAM, 0)) >= 0)
+    {
+        struct sockaddr_in sin;
+        socklen_t sin_len = sizeof(sin);
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family      = AF_INET;
+        sin.sin_port        = htons(9);    /* any non-zero port will do */
+        sin.sin_addr.s_addr = peer_addr;
+
+        if (connect(route_sd, (struct sockaddr *) &sin, sizeof(sin)) == 0 &&
+            getsockname(route_sd, (struct sockaddr *) &sin, &sin_len) == 0 &&
+            sin.sin_addr.s_addr != htonl(INADDR_ANY))
+        {
+            closesocket(route_sd);
+            return sin.sin_addr.s_addr;
+        }
+        closesocket(route_sd);
+    }
 
     if (gethostname(hostname, sizeof(hostname)) < 0)
     {
@@ -112,51 +231,172 @@ uint32_t _network_get_interface_ip(uint32_t peer_addr)
     return ((struct in_addr *) *h->h_addr_list)->s_addr;
 }
 
-int _network_start_recv_thread(mysock_context_t *ctx)
+/* start delivering packets received on the given mysocket's socket */
+int _network_start_recv(mysock_context_t *ctx)
 {
     network_context_socket_t *net_ctx =
         (network_context_socket_t *) ctx->network_state.impl_data;
+    network_watch_t *watch;
+    network_recv_thread_t *thread;
 
     assert(net_ctx);
+    watch = &net_ctx->watch;
+    assert(!watch->thread);
 
-    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    _network_recv_engine_start();
+
+    watch->socket    = net_ctx->socket;
+    watch->sock_ctx  = ctx;
+    watch->slot      = NO_SLOT;
+    watch->engine_id = recv_engine_id;
+    watch->thread    = thread = &recv_threads[
+        __atomic_fetch_add(&next_recv_thread, 1, __ATOMIC_RELAXED) %
+        num_recv_threads];
+
+    /* if the socket can't be readied (e.g. the peer refused the
+     * connection), nothing is ever received on it.
+     */
+    if (_network_prepare_recv(&ctx->network_state) < 0)
     {
-        perror("signal(SIGPIPE)");
-        assert(0);
-        return -1;
+        DEBUG_LOG(("not watching socket %d\n", (int) watch->socket));
+        return 0;
     }
 
-    net_ctx->recv_thread = _mysock_create_thread(network_recv_thread_func,
-                                                 ctx, FALSE);
-    net_ctx->recv_thread_started = TRUE;
+    PTHREAD_CALL(pthread_mutex_lock(&thread->lock));
+    _network_watch_locked(thread, watch);
+    PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
     return 0;
 }
 
-/* block until the network receive thread completes */
-void _network_stop_recv_thread(mysock_context_t *ctx)
+/* stop delivering packets to the given mysocket.  this doesn't return until
+ * any packets being dispatched to it have been queued, so the mysocket can
+ * be freed once it does.  a listening mysocket's pending connections are
+ * closed.
+ */
+void _network_stop_recv(mysock_context_t *ctx)
 {
     network_context_socket_t *net_ctx =
         (network_context_socket_t *) ctx->network_state.impl_data;
+    network_watch_t *watch, *pending;
+    network_recv_thread_t *thread;
 
-    DEBUG_LOG(("stopping receive thread\n"));
+    DEBUG_LOG(("stopping receive\n"));
     assert(net_ctx);
 
+    watch = &net_ctx->watch;
+    if (!(thread = watch->thread) || watch->engine_id != recv_engine_id)
+        return;     /* never started, or inherited across fork() */
 
-    if (net_ctx->recv_thread_started)
+    PTHREAD_CALL(pthread_mutex_lock(&thread->lock));
+    _network_unwatch_locked(watch);
+    for (pending = watch->pending_head; pending;
+         pending = pending->pending_next)
     {
-        char dummy = 'X';
-        if (write(net_ctx->exit_pipe[EXIT_PIPE_WRITE_INDEX],
-                  &dummy, sizeof(dummy)) < 0)
-        {
-            assert(0);
-            abort();
-        }
+        _network_unwatch_locked(pending);
+        pending->removed = TRUE;
+    }
+
+    while (_network_watch_busy_locked(watch))
+        PTHREAD_CALL(pthread_cond_wait(&thread->idle_cond, &thread->lock));
 
+    pending = watch->pending_head;
+    watch->pending_head = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
+
+    while (pending)
+    {
+        network_watch_t *next = pending->pending_next;
 
-        PTHREAD_CALL(pthread_join(net_ctx->recv_thread, NULL));
-        net_ctx->recv_thread_started = FALSE;
+        if (pending->socket >= 0)
+            closesocket(pending->socket);
+        free(pending);
+        pending = next;
+    }
+
+    watch->thread = NULL;
+    DEBUG_LOG(("stopped receive\n"));
+}
+
+void _network_watch_pending(network_watch_t       *listen_watch,
+                            socket_t               sd,
+                            const struct sockaddr *peer_addr,
+                            socklen_t              peer_addr_len)
+{
+    network_recv_thread_t *thread;
+    network_watch_t *watch;
+
+    assert(listen_watch && listen_watch->thread && peer_addr);
+    assert(listen_watch->busy && !listen_watch->pending);
+    assert(peer_addr_len <= (socklen_t) sizeof(watch->peer_addr));
+
+    watch = (network_watch_t *) calloc(1, sizeof(*watch));
+    assert(watch);
+
+    watch->socket        = sd;
+    watch->sock_ctx      = listen_watch->sock_ctx;
+    watch->engine_id     = listen_watch->engine_id;
+    watch->slot          = NO_SLOT;
+    watch->pending       = TRUE;
+    memcpy(&watch->peer_addr, peer_addr, peer_addr_len);
+    watch->peer_addr_len = peer_addr_len;
+
+    /* a pending connection is watched by the listening mysocket's thread,
+     * so SYNs for any one listening mysocket are dispatched serially.
+     */
+    thread = listen_watch->thread;
+    PTHREAD_CALL(pthread_mutex_lock(&thread->lock));
+    watch->pending_next = listen_watch->pending_head;
+    if (watch->pending_next)
+        watch->pending_next->pending_prev = watch;
+    listen_watch->pending_head = watch;
+    _network_watch_locked(thread, watch);
+    PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
+}
+
+/* TIME_WAIT channels are all watched by the engine's first thread */
+void _network_watch_time_wait(network_time_wait_t *tw)
+{
+    network_recv_thread_t *thread;
+    network_watch_slot_t *slot;
+
+    assert(tw && tw->handle >= 0);
+
+    _network_recv_engine_start();
+
+    thread = &recv_threads[0];
+    PTHREAD_CALL(pthread_mutex_lock(&thread->lock));
+    tw->engine_id = recv_engine_id;
+    tw->busy      = FALSE;
+    tw->slot      = _network_slot_alloc_locked(thread, tw->handle);
+
+    slot = &thread->slots[tw->slot];
+    slot->time_wait = tw;
+    PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
+}
+
+/* stop watching a TIME_WAIT channel, and close it.  a channel inherited
+ * across fork() isn't watched here, but it's still closed.
+ */
+void _network_time_wait_close(network_time_wait_t *tw)
+{
+    network_recv_thread_t *thread = &recv_threads[0];
+
+    assert(tw);
+
+    if (tw->engine_id == recv_engine_id)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&thread->lock));
+        _network_unwatch_time_wait_locked(tw);
+        while (tw->busy)
+            PTHREAD_CALL(pthread_cond_wait(&thread->idle_cond, &thread->lock));
+        PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
+    }
+
+    if (tw->handle >= 0)
+    {
+        closesocket(tw->handle);
+        tw->handle = -1;
     }
-    DEBUG_LOG(("stopped receive thread\n"));
 }
 
 
@@ -183,6 +423,54 @@ int _network_init_socket(mysock_context_t  *sock_ctx,
     return 0;
 }
 
+/* as _network_init_socket(), for a context last released with
+ * _network_recycle_socket(), whose allocation is reused.
+ */
+int _network_reinit_socket(mysock_context_t  *sock_ctx,
+                           network_context_t *net_ctx,
+                           int                type)
+{
+    network_context_socket_t *impl;
+
+    assert(sock_ctx && net_ctx && net_ctx->impl_data);
+    impl = (network_context_socket_t *) net_ctx->impl_data;
+    assert(impl->socket < 0 && !impl->watch.thread);
+
+    memset(net_ctx, 0, sizeof(*net_ctx));
+    net_ctx->impl_data   = impl;
+    net_ctx->random_seed = 0x632a;
+
+    /* the watch's receive buffer needn't be cleared */
+    memset(&impl->watch, 0, offsetof(network_watch_t, buf));
+
+    if ((impl->socket = socket(AF_INET, type, 0)) < 0)
+    {
+        perror("socket");
+        assert(0);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* close the socket of a context that's no longer receiving, but keep the
+ * allocation for _network_reinit_socket().
+ */
+void _network_recycle_socket(network_context_t *ctx)
+{
+    network_context_socket_t *impl;
+
+    assert(ctx && ctx->impl_data);
+    impl = (network_context_socket_t *) ctx->impl_data;
+    assert(!impl->watch.thread);
+
+    if (impl->socket >= 0)
+    {
+        closesocket(impl->socket);
+        impl->socket = -1;
+    }
+}
+
 /* set the local port associated with the given network layer context */
 int _network_bind_socket(network_context_t *ctx,
                          struct sockaddr   *addr,
@@ -190,103 +478,575 @@ int _network_bind_socket(network_context_t *ctx,
 {
     assert(ctx && addr);
     VERIFY_SOCKET(ctx);
+
+    _network_invalidate_local_info(ctx);
     return bind(GET_SOCKET(ctx), addr, addrlen);
 }
 
 
-/* process network input.
- * this just loops around, waiting for data to arrive, and buffering it
- * for later consumption by network_recv().  (outgoing data is sent
- * immediately via network_send(), and so does not require its own thread).
- * 
- * this runs in its own thread, mostly because the transport layer needs to
- * wait with a timeout for incoming data from the peer.  [usual mechanisms
- * for I/O with timeouts such as poll(), select(), or asynchronous I/O
- * don't work with all underlying I/O mechanisms we might support (e.g.
- * VNS).  so we implement the timeout in a more generic (I/O-independent)
- * manner using the pthreads API instead].
+/* start the network receive engine, if it isn't running yet */
+static void _network_recv_engine_start(void)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&recv_engine_lock));
+    if (!recv_engine_started)
+    {
+        _network_recv_engine_init();
+        recv_engine_started = TRUE;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&recv_engine_lock));
+}
+
+/* start the network receive engine's threads.  recv_engine_lock must be
+ * held.
  */
-static void *network_recv_thread_func(void *arg_ptr)
+static void _network_recv_engine_init(void)
 {
-    char packet_buf[MAX_IP_PAYLOAD_LEN];
-    mysock_context_t *ctx;
-    network_context_socket_t *net_ctx;
+    const char *num_threads = getenv("STCP_NETWORK_THREADS");
+    static bool_t fork_handler_registered = FALSE;
+    unsigned int k;
 
-    DEBUG_LOG(("started receive thread\n"));
-    ctx = (mysock_context_t *) arg_ptr;
-    assert(ctx);
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror("signal(SIGPIPE)");
+        assert(0);
+    }
 
-    net_ctx = (network_context_socket_t *) ctx->network_state.impl_data;
-    assert(net_ctx);
+    if (!fork_handler_registered)
+    {
+        PTHREAD_CALL(pthread_atfork(NULL, NULL,
+                                    _network_recv_engine_fork_child));
+        fork_handler_registered = TRUE;
+    }
 
-    for (;;)
+    num_recv_threads = 1;
+    if (num_threads && atoi(num_threads) > 0 && !_mysock_stack_polled())
+        num_recv_threads = MIN((unsigned int) atoi(num_threads),
+                               NETWORK_RECV_MAX_THREADS);
+
+    for (k = 0; k < num_recv_threads; ++k)
     {
-        ssize_t bytes_read;
-        bool_t packet_ready = FALSE;
-        bool_t done = FALSE;
-        struct pollfd fds[] =
+        network_recv_thread_t *thread = &recv_threads[k];
+
+        PTHREAD_CALL(pthread_mutex_init(&thread->lock, NULL));
+        PTHREAD_CALL(pthread_cond_init(&thread->idle_cond, NULL));
+        thread->free_slot = NO_SLOT;
+
+#ifdef LINUX
+        if ((thread->epoll_fd = epoll_create(NETWORK_RECV_MAX_EVENTS)) < 0)
+        {
+            perror("epoll_create");
+            assert(0);
+            abort();
+        }
+#else
+        if (pipe(thread->wake_pipe) < 0 ||
+            fcntl(thread->wake_pipe[WAKE_PIPE_READ_INDEX],
+                  F_SETFL, O_NONBLOCK) < 0)
+        {
+            perror("pipe");
+            assert(0);
+            abort();
+        }
+#endif
+
+        if (!_mysock_stack_polled())
         {
-            { net_ctx->exit_pipe[EXIT_PIPE_READ_INDEX], POLLIN, 0 },
-            { net_ctx->socket, POLLIN, 0 }
-        };
+            thread->thread = _mysock_create_thread(network_recv_thread_func,
+                                                   thread, TRUE);
+        }
+    }
+}
 
+/* called in the child after a fork().  the parent's engine threads don't
+ * exist here, and its locks may have been held when they were copied, so
+ * everything is discarded without locking.  the watches the engine had are
+ * left alone; _network_stop_recv() knows them by their engine_id.
+ */
+static void _network_recv_engine_fork_child(void)
+{
+    unsigned int k;
+
+    for (k = 0; k < num_recv_threads; ++k)
+    {
+        network_recv_thread_t *thread = &recv_threads[k];
+
+#ifdef LINUX
+        close(thread->epoll_fd);
+#else
+        close(thread->wake_pipe[WAKE_PIPE_READ_INDEX]);
+        close(thread->wake_pipe[WAKE_PIPE_WRITE_INDEX]);
+        free(thread->fds);
+        free(thread->keys);
+#endif
+        free(thread->slots);
+        memset(thread, 0, sizeof(*thread));
+    }
+
+    num_recv_threads    = 0;
+    recv_engine_started = FALSE;
+    ++recv_engine_id;
+    PTHREAD_CALL(pthread_mutex_init(&recv_engine_lock, NULL));
+}
 
-        while (!packet_ready && !done)
+/* take a free slot in the thread's table, and start watching the given
+ * socket for input under it.  the caller makes the slot's watch or
+ * time_wait point at what the socket belongs to.  the thread's lock must be
+ * held.
+ */
+static unsigned int _network_slot_alloc_locked(network_recv_thread_t *thread,
+                                               socket_t               sd)
+{
+    network_watch_slot_t *slot;
+    unsigned int k;
+
+    assert(thread && sd >= 0);
+
+    if (thread->free_slot == NO_SLOT)
+    {
+        unsigned int new_num_slots = thread->num_slots
+            ? 2 * thread->num_slots : NETWORK_WATCH_MIN_SLOTS;
+
+        thread->slots = (network_watch_slot_t *)
+            realloc(thread->slots, new_num_slots * sizeof(*thread->slots));
+        assert(thread->slots);
+
+        for (k = thread->num_slots; k < new_num_slots; ++k)
         {
-            switch (poll(fds, sizeof(fds) / sizeof(fds[0]), -1))
-            {
-            case -1:
-                assert(errno == EINTR);
-                break;
-
-            case 0:
-                assert(0);
-                break;
-
-            default:
-                assert(!(fds[0].revents & POLLERR));
-                assert(!(fds[1].revents & POLLERR));
-
-                if (fds[0].revents)
-                    done = TRUE;
-                if (fds[1].revents)
-                    packet_ready = TRUE;
-                break;
-            }
+            thread->slots[k].watch      = NULL;
+            thread->slots[k].time_wait  = NULL;
+            thread->slots[k].generation = 0;
+            thread->slots[k].next_free  =
+                (k + 1 < new_num_slots) ? k + 1 : NO_SLOT;
         }
 
-        if (done)
-            break;
+        thread->free_slot = thread->num_slots;
+        thread->num_slots = new_num_slots;
+    }
 
-        /* block, waiting for network input.  (the system call will be
-         * interrupted by the transport layer thread if we're to exit).
-         */
-        if ((bytes_read = _network_recv_packet(&ctx->network_state,
-                                               packet_buf,
-                                               sizeof(packet_buf))) <= 0)
+    k = thread->free_slot;
+    slot = &thread->slots[k];
+    thread->free_slot = slot->next_free;
+
+#ifdef LINUX
+    {
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof(event));
+        event.events   = EPOLLIN;
+        event.data.u64 = ((uint64_t) slot->generation << 32) | k;
+        if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, sd, &event) < 0)
         {
-            DEBUG_LOG(("_network_recv_packet interrupted, errno=%d\n", errno));
-            break;
+            perror("epoll_ctl(EPOLL_CTL_ADD)");
+            assert(0);
         }
+    }
+#else
+    {
+        char dummy = 'X';
+        (void) write(thread->wake_pipe[WAKE_PIPE_WRITE_INDEX],
+                     &dummy, sizeof(dummy));
+    }
+#endif
+
+    return k;
+}
+
+/* stop watching the given socket, and free its slot; any events still in
+ * flight for it are then ignored.  the thread's lock must be held.
+ */
+static void _network_slot_free_locked(network_recv_thread_t *thread,
+                                      unsigned int           k,
+                                      socket_t               sd)
+{
+    network_watch_slot_t *slot;
+
+    assert(thread && k < thread->num_slots);
+    slot = &thread->slots[k];
+
+#ifdef LINUX
+    if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_DEL, sd, NULL) < 0)
+    {
+        perror("epoll_ctl(EPOLL_CTL_DEL)");
+        assert(0);
+    }
+#endif
+
+    slot->watch      = NULL;
+    slot->time_wait  = NULL;
+    slot->next_free  = thread->free_slot;
+    ++slot->generation;
+    thread->free_slot = k;
+}
+
+/* give the watch a slot in the thread's table, and start watching its
+ * socket for input.  the thread's lock must be held.
+ */
+static void _network_watch_locked(network_recv_thread_t *thread,
+                                  network_watch_t       *watch)
+{
+    assert(thread && watch);
+    assert(watch->slot == NO_SLOT);
+    assert(watch->socket >= 0);
+
+    watch->thread = thread;
+    watch->slot   = _network_slot_alloc_locked(thread, watch->socket);
+    thread->slots[watch->slot].watch = watch;
+}
+
+/* stop watching the watch's socket, and free its slot.  the thread's lock
+ * must be held.
+ */
+static void _network_unwatch_locked(network_watch_t *watch)
+{
+    assert(watch && watch->thread);
+    if (watch->slot == NO_SLOT)
+        return;
+
+    assert(watch->thread->slots[watch->slot].watch == watch);
+    _network_slot_free_locked(watch->thread, watch->slot, watch->socket);
+    watch->slot = NO_SLOT;
+}
+
+/* as _network_unwatch_locked(), for a TIME_WAIT channel.  the lock of the
+ * engine's first thread, which watches them all, must be held.
+ */
+static void _network_unwatch_time_wait_locked(network_time_wait_t *tw)
+{
+    network_recv_thread_t *thread = &recv_threads[0];
+
+    assert(tw);
+    if (tw->slot == NO_SLOT)
+        return;
+
+    assert(thread->slots[tw->slot].time_wait == tw);
+    _network_slot_free_locked(thread, tw->slot, tw->handle);
+    tw->slot = NO_SLOT;
+}
+
+/* TRUE if packets are being dispatched from the given watch, or any of its
+ * pending connections.  the thread's lock must be held.
+ */
+static bool_t _network_watch_busy_locked(const network_watch_t *watch)
+{
+    const network_watch_t *pending;
+
+    if (watch->busy)
+        return TRUE;
+
+    for (pending = watch->pending_head; pending;
+         pending = pending->pending_next)
+    {
+        if (pending->busy)
+            return TRUE;
+    }
+
+    return FALSE;
+}
 
-        assert(bytes_read <= (int)sizeof(packet_buf));
-        if (ctx->listening)
+/* dispatch input from the watch with the given event key, if it's still
+ * watched.
+ */
+static void _network_recv_event(network_recv_thread_t *thread, uint64_t key)
+{
+    unsigned int slot = (unsigned int) (key & 0xffffffff);
+    network_watch_t *watch;
+    network_time_wait_t *tw;
+
+    PTHREAD_CALL(pthread_mutex_lock(&thread->lock));
+    if (slot >= thread->num_slots ||
+        (!thread->slots[slot].watch && !thread->slots[slot].time_wait) ||
+        thread->slots[slot].generation != (uint32_t) (key >> 32))
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
+        return;     /* unwatched since the event arrived */
+    }
+
+    if ((tw = thread->slots[slot].time_wait) != NULL)
+    {
+        tw->busy = TRUE;
+        PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
+
+        _network_recv_time_wait_input(thread, tw);
+
+        PTHREAD_CALL(pthread_mutex_lock(&thread->lock));
+        tw->busy = FALSE;
+        PTHREAD_CALL(pthread_cond_broadcast(&thread->idle_cond));
+        PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
+        return;
+    }
+
+    watch = thread->slots[slot].watch;
+    watch->busy = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
+
+    _network_recv_watch(watch);
+
+    PTHREAD_CALL(pthread_mutex_lock(&thread->lock));
+    watch->busy = FALSE;
+    PTHREAD_CALL(pthread_cond_broadcast(&thread->idle_cond));
+
+    /* a pending connection that's no longer watched has either been passed
+     * on to a new mysocket, or been closed by the peer.  (if the listening
+     * mysocket's being closed, _network_stop_recv() frees it instead.)
+     */
+    if (watch->pending && !watch->removed && watch->slot == NO_SLOT)
+    {
+        network_watch_t *listen_watch =
+            &((network_context_socket_t *)
+              watch->sock_ctx->network_state.impl_data)->watch;
+
+        if (watch->pending_prev)
+            watch->pending_prev->pending_next = watch->pending_next;
+        else
+            listen_watch->pending_head = watch->pending_next;
+        if (watch->pending_next)
+            watch->pending_next->pending_prev = watch->pending_prev;
+    }
+    else
+    {
+        watch = NULL;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
+
+    if (watch)
+    {
+        if (watch->socket >= 0)
+            closesocket(watch->socket);
+        free(watch);
+    }
+}
+
+/* read and dispatch everything that's arrived on the given watch.  this
+ * runs with watch->busy set, so _network_stop_recv() waits for it.
+ */
+static void _network_recv_watch(network_watch_t *watch)
+{
+    network_recv_thread_t *thread = watch->thread;
+    mysock_context_t *ctx = watch->sock_ctx;
+    const void *packet;
+    ssize_t packet_len;
+
+    assert(ctx);
+    while ((packet_len = _network_recv_packet(&ctx->network_state,
+                                              watch, &packet)) > 0)
+    {
+        assert(packet_len <= MAX_IP_PAYLOAD_LEN);
+        if (!ctx->listening)
+        {
+            /* enqueue the packet directly for this context (unless it
+             * failed the checksum check, in which case it's dropped).
+             */
+            if (_mysock_accept_packet(ctx, NULL, packet, packet_len))
+            {
+                (void) _mysock_ring_enqueue(ctx, &ctx->network_recv_queue,
+                                            packet, packet_len);
+            }
+        }
+        else if (!watch->pending)
         {
             /* if the socket was accepting new connections, incoming
              * packets need to be demultiplexed and dispatched to the
              * appropriate mysocket context.
              */
-            _mysock_enqueue_connection(ctx, packet_buf, bytes_read,
-                                       &ctx->network_state.peer_addr,
-                                       ctx->network_state.peer_addr_len, NULL);
+            (void) _mysock_enqueue_connection(
+                ctx, packet, packet_len, &ctx->network_state.peer_addr,
+                ctx->network_state.peer_addr_len, NULL);
         }
         else
         {
-            /* enqueue the packet directly for this context */
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue,
-                                   packet_buf, bytes_read);
+            bool_t queued;
+
+            /* a pending connection's socket passes to the new mysocket
+             * along with its SYN, and is watched as that mysocket's from
+             * then on.  if the SYN's dropped, keep waiting for another.
+             */
+            PTHREAD_CALL(pthread_mutex_lock(&thread->lock));
+            _network_unwatch_locked(watch);
+            PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
+
+            queued = _mysock_enqueue_connection(
+                ctx, packet, packet_len, &ctx->network_state.peer_addr,
+                ctx->network_state.peer_addr_len, NULL);
+
+            PTHREAD_CALL(pthread_mutex_lock(&thread->lock));
+            if (queued)
+                watch->socket = -1;
+            else if (!watch->removed)
+                _network_watch_locked(thread, watch);
+            PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
+
+            if (queued)
+                return;
+        }
+    }
+
+    if (packet_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+
+    /* the peer closed the socket, or it failed */
+    DEBUG_LOG(("_network_recv_packet on socket %d returned %d, errno=%d\n",
+               (int) watch->socket, (int) packet_len, errno));
+    PTHREAD_CALL(pthread_mutex_lock(&thread->lock));
+    _network_unwatch_locked(watch);
+    PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
+}
+
+/* pass everything that's arrived on a TIME_WAIT channel up to the
+ * mysocket layer.  once the peer closes its end, its side of the connection
+ * is over, and nothing more can arrive, so the channel is closed; the
+ * connection stays in TIME_WAIT until it expires, as usual.  this runs with
+ * tw->busy set, so _network_time_wait_close() waits for it.
+ */
+static void _network_recv_time_wait_input(network_recv_thread_t *thread,
+                                          network_time_wait_t   *tw)
+{
+    const void *header;
+    size_t header_len;
+    ssize_t packet_len;
+
+    assert(thread && tw);
+    while ((packet_len = _network_recv_time_wait(tw, &header,
+                                                 &header_len)) > 0)
+    {
+        _mysock_time_wait_input(tw, header, header_len, packet_len);
+    }
+
+    if (packet_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+
+    DEBUG_LOG(("TIME_WAIT channel %d closed by peer\n", tw->handle));
+    PTHREAD_CALL(pthread_mutex_lock(&thread->lock));
+    _network_unwatch_time_wait_locked(tw);
+    closesocket(tw->handle);
+    tw->handle = -1;
+    PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
+}
+
+/* in polled mode, wait up to timeout milliseconds (indefinitely if it's
+ * negative) for network input, and dispatch it.  the application's thread
+ * does this in mystack_poll(), in place of the engine's thread.
+ */
+int _network_poll_recv(int timeout)
+{
+    bool_t started;
+
+    assert(_mysock_stack_polled());
+
+    PTHREAD_CALL(pthread_mutex_lock(&recv_engine_lock));
+    started = recv_engine_started;
+    PTHREAD_CALL(pthread_mutex_unlock(&recv_engine_lock));
+
+    if (!started)
+    {
+        /* nothing to watch yet */
+        (void) poll(NULL, 0, timeout);
+        return 0;
+    }
+
+    return _network_recv_wait(&recv_threads[0], timeout);
+}
+
+/* wait up to timeout milliseconds (indefinitely if it's negative) for data
+ * to arrive on any of the sockets watched by this engine thread, and buffer
+ * it for later consumption by network_recv().  returns the number of
+ * sockets that had input.
+ */
+static int _network_recv_wait(network_recv_thread_t *thread, int timeout)
+{
+#ifdef LINUX
+    struct epoll_event events[NETWORK_RECV_MAX_EVENTS];
+    int k, num_events;
+
+    if ((num_events = epoll_wait(thread->epoll_fd, events,
+                                 ARRAY_DIM(events), timeout)) < 0)
+    {
+        assert(errno == EINTR);
+        return 0;
+    }
+
+    for (k = 0; k < num_events; ++k)
+        _network_recv_event(thread, events[k].data.u64);
+    return num_events;
+#else
+    unsigned int k, num_fds = 1;
+    int rc, num_events = 0;
+
+    /* the poll set is rebuilt each time around, as watches come and go.
+     * the wake pipe interrupts poll() if one is added meanwhile.
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&thread->lock));
+    if (thread->fds_capacity < thread->num_slots + 1)
+    {
+        thread->fds_capacity = thread->num_slots + 1;
+        thread->fds  = (struct pollfd *)
+            realloc(thread->fds, thread->fds_capacity * sizeof(*thread->fds));
+        thread->keys = (uint64_t *)
+            realloc(thread->keys,
+                    thread->fds_capacity * sizeof(*thread->keys));
+        assert(thread->fds && thread->keys);
+    }
+
+    thread->fds[0].fd     = thread->wake_pipe[WAKE_PIPE_READ_INDEX];
+    thread->fds[0].events = POLLIN;
+    for (k = 0; k < thread->num_slots; ++k)
+    {
+        const network_watch_slot_t *slot = &thread->slots[k];
+
+        if (!slot->watch && !slot->time_wait)
+            continue;
+
+        thread->fds[num_fds].fd     = slot->watch ? slot->watch->socket
+                                                  : slot->time_wait->handle;
+        thread->fds[num_fds].events = POLLIN;
+        thread->keys[num_fds] = ((uint64_t) slot->generation << 32) | k;
+        ++num_fds;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&thread->lock));
+
+    if ((rc = poll(thread->fds, num_fds, timeout)) < 0)
+    {
+        assert(errno == EINTR);
+        return 0;
+    }
+
+    if (thread->fds[0].revents)
+    {
+        char dummy[64];
+        while (read(thread->fds[0].fd, dummy, sizeof(dummy)) > 0)
+            ;
+    }
+
+    for (k = 1; k < num_fds; ++k)
+    {
+        if (thread->fds[k].revents)
+        {
+            _network_recv_event(thread, thread->keys[k]);
+            ++num_events;
         }
     }
+    return num_events;
+#endif
+}
+
+/* process network input.
+ * this just loops around, waiting for data to arrive on any of the sockets
+ * watched by this engine thread, and buffering it for later consumption by
+ * network_recv().  (outgoing data is sent immediately via network_send(),
+ * and so does not require its own thread).
+ *
+ * the transport worker running each mysocket is told when packets are
+ * queued here, so the transport doesn't depend on which I/O mechanism is
+ * used to wait for them.
+ */
+static void *network_recv_thread_func(void *arg_ptr)
+{
+    network_recv_thread_t *thread = (network_recv_thread_t *) arg_ptr;
+
+    DEBUG_LOG(("started receive thread\n"));
+    assert(thread);
+
+    for (;;)
+        (void) _network_recv_wait(thread, -1);
 
     return NULL;
 }
@@ -309,15 +1069,6 @@ _network_alloc_context_socket(int socket_type, size_t ctx_len)
         ctx = NULL;
     }
 
-    ctx->exit_pipe[0] = ctx->exit_pipe[1] = -1;
-    if (pipe(ctx->exit_pipe) < 0)
-    {
-        perror("pipe");
-        assert(0);
-        _network_destroy_context_socket(ctx);
-        ctx = NULL;
-    }
-
     return ctx;
 }
 
@@ -332,18 +1083,6 @@ static void _network_destroy_context_socket(network_context_socket_t *ctx)
         ctx->socket = -1;
     }
 
-    if (ctx->exit_pipe[0] >= 0)
-    {
-        close(ctx->exit_pipe[0]);
-        ctx->exit_pipe[0] = -1;
-    }
-
-    if (ctx->exit_pipe[1] >= 0)
-    {
-        close(ctx->exit_pipe[1]);
-        ctx->exit_pipe[1] = -1;
-    }
-
     free(ctx);
 }
 
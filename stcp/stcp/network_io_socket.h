@@ -16,16 +16,48 @@
 
 typedef int socket_t;
 
+struct network_recv_thread;
+
+/* a socket watched by the network receive engine (see network_io_socket.c).
+ * there's one for each mysocket receiving from the network, and one for
+ * each connection a listening mysocket has accepted but not yet received
+ * a SYN on.  all fields but the receive buffer are owned by the engine.
+ */
+typedef struct network_watch
+{
+    socket_t                    socket;
+    struct mysock_context      *sock_ctx;   /* mysocket packets go to */
+    struct network_recv_thread *thread;     /* engine thread watching it */
+    unsigned int                engine_id;  /* engine thread belongs to */
+    unsigned int                slot;       /* in thread's table, if watched */
+    bool_t                      busy;       /* packets being dispatched? */
+
+    /* a listening mysocket's pending connections.  a pending watch's
+     * socket passes to the new mysocket once its SYN has been queued.
+     */
+    bool_t                      pending;
+    bool_t                      removed;    /* by _network_stop_recv() */
+    struct network_watch       *pending_head;
+    struct network_watch       *pending_prev, *pending_next;
+    struct sockaddr             peer_addr;  /* pending connection's peer */
+    socklen_t                   peer_addr_len;
+
+    /* input received but not yet returned by _network_recv_packet().  a
+     * stream-based implementation uses this to reassemble packets.
+     */
+    size_t buf_start;
+    size_t buf_len;
+    size_t discard_len; /* remainder of an oversized packet to skip */
+    char   buf[4 * (sizeof(uint16_t) + MAX_IP_PAYLOAD_LEN)];
+} network_watch_t;
+
 /* socket-based network layer additional state.
  * this is pointed to by impl_data in the network_context_t structure.
  */
 typedef struct
 {
-    pthread_t          recv_thread;
-    bool_t             recv_thread_started;
-
     socket_t           socket;  /* socket used for communication to peer */
-    int                exit_pipe[2];    /* used to wake up read thread */
+    network_watch_t    watch;   /* socket's entry in the receive engine */
 } network_context_socket_t;
 
 typedef network_context_socket_t network_context_socket_udp_t;
@@ -36,7 +68,8 @@ typedef struct
 
     /* additional state required by TCP-based network layer */
     mysock_context_t *sock_ctx;
-    socket_t          new_socket;   /* temporary result of accept() */
+    socket_t          new_socket;   /* accepted socket whose SYN is being
+                                     * dispatched (owned by its watch) */
     pthread_mutex_t   connect_lock;
     bool_t            connected;
 } network_context_socket_tcp_t;
@@ -62,18 +95,58 @@ int _network_init_socket(mysock_context_t  *sock_ctx,
                          int                type,
                          size_t             ctx_len);
 
+int _network_reinit_socket(mysock_context_t  *sock_ctx,
+                           network_context_t *net_ctx,
+                           int                type);
+
 void _network_close_socket(network_context_t *net_ctx);
+void _network_recycle_socket(network_context_t *net_ctx);
 
 int _network_bind_socket(network_context_t *ctx,
                          struct sockaddr   *addr,
                          int                addrlen);
 
 
-/* this is not called directly.  use network_start_recv_thread() and
- * network_stop_recv_thread() instead.
+/* the following are provided by the underlying I/O implementation for the
+ * network receive engine, and are not called directly.  use
+ * _network_start_recv() and _network_stop_recv() instead.
+ */
+
+/* ready the given mysocket's socket for the engine to watch, e.g. by
+ * connecting it to the peer.
+ */
+int _network_prepare_recv(network_context_t *ctx);
+
+/* return the next packet received on the given watch, without blocking.
+ * *packet is set to point at it; it remains valid until the next call.
+ * returns the packet's length, 0 if the peer has closed the socket, or -1
+ * with errno set (to EAGAIN if no complete packet has arrived yet).
  */
 ssize_t _network_recv_packet(network_context_t *ctx,
-                             void *dst, size_t max_len);
+                             network_watch_t   *watch,
+                             const void       **packet);
+
+/* watch a connection accepted on a listening mysocket's watch until its
+ * SYN packet arrives.  this must only be called from within
+ * _network_recv_packet() on the listening mysocket's own watch.
+ */
+void _network_watch_pending(network_watch_t       *listen_watch,
+                            socket_t               sd,
+                            const struct sockaddr *peer_addr,
+                            socklen_t              peer_addr_len);
+
+/* as _network_recv_packet(), for a TIME_WAIT channel.  *header is set to
+ * point at up to the first *header_len bytes of the packet (at least its
+ * STCP header, if it's that long); the rest isn't kept.  returns the
+ * packet's whole length, 0 if the peer has closed the channel, or -1 with
+ * errno set.
+ */
+ssize_t _network_recv_time_wait(network_time_wait_t *tw,
+                                const void         **header,
+                                size_t              *header_len);
+
+/* start watching a TIME_WAIT channel, from _network_time_wait_start() */
+void _network_watch_time_wait(network_time_wait_t *tw);
 
 
 #endif  /* __NETWORK_IO_SOCKET_H__ */
@@ -5,9 +5,12 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdlib.h>
-#include <alloca.h>
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "network_io_socket.h"
@@ -18,7 +21,12 @@
 typedef ssize_t (*io_func_t)(socket_t sd, void *buf, size_t count);
 
 static int _tcp_io(socket_t, void *, size_t, io_func_t);
+static int _tcp_writev(socket_t, struct iovec *, int);
 static int _tcp_connect(network_context_t *ctx);
+static ssize_t _tcp_accept(network_context_t *ctx, network_watch_t *watch);
+static void _tcp_init_context(mysock_context_t  *sock_ctx,
+                              network_context_t *net_ctx);
+static void _tcp_set_nodelay(socket_t tcp_sd);
 
 
 /* a few words about using TCP to emulate the underlying datagram
@@ -33,6 +41,13 @@ static int _tcp_connect(network_context_t *ctx);
  *   - the passive side dispatches the SYN packet to the right STCP
  *     context, and updates the new context's TCP socket to be that of the
  *     newly accepted (real TCP) connection.
+ *   - each packet is preceded on the TCP connection by its length.  as the
+ *     network receive engine reads without blocking, a packet may arrive
+ *     in pieces; these are reassembled in the socket's watch.
+ *   - Nagle's algorithm is turned off on every TCP socket, as each write
+ *     is a whole packet that should go out at once.  otherwise a small
+ *     packet sent right after another (e.g. a FIN after an ACK) is held
+ *     until the peer's delayed ACK of the first.
  */
 
 
@@ -54,13 +69,56 @@ int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
     tcp_io_ctx = (network_context_socket_tcp_t *) net_ctx->impl_data;
     assert(tcp_io_ctx);
 
+    PTHREAD_CALL(pthread_mutex_init(&tcp_io_ctx->connect_lock, NULL));
+    _tcp_init_context(sock_ctx, net_ctx);
+
+    return 0;
+}
+
+/* as _network_init(), for a context last released with _network_recycle().
+ * its allocation and connect_lock are reused.
+ */
+int _network_reinit(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    int rc;
+
+    assert(sock_ctx && net_ctx);
+    if ((rc = _network_reinit_socket(sock_ctx, net_ctx, SOCK_STREAM)) < 0)
+        return rc;
+
+    _tcp_init_context(sock_ctx, net_ctx);
+    return 0;
+}
+
+static void _tcp_init_context(mysock_context_t  *sock_ctx,
+                              network_context_t *net_ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx =
+        (network_context_socket_tcp_t *) net_ctx->impl_data;
+
+    assert(tcp_io_ctx);
+
     tcp_io_ctx->sock_ctx = sock_ctx;
     tcp_io_ctx->new_socket = -1;
     tcp_io_ctx->connected = FALSE;
+    _tcp_set_nodelay(GET_SOCKET(net_ctx));
 
-    PTHREAD_CALL(pthread_mutex_init(&tcp_io_ctx->connect_lock, NULL));
+    /* the kernel's TCP checksum already protects every packet */
+    net_ctx->checksum_trusted = TRUE;
+}
 
-    return 0;
+/* the accepted socket in new_socket, if any, belongs to its watch */
+void _network_recycle(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+
+    assert(ctx);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+
+    tcp_io_ctx->new_socket = -1;
+    _network_recycle_socket(ctx);
 }
 
 void _network_close(network_context_t *ctx)
@@ -72,13 +130,6 @@ void _network_close(network_context_t *ctx)
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
     assert(tcp_io_ctx);
 
-    if (tcp_io_ctx->new_socket != -1)
-    {
-        DEBUG_LOG(("closing TCP network layer socket %d...\n",
-                   (int) tcp_io_ctx->new_socket));
-        closesocket(tcp_io_ctx->new_socket);
-    }
-
     PTHREAD_CALL(pthread_mutex_destroy(&tcp_io_ctx->connect_lock));
 
     _network_close_socket(ctx);
@@ -126,10 +177,49 @@ void _network_update_passive_state(network_context_t *new_ctx,
     new_tcp_ctx->base.socket = accept_tcp_ctx->new_socket;
     new_tcp_ctx->connected = TRUE;
     accept_tcp_ctx->new_socket = -1;
+
+    /* the new context now talks over a different socket */
+    _network_invalidate_local_info(new_ctx);
     DEBUG_LOG(("passed accepted socket %d on to new context...\n",
                new_tcp_ctx->base.socket));
 }
 
+/* the connection request's socket is still the one in new_socket, as it
+ * remains pending (and watched by the listening socket) until a request on
+ * it is queued.
+ */
+ssize_t _network_reply_passive(network_context_t *accept_ctx,
+                               void *user_data,
+                               const struct sockaddr *peer_addr,
+                               int peer_addr_len,
+                               const void *src, size_t len)
+{
+    network_context_socket_tcp_t *accept_tcp_ctx;
+    uint16_t packet_len;    /* network byte order */
+
+    assert(accept_ctx && src && peer_addr);
+    assert(peer_addr_len > 0);
+    assert(!user_data);
+
+    accept_tcp_ctx = (network_context_socket_tcp_t *) accept_ctx->impl_data;
+    assert(accept_tcp_ctx);
+
+    if (accept_tcp_ctx->new_socket < 0)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    packet_len = htons(len);
+    if (_tcp_io(accept_tcp_ctx->new_socket, &packet_len, sizeof(packet_len),
+                (io_func_t) write) < 0 ||
+        _tcp_io(accept_tcp_ctx->new_socket, (void *) src, len,
+                (io_func_t) write) < 0)
+        return -1;
+
+    return len;
+}
+
 
 /* send the given packet to the peer */
 ssize_t _network_send_packet(network_context_t *ctx,
@@ -159,83 +249,412 @@ ssize_t _network_send_packet(network_context_t *ctx,
     return len;
 }
 
-/* read a packet from the peer */
-ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
+/* send a batch of packets to the peer.  each packet is framed by its
+ * length, as in _network_send_packet(), but the whole batch goes out with
+ * a single writev().
+ */
+ssize_t _network_send_packets(network_context_t *ctx,
+                              const void *const *srcs, const size_t *lens,
+                              unsigned int num_packets)
+{
+    uint16_t     packet_lens[MAX_PACKET_BATCH];  /* network byte order */
+    struct iovec iov[2 * MAX_PACKET_BATCH];
+    ssize_t      total_len = 0;
+    unsigned int k;
+
+    assert(ctx && srcs && lens);
+    assert(num_packets <= MAX_PACKET_BATCH);
+    assert(ctx->peer_addr_len > 0);
+
+    VERIFY_SOCKET(ctx);
+    DEBUG_PEER(ctx);
+
+    if (num_packets == 0)
+        return 0;
+
+    if (_tcp_connect(ctx) < 0)
+        return -1;
+
+    for (k = 0; k < num_packets; ++k)
+    {
+        assert(srcs[k]);
+        packet_lens[k] = htons(lens[k]);
+
+        iov[2 * k].iov_base     = &packet_lens[k];
+        iov[2 * k].iov_len      = sizeof(packet_lens[k]);
+        iov[2 * k + 1].iov_base = (void *) srcs[k];
+        iov[2 * k + 1].iov_len  = lens[k];
+        total_len += lens[k];
+    }
+
+    if (_tcp_writev(GET_SOCKET(ctx), iov, 2 * num_packets) < 0)
+        return -1;
+
+    return total_len;
+}
+
+/* ready a mysocket's socket for the network receive engine.  an active
+ * mysocket's socket must be connected before there's anything to wait for,
+ * and a listening one's must not block in accept().
+ */
+int _network_prepare_recv(network_context_t *ctx)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
-    uint16_t packet_len;
-    socket_t io_socket;
-    int rc;
 
-    assert(ctx && dst);
+    assert(ctx);
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
     assert(tcp_io_ctx);
     assert(tcp_io_ctx->sock_ctx);
 
     VERIFY_SOCKET(ctx);
-    io_socket = tcp_io_ctx->base.socket;
+    if (tcp_io_ctx->sock_ctx->is_active)
+        return _tcp_connect(ctx);
 
-    if (tcp_io_ctx->sock_ctx->is_active && _tcp_connect(ctx) < 0)
-        return -1;
+    if (tcp_io_ctx->sock_ctx->listening)
+    {
+        int flags = fcntl(GET_SOCKET(ctx), F_GETFL);
+
+        if (flags < 0 ||
+            fcntl(GET_SOCKET(ctx), F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+            perror("fcntl (network_io_tcp)");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* read the next packet from the peer, if it's all arrived.  on a listening
+ * mysocket's own watch, this instead accepts new connections, each of which
+ * is watched until its SYN arrives; that's then returned with new_socket and
+ * the peer address set, ready for _network_update_passive_state().
+ */
+ssize_t _network_recv_packet(network_context_t *ctx,
+                             network_watch_t   *watch,
+                             const void       **packet)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+
+    assert(ctx && watch && packet);
 
-    if (tcp_io_ctx->sock_ctx->listening/* ||
-        (tcp_io_ctx->sock_ctx->is_active && !tcp_io_ctx->connected)*/)
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+    assert(tcp_io_ctx->sock_ctx);
+
+    if (tcp_io_ctx->sock_ctx->listening && !watch->pending)
+        return _tcp_accept(ctx, watch);
+
+    for (;;)
     {
-        socket_t tmp_sd;
+        size_t buffered = watch->buf_len - watch->buf_start;
+        size_t wanted;
+        ssize_t rc;
 
-        ctx->peer_addr_len = sizeof(ctx->peer_addr);
-        if ((tmp_sd = accept(GET_SOCKET(ctx),
-                             &ctx->peer_addr,
-                             &ctx->peer_addr_len)) < 0)
+        if (watch->discard_len > 0)
         {
-            perror("accept (network_io_tcp)");
-            return tmp_sd;
+            /* skip (what's arrived of) a packet too large to deliver */
+            size_t discarded = MIN(buffered, watch->discard_len);
+
+            watch->buf_start   += discarded;
+            watch->discard_len -= discarded;
+            buffered           -= discarded;
         }
 
-        DEBUG_LOG(("accepted from peer, tmp_sd=%d...\n", (int) tmp_sd));
+        if (watch->discard_len == 0 && buffered >= sizeof(uint16_t))
+        {
+            const char *frame = watch->buf + watch->buf_start;
+            uint16_t packet_len;
+
+            memcpy(&packet_len, frame, sizeof(packet_len));
+            packet_len = ntohs(packet_len);
+
+            if (packet_len > MAX_IP_PAYLOAD_LEN)
+            {
+                DEBUG_LOG(("discarding %u byte packet\n",
+                           (unsigned int) packet_len));
+                watch->buf_start  += sizeof(packet_len);
+                watch->discard_len = packet_len;
+                continue;
+            }
+
+            if (buffered >= sizeof(packet_len) + packet_len)
+            {
+                watch->buf_start += sizeof(packet_len) + packet_len;
+                *packet = frame + sizeof(packet_len);
+
+                if (watch->pending)
+                {
+                    /* the SYN on a newly accepted connection */
+                    tcp_io_ctx->new_socket = watch->socket;
+                    ctx->peer_addr         = watch->peer_addr;
+                    ctx->peer_addr_len     = watch->peer_addr_len;
+                    DEBUG_PEER(ctx);
+                }
+
+                return packet_len;
+            }
+
+            wanted = sizeof(packet_len) + packet_len - buffered;
+        }
+        else
+        {
+            wanted = watch->discard_len
+                ? MIN(watch->discard_len, sizeof(watch->buf))
+                : sizeof(uint16_t) - buffered;
+        }
 
-        /* keep listening socket open for futher connection requests */
-        /* we will not reenter this function until this SYN packet has
-         * been dispatched to the right context, and that context's
-         * socket updated to be 'new_socket'
+        /* move the partial packet to the front of the buffer, and read as
+         * much more as fits.  a pending connection's socket is read only up
+         * to the end of its SYN, as whatever follows belongs to the new
+         * mysocket.
          */
-        assert(tcp_io_ctx->new_socket == -1);
-        tcp_io_ctx->new_socket = tmp_sd;
-        io_socket = tmp_sd;
+        if (watch->buf_start > 0)
+        {
+            memmove(watch->buf, watch->buf + watch->buf_start, buffered);
+            watch->buf_start = 0;
+            watch->buf_len   = buffered;
+        }
+
+        if (!watch->pending)
+            wanted = sizeof(watch->buf) - buffered;
+        assert(wanted > 0 && buffered + wanted <= sizeof(watch->buf));
+
+        if ((rc = recv(watch->socket, watch->buf + buffered, wanted,
+                       MSG_DONTWAIT)) <= 0)
+        {
+            DEBUG_LOG(("couldn't read packet: %d\n", (int) rc));
+            return rc;
+        }
+
+        watch->buf_len += rc;
     }
+}
 
-    DEBUG_PEER(ctx);
+/* keep a closed mysocket's TCP connection open as its TIME_WAIT channel.
+ * the peer's stream is picked up wherever the mysocket's watch left off;
+ * anything already buffered there arrived before the mysocket closed, so
+ * it's skipped.
+ */
+int _network_time_wait_start(network_context_t *ctx, network_time_wait_t *tw)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    network_watch_t *watch;
+    const char *frame;
+    size_t buffered;
 
-#ifdef DEBUG
-    if (getpeername(io_socket, &ctx->peer_addr, &ctx->peer_addr_len) < 0)
-    {
-        DEBUG_LOG(("getpeername failed (errno=%d)\n", errno));
+    assert(ctx && tw);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+
+    watch = &tcp_io_ctx->base.watch;
+    assert(!watch->thread);
+
+    if (!tcp_io_ctx->connected || tcp_io_ctx->base.socket < 0)
         return -1;
+
+    memset(tw, 0, sizeof(*tw));
+    tw->handle = tcp_io_ctx->base.socket;
+    tw->slot   = (unsigned int) -1;
+    tcp_io_ctx->base.socket = -1;
+
+    buffered = watch->buf_len - watch->buf_start;
+    frame    = watch->buf + watch->buf_start;
+    if (watch->discard_len > buffered)
+    {
+        tw->skip_len = watch->discard_len - buffered;
+        buffered = 0;
+    }
+    else
+    {
+        frame    += watch->discard_len;
+        buffered -= watch->discard_len;
     }
-#endif
 
-    if ((rc = _tcp_io(io_socket, &packet_len, sizeof(packet_len), read)) <= 0)
+    while (buffered >= sizeof(uint16_t))
     {
-        DEBUG_LOG(("couldn't read packet len: %d\n", rc));
-        return rc;
+        uint16_t packet_len;
+
+        memcpy(&packet_len, frame, sizeof(packet_len));
+        packet_len = ntohs(packet_len);
+        frame    += sizeof(packet_len);
+        buffered -= sizeof(packet_len);
+
+        if (packet_len > buffered)
+        {
+            tw->skip_len = packet_len - buffered;
+            buffered = 0;
+            break;
+        }
+
+        frame    += packet_len;
+        buffered -= packet_len;
     }
 
-    packet_len = ntohs(packet_len);
-    if ((rc = _tcp_io(io_socket, dst, MIN(packet_len, max_len), read)) <= 0)
+    if (buffered > 0)
     {
-        DEBUG_LOG(("couldn't read packet: %d\n", rc));
-        return rc;
+        memcpy(tw->partial, frame, buffered);
+        tw->partial_len = buffered;
     }
 
-    if (packet_len > max_len)
+    _network_watch_time_wait(tw);
+    return 0;
+}
+
+/* only the start of each packet is read into the channel's partial buffer,
+ * as far as the header; the rest of it is skipped.
+ */
+ssize_t _network_recv_time_wait(network_time_wait_t *tw,
+                                const void         **header,
+                                size_t              *header_len)
+{
+    assert(tw && header && header_len);
+    assert(tw->handle >= 0);
+
+    for (;;)
     {
-        /* discard unread remainder of packet */
-        char *dummy = (char *) alloca(packet_len - max_len);
-        (void) _tcp_io(io_socket, dummy, packet_len - max_len, read);
+        const size_t max_header = sizeof(tw->partial) - sizeof(uint16_t);
+        size_t wanted;
+        ssize_t rc;
+
+        if (tw->skip_len > 0)
+        {
+            char scratch[MAX_IP_PAYLOAD_LEN];
+
+            if ((rc = recv(tw->handle, scratch,
+                           MIN(tw->skip_len, sizeof(scratch)),
+                           MSG_DONTWAIT)) <= 0)
+                return rc;
+
+            tw->skip_len -= rc;
+            continue;
+        }
+
+        if (tw->partial_len < sizeof(uint16_t))
+        {
+            wanted = sizeof(uint16_t) - tw->partial_len;
+        }
+        else
+        {
+            uint16_t packet_len;
+            size_t header_wanted;
+
+            memcpy(&packet_len, tw->partial, sizeof(packet_len));
+            packet_len    = ntohs(packet_len);
+            header_wanted = MIN(packet_len, max_header);
+
+            if (packet_len == 0 || packet_len > MAX_IP_PAYLOAD_LEN)
+            {
+                /* nothing that could be an STCP segment */
+                tw->skip_len    = packet_len;
+                tw->partial_len = 0;
+                continue;
+            }
+
+            if (tw->partial_len == sizeof(packet_len) + header_wanted)
+            {
+                *header     = tw->partial + sizeof(packet_len);
+                *header_len = header_wanted;
+                tw->skip_len    = packet_len - header_wanted;
+                tw->partial_len = 0;
+                return packet_len;
+            }
+
+            wanted = sizeof(packet_len) + header_wanted - tw->partial_len;
+        }
+
+        if ((rc = recv(tw->handle, tw->partial + tw->partial_len, wanted,
+                       MSG_DONTWAIT)) <= 0)
+            return rc;
+
+        tw->partial_len += rc;
     }
+}
+
+/* send a packet on a TIME_WAIT channel, framed as in _network_send_packet() */
+ssize_t _network_time_wait_send(network_time_wait_t *tw,
+                                const void *src, size_t len)
+{
+    uint16_t packet_len;    /* network byte order */
+    struct iovec iov[2];
+
+    assert(tw && src);
 
-    return packet_len;
+    if (tw->handle < 0)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    packet_len = htons(len);
+    iov[0].iov_base = &packet_len;
+    iov[0].iov_len  = sizeof(packet_len);
+    iov[1].iov_base = (void *) src;
+    iov[1].iov_len  = len;
+
+    if (_tcp_writev(tw->handle, iov, 2) < 0)
+        return -1;
+
+    return len;
+}
+
+/* accept any new connections on a listening mysocket.  returns -1 with
+ * errno set to EAGAIN once there are none left, or with some other error if
+ * the listening socket failed.
+ */
+static ssize_t _tcp_accept(network_context_t *ctx, network_watch_t *watch)
+{
+    assert(ctx && watch);
+
+    for (;;)
+    {
+        struct sockaddr peer_addr;
+        socklen_t peer_addr_len = sizeof(peer_addr);
+        socket_t tmp_sd;
+
+        if ((tmp_sd = accept(watch->socket,
+                             &peer_addr, &peer_addr_len)) < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                errno == EINTR || errno == ECONNABORTED)
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+
+            perror("accept (network_io_tcp)");
+            return -1;
+        }
+
+        DEBUG_LOG(("accepted from peer, tmp_sd=%d...\n", (int) tmp_sd));
+
+#ifndef LINUX
+        /* some systems pass O_NONBLOCK on from the listening socket, but
+         * the new mysocket writes to this one with blocking I/O.
+         */
+        {
+            int flags = fcntl(tmp_sd, F_GETFL);
+            if (flags >= 0)
+                (void) fcntl(tmp_sd, F_SETFL, flags & ~O_NONBLOCK);
+        }
+#endif
+        _tcp_set_nodelay(tmp_sd);
+
+        _network_watch_pending(watch, tmp_sd, &peer_addr, peer_addr_len);
+    }
+}
+
+static void _tcp_set_nodelay(socket_t tcp_sd)
+{
+    int on = 1;
+
+    if (setsockopt(tcp_sd, IPPROTO_TCP, TCP_NODELAY,
+                   (const char *) &on, sizeof(on)) < 0)
+    {
+        DEBUG_LOG(("couldn't set TCP_NODELAY on socket %d\n", (int) tcp_sd));
+    }
 }
 
 
@@ -264,6 +683,38 @@ static int _tcp_io(socket_t tcp_sd, void *buf, size_t count, io_func_t io_func)
     return count;
 }
 
+/* write out all of the given buffers, resuming after short writes */
+static int _tcp_writev(socket_t tcp_sd, struct iovec *iov, int iovcnt)
+{
+    assert(iov && iovcnt > 0);
+    while (iovcnt > 0)
+    {
+        ssize_t rc;
+
+        if ((rc = writev(tcp_sd, iov, iovcnt)) <= 0)
+        {
+            DEBUG_LOG(("_tcp_writev rc: %d\n", (int) rc));
+            return -1;
+        }
+
+        /* skip past the buffers that were written completely */
+        while (iovcnt > 0 && (size_t) rc >= iov->iov_len)
+        {
+            rc -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return 0;
+}
+
 static int _tcp_connect(network_context_t *ctx)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
@@ -287,6 +738,7 @@ static int _tcp_connect(network_context_t *ctx)
         {
             perror("connect (_tcp_connect)");
             fprintf(stderr, "(errno=%d)\n", errno);
+            PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
             return -1;
         }
 
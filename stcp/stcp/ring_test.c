@@ -0,0 +1,129 @@
+/* ring_test.c--stress test for the network receive ring.
+ *
+ * a producer thread pushes packets of varying length through a context's
+ * packet_ring_t with _mysock_ring_enqueue(), retrying whenever the ring is
+ * full, while the main thread takes them off in batches with
+ * _mysock_ring_dequeue_batch() and checks that every packet arrives once,
+ * in order and intact.  the producer pauses now and then, so the consumer
+ * also goes to sleep on data_ready_cond and has to be woken.
+ *
+ * usage: ring_test [packets]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "mysock_impl.h"
+
+
+#define RING_TEST_BATCH     16
+#define RING_TEST_MIN_LEN   sizeof(unsigned int)
+#define RING_TEST_PAUSE     4096    /* producer pauses every so many */
+
+static mysock_context_t *ctx;
+static unsigned int num_packets;
+static unsigned long full_retries;
+
+
+/* the length and contents of packet k are a function of k alone */
+static size_t packet_len(unsigned int k)
+{
+    return RING_TEST_MIN_LEN +
+           (k * 2654435761u >> 7) % (MAX_IP_PAYLOAD_LEN - RING_TEST_MIN_LEN + 1);
+}
+
+static void fill_packet(char *packet, unsigned int k)
+{
+    size_t j, len = packet_len(k);
+
+    memcpy(packet, &k, sizeof(k));
+    for (j = sizeof(k); j < len; ++j)
+        packet[j] = (char) (k + j);
+}
+
+static void *producer_func(void *arg)
+{
+    char packet[MAX_IP_PAYLOAD_LEN];
+    unsigned int k;
+
+    for (k = 0; k < num_packets; ++k)
+    {
+        fill_packet(packet, k);
+        while (!_mysock_ring_enqueue(ctx, &ctx->network_recv_queue,
+                                     packet, packet_len(k)))
+        {
+            ++full_retries;
+            sched_yield();
+        }
+
+        if (k % RING_TEST_PAUSE == RING_TEST_PAUSE - 1)
+            usleep(100);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    static char batch[RING_TEST_BATCH][MAX_IP_PAYLOAD_LEN];
+    char expected[MAX_IP_PAYLOAD_LEN];
+    size_t lens[RING_TEST_BATCH];
+    unsigned int next = 0, n, k;
+    unsigned long errors = 0;
+    pthread_t producer;
+
+    num_packets = (argc > 1) ? (unsigned int) atoi(argv[1]) : 1000000;
+
+    ctx = (mysock_context_t *) calloc(1, sizeof(*ctx));
+    assert(ctx);
+    PTHREAD_CALL(pthread_mutex_init(&ctx->data_ready_lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&ctx->data_ready_cond, NULL));
+
+    PTHREAD_CALL(pthread_create(&producer, NULL, producer_func, NULL));
+
+    while (next < num_packets && errors < 20)
+    {
+        n = _mysock_ring_dequeue_batch(ctx, &ctx->network_recv_queue,
+                                       batch, sizeof(batch[0]), lens,
+                                       RING_TEST_BATCH);
+        assert(n > 0 && n <= RING_TEST_BATCH);
+
+        for (k = 0; k < n; ++k, ++next)
+        {
+            fill_packet(expected, next);
+            if (lens[k] != packet_len(next) ||
+                memcmp(batch[k], expected, lens[k]) != 0)
+            {
+                unsigned int got;
+
+                memcpy(&got, batch[k], sizeof(got));
+                fprintf(stderr, "packet %u: got packet %u, %u bytes "
+                        "(expected %u)\n", next, got, (unsigned) lens[k],
+                        (unsigned) packet_len(next));
+                ++errors;
+            }
+        }
+    }
+
+    PTHREAD_CALL(pthread_join(producer, NULL));
+
+    if (!errors && ctx->network_recv_queue.tail != ctx->network_recv_queue.head)
+    {
+        fprintf(stderr, "ring not empty after the last packet\n");
+        ++errors;
+    }
+
+    printf("ring_test: %u packets, %lu ring-full retries: %s\n",
+           next, full_retries, errors ? "FAILED" : "ok");
+
+    free(ctx->network_recv_queue.slots);
+    PTHREAD_CALL(pthread_cond_destroy(&ctx->data_ready_cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&ctx->data_ready_lock));
+    free(ctx);
+    return errors ? 1 : 0;
+}
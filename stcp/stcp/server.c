@@ -42,6 +42,7 @@ main(int argc, char *argv[])
     int len, opt, errflg = 0;
     char localname[256];
     bool_t reliable = TRUE;
+    int defer_accept = 10;  /* seconds */
 
 
     /* Parse the command line */
@@ -83,11 +84,21 @@ main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    if (mylisten(bindsd, 5) < 0)
+    if (mylisten(bindsd, MYSOMAXCONN) < 0)
     {
         perror("mylisten");
         exit(EXIT_FAILURE);
     }
+
+    /* the client speaks first, so there's nothing to do with a connection
+     * until its request arrives.
+     */
+    if (mysetsockopt(bindsd, IPPROTO_TCP, MYTCP_DEFER_ACCEPT,
+                     &defer_accept, sizeof(defer_accept)) < 0)
+    {
+        perror("mysetsockopt");
+        exit(EXIT_FAILURE);
+    }
     if (local_name(bindsd, localname) < 0)
     {
         perror("local_name");
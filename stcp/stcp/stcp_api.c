@@ -2,6 +2,7 @@
 
 #include <pthread.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
@@ -16,7 +17,11 @@
 #include "transport.h"
 
 
-/* called by the transport layer thread to unblock the calling application,
+static void _stcp_fill_header(mysock_context_t *ctx, char *packet,
+                              size_t packet_len, uint16_t local_port);
+static void _stcp_set_header_checksum(mysock_context_t *ctx, char *packet);
+
+/* called by the transport layer to unblock the calling application,
  * e.g. when the connection is complete, or when an error is detected while
  * attempting to make the connection.  before calling this, the STCP layer may
  * set errno as it wishes to indicate any error to the calling application.
@@ -40,90 +45,53 @@ void stcp_unblock_application(mysocket_t sd)
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
     PTHREAD_CALL(pthread_cond_signal(&ctx->blocking_cond));
 
+    /* the connection is now writable, or has failed */
+    _mysock_notify(ctx);
+
     if (!ctx->is_active)
     {
-        /* move from incomplete to completed connection queue */
-        _mysock_passive_connection_complete(ctx);
+        struct timespec deadline;
+
+        /* move from incomplete to completed connection queue, unless the
+         * listening socket waits for the peer to send something first.
+         */
+        if (ctx->stcp_errno == 0 &&
+            _mysock_should_defer_accept(ctx, &deadline))
+            _mysock_defer_accept(ctx, &deadline);
+        else
+            _mysock_passive_connection_complete(ctx);
     }
 }
 
 
-/* called by the transport layer to wait for new data, either from the network
- * or from the application, or for the application to request that the
- * mysocket be closed, depending on the value of flags.  abstime is the
- * absolute time at which the function should quit waiting; if NULL, it blocks
- * indefinitely until data arrives.
- *
- * sd is the mysocket descriptor for the connection of interest.
- *
- * returns bit vector corresponding to application/network data being ready,
- * of the same format as the flags passed (see the enum in stcp_api.h).
+/* called by the transport layer to say which events it waits for next on
+ * the mysocket: new data, either from the network or from the application,
+ * the application requesting that the mysocket be closed, or a timeout at
+ * abstime (if not NULL), depending on the value of flags.  the transport
+ * worker running the connection passes them to transport_handle_event()
+ * once they occur.
  */
-unsigned int stcp_wait_for_event(mysocket_t             sd,
-                                 unsigned int           flags,
-                                 const struct timespec *abstime)
+void stcp_request_event(mysocket_t             sd,
+                        unsigned int           flags,
+                        const struct timespec *abstime)
 {
-    unsigned int rc = 0;
-    mysock_context_t *ctx = _mysock_get_context(sd);
-
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    for (;;)
-    {
-        if ((flags & APP_DATA) && (ctx->app_recv_queue.head != NULL))
-            rc |= APP_DATA;
-
-        if ((flags & NETWORK_DATA) && (ctx->network_recv_queue.head != NULL))
-            rc |= NETWORK_DATA;
-
-        if (/*(flags & APP_CLOSE_REQUESTED) &&*/
-            ctx->close_requested && (ctx->app_recv_queue.head == NULL))
-        {
-            /* we should only wake up on this event once.  also, we don't
-             * pass the close event down to STCP until we've already passed
-             * it all outstanding data from the app.
-             */
-            ctx->close_requested = FALSE;
-            rc |= APP_CLOSE_REQUESTED;
-        }
-
-        if (rc)
-            break;
-
-        if (abstime)
-        {
-            /* wait with timeout */
-            switch (pthread_cond_timedwait(&ctx->data_ready_cond,
-                                           &ctx->data_ready_lock,
-                                           abstime))
-            {
-            case 0: /* some data might be available */
-            case EINTR:
-                break;
-
-            case ETIMEDOUT: /* no data arrived in the specified time */
-                goto done;
-
-            case EINVAL:
-                assert(0);
-                break;
+    _mysock_request_event(_mysock_get_context(sd), flags, abstime);
+}
 
-            default:
-                assert(0);
-                break;
-            }
-        }
-        else
-        {
-            /* block indefinitely */
-            PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
-                                           &ctx->data_ready_lock));
-        }
-    }
+/* called by the transport layer once it's finished with the mysocket */
+void stcp_transport_done(mysocket_t sd)
+{
+    _mysock_get_context(sd)->transport_over = TRUE;
+}
 
-done:
-    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+/* the record's kept once the mysocket is freed; see mysock_time_wait.c */
+void stcp_time_wait(mysocket_t sd, uint32_t local_seq, uint32_t remote_seq)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
 
-    return rc;
+    ctx->time_wait            = TRUE;
+    ctx->time_wait_local_seq  = local_seq;
+    ctx->time_wait_remote_seq = remote_seq;
 }
 
 /* allow STCP implementation to establish a context for a given mysocket
@@ -144,6 +112,20 @@ void *stcp_get_context(mysocket_t sd)
     return ctx->stcp_state;
 }
 
+bool_t stcp_get_syn_ack_sent(mysocket_t sd,
+                             uint32_t *syn_seq, uint32_t *syn_ack_seq)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx && syn_seq && syn_ack_seq);
+    if (!ctx->syn_ack_sent)
+        return FALSE;
+
+    *syn_seq     = ctx->syn_seq;
+    *syn_ack_seq = ctx->syn_ack_seq;
+    return TRUE;
+}
+
 /* stcp_network_recv
  *
  * Receive a datagram from the peer.  The call blocks until data is
@@ -157,14 +139,26 @@ void *stcp_get_context(mysocket_t sd)
  */
 ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
 {
-    ssize_t len = _network_recv(sd, dst, max_len);
-
-    /* checksum should have been verified by underlying network layer in
-     * this implementation.
+    /* the checksum policy was applied as the packet arrived from the
+     * network, so there's nothing more to check here.
      */
-    assert(len <= 0 ||
-           _mysock_verify_checksum(_mysock_get_context(sd), dst, len));
-    return len;
+    return _network_recv(sd, dst, max_len);
+}
+
+/* stcp_network_recv_batch
+ *
+ * Receive all datagrams waiting from the peer (up to max_segs) with a
+ * single pass over the network receive queue.  The call blocks until data
+ * is available.
+ *
+ * This call returns the number of datagrams read into dst; the length of
+ * datagram k is stored in lens[k].
+ */
+int stcp_network_recv_batch(mysocket_t sd, void *dst, size_t seg_len,
+                            size_t *lens, unsigned int max_segs)
+{
+    /* as stcp_network_recv(), checksums have already been verified */
+    return _network_recv_batch(sd, dst, seg_len, lens, max_segs);
 }
 
 /* stcp_network_send()
@@ -196,7 +190,6 @@ ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
     size_t            packet_len;
     const void       *next_buf;
     va_list           argptr;
-    struct tcphdr    *header;
 
     assert(ctx && src);
 
@@ -215,11 +208,130 @@ ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
     }
     va_end(argptr);
 
-    /* fill in fields in the TCP header that aren't handled by students */
+    _stcp_fill_header(ctx, packet, packet_len,
+                      _network_get_port(&ctx->network_state));
+
+    /* th_sum stays zero if the network doesn't need checksums */
+    if (_mysock_checksum_required(ctx))
+    {
+        if (packet_len == sizeof(struct tcphdr))
+            _stcp_set_header_checksum(ctx, packet);
+        else
+            _mysock_set_checksum(ctx, packet, packet_len);
+    }
+
+    return _network_send(sd, packet, packet_len);
+}
+
+/* stcp_network_send_batch()
+ *
+ * Send several datagrams (unreliably) to the peer.  Each entry in segs is
+ * sent exactly as stcp_network_send(sd, segs[k].data, segs[k].len, NULL)
+ * would, but the local port is looked up once for the whole batch, and up
+ * to MAX_PACKET_BATCH datagrams at a time are passed down to the network
+ * layer together.  The payload is summed as it's copied into the packet,
+ * or not at all if the caller has cached its sum from an earlier send (or
+ * if the network doesn't need checksums).
+ *
+ * Returns the total number of bytes transferred on success, or -1 on
+ * failure.
+ */
+ssize_t stcp_network_send_batch(mysocket_t sd, const stcp_segment_t *segs,
+                                unsigned int num_segs)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    char              packets[MAX_PACKET_BATCH][MAX_IP_PAYLOAD_LEN];
+    const void       *bufs[MAX_PACKET_BATCH];
+    size_t            lens[MAX_PACKET_BATCH];
+    uint16_t          local_port;
+    bool_t            checksum_required;
+    ssize_t           total_len = 0;
+    unsigned int      k, n;
+
+    assert(ctx && (segs || !num_segs));
+
+    local_port = _network_get_port(&ctx->network_state);
+    checksum_required = _mysock_checksum_required(ctx);
+
+    while (num_segs > 0)
+    {
+        int rc;
+
+        n = MIN(num_segs, MAX_PACKET_BATCH);
+        for (k = 0; k < n; ++k)
+        {
+            const size_t hdr_len = sizeof(struct tcphdr);
+            const char  *data = (const char *) segs[k].data;
+            stcp_sum_t  *cached_sum = segs[k].payload_sum;
+            uint16_t     payload_sum;
+
+            assert(data);
+            assert(segs[k].len >= hdr_len);
+            assert(segs[k].len <= sizeof(packets[k]));
+
+            memcpy(packets[k], data, hdr_len);
+            _stcp_fill_header(ctx, packets[k], segs[k].len, local_port);
+
+            if (!checksum_required)
+            {
+                /* th_sum stays zero */
+                memcpy(packets[k] + hdr_len, data + hdr_len,
+                       segs[k].len - hdr_len);
+            }
+            else if (segs[k].len == hdr_len)
+            {
+                _stcp_set_header_checksum(ctx, packets[k]);
+            }
+            else
+            {
+                if (cached_sum && *cached_sum != STCP_SUM_UNKNOWN)
+                {
+                    memcpy(packets[k] + hdr_len, data + hdr_len,
+                           segs[k].len - hdr_len);
+                    payload_sum = (uint16_t) *cached_sum;
+                }
+                else
+                {
+                    payload_sum = _mysock_copy_and_sum(packets[k] + hdr_len,
+                                                       data + hdr_len,
+                                                       segs[k].len - hdr_len);
+                    if (cached_sum)
+                        *cached_sum = 0x10000 | payload_sum;
+                }
+
+                _mysock_set_checksum_with_payload_sum(ctx, packets[k],
+                                                      hdr_len, segs[k].len,
+                                                      payload_sum);
+            }
+
+            bufs[k] = packets[k];
+            lens[k] = segs[k].len;
+        }
+
+        if ((rc = _network_send_batch(sd, bufs, lens, n)) < 0)
+            return -1;
+
+        total_len += rc;
+        segs      += n;
+        num_segs  -= n;
+    }
+
+    return total_len;
+}
+
+/* fill in fields in the TCP header that aren't handled by students, other
+ * than the checksum.  local_port is in network byte order.
+ */
+static void _stcp_fill_header(mysock_context_t *ctx, char *packet,
+                              size_t packet_len, uint16_t local_port)
+{
+    struct tcphdr *header;
+
+    assert(ctx && packet);
     assert(packet_len >= sizeof(struct tcphdr));
     header = (struct tcphdr *) packet;
 
-    header->th_sport = _network_get_port(&ctx->network_state);
+    header->th_sport = local_port;
     /* N.B. assert(header->th_sport > 0) fires in the UDP SYN-ACK case */
 
     assert(ctx->network_state.peer_addr.sa_family == AF_INET);
@@ -227,11 +339,52 @@ ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
         ((struct sockaddr_in *) &ctx->network_state.peer_addr)->sin_port;
     assert(header->th_dport > 0);
 
-    header->th_sum = 0; /* set below */
+    header->th_sum = 0; /* set by the caller */
     header->th_urp = 0; /* ignored */
+}
 
-    _mysock_set_checksum(ctx, packet, packet_len);
-    return _network_send(sd, packet, packet_len);
+/* set the checksum of a header-only segment.  these are mostly ACKs, which
+ * differ from the previous one in only a few fields, so rather than summing
+ * the header again, the last checksum is adjusted for each 16-bit word that
+ * changed (RFC 1624).
+ */
+static void _stcp_set_header_checksum(mysock_context_t *ctx, char *packet)
+{
+    const unsigned int sum_word = offsetof(struct tcphdr, th_sum) >> 1;
+    uint16_t header[ARRAY_DIM(ctx->last_header)];
+    uint32_t pseudo_sum;
+    uint16_t th_sum;
+    unsigned int k;
+
+    assert(ctx && packet);
+    assert(sizeof(header) == sizeof(struct tcphdr));
+
+    pseudo_sum = _mysock_get_pseudo_header_sum(ctx);
+    memcpy(header, packet, sizeof(header));
+
+    if (!ctx->last_header_valid || ctx->last_header_pseudo_sum != pseudo_sum)
+    {
+        _mysock_set_checksum(ctx, packet, sizeof(header));
+        th_sum = ((struct tcphdr *) packet)->th_sum;
+    }
+    else
+    {
+        th_sum = ctx->last_header[sum_word];
+        for (k = 0; k < ARRAY_DIM(header); ++k)
+        {
+            if (k != sum_word && header[k] != ctx->last_header[k])
+            {
+                th_sum = _mysock_checksum_adjust(th_sum, ctx->last_header[k],
+                                                 header[k]);
+            }
+        }
+        ((struct tcphdr *) packet)->th_sum = th_sum;
+    }
+
+    header[sum_word] = th_sum;
+    memcpy(ctx->last_header, header, sizeof(header));
+    ctx->last_header_pseudo_sum = pseudo_sum;
+    ctx->last_header_valid = TRUE;
 }
 
 /* receive data from the application (sent to us using mywrite()).
@@ -246,8 +399,8 @@ size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len)
      * passed down to the transport layer.  if it doesn't fit in the specified
      * buffer, any left over is kept for the next call to app_recv().
      */
-    return _mysock_dequeue_buffer(ctx, &ctx->app_recv_queue,
-                                  dst, max_len, TRUE);
+    return (size_t) _mysock_dequeue_bytes(ctx, &ctx->app_recv_queue,
+                                          dst, max_len, TRUE);
 }
 
 /* pass data up to the application for consumption by myread() */
@@ -259,7 +412,11 @@ void stcp_app_send(mysocket_t sd, const void *src, size_t src_len)
     {
         DEBUG_LOG(("stcp_app_send(%d):  sending %u bytes up to app\n",
                    sd, src_len));
-        _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, src, src_len);
+        (void) _mysock_enqueue_bytes(ctx, &ctx->app_send_queue,
+                                     src, src_len, FALSE);
+
+        if (ctx->accept_deferred)
+            _mysock_end_accept_deferral(ctx);
     }
 }
 
@@ -268,6 +425,9 @@ void stcp_fin_received(mysocket_t sd)
     mysock_context_t *ctx = _mysock_get_context(sd);
     assert(ctx);
     DEBUG_LOG(("stcp_fin_received(%d):  setting eof flag\n", sd));
-    _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, NULL, 0);
+    _mysock_set_eof(ctx, &ctx->app_send_queue);
+
+    if (ctx->accept_deferred)
+        _mysock_end_accept_deferral(ctx);
 }
 
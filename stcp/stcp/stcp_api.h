@@ -10,7 +10,7 @@
 #include "mysock.h" /* mysocket_t */
 
 
-/* stcp_wait_for_event() flags */
+/* stcp_request_event() flags */
 typedef enum
 {
     TIMEOUT             = 0,
@@ -21,45 +21,57 @@ typedef enum
 } stcp_event_type_t;
 
 
-/* called by the transport layer thread to unblock the calling application,
+/* called by the transport layer to unblock the calling application,
  * e.g. when the connection is established, or when an error is detected
  * while attempting to make the connection.  the STCP layer may set errno
  * as it likes to indicate any error to the calling application.
  */
 void stcp_unblock_application(mysocket_t sd);
 
-/* called by the transport layer to wait for new data, either from the network
- * or from the application, or for the application to request that the
- * socket be closed via myclose(), depending on the value of wait_flags.
- * abstime is the absolute time at which the function should quit waiting
- * (i.e., the value of the system clock at which the timeout should be
- * indicated; it has the same origin as time(2) and gettimeofday(2), so a
- * structure containing all zeros corresponds to 00:00:00 GMT, January 1,
- * 1970); if the timeout pointer is NULL, the function blocks indefinitely
- * until data arrives.  the close event is triggered only once, once all
- * pending data has been dequeued from the application.
+/* called by the transport layer to say which events it waits for next on a
+ * connection: new data, either from the network or from the application,
+ * the application requesting that the socket be closed via myclose(), or
+ * a timeout, depending on the value of wait_flags.  abstime is the absolute
+ * time at which the timeout should be indicated (it has the same origin as
+ * time(2) and gettimeofday(2), so a structure containing all zeros
+ * corresponds to 00:00:00 GMT, January 1, 1970); if the timeout pointer is
+ * NULL, no timeout is indicated.  the close event is triggered only once,
+ * once all pending data has been dequeued from the application.
  *
- * sd is the mysocket descriptor for the connection of interest.
+ * this doesn't block.  connections are run by a fixed pool of transport
+ * workers; when one of the events occurs, the connection's worker calls
+ * transport_handle_event() with a bit mask of the events that occurred, of
+ * the same format as the flags passed (see the stcp_event_type_t enum
+ * above), or with no bits set (TIMEOUT) once abstime has been reached.
  *
- * the function returns a bit mask corresponding to an application data
- * arriving/network data arriving/close event, of the same format as the flags
- * passed (see the stcp_event_type_t enum above).  one or more bits may be
- * set, if multiple events have occurred.
+ * sd is the mysocket descriptor for the connection of interest.
  *
- * if an event has occurred since the last call to stcp_wait_for_event(), or
- * the system time has already reached the absolute time specified to the
- * call, the function will return immediately.  events are queued, so, for
- * example, if multiple packets have arrived from the peer, after dequeueing a
- * single such event with stcp_network_recv(), a subsequent call to
- * stcp_wait_for_event() (with appropriate flags) would return immediately
- * with a pending event to be processed.  similarly, if you read only some
- * of the data waiting to be sent by the application, a subsequent call to
- * stcp_wait_for_event() (again with appropriate flags) will return
- * immediately with a pending event to be processed.
+ * events are queued, so, for example, if multiple packets have arrived from
+ * the peer and only some are dequeued with stcp_network_recv(), the
+ * transport is called again straight away with a pending event to be
+ * processed.  similarly, if you read only some of the data waiting to be
+ * sent by the application, you'll be called again with APP_DATA set.  each
+ * call replaces the wait_flags and timeout of the previous one.
+ */
+void stcp_request_event(mysocket_t             sd,
+                        unsigned int           wait_flags,
+                        const struct timespec *abstime);
+
+/* called by the transport layer once it's finished with a connection (which
+ * it must not touch again after this).  if the application is still blocked
+ * waiting for the connection to be established, it's unblocked with errno
+ * set as the transport left it, or ECONNREFUSED if that was unset.
+ */
+void stcp_transport_done(mysocket_t sd);
+
+/* called by the transport layer, just before stcp_transport_done(), if the
+ * connection has entered TIME_WAIT.  local_seq is the sequence number
+ * following our FIN, and remote_seq the one following the peer's.  the
+ * mysocket layer then keeps a small record of the connection for a while
+ * after it's closed, and ACKs any retransmission of the peer's FIN from
+ * that, so the transport needn't stay around to do so.
  */
-unsigned int stcp_wait_for_event(mysocket_t             sd,
-                                 unsigned int           wait_flags,
-                                 const struct timespec *abstime);
+void stcp_time_wait(mysocket_t sd, uint32_t local_seq, uint32_t remote_seq);
 
 /* allow STCP implementation to establish a context for a given mysocket
  * descriptor.  this context should contain any information that needs to be
@@ -71,6 +83,17 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
 void stcp_set_context(mysocket_t sd, const void *stcp_state);
 void *stcp_get_context(mysocket_t my_sd);
 
+/* for a passive connection, returns TRUE if the mysocket layer has already
+ * answered the peer's SYN itself (with a SYN cookie, when the listening
+ * socket was under pressure).  syn_seq and syn_ack_seq are then set to the
+ * sequence numbers of that SYN and of the SYN-ACK sent in reply, and the
+ * first packet received is the peer's ACK of the SYN-ACK rather than the
+ * SYN.  transport_init() should carry on from there as if it had sent the
+ * SYN-ACK.  returns FALSE otherwise.
+ */
+bool_t stcp_get_syn_ack_sent(mysocket_t sd,
+                             uint32_t *syn_seq, uint32_t *syn_ack_seq);
+
 /* Receive a datagram from the peer.
  *
  * sd       Mysocket descriptor.
@@ -81,6 +104,21 @@ void *stcp_get_context(mysocket_t my_sd);
  */
 ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
 
+/* Receive every datagram queued from the peer (up to max_segs) at once.
+ *
+ * sd       Mysocket descriptor.
+ * dst      A pointer to max_segs contiguous buffers of seg_len bytes each;
+ *          datagram k is copied to dst + k * seg_len.
+ * seg_len  The size in bytes of each buffer in dst.
+ * lens     Receives the length of each datagram read into dst.
+ * max_segs The number of buffers in dst (and entries in lens).
+ *
+ * Like stcp_network_recv(), this blocks until at least one datagram is
+ * available.  This call returns the number of datagrams read into dst.
+ */
+int stcp_network_recv_batch(mysocket_t sd, void *dst, size_t seg_len,
+                            size_t *lens, unsigned int max_segs);
+
 /* Send data (unreliably) to the peer.
  *
  * sd           Mysocket descriptor
@@ -98,6 +136,41 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
  */
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...);
 
+/* cached checksum of a segment's payload; see stcp_segment_t */
+typedef uint32_t stcp_sum_t;
+#define STCP_SUM_UNKNOWN 0
+
+/* a single datagram passed to stcp_network_send_batch() */
+typedef struct
+{
+    const void *data;   /* STCP header followed by any payload */
+    size_t      len;    /* length in bytes of data */
+
+    /* optional.  if not NULL, this caches the checksum of the payload (the
+     * data following the 20-byte header) between sends of the same segment,
+     * e.g. on retransmission; only the header is then summed.  set it to
+     * STCP_SUM_UNKNOWN before the first send, and again whenever the
+     * payload changes.
+     */
+    stcp_sum_t *payload_sum;
+} stcp_segment_t;
+
+/* Send several datagrams (unreliably) to the peer.
+ *
+ * sd           Mysocket descriptor
+ * segs         An array of num_segs datagrams, each a contiguous buffer
+ * num_segs     The number of entries in segs
+ *
+ * This is equivalent to calling stcp_network_send() once per segment, in
+ * order, but the segments are handed to the network layer together so it
+ * can submit them with far fewer system calls.
+ *
+ * Returns the total number of bytes transferred on success, or -1 on
+ * failure.
+ */
+ssize_t stcp_network_send_batch(mysocket_t sd, const stcp_segment_t *segs,
+                                unsigned int num_segs);
+
 /* receive data from the application (sent to us using mywrite()) */
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len);
 
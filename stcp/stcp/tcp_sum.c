@@ -1,12 +1,51 @@
 /* TCP checksum support--this is not used directly by students */
 
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include "mysock_impl.h"
 #include "transport.h"
 #include "tcp_sum.h"
 
+/* the vectorised checksum loops need GCC's target attributes and x86
+ * intrinsics; everywhere else, the portable loop is used.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_SIMD
+#include <immintrin.h>
+#endif
+
+
+/* sums the given buffer as a sequence of 16-bit words in memory order (an
+ * odd trailing byte is padded with zero), without folding the result.
+ */
+typedef uint64_t (*checksum_sum_fn_t)(const void *buf, size_t len);
+
+/* as checksum_sum_fn_t, but also copies the buffer to dst */
+typedef uint64_t (*checksum_copy_fn_t)(void *dst, const void *src,
+                                       size_t len);
+
+static uint64_t _mysock_sum_scalar(const void *buf, size_t len);
+static uint64_t _mysock_copy_sum_scalar(void *dst, const void *src,
+                                        size_t len);
+#ifdef CHECKSUM_SIMD
+static uint64_t _mysock_sum_sse2(const void *buf, size_t len);
+static uint64_t _mysock_sum_avx2(const void *buf, size_t len);
+static uint64_t _mysock_copy_sum_sse2(void *dst, const void *src,
+                                      size_t len);
+static uint64_t _mysock_copy_sum_avx2(void *dst, const void *src,
+                                      size_t len);
+#endif
+static uint16_t _mysock_fold_sum(uint64_t sum);
+static uint16_t _mysock_wire_checksum(uint16_t cksum);
+static void _mysock_checksum_init(void);
+
+static pthread_once_t checksum_init_once = PTHREAD_ONCE_INIT;
+static checksum_sum_fn_t checksum_sum = _mysock_sum_scalar;
+static checksum_copy_fn_t checksum_copy = _mysock_copy_sum_scalar;
+
 
 /* computes checksum for TCP segment, based on description in RFCs 793 and
  * 1071, and Berkeley in_cksum().
@@ -16,54 +55,315 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
                               const void *packet,
                               size_t len /*host byte order*/)
 {
-    struct
+    return _mysock_tcp_checksum_partial(
+        _mysock_pseudo_header_sum(src_addr, dst_addr), packet, len);
+}
+
+/* returns the (unfolded) sum of the TCP pseudo-header's addresses and
+ * protocol.  this doesn't change over the life of a connection, so it can
+ * be computed once and passed to _mysock_tcp_checksum_partial(), which adds
+ * in the segment length.  the sum is symmetric in src_addr and dst_addr.
+ */
+uint32_t _mysock_pseudo_header_sum(uint32_t src_addr /*network byte order*/,
+                                   uint32_t dst_addr /*network byte order*/)
+{
+    uint32_t sum;
+
+    assert(src_addr > 0);
+    assert(dst_addr > 0);
+
+    /* the 96-bit pseudo header (less the length), taken as 16-bit words in
+     * memory order.  this is done arithmetically rather than by aliasing a
+     * packed structure, which the optimiser is entitled to get wrong.
+     */
+    sum  = (src_addr >> 16) + (src_addr & 0xffff);
+    sum += (dst_addr >> 16) + (dst_addr & 0xffff);
+    sum += htons(IPPROTO_TCP);  /* zero byte, then protocol */
+
+    return sum;
+}
+
+/* computes checksum for TCP segment, given the pseudo-header sum from
+ * _mysock_pseudo_header_sum().
+ */
+uint16_t _mysock_tcp_checksum_partial(uint32_t pseudo_sum,
+                                      const void *packet,
+                                      size_t len /*host byte order*/)
+{
+    uint64_t sum;
+    uint16_t th_sum;
+
+    assert(packet && len >= sizeof(struct tcphdr));
+
+    PTHREAD_CALL(pthread_once(&checksum_init_once, _mysock_checksum_init));
+
+    /* th_sum is treated as zero during checksum computation.  rather than
+     * skipping it inside the loop, sum the whole segment and then subtract
+     * it (adding its one's complement).  the packet may have any alignment.
+     */
+    memcpy(&th_sum, (const char *) packet + offsetof(struct tcphdr, th_sum),
+           sizeof(th_sum));
+
+    sum  = checksum_sum(packet, len);
+    sum += pseudo_sum + htons(len);
+    sum += (uint16_t) ~th_sum;
+
+    return (uint16_t) ~_mysock_fold_sum(sum);
+}
+
+/* returns the one's complement sum of the given buffer, folded to 16 bits
+ * (but not complemented).  sums of separate pieces of a segment may be added
+ * together, provided each piece starts at an even offset.
+ */
+uint16_t _mysock_buffer_sum(const void *buf, size_t len)
+{
+    PTHREAD_CALL(pthread_once(&checksum_init_once, _mysock_checksum_init));
+    return _mysock_fold_sum(checksum_sum(buf, len));
+}
+
+/* copies len bytes from src to dst (which must not overlap), returning the
+ * same sum as _mysock_buffer_sum(src, len).  the data is read only once, so
+ * this is about as cheap as the copy alone.
+ */
+uint16_t _mysock_copy_and_sum(void *dst, const void *src, size_t len)
+{
+    assert(dst && src);
+
+    PTHREAD_CALL(pthread_once(&checksum_init_once, _mysock_checksum_init));
+    return _mysock_fold_sum(checksum_copy(dst, src, len));
+}
+
+/* returns the checksum cksum, updated for a 16-bit word in the checksummed
+ * data changing from old_word to new_word.  this is eqn. 3 of RFC 1624.
+ * the result is in the form sent on the wire (see _mysock_wire_checksum()).
+ */
+uint16_t _mysock_checksum_adjust(uint16_t cksum,
+                                 uint16_t old_word, uint16_t new_word)
+{
+    uint32_t sum = (uint16_t) ~cksum;
+
+    sum += (uint16_t) ~old_word;
+    sum += new_word;
+
+    return _mysock_wire_checksum((uint16_t) ~_mysock_fold_sum(sum));
+}
+
+/* a computed checksum of zero is sent as 0xffff (its one's complement
+ * equivalent), as in UDP; a zero th_sum marks a segment that the sender
+ * didn't checksum because the underlying network is trusted.
+ */
+static uint16_t _mysock_wire_checksum(uint16_t cksum)
+{
+    return cksum ? cksum : 0xffff;
+}
+
+/* fold a 64-bit one's complement sum down to 16 bits */
+static uint16_t _mysock_fold_sum(uint64_t sum)
+{
+    sum = (sum >> 32) + (sum & 0xffffffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+
+    return (uint16_t) sum;
+}
+
+/* portable summation loop.  32-bit words are accumulated into a 64-bit sum,
+ * which can't overflow for any packet we handle; folding the result down to
+ * 16 bits gives the same one's complement sum as adding 16-bit words.
+ */
+static uint64_t _mysock_sum_scalar(const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    uint64_t sum = 0;
+    uint32_t word;
+
+    for (; len >= sizeof(word); p += sizeof(word), len -= sizeof(word))
     {
-        uint32_t src_addr;
-        uint32_t dst_addr;
-        uint8_t  zero;
-        uint8_t  protocol;
-        uint16_t len;
-    } __attribute__ ((packed)) pseudo_header =
+        memcpy(&word, p, sizeof(word));
+        sum += word;
+    }
+
+    if (len > 0)
     {
-        src_addr, dst_addr, 0, IPPROTO_TCP, htons(len)
-    };
+        /* trailing bytes keep their position within a zero-padded word */
+        word = 0;
+        memcpy(&word, p, len);
+        sum += word;
+    }
 
-    unsigned int k;
-    int32_t sum = 0;
+    return sum;
+}
 
-    assert(packet && len >= sizeof(struct tcphdr));
-    assert(sizeof(pseudo_header) == 12);
+/* portable copy-and-sum loop; as _mysock_sum_scalar() */
+static uint64_t _mysock_copy_sum_scalar(void *dst, const void *src,
+                                        size_t len)
+{
+    const uint8_t *p = (const uint8_t *) src;
+    uint8_t *q = (uint8_t *) dst;
+    uint64_t sum = 0;
+    uint32_t word;
 
+    for (; len >= sizeof(word);
+         p += sizeof(word), q += sizeof(word), len -= sizeof(word))
+    {
+        memcpy(&word, p, sizeof(word));
+        memcpy(q, &word, sizeof(word));
+        sum += word;
+    }
 
-    assert(src_addr > 0);
-    assert(dst_addr > 0);
+    if (len > 0)
+    {
+        word = 0;
+        memcpy(&word, p, len);
+        memcpy(q, &word, len);
+        sum += word;
+    }
 
-    /* process 96-bit pseudo header */
-    for (k = 0; k < sizeof(pseudo_header) / sizeof(uint16_t); ++k)
-        sum += ((uint16_t *) &pseudo_header)[k];
+    return sum;
+}
+
+#ifdef CHECKSUM_SIMD
+/* SSE2 summation: each 128-bit load is split into 32-bit words, which are
+ * zero-extended into two 64-bit lane accumulators.
+ */
+__attribute__ ((target("sse2")))
+static uint64_t _mysock_sum_sse2(const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    uint64_t lanes[2];
 
-    /* process TCP header and payload */
-    assert(((long)packet & 2) == 0);
-    assert((offsetof(struct tcphdr, th_sum) & 2) == 0);
-    for (k = 0; k < (len >> 1); ++k)
+    for (; len >= 16; p += 16, len -= 16)
     {
-        if (k == (offsetof(struct tcphdr, th_sum) >> 1))
-            continue;   /* th_sum == 0 during checksum computation */
-        sum += ((uint16_t *) packet)[k];
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
     }
 
-    if (len & 1)
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    return lanes[0] + lanes[1] + _mysock_sum_scalar(p, len);
+}
+
+/* SSE2 copy-and-sum; as _mysock_sum_sse2(), storing each load to dst */
+__attribute__ ((target("sse2")))
+static uint64_t _mysock_copy_sum_sse2(void *dst, const void *src,
+                                      size_t len)
+{
+    const uint8_t *p = (const uint8_t *) src;
+    uint8_t *q = (uint8_t *) dst;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    uint64_t lanes[2];
+
+    for (; len >= 16; p += 16, q += 16, len -= 16)
     {
-        uint16_t tmp = 0;
-        *(uint8_t *) &tmp = ((uint8_t *) packet)[len - 1];
-        sum += tmp;
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        _mm_storeu_si128((__m128i *) q, v);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
     }
 
-    /* fold 32-bit sum to 16 bits */
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    return lanes[0] + lanes[1] + _mysock_copy_sum_scalar(q, p, len);
+}
+
+/* AVX2 summation: as the SSE2 version, with 256-bit loads, two independent
+ * accumulators, and four 64-bit lanes each.
+ */
+__attribute__ ((target("avx2")))
+static uint64_t _mysock_sum_avx2(const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+    uint64_t lanes[4];
+
+    for (; len >= 64; p += 64, len -= 64)
+    {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *) p);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *) (p + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v1, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v1, zero));
+    }
+
+    if (len >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+        p += 32, len -= 32;
+    }
+
+    if (len >= 16)
+    {
+        acc0 = _mm256_add_epi64(acc0, _mm256_cvtepu32_epi64(
+            _mm_loadu_si128((const __m128i *) p)));
+        p += 16, len -= 16;
+    }
+
+    /* the tail isn't handed to _mysock_sum_sse2(), as mixing legacy SSE
+     * code with dirty upper AVX registers is very slow on some CPUs.
+     */
+    _mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(acc0, acc1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           _mysock_sum_scalar(p, len);
+}
+
+/* AVX2 copy-and-sum; as _mysock_sum_avx2(), storing each load to dst */
+__attribute__ ((target("avx2")))
+static uint64_t _mysock_copy_sum_avx2(void *dst, const void *src,
+                                      size_t len)
+{
+    const uint8_t *p = (const uint8_t *) src;
+    uint8_t *q = (uint8_t *) dst;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+    uint64_t lanes[4];
+
+    for (; len >= 32; p += 32, q += 32, len -= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        _mm256_storeu_si256((__m256i *) q, v);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+    }
+
+    if (len >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        _mm_storeu_si128((__m128i *) q, v);
+        acc0 = _mm256_add_epi64(acc0, _mm256_cvtepu32_epi64(v));
+        p += 16, q += 16, len -= 16;
+    }
+
+    _mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(acc0, acc1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           _mysock_copy_sum_scalar(q, p, len);
+}
+#endif  /* CHECKSUM_SIMD */
 
-    return (uint16_t) ~sum;
+/* pick the fastest summation loop this CPU supports (GCC's builtin checks
+ * CPUID, and that the OS saves the AVX registers).
+ */
+static void _mysock_checksum_init(void)
+{
+#ifdef CHECKSUM_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        checksum_sum  = _mysock_sum_avx2;
+        checksum_copy = _mysock_copy_sum_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        checksum_sum  = _mysock_sum_sse2;
+        checksum_copy = _mysock_copy_sum_sse2;
+    }
+#endif
 }
 
 /* update checksum in the given STCP segment */
@@ -75,12 +375,72 @@ void _mysock_set_checksum(const mysock_context_t *ctx,
 
     assert(ctx->network_state.peer_addr.sa_family == AF_INET);
 
-    ((struct tcphdr *) packet)->th_sum = _mysock_tcp_checksum(
-        _network_get_local_addr((network_context_t *)
-                                &ctx->network_state), /*src*/
-        ((struct sockaddr_in *) &ctx->network_state.peer_addr)-> /*dst*/
-            sin_addr.s_addr,
-        packet, len);
+    ((struct tcphdr *) packet)->th_sum = _mysock_wire_checksum(
+        _mysock_tcp_checksum_partial(_mysock_get_pseudo_header_sum(ctx),
+                                     packet, len));
+}
+
+/* update checksum in a segment sent to peer_addr before there's a
+ * connection for it, from the interface that reaches the peer.
+ */
+void _mysock_set_checksum_to_peer(const struct sockaddr *peer_addr,
+                                  void *packet, size_t len)
+{
+    uint32_t peer_ip;
+
+    assert(peer_addr && packet);
+    assert(peer_addr->sa_family == AF_INET);
+    assert(len >= sizeof(struct tcphdr));
+
+    peer_ip = ((const struct sockaddr_in *) peer_addr)->sin_addr.s_addr;
+    ((struct tcphdr *) packet)->th_sum = _mysock_wire_checksum(
+        _mysock_tcp_checksum(_network_get_interface_ip(peer_ip), peer_ip,
+                             packet, len));
+}
+
+/* returns the checksum to send in a segment between the given addresses, for
+ * a connection that no longer has a context (e.g. one in TIME_WAIT).  a
+ * received segment's checksum is verified by comparing it with this.
+ */
+uint16_t _mysock_segment_checksum(uint32_t src_addr /*network byte order*/,
+                                  uint32_t dst_addr /*network byte order*/,
+                                  const void *packet,
+                                  size_t len /*host byte order*/)
+{
+    assert(packet);
+    assert(len >= sizeof(struct tcphdr));
+
+    return _mysock_wire_checksum(
+        _mysock_tcp_checksum(src_addr, dst_addr, packet, len));
+}
+
+/* update checksum in the given STCP segment, where the sum of everything
+ * after the first hdr_len bytes (hdr_len must be even) is already known.
+ * payload_sum is as returned by _mysock_buffer_sum().
+ */
+void _mysock_set_checksum_with_payload_sum(const mysock_context_t *ctx,
+                                           void *packet, size_t hdr_len,
+                                           size_t len, uint16_t payload_sum)
+{
+    uint64_t sum;
+    uint16_t th_sum;
+
+    assert(ctx && packet);
+    assert(hdr_len >= sizeof(struct tcphdr) && hdr_len <= len);
+    assert((hdr_len & 1) == 0);
+
+    PTHREAD_CALL(pthread_once(&checksum_init_once, _mysock_checksum_init));
+
+    memcpy(&th_sum, (const char *) packet + offsetof(struct tcphdr, th_sum),
+           sizeof(th_sum));
+
+    sum  = checksum_sum(packet, hdr_len);
+    sum += _mysock_get_pseudo_header_sum(ctx) + htons(len);
+    sum += (uint16_t) ~th_sum;
+    sum += payload_sum;
+
+    ((struct tcphdr *) packet)->th_sum =
+        _mysock_wire_checksum((uint16_t) ~_mysock_fold_sum(sum));
 }
 
 /* returns TRUE if checksum is correct, FALSE otherwise */
@@ -94,13 +454,110 @@ bool_t _mysock_verify_checksum(const mysock_context_t *ctx,
 
     assert(ctx->network_state.peer_addr.sa_family == AF_INET);
 
-    my_sum = _mysock_tcp_checksum(
-        ((struct sockaddr_in *) &ctx->network_state.peer_addr)-> /*src*/
-            sin_addr.s_addr,
-        _network_get_local_addr((network_context_t *)
-                                &ctx->network_state), /*dst*/
-        packet, len);
+    /* the pseudo-header sum is the same with source and destination
+     * swapped, so the one cached for sending is used here too.
+     */
+    my_sum = _mysock_tcp_checksum_partial(
+        _mysock_get_pseudo_header_sum(ctx), packet, len);
+
+    return _mysock_wire_checksum(my_sum) == ((struct tcphdr *) packet)->th_sum;
+}
+
+/* returns TRUE if STCP segments sent on the given connection need a
+ * checksum, i.e. if the underlying network might corrupt them.
+ */
+bool_t _mysock_checksum_required(const mysock_context_t *ctx)
+{
+    assert(ctx);
+    return !ctx->network_state.checksum_trusted ||
+           ctx->network_state.corrupt_rate > 0;
+}
+
+/* applies the connection's checksum policy to a packet received from the
+ * network, in all builds.  returns TRUE if the packet should be passed on
+ * to STCP, or FALSE if it should be dropped, in which case it's counted in
+ * the connection's bad_checksums.
+ *
+ * peer_addr is the address the packet came from, if the connection doesn't
+ * have a peer yet (i.e. a SYN arriving at a listening socket); otherwise,
+ * it should be NULL.
+ */
+bool_t _mysock_accept_packet(mysock_context_t *ctx,
+                             const struct sockaddr *peer_addr,
+                             const void *packet, size_t len)
+{
+    network_context_t *net_ctx;
+    uint16_t th_sum;
+    bool_t ok;
+
+    assert(ctx && packet);
+    net_ctx = &ctx->network_state;
+
+    if (len < sizeof(struct tcphdr))
+    {
+        ok = FALSE;
+    }
+    else
+    {
+        memcpy(&th_sum,
+               (const char *) packet + offsetof(struct tcphdr, th_sum),
+               sizeof(th_sum));
+
+        if (th_sum == 0)
+        {
+            ok = net_ctx->checksum_trusted;
+        }
+        else if (peer_addr)
+        {
+            uint32_t peer_ip;
+
+            assert(peer_addr->sa_family == AF_INET);
+            peer_ip =
+                ((const struct sockaddr_in *) peer_addr)->sin_addr.s_addr;
+
+            ok = _mysock_wire_checksum(_mysock_tcp_checksum(
+                     peer_ip, _network_get_interface_ip(peer_ip),
+                     packet, len)) == th_sum;
+        }
+        else
+        {
+            ok = _mysock_verify_checksum(ctx, packet, len);
+        }
+    }
+
+    if (!ok)
+    {
+        ++net_ctx->bad_checksums;
+        DEBUG_LOG(("dropping packet with bad checksum (%lu so far)\n",
+                   net_ctx->bad_checksums));
+    }
+
+    return ok;
+}
+
+/* returns the pseudo-header sum for the given connection, computing it on
+ * first use.  it's cached in the network layer state along with the local
+ * address, and invalidated with it.
+ */
+uint32_t _mysock_get_pseudo_header_sum(const mysock_context_t *ctx)
+{
+    network_context_t *net_ctx = (network_context_t *) &ctx->network_state;
+    uint32_t local_addr;
+
+    assert(ctx);
+    assert(net_ctx->peer_addr.sa_family == AF_INET);
+
+    /* this refreshes the cache if the peer has changed */
+    local_addr = _network_get_local_addr(net_ctx);
+
+    if (!net_ctx->pseudo_header_sum_valid)
+    {
+        net_ctx->pseudo_header_sum = _mysock_pseudo_header_sum(
+            local_addr,
+            ((struct sockaddr_in *) &net_ctx->peer_addr)->sin_addr.s_addr);
+        net_ctx->pseudo_header_sum_valid = TRUE;
+    }
 
-    return my_sum == ((struct tcphdr *) packet)->th_sum;
+    return net_ctx->pseudo_header_sum;
 }
 
@@ -12,11 +12,45 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
                               const void *packet,
                               size_t len /*host byte order*/);
 
+uint32_t _mysock_pseudo_header_sum(uint32_t src_addr /*network byte order*/,
+                                   uint32_t dst_addr /*network byte order*/);
+
+uint16_t _mysock_tcp_checksum_partial(uint32_t pseudo_sum,
+                                      const void *packet,
+                                      size_t len /*host byte order*/);
+
+uint16_t _mysock_buffer_sum(const void *buf, size_t len);
+
+uint16_t _mysock_copy_and_sum(void *dst, const void *src, size_t len);
+
+uint16_t _mysock_checksum_adjust(uint16_t cksum,
+                                 uint16_t old_word, uint16_t new_word);
+
+uint32_t _mysock_get_pseudo_header_sum(const mysock_context_t *ctx);
+
 void _mysock_set_checksum(const struct mysock_context *ctx,
                           void *packet, size_t len);
 
+void _mysock_set_checksum_to_peer(const struct sockaddr *peer_addr,
+                                  void *packet, size_t len);
+
+void _mysock_set_checksum_with_payload_sum(const mysock_context_t *ctx,
+                                           void *packet, size_t hdr_len,
+                                           size_t len, uint16_t payload_sum);
+
+uint16_t _mysock_segment_checksum(uint32_t src_addr /*network byte order*/,
+                                  uint32_t dst_addr /*network byte order*/,
+                                  const void *packet,
+                                  size_t len /*host byte order*/);
+
 bool_t _mysock_verify_checksum(const mysock_context_t *ctx,
                                const void *packet, size_t len);
 
+bool_t _mysock_checksum_required(const mysock_context_t *ctx);
+
+bool_t _mysock_accept_packet(mysock_context_t *ctx,
+                             const struct sockaddr *peer_addr,
+                             const void *packet, size_t len);
+
 #endif  /* __TCP_CHECKSUM_H__ */
 
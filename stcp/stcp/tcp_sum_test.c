@@ -0,0 +1,185 @@
+/* tcp_sum_test.c--checks the vectorised checksum loops against the scalar
+ * ones.
+ *
+ * this includes tcp_sum.c itself, so that the summation loops (which are
+ * static) can be called directly, and is linked with every object but
+ * tcp_sum.o.  each trial sums a buffer of random length at a random
+ * alignment with every loop this CPU supports, and compares the results
+ * with _mysock_sum_scalar() and with a naive RFC 1071 sum of 16-bit words.
+ * the copy-and-sum loops are checked the same way, and must copy exactly
+ * len bytes.
+ *
+ * usage: tcp_sum_test [trials [seed]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tcp_sum.c"
+
+
+#define TEST_MAX_LEN    (2 * MAX_IP_PAYLOAD_LEN)
+#define TEST_MAX_ALIGN  64
+#define TEST_GUARD      64
+#define TEST_GUARD_BYTE 0xa5
+
+typedef struct
+{
+    const char *name;
+    checksum_sum_fn_t sum;
+    checksum_copy_fn_t copy;
+} sum_impl_t;
+
+static int failures = 0;
+
+
+/* RFC 1071's sum of 16-bit words in memory order, folded to 16 bits */
+static uint16_t reference_sum(const uint8_t *p, size_t len)
+{
+    uint32_t sum = 0;
+    uint16_t word;
+
+    for (; len >= 2; p += 2, len -= 2)
+    {
+        memcpy(&word, p, sizeof(word));
+        sum += word;
+    }
+
+    if (len > 0)
+    {
+        word = 0;
+        memcpy(&word, p, 1);
+        sum += word;
+    }
+
+    while (sum >> 16)
+        sum = (sum >> 16) + (sum & 0xffff);
+    return (uint16_t) sum;
+}
+
+static void check_impl(const sum_impl_t *impl,
+                       const uint8_t *src, uint8_t *dst_base,
+                       size_t align, size_t len, uint16_t expected)
+{
+    uint8_t *dst = dst_base + TEST_GUARD + align;
+    uint64_t scalar, sum;
+    size_t k;
+
+    scalar = _mysock_sum_scalar(src, len);
+    sum = impl->sum(src, len);
+    if (sum != scalar || _mysock_fold_sum(sum) != expected)
+    {
+        fprintf(stderr, "%s sum: len %u align %u: got %llx, scalar %llx, "
+                "reference %x\n", impl->name, (unsigned) len,
+                (unsigned) align, (unsigned long long) sum,
+                (unsigned long long) scalar, expected);
+        ++failures;
+    }
+
+    memset(dst_base, TEST_GUARD_BYTE,
+           TEST_GUARD + TEST_MAX_ALIGN + TEST_MAX_LEN + TEST_GUARD);
+    sum = impl->copy(dst, src, len);
+    if (sum != scalar)
+    {
+        fprintf(stderr, "%s copy: len %u align %u: got %llx, scalar %llx\n",
+                impl->name, (unsigned) len, (unsigned) align,
+                (unsigned long long) sum, (unsigned long long) scalar);
+        ++failures;
+    }
+
+    if (memcmp(dst, src, len) != 0)
+    {
+        fprintf(stderr, "%s copy: len %u align %u: data differs\n",
+                impl->name, (unsigned) len, (unsigned) align);
+        ++failures;
+    }
+
+    for (k = 0; k < TEST_GUARD + align; ++k)
+        if (dst_base[k] != TEST_GUARD_BYTE)
+            break;
+    if (k == TEST_GUARD + align)
+        for (k = 0; k < TEST_GUARD; ++k)
+            if (dst[len + k] != TEST_GUARD_BYTE)
+                break;
+    if (k != TEST_GUARD)
+    {
+        fprintf(stderr, "%s copy: len %u align %u: wrote outside dst\n",
+                impl->name, (unsigned) len, (unsigned) align);
+        ++failures;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    sum_impl_t impls[3];
+    int n_impls = 0, n_trials, trial, k;
+    unsigned int seed;
+    uint8_t *src_base, *dst_base;
+
+    n_trials = (argc > 1) ? atoi(argv[1]) : 200000;
+    seed = (argc > 2) ? (unsigned int) atoi(argv[2])
+                      : (unsigned int) time(NULL);
+    srand(seed);
+
+    impls[n_impls].name = "scalar";
+    impls[n_impls].sum  = _mysock_sum_scalar;
+    impls[n_impls].copy = _mysock_copy_sum_scalar;
+    ++n_impls;
+#ifdef CHECKSUM_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+    {
+        impls[n_impls].name = "sse2";
+        impls[n_impls].sum  = _mysock_sum_sse2;
+        impls[n_impls].copy = _mysock_copy_sum_sse2;
+        ++n_impls;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        impls[n_impls].name = "avx2";
+        impls[n_impls].sum  = _mysock_sum_avx2;
+        impls[n_impls].copy = _mysock_copy_sum_avx2;
+        ++n_impls;
+    }
+#endif
+
+    src_base = (uint8_t *) malloc(TEST_MAX_ALIGN + TEST_MAX_LEN);
+    dst_base = (uint8_t *) malloc(TEST_GUARD + TEST_MAX_ALIGN +
+                                  TEST_MAX_LEN + TEST_GUARD);
+    assert(src_base && dst_base);
+
+    for (trial = 0; trial < n_trials; ++trial)
+    {
+        size_t len, align, dst_align, j;
+        uint8_t *src;
+        uint16_t expected;
+
+        /* short buffers are where the loops' tails get exercised, so bias
+         * the lengths towards them; some trials use all-ones data, which
+         * carries the most.
+         */
+        len = (size_t) rand() % ((trial & 1) ? 256 : TEST_MAX_LEN + 1);
+        align = (size_t) rand() % TEST_MAX_ALIGN;
+        dst_align = (size_t) rand() % TEST_MAX_ALIGN;
+        src = src_base + align;
+        for (j = 0; j < len; ++j)
+            src[j] = (trial % 16 == 0) ? 0xff : (uint8_t) rand();
+
+        expected = reference_sum(src, len);
+        for (k = 0; k < n_impls; ++k)
+            check_impl(&impls[k], src, dst_base, dst_align, len, expected);
+
+        if (failures > 20)
+            break;
+    }
+
+    free(src_base);
+    free(dst_base);
+
+    printf("tcp_sum_test: %d trials of", trial);
+    for (k = 0; k < n_impls; ++k)
+        printf(" %s", impls[k].name);
+    printf(" (seed %u): %s\n", seed, failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
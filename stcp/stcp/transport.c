@@ -15,11 +15,11 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
 #include "mysock.h"
 #include "stcp_api.h"
 #include "transport.h"
 #include <sys/time.h>
-#include <signal.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 
@@ -47,6 +47,20 @@ enum {
 #define SEQUENCE_NUMBER_SPACE 4294967296
 #define TCP_DATA_OFFSET 5
 #define MAX_RETRIES 6
+#define FIN_WAIT_2_TIMEOUT 60 /* Seconds to wait for the peer's FIN once ours is acked */
+#ifndef NETWORK_BATCH_SIZE
+#define NETWORK_BATCH_SIZE 16 /* Maximum segments drained per NETWORK_DATA event */
+#endif
+#define MAX_SEGMENTS_IN_WINDOW ((MAX_WINDOW_SIZE + STCP_MSS - 1) / STCP_MSS)
+
+// Payload checksum of a data segment, kept so that it isn't recomputed
+// when the segment is retransmitted
+typedef struct
+{
+	tcp_seq seqNumber;      /* Sequence number of the segment */
+	size_t length;          /* Payload length of the segment */
+	stcp_sum_t payloadSum;  /* Cached by stcp_network_send_batch() */
+} segmentSumInfo;
 
 /* this structure is global to a mysocket descriptor */
 typedef struct
@@ -84,17 +98,45 @@ typedef struct
 	// Retransmission count of FIN
 	int finRetransmit;
 
+	// Sequence number of the peer's FIN, once it's arrived
+	tcp_seq peerFinSeqNumber;
+
+	// Batch of segments drained from the network in one NETWORK_DATA event
+	char rcvdSegments[NETWORK_BATCH_SIZE][TCP_HEADER_SIZE + STCP_MSS];
+	char appDeliveryBuffer[MAX_WINDOW_SIZE]; /* In-order data staged for the application */
+	size_t appDeliveryLength;
+	bool ackPending;                         /* A cumulative ACK is owed for this batch */
+
+	// Payload checksums of the most recently sent data segments
+	segmentSumInfo sentSegmentSums[MAX_SEGMENTS_IN_WINDOW];
+	unsigned int nextSegmentSumSlot;
+
+	// Handshake state, kept between events until the connection is established
+	bool_t isActive;
+	tcp_seq localSeqNumber;
+	tcp_seq remoteSeqNumber;
+	int handshakeRetries;
+
+	// Expiry time of the running timer (valid while isTimerSet)
+	struct timespec timerDeadline;
+
 } context_t;
 
-// Global declaration of Context variable for accessing in timer related
-// functions
-static context_t *ctx;
+// Context of the connection being handled.  Transport workers each handle
+// one connection at a time, so this is set per thread on every entry from
+// the worker (transport_init() and transport_handle_event())
+static __thread context_t *ctx;
 
 static void generate_initial_seq_num(context_t *ctx);
-static void control_loop(mysocket_t sd, context_t *ctx);
+static void initialize_connection(mysocket_t sd, context_t *ctx);
+static void handle_connection_event(mysocket_t sd, unsigned int event);
 void stopTimer();
 void startTimer();
 void createStcpHeader(STCPHeader* stcpHdr);
+void flushDataToApplication(mysocket_t sd);
+void notifyFinReceived(mysocket_t sd);
+static void enterTimeWait(mysocket_t sd);
+void sendDataSegments(mysocket_t sd, char* data, size_t dataLength, tcp_seq startSeqNumber);
 // Function to set the timer variable
 void setTimerForUnackedData(bool value)
 {
@@ -113,16 +155,14 @@ bool isTimerValueSet(){
 }
 
 //Function to handle the timer expiry by retransmission
-void handleTimerExpiry(int sigNum)
+void handleTimerExpiry()
 {
 	#ifdef print
 	printf("\n HandleTimeExpiry Method Entry\n");
 	#endif
-	size_t retransmitDataLength = 0, stcpSegmentLength = 0;
+	size_t retransmitDataLength = 0;
 	char* dataToRetransmit = NULL;
-	unsigned int iterator = 0, iterator2 = 0, numOfSegments = 0;
-	tcp_seq startSeqNumber = ctx->sendBase;
-	char* stcpSegment = NULL;
+	unsigned int iterator = 0, iterator2 = 0;
 	STCPHeader *segmentHeader = NULL;
 
 	if(isTimerValueSet())
@@ -139,13 +179,6 @@ void handleTimerExpiry(int sigNum)
 			retransmitDataLength = ctx->nextSeqNum + (SEQUENCE_NUMBER_SPACE - ctx->sendBase + 1);
 	  }
 
-	  // Check the number of segments that needs to be send
-	  numOfSegments = (int)(retransmitDataLength/STCP_MSS);
-
-	  if((numOfSegments*STCP_MSS) < retransmitDataLength){
-			numOfSegments++;
-	  }
-
 	  // Copy the data into the buffer
 	  dataToRetransmit = (char*) calloc(retransmitDataLength, sizeof(char));
 
@@ -156,54 +189,20 @@ void handleTimerExpiry(int sigNum)
 			iterator2 = (iterator2 + 1) % MAX_WINDOW_SIZE;
 	  }
 
-	  // Make segments and send the packet to the remote side
-	  do{  
-			if(retransmitDataLength >= STCP_MSS){
-				stcpSegmentLength = TCP_HEADER_SIZE + STCP_MSS;
-				stcpSegment = (char*) calloc(stcpSegmentLength, sizeof(char));
-				segmentHeader = (STCPHeader*) stcpSegment;
-
-				createStcpHeader(segmentHeader);
-
-				memcpy(stcpSegment+TCP_HEADER_SIZE, dataToRetransmit, STCP_MSS);
-			
-				#ifdef print
-				printf("\n Retransmitted segment count %d\n",ctx->numberOfRetransmission);
-				#endif
-
-				dataToRetransmit = dataToRetransmit + STCP_MSS;
-				retransmitDataLength = retransmitDataLength - STCP_MSS;
-
-				segmentHeader->th_seq = htonl(startSeqNumber);
-				startSeqNumber = startSeqNumber + STCP_MSS;
-			}
-			else{
-
-				stcpSegmentLength = TCP_HEADER_SIZE + retransmitDataLength;
-				stcpSegment = (char*) calloc(stcpSegmentLength, sizeof(char));
-				segmentHeader = (STCPHeader*) stcpSegment;
-
-				createStcpHeader(segmentHeader);
-
-				memcpy(stcpSegment+TCP_HEADER_SIZE, dataToRetransmit, retransmitDataLength);
-				segmentHeader->th_seq = htonl(startSeqNumber);
-				retransmitDataLength = 0;
-			}
-
-			do{
-			}while(stcp_network_send(ctx->sd, stcpSegment, stcpSegmentLength, NULL) < 0);
+	  #ifdef print
+	  printf("\n Retransmitted segment count %d\n",ctx->numberOfRetransmission);
+	  #endif
 
-		        numOfSegments--;
+	  // Make segments and send them to the remote side in one batch
+	  sendDataSegments(ctx->sd, dataToRetransmit, retransmitDataLength, ctx->sendBase);
 
-			if(stcpSegment){
-				free(stcpSegment);
-				stcpSegment = NULL;
-			}
-		}while(retransmitDataLength != 0 || numOfSegments != 0);  
+	  free(dataToRetransmit);
+	  dataToRetransmit = NULL;
 	  
 		ctx->numberOfRetransmission++;
 	}
-	else if((ctx->finRetransmit < MAX_RETRIES) && (ctx->connection_state == CSTATE_FINWAIT_1)){
+	else if((ctx->finRetransmit < MAX_RETRIES) && (ctx->connection_state == CSTATE_FINWAIT_1 ||
+	                                               ctx->connection_state == CSTATE_CLOSING)){
 
 	   	// Allocate memory for FIN Packet
 	   	segmentHeader = (STCPHeader*) calloc(1, sizeof(STCPHeader));
@@ -214,11 +213,8 @@ void handleTimerExpiry(int sigNum)
 	   	segmentHeader->th_flags = 0|TH_FIN;
 
 	   	//send the FIN Packet
-	   	while(stcp_network_send(ctx->sd, segmentHeader, sizeof(STCPHeader), NULL) < 0){
-           	}
+	   	(void) stcp_network_send(ctx->sd, segmentHeader, sizeof(STCPHeader), NULL);
 
-	   	// Change the state to FIN_WAIT_1
-	   	ctx->connection_state = CSTATE_FINWAIT_1;
 		ctx->finRetransmit++;
 
 		#ifdef print
@@ -235,8 +231,7 @@ void handleTimerExpiry(int sigNum)
 		segmentHeader->th_flags = 0|TH_FIN;
 		
 		//send the FIN Packet
-		while(stcp_network_send(ctx->sd, segmentHeader, sizeof(STCPHeader), NULL) < 0){
-		}
+		(void) stcp_network_send(ctx->sd, segmentHeader, sizeof(STCPHeader), NULL);
 
 		// Change the state to LAST_ACK
 		ctx->connection_state = CSTATE_LAST_ACK;
@@ -248,8 +243,10 @@ void handleTimerExpiry(int sigNum)
 		#ifdef print
        		printf("\n Network Layer has failed after trying to retransmit the packet for 6 times\n");
 		#endif
+		// Give up on the peer; the worker passes the error on
+		errno = ETIMEDOUT;
 		ctx->done = true;
-		exit(0);
+		return;
         }
 
 	if(!isTimerValueSet())
@@ -257,14 +254,36 @@ void handleTimerExpiry(int sigNum)
 
 }
 
-//Function to start timer (Timer value is chosen as 500ms)
+// Function to arm the timer to expire the given number of seconds from now
+void setTimerDeadline(time_t seconds){
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	ctx->timerDeadline.tv_sec = now.tv_sec + seconds;
+	ctx->timerDeadline.tv_nsec = now.tv_usec * 1000;
+	setTimerForUnackedData(true);
+}
+
+// Function to check whether the running timer has expired
+bool hasTimerExpired(){
+	struct timeval now;
+
+	if(!isTimerValueSet())
+		return false;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec > ctx->timerDeadline.tv_sec) ||
+	       (now.tv_sec == ctx->timerDeadline.tv_sec &&
+	        now.tv_usec * 1000 >= ctx->timerDeadline.tv_nsec);
+}
+
+//Function to start timer (Timer value is chosen as 1 second).  The worker
+//running this connection raises a TIMEOUT event once it expires
 void startTimer(){
 	#ifdef print
 	printf("\n startTime method entry\n");
 	#endif
-	setTimerForUnackedData(true);
-	signal(SIGALRM, handleTimerExpiry);
-	alarm(1);
+	setTimerDeadline(1);
 }
 
 // Function to stop the timer
@@ -273,7 +292,6 @@ void stopTimer(){
 	printf("\nstop timer method entry\n");
 	#endif
 	setTimerForUnackedData(false);
-	alarm(0);
 }
 
 
@@ -294,6 +312,83 @@ void createStcpHeader(STCPHeader* stcpHdr){
 	  }
 }
 
+// Function to find the cached payload checksum for a data segment. A segment
+// which was sent before with the same sequence number and length gets its old
+// checksum back; otherwise the oldest slot not already in use by this batch
+// is handed out, marked as unknown.
+stcp_sum_t* getPayloadSumSlot(tcp_seq seqNumber, size_t length, bool* slotsInUse){
+	unsigned int iterator;
+	segmentSumInfo* slot = NULL;
+
+	for(iterator = 0; iterator < MAX_SEGMENTS_IN_WINDOW; iterator++){
+		slot = &ctx->sentSegmentSums[iterator];
+		if(!slotsInUse[iterator] && slot->length == length && slot->seqNumber == seqNumber){
+			slotsInUse[iterator] = true;
+			return &slot->payloadSum;
+		}
+	}
+
+	// A batch never has more than MAX_SEGMENTS_IN_WINDOW segments, so a free
+	// slot always exists
+	do{
+		iterator = ctx->nextSegmentSumSlot;
+		ctx->nextSegmentSumSlot = (ctx->nextSegmentSumSlot + 1) % MAX_SEGMENTS_IN_WINDOW;
+	}while(slotsInUse[iterator]);
+
+	slotsInUse[iterator] = true;
+	slot = &ctx->sentSegmentSums[iterator];
+	slot->seqNumber = seqNumber;
+	slot->length = length;
+	slot->payloadSum = STCP_SUM_UNKNOWN;
+	return &slot->payloadSum;
+}
+
+// Function to split the data into MSS sized segments starting at the given
+// sequence number, and hand all of them to the network layer in one batch
+void sendDataSegments(mysocket_t sd, char* data, size_t dataLength, tcp_seq startSeqNumber){
+	#ifdef print
+	printf("\n sendDataSegments Method Entry\n");
+	#endif
+	char stcpSegments[MAX_SEGMENTS_IN_WINDOW][TCP_HEADER_SIZE + STCP_MSS];
+	stcp_segment_t segmentList[MAX_SEGMENTS_IN_WINDOW];
+	bool slotsInUse[MAX_SEGMENTS_IN_WINDOW] = {false};
+	unsigned int numOfSegments = 0;
+	size_t segmentDataLength = 0;
+	STCPHeader* segmentHeader = NULL;
+
+	// No more than a window's worth of data is ever outstanding
+	dataLength = MIN(dataLength, (size_t)MAX_WINDOW_SIZE);
+
+	while(dataLength > 0){
+		segmentDataLength = MIN(dataLength, (size_t)STCP_MSS);
+
+		memset(stcpSegments[numOfSegments], 0, TCP_HEADER_SIZE);
+		segmentHeader = (STCPHeader*) stcpSegments[numOfSegments];
+
+		//Fill the header
+		createStcpHeader(segmentHeader);
+		segmentHeader->th_seq = htonl(startSeqNumber);
+
+		//copy the data inside the segment
+		memcpy(stcpSegments[numOfSegments]+TCP_HEADER_SIZE, data, segmentDataLength);
+
+		segmentList[numOfSegments].data = stcpSegments[numOfSegments];
+		segmentList[numOfSegments].len = TCP_HEADER_SIZE + segmentDataLength;
+		segmentList[numOfSegments].payload_sum = getPayloadSumSlot(startSeqNumber, segmentDataLength, slotsInUse);
+		numOfSegments++;
+
+		data = data + segmentDataLength;
+		dataLength = dataLength - segmentDataLength;
+		startSeqNumber = startSeqNumber + segmentDataLength;
+	}
+
+	// Send the segments; if the network layer fails, they're treated as
+	// lost and the retransmission timer sends them again
+	if(numOfSegments > 0){
+		(void) stcp_network_send_batch(sd, segmentList, numOfSegments);
+	}
+}
+
 // Function to get the data size that can be stored 
 tcp_seq getEmptySenderBufferSize(){
 		 
@@ -337,7 +432,8 @@ void setReceivedBytesInReceiverWindow(int* rcvrWindow, size_t startPosition, siz
 	}
 }
 
-// Function which sends the data to the application 
+// Function which stages the in-order data for the application. The data is
+// passed up by flushDataToApplication() once per batch of segments.
 void sendDataToApplication(mysocket_t sd){
   
    #ifdef print
@@ -356,9 +452,12 @@ void sendDataToApplication(mysocket_t sd){
    if(lengthOfDataToSent > MAX_WINDOW_SIZE){
 		lengthOfDataToSent = MAX_WINDOW_SIZE;
    }
-   
-   //create the buffer to store data to send to application
-   dataToApp = (char*) calloc(lengthOfDataToSent, sizeof(char));
+
+   // Make room in the staging buffer if this data doesn't fit
+   if(ctx->appDeliveryLength + lengthOfDataToSent > sizeof(ctx->appDeliveryBuffer)){
+		flushDataToApplication(sd);
+   }
+   dataToApp = ctx->appDeliveryBuffer + ctx->appDeliveryLength;
 
    //copy the data from receiver window
    iterator = ctx->rcvBufferBaseInfo;
@@ -368,14 +467,7 @@ void sendDataToApplication(mysocket_t sd){
 	  ctx->rcvrWindow[iterator] = -1;
 	  iterator = (iterator + 1)%MAX_WINDOW_SIZE;
    }
-
-   //send data to App
-   stcp_app_send(sd, dataToApp, lengthOfDataToSent);
-   
-   if(dataToApp != NULL){
-		free(dataToApp);
-		dataToApp = NULL;
-   }
+   ctx->appDeliveryLength = ctx->appDeliveryLength + lengthOfDataToSent;
 
    //Update the varibales
    ctx->expectedSeqNumber = ctx->expectedSeqNumber + lengthOfDataToSent;
@@ -386,6 +478,26 @@ void sendDataToApplication(mysocket_t sd){
 
 }
 
+// Function which passes the staged in-order data up to the application
+void flushDataToApplication(mysocket_t sd){
+
+   #ifdef print
+   printf("\n flushDataToApplication Method Entry\n");
+   #endif
+   if(ctx->appDeliveryLength > 0){
+		stcp_app_send(sd, ctx->appDeliveryBuffer, ctx->appDeliveryLength);
+		ctx->appDeliveryLength = 0;
+   }
+}
+
+// Function to tell the application the peer has closed. Any data staged in
+// this batch is passed up first, as it comes ahead of the EOF
+void notifyFinReceived(mysocket_t sd){
+
+   flushDataToApplication(sd);
+   stcp_fin_received(sd);
+}
+
 // Function to send the Acknowledgement
 void sendAcknowledgementPacket(mysocket_t sd){
 
@@ -397,298 +509,626 @@ void sendAcknowledgementPacket(mysocket_t sd){
   
    stcpAckPacket->th_ack = htonl(ctx->expectedSeqNumber);
    stcpAckPacket->th_flags = 0|TH_ACK;
-   while(stcp_network_send(ctx->sd, stcpAckPacket, sizeof(STCPHeader), NULL) < 0){
-   }
+   (void) stcp_network_send(ctx->sd, stcpAckPacket, sizeof(STCPHeader), NULL);
    #ifdef print
    printf("\n Sending ACK for seq number %u\n",ctx->expectedSeqNumber);
    #endif
+   ctx->ackPending = false;
+   free(stcpAckPacket);
 }
 
-/* initialise the transport layer, and start the main loop, handling
-* any data from the peer or the application.  this function should not
-* return until the connection is closed.
-*/
-void transport_init(mysocket_t sd, bool_t is_active)
-{
-	ssize_t recvdDataLength = 0;
-	unsigned int rcvdEvent = 0;
-	tcp_seq remoteSeqNumber;
-	tcp_seq localSeqNumber;
-	int success = 0;
-	int retries = 0;
+// Function to finish off a batch of received segments: the staged data is
+// passed up to the application once, and a single cumulative ACK is sent
+void flushReceivedData(mysocket_t sd){
 
-	time_t timeToTimeout;
-	timeToTimeout = time(NULL);
-	timeToTimeout = timeToTimeout + 2;
+   flushDataToApplication(sd);
 
-	struct timespec waitTime;
-	waitTime.tv_sec = timeToTimeout;
+   if(ctx->ackPending){
+		sendAcknowledgementPacket(sd);
+   }
+}
 
-	// Control packet pointer
-	STCPHeader* stcpPacket = NULL;
+// Function to process one segment received from the network. Data
+// delivered to the application and the ACK for it are deferred until
+// flushReceivedData() is called once for the whole batch of segments.
+void handleNetworkSegment(mysocket_t sd, char* stcpSegment, size_t stcpSegmentLength){
 
+	#ifdef print
+	printf("\n handleNetworkSegment Method Entry\n");
+	#endif
+	size_t rcvdNetworkDataLength = 0, startIndex = 0;
+	char* rcvdNetworkData = NULL;
+	STCPHeader* segmentHeader = NULL;
+	STCPHeader* ackSegment = NULL;
 
-	ctx = (context_t *) calloc(1, sizeof(context_t));
-	assert(ctx);
+	segmentHeader = (STCPHeader*) stcpSegment;
+	// Endianess Support
+	segmentHeader->th_ack = ntohl(segmentHeader->th_ack);
+	segmentHeader->th_seq = ntohl(segmentHeader->th_seq);
+	segmentHeader->th_win = ntohs(segmentHeader->th_win);
 
-	ctx->done = false;
-	ctx->connection_state = CSTATE_DEFAULT;
+	ctx->currentRcvrWindowSize = (segmentHeader->th_win); /* storing the remote side receiver window */
 
-	// Generate the initial Sequence Number
-	generate_initial_seq_num(ctx);
-	localSeqNumber = ctx->initial_sequence_num;
-
-	/* XXX: you should send a SYN packet here if is_active, or wait for one
-	* to arrive if !is_active.  after the handshake completes, unblock the
-	* application with stcp_unblock_application(sd).  you may also use
-	* this to communicate an error condition back to the application, e.g.
-	* if connection fails; to do so, just set errno appropriately (e.g. to
-	* ECONNREFUSED, etc.) before calling the function.
-	*/
+	/* Here we will first see whether there is any data in tha packet or its just an ACK packet
+	* for data packet we need to send the ACK ASAP */
+
+	if(TCP_OPTIONS_LEN(stcpSegment) == 0){
+		rcvdNetworkDataLength = stcpSegmentLength - TCP_HEADER_SIZE; // There is no options in segment
+	}else{
+		rcvdNetworkDataLength = stcpSegmentLength - TCP_OPTIONS_LEN(stcpSegment) - TCP_HEADER_SIZE;
+	}
+
+	// This will handle DATA Packet with or without ACK 
+	if(rcvdNetworkDataLength != 0){
+
+		// Handle the ACK packet and DATA Packet separately
+		// Here we will update the sequence numbers as per the ACK received
+		if(segmentHeader->th_flags & TH_ACK){
+			if(segmentHeader->th_ack > ctx->sendBase && 
+				segmentHeader->th_ack <= ctx->nextSeqNum)
+			{
 
-	if(is_active)
-	{
-		while(success == 0 && retries < MAX_RETRIES)
-		{
-			// Allocate memory of header size to send the SYN Packet
-			stcpPacket = (STCPHeader*) calloc(1, sizeof(STCPHeader));
-
-			// Creating a SYN packet 
-			stcpPacket->th_flags = 0 | TH_SYN;
-			stcpPacket->th_seq = htonl(localSeqNumber++);
-			stcpPacket->th_off = 0;
-			stcpPacket->th_win = htons(MAX_WINDOW_SIZE);
-			stcpPacket->th_ack = htonl(0);
-
-			// SYN packet sent
-			if(stcp_network_send(sd, stcpPacket, sizeof(STCPHeader), NULL) < 0){
 				#ifdef print
-				printf("\nFailed to send the SYN packet \n");
+				printf("\n Data packet with valid ACK packet received with seq number %u and seq number of ack field %u\n", segmentHeader->th_seq,segmentHeader->th_ack);
 				#endif
-				errno = ECONNREFUSED;
+				ctx->sendBufferBaseInfo = (ctx->sendBufferBaseInfo + (segmentHeader->th_ack - ctx->sendBase)) % MAX_WINDOW_SIZE;
+				ctx->sendBase = segmentHeader->th_ack;
+				// Timer Check, if running then stop it`
+				if(isTimerValueSet()){
+					stopTimer();
+				}
+				// Restart the time if there are still some unacked data
+				if(ctx->sendBase < ctx->nextSeqNum){
+					startTimer();
+				}
+			}	
+		}//Handle the DATA Packet along with FIN packet
+		if((segmentHeader->th_flags & TH_FIN) &&
+	                                        (segmentHeader->th_seq == ctx->expectedSeqNumber)) {
+
+				// The FIN follows the data
+				ctx->peerFinSeqNumber = segmentHeader->th_seq + rcvdNetworkDataLength;
+
+				if(ctx->connection_state == CSTATE_ESTABLISHED){
+	                                                // Notify the application
+                                                        notifyFinReceived(sd);
+                                                        // Change the state to CLOSE_WAIT
+                                                        ctx->connection_state = CSTATE_CLOSE_WAIT;
+                                                                                                                                                                                         }
+                                                 else if(ctx->connection_state == CSTATE_FINWAIT_1){
+                                                        // Notify the application       
+                                                        notifyFinReceived(sd);
+                                                                                                                                                                                                //Change the state to CLOSING
+                                                        ctx->connection_state = CSTATE_CLOSING;
+                                                                                                                                                                                         }else if(ctx->connection_state == CSTATE_FINWAIT_2){
+                                                        // Notify the application
+                                                        notifyFinReceived(sd);
+                                                                                                                                                                                                // Change state to TIME_WAIT
+                                                        enterTimeWait(sd);
+				}
+		}
+		#ifdef print
+		printf("\n DAta packet received with sequence number %u\n",segmentHeader->th_seq);
+		#endif
+	
+		// check whether the segment is inorder (Receiver's Action)
+		if(segmentHeader->th_seq == ctx->expectedSeqNumber){
+
+			#ifdef print
+			printf("\n In Order Data Received\n");
+			#endif
+			if(rcvdNetworkDataLength > MAX_WINDOW_SIZE){
+				rcvdNetworkDataLength = MAX_WINDOW_SIZE;
 			}
-			else{
+	   
+			rcvdNetworkData = (char*) calloc(rcvdNetworkDataLength, sizeof(char));
+			memcpy(rcvdNetworkData, stcpSegment+TCP_DATA_START(stcpSegment), rcvdNetworkDataLength);
+
+			// store the received data into the receiver data buffer
+			storeDataIntoBuffer(ctx->rcvrDataBuffer, rcvdNetworkData, 
+			ctx->rcvBufferBaseInfo, rcvdNetworkDataLength);
+
+			// switch the bytes on in receiver window which have been received
+			setReceivedBytesInReceiverWindow(ctx->rcvrWindow, ctx->rcvBufferBaseInfo, rcvdNetworkDataLength);
+
+			// Send Data to Application 
+			sendDataToApplication(sd);
+
+			//Ack for the inorder data is sent once per batch
+			ctx->ackPending = true;
+	   
+			// Free the memory after storing it inside the receiver buffer
+			if(rcvdNetworkData != NULL){
+				free(rcvdNetworkData);
+				rcvdNetworkData = NULL;
+			}
+		}
+		//Received the out of order data (Receiver Action)
+		else if(segmentHeader->th_seq > ctx->expectedSeqNumber && 
+				segmentHeader->th_seq <= (ctx->expectedSeqNumber + MAX_WINDOW_SIZE -1)){
 				#ifdef print
-				printf("SYN Packet Sent %d\n",stcpPacket->th_seq);
+				printf("\n Out of Order Data received\n");
 				#endif
-				//Connection State Changed to SYN SENT
-				ctx->connection_state = CSTATE_SYNSENT;
-				free(stcpPacket);
-				stcpPacket = NULL;
-			}// End of SYN
+		
+				// check for the buffer space in receivers end. Space should be there
+				// as we are sending the data from sender side only if rcvr window size
+				// is greater than 0. To be double sure we can check here again
+				if(ctx->selfRcvWindowSize > 0){
+					//check for data size is within the window size or not
+					if((segmentHeader->th_seq + rcvdNetworkDataLength) > 
+								(ctx->expectedSeqNumber + MAX_WINDOW_SIZE - 1)){
+						rcvdNetworkDataLength = (ctx->expectedSeqNumber + MAX_WINDOW_SIZE - segmentHeader->th_seq);
+					} 
+					
+					rcvdNetworkData = (char*) calloc(rcvdNetworkDataLength, sizeof(char));
+					memcpy(rcvdNetworkData, stcpSegment+TCP_DATA_START(stcpSegment), rcvdNetworkDataLength);
 
-			// Wait for SYN-ACK to be received for infinite time period (Need to implement a timeout mechanism)
-			rcvdEvent = stcp_wait_for_event(sd, NETWORK_DATA | TIMEOUT, &waitTime);
-			stcpPacket = (STCPHeader*) calloc(1, sizeof(STCPHeader));
-			assert(stcpPacket);
+					startIndex = (ctx->rcvBufferBaseInfo + (segmentHeader->th_seq - ctx->expectedSeqNumber))%MAX_WINDOW_SIZE;
+						
 
-			if(rcvdEvent & NETWORK_DATA){
+					storeDataIntoBuffer(ctx->rcvrDataBuffer, rcvdNetworkData, startIndex, rcvdNetworkDataLength);
+						
 
-				if((recvdDataLength = stcp_network_recv(sd, stcpPacket, sizeof(STCPHeader))) < 0){
-					#ifdef print
-					printf("\n SYN-ACK packet of size 0 received from the Network\n");
-					#endif
+					//switch the bytes on in receiver window which have been received
+					setReceivedBytesInReceiverWindow(ctx->rcvrWindow, startIndex, rcvdNetworkDataLength);
+	
+					//Update the receiver window size 
+					ctx->selfRcvWindowSize = ctx->selfRcvWindowSize - rcvdNetworkDataLength;
+
+					//Acknowledgement is sent once per batch
+					ctx->ackPending = true;
+
+					//Free the memory after storing it insider the receiver buffer
+					if(rcvdNetworkData != NULL){
+						free(rcvdNetworkData);
+						rcvdNetworkData = NULL;
+					}
 				}
-				else{
-					#ifdef print
-					printf("\n Received the Packet from Network Layer after sending SYN\n");
-					#endif
+		}
+		// Data Received contains part of old data and part of expected data (Receiver Action)
+		else if(segmentHeader->th_seq < ctx->expectedSeqNumber && 
+		                           segmentHeader->th_seq >= ctx->expectedSeqNumber - MAX_WINDOW_SIZE){
+
+			// Discard the Data which is already acknowledged
+			if((segmentHeader->th_seq + rcvdNetworkDataLength) >= ctx->expectedSeqNumber){
+			// This means data has part of new data also. Need to store that and send to application
+			        #ifdef print
+				printf("\n Old Segment received may contain some new data\n");
+				#endif
+				// Data Start Position in packet
+				startIndex = ctx->expectedSeqNumber - segmentHeader->th_seq;
+			
+				rcvdNetworkDataLength = (rcvdNetworkDataLength - (ctx->expectedSeqNumber - segmentHeader->th_seq));
+
+				if(rcvdNetworkDataLength > MAX_WINDOW_SIZE){
+					rcvdNetworkDataLength = MAX_WINDOW_SIZE;
+			        }
 
-					stcpPacket = (STCPHeader *)(stcpPacket);
-					stcpPacket->th_ack = ntohl(stcpPacket->th_ack);
-					stcpPacket->th_seq = ntohl(stcpPacket->th_seq);
+				//Copy the required portion of data from the segment
+				rcvdNetworkData = (char*) calloc(rcvdNetworkDataLength, sizeof(char));
+				memcpy(rcvdNetworkData, stcpSegment+TCP_DATA_START(stcpSegment)+startIndex, rcvdNetworkDataLength);
 
+				// store the received data into the receiver data buffer
+				storeDataIntoBuffer(ctx->rcvrDataBuffer, rcvdNetworkData,
+				ctx->rcvBufferBaseInfo, rcvdNetworkDataLength);
+
+				// switch the bytes on in receiver window which have been received
+				setReceivedBytesInReceiverWindow(ctx->rcvrWindow, ctx->rcvBufferBaseInfo, rcvdNetworkDataLength);
+
+				// Send Data to Application 
+				sendDataToApplication(sd);
+
+				//Ack for the inorder data is sent once per batch
+				ctx->ackPending = true;
+
+				// Free the memory after storing it inside the receiver buffer
+				if(rcvdNetworkData != NULL){
+					free(rcvdNetworkData);
+					rcvdNetworkData = NULL;
+				}
+			}else
+				ctx->ackPending = true;
+		}
+	}
+	// PURE ACK PACKET RECEIVED
+	else if( rcvdNetworkDataLength == 0){
+		// Received the ACK packet (Sender Action)
+		if(segmentHeader->th_flags & TH_ACK){
+			if(ctx->connection_state == CSTATE_ESTABLISHED){
+				if(segmentHeader->th_ack > ctx->sendBase && segmentHeader->th_ack <= ctx->nextSeqNum)
+				{
 					#ifdef print
-					printf("\n Sequence Number of SYNACK Packet is %d, ACK %d",stcpPacket->th_seq, stcpPacket->th_ack);
+					printf("\n Ack packet received with seq number %u and seq number of ack field %u\n", segmentHeader->th_seq,segmentHeader->th_ack);
 					#endif
-					if((stcpPacket->th_flags & TH_SYN) && (stcpPacket->th_flags & TH_ACK) &&
-						(stcpPacket->th_ack == (localSeqNumber))){
-
-						#ifdef print
-						printf("\n SYN-ACK packet received from the server\n");
-						#endif
-						success = 1;
-						remoteSeqNumber = stcpPacket->th_seq;
-
-						//Connection State Changed to SYN-ACK RCVD
-						ctx->connection_state = CSTATE_SYNACKRCVD;
-						free(stcpPacket);
-						stcpPacket = NULL; // End of SYN-ACK
-
-						//Creating an ACK packet
-						stcpPacket = (STCPHeader*) calloc(1, sizeof(STCPHeader));
-						assert(stcpPacket);
-
-						stcpPacket->th_flags = 0 | TH_ACK;
-						stcpPacket->th_seq = htonl(localSeqNumber++);
-						stcpPacket->th_off = 0;
-						stcpPacket->th_win = htons(MAX_WINDOW_SIZE);
-						stcpPacket->th_ack = htonl(++remoteSeqNumber);
-
-						if(stcp_network_send(sd, stcpPacket, sizeof(STCPHeader), NULL) < 0){
-							#ifdef print	
-							printf("\nFailed to send the ACK packet \n");
-							#endif
-							errno = ECONNREFUSED;
-						}
-						else{
-							#ifdef print
-							printf("\n ACK packet sent successfully with seq number %d\n", stcpPacket->th_seq);
-							#endif
-							//Connection State Changed to ACK SENT
-							ctx->connection_state = CSTATE_ACKSENT;
-							free(stcpPacket);
-							stcpPacket = NULL;
-						}
-					}else{
-							#ifdef print
-							printf("\n Wrong SYN-ACK packet received\n");
-							#endif
-							retries++;
+					ctx->sendBufferBaseInfo = (ctx->sendBufferBaseInfo + (segmentHeader->th_ack - ctx->sendBase)) % MAX_WINDOW_SIZE;
+					ctx->sendBase = segmentHeader->th_ack;
+				
+			        	// Timer Check, if running then stop it`
+					if(isTimerValueSet()){
+						stopTimer();
 					}
-				}            
-			}else if(rcvdEvent == TIMEOUT){
-				#ifdef print
-				printf("\n Timeout of SYN Packet. Retransmitting SYN Packet \n");
-				#endif
-				retries++;
+					// Restart the time if there are still some unacked data
+					if(ctx->sendBase < ctx->nextSeqNum){
+						startTimer();
+					}
+                                                        // ACK received for INORDER Data
+					ctx->numberOfRetransmission = 0;
+				
+				}else{
+					#ifdef print
+					printf("\n ACK Packet with sequence number out of congestion window\n");
+					#endif
+				}
+			}else if(ctx->connection_state == CSTATE_FINWAIT_1){
+				// change the state and send nothing
+				ctx->connection_state = CSTATE_FINWAIT_2;
+				ctx->finRetransmit = 0;
+
+				if(isTimerValueSet()){
+				   stopTimer();
+				}
+			}else if(ctx->connection_state == CSTATE_LAST_ACK){
+			        ctx->finRetransmit = 0;	
+                                                ctx->connection_state = CSTATE_TIME_WAIT;
+				if(isTimerValueSet()){
+				    stopTimer();
+				}
+				// change the state and send nothing
+                                                ctx->done = true;
+
+			}else if(ctx->connection_state == CSTATE_CLOSING){
+				// change the state to time_wait
+				ctx->finRetransmit = 0;
+
+				 if(isTimerValueSet()){
+				     stopTimer();
+				 }
+				 enterTimeWait(sd);
 			}
-		}
+		   
+		}// Received a FIN segment
+		else if((segmentHeader->th_flags & TH_FIN) && 
+		        (segmentHeader->th_seq == ctx->expectedSeqNumber)) {
+
+			ctx->peerFinSeqNumber = segmentHeader->th_seq;
+
+			if(ctx->connection_state == CSTATE_ESTABLISHED){
+			        // Notify the application
+				notifyFinReceived(sd);
+				// Send the ACK packet
+				ackSegment = (STCPHeader*) calloc(1, sizeof(STCPHeader));
+				createStcpHeader(ackSegment);
+
+				ackSegment->th_ack = htonl(++(ctx->expectedSeqNumber));
+				ctx->ackPending = false; /* this ACK is cumulative */
+				ackSegment->th_flags = 0|TH_ACK;
+
+				(void) stcp_network_send(sd, ackSegment, sizeof(STCPHeader), NULL);
+
+				// Change the state to CLOSE_WAIT
+				ctx->connection_state = CSTATE_CLOSE_WAIT;
+			
+			        // free the memory
+				if( ackSegment != NULL){
+				        free(ackSegment);
+					ackSegment = NULL;
+			        }
+			}
+			else if(ctx->connection_state == CSTATE_FINWAIT_1){
+		                // Notify the application	
+				notifyFinReceived(sd);
+
+				// Send the Ack
+				ackSegment = (STCPHeader*) calloc(1, sizeof(STCPHeader));
+                                                createStcpHeader(ackSegment);
+                                                ackSegment->th_ack = htonl(++(ctx->expectedSeqNumber));
+                                                ctx->ackPending = false; /* this ACK is cumulative */
+		                ackSegment->th_flags = 0|TH_ACK;
+
+                                                (void) stcp_network_send(sd, ackSegment, sizeof(STCPHeader), NULL);
+				//Change the state to CLOSING
+				ctx->connection_state = CSTATE_CLOSING;
+
+			}else if(ctx->connection_state == CSTATE_FINWAIT_2){
+				// Notify the application
+				notifyFinReceived(sd);
+				// Send the ACK Packet
+                                                ackSegment = (STCPHeader*) calloc(1, sizeof(STCPHeader));
+                                                createStcpHeader(ackSegment);
+                                                ackSegment->th_ack = htonl(++(ctx->expectedSeqNumber));
+                                                ctx->ackPending = false; /* this ACK is cumulative */
+		                ackSegment->th_flags = 0|TH_ACK;
+
+		                (void) stcp_network_send(sd, ackSegment, sizeof(STCPHeader), NULL);
+
+				// Change state to TIME_WAIT
+				enterTimeWait(sd);
+			}
+		}				
 	}
-	else
-	{
-		// Server Side 
-		// - Waiting for the SYN Packet to be received
-		rcvdEvent = stcp_wait_for_event(sd, NETWORK_DATA, NULL);
+}
+
+// Function to enter TIME_WAIT.  The connection is done with here; the
+// mysocket layer keeps just enough of it to ACK the peer's FIN again if
+// that's retransmitted
+static void enterTimeWait(mysocket_t sd)
+{
+	ctx->connection_state = CSTATE_TIME_WAIT;
+	stcp_time_wait(sd, ctx->nextSeqNum, ctx->peerFinSeqNumber + 1);
+	ctx->done = true;
+}
+
+// Function to send a SYN (active side) or SYN-ACK (passive side) of the
+// handshake, and wait for the peer's answer for at most 2 seconds
+static void sendHandshakeSegment(mysocket_t sd)
+{
+	STCPHeader* stcpPacket = NULL;
+
+	stcpPacket = (STCPHeader*) calloc(1, sizeof(STCPHeader));
+	assert(stcpPacket);
+
+	if(ctx->isActive){
+		// Creating a SYN packet 
+		stcpPacket->th_flags = 0 | TH_SYN;
+		stcpPacket->th_seq = htonl(ctx->localSeqNumber++);
+		stcpPacket->th_ack = htonl(0);
+	}else{
+		//Building the SYN-ACK Packet to send
+		stcpPacket->th_flags = (0 | TH_ACK | TH_SYN);
+		stcpPacket->th_seq = htonl(ctx->localSeqNumber++);
+		stcpPacket->th_ack = htonl(++ctx->remoteSeqNumber);
+	}
+	stcpPacket->th_off = 0;
+	stcpPacket->th_win = htons(MAX_WINDOW_SIZE);
+
+	if(stcp_network_send(sd, stcpPacket, sizeof(STCPHeader), NULL) < 0){
+		#ifdef print
+		printf("\nFailed to send the handshake packet \n");
+		#endif
+		errno = ECONNREFUSED;
+	}
+	else{
+		#ifdef print
+		printf("Handshake Packet Sent %d\n",stcpPacket->th_seq);
+		#endif
+		//Connection State Changed to SYN SENT or SYNACK SENT
+		ctx->connection_state = ctx->isActive ? CSTATE_SYNSENT : CSTATE_SYNACKSENT;
+	}
+	free(stcpPacket);
+
+	setTimerDeadline(2);
+}
+
+// Function to retry the handshake after a timeout or a wrong answer from
+// the peer; gives up after MAX_RETRIES attempts
+static void retryHandshake(mysocket_t sd)
+{
+	if(++ctx->handshakeRetries < MAX_RETRIES){
+		sendHandshakeSegment(sd);
+	}else{
+		#ifdef print
+		printf("\n Handshake failed after %d retries\n", ctx->handshakeRetries);
+		#endif
+		ctx->done = true;
+	}
+}
+
+// Function to handle one event during the handshake.  The connection is
+// established once the SYN-ACK (active side) or the final ACK (passive
+// side) arrives
+static void handle_handshake_event(mysocket_t sd, unsigned int event)
+{
+	STCPHeader* stcpPacket = NULL;
+	bool success = false;
 
-		// Allocating memory to receive buffer
+	if(event & NETWORK_DATA){
 		stcpPacket = (STCPHeader*) calloc(1, sizeof(STCPHeader));
 		assert(stcpPacket);
 
-		if(rcvdEvent & NETWORK_DATA)
-		{
-			if((recvdDataLength = stcp_network_recv(sd, stcpPacket, sizeof(STCPHeader))) < 0){
+		if(stcp_network_recv(sd, stcpPacket, sizeof(STCPHeader)) < 0){
+			#ifdef print
+			printf("\n Handshake packet of size 0 received from the Network\n");
+			#endif
+			if(ctx->isActive || ctx->connection_state != CSTATE_DEFAULT)
+				sendHandshakeSegment(sd);
+			else
+				ctx->done = true;
+		}
+		else if(ctx->isActive){
+			stcpPacket->th_ack = ntohl(stcpPacket->th_ack);
+			stcpPacket->th_seq = ntohl(stcpPacket->th_seq);
+
+			#ifdef print
+			printf("\n Sequence Number of SYNACK Packet is %d, ACK %d",stcpPacket->th_seq, stcpPacket->th_ack);
+			#endif
+			if((stcpPacket->th_flags & TH_SYN) && (stcpPacket->th_flags & TH_ACK) &&
+				(stcpPacket->th_ack == (ctx->localSeqNumber))){
+
 				#ifdef print
-				printf("\n SYN packet of size 0 received from the Network\n");
+				printf("\n SYN-ACK packet received from the server\n");
 				#endif
+				success = true;
+				ctx->remoteSeqNumber = stcpPacket->th_seq;
+
+				//Connection State Changed to SYN-ACK RCVD
+				ctx->connection_state = CSTATE_SYNACKRCVD;
+
+				//Creating an ACK packet
+				memset(stcpPacket, 0, sizeof(STCPHeader));
+				stcpPacket->th_flags = 0 | TH_ACK;
+				stcpPacket->th_seq = htonl(ctx->localSeqNumber++);
+				stcpPacket->th_off = 0;
+				stcpPacket->th_win = htons(MAX_WINDOW_SIZE);
+				stcpPacket->th_ack = htonl(++ctx->remoteSeqNumber);
+
+				if(stcp_network_send(sd, stcpPacket, sizeof(STCPHeader), NULL) < 0){
+					#ifdef print	
+					printf("\nFailed to send the ACK packet \n");
+					#endif
+					errno = ECONNREFUSED;
+				}
+				else{
+					//Connection State Changed to ACK SENT
+					ctx->connection_state = CSTATE_ACKSENT;
+				}
+			}else{
+				#ifdef print
+				printf("\n Wrong SYN-ACK packet received\n");
+				#endif
+				retryHandshake(sd);
 			}
-			else{
+		}
+		else if(ctx->connection_state == CSTATE_DEFAULT){
+			// Server Side - the first packet has to be the SYN
+			stcpPacket->th_seq = ntohl(stcpPacket->th_seq);
+
+			if(stcpPacket->th_flags & TH_SYN){
 				#ifdef print
-				printf("\n Received a Packet from Network Layer\n");
+				printf("\n SYN packet received from the client with seqNum %d\n",stcpPacket->th_seq);
 				#endif
+				//Connection State Changed to SYNRCVD
+				ctx->connection_state = CSTATE_SYNRCVD;
+				ctx->remoteSeqNumber = stcpPacket->th_seq;
 
-				stcpPacket = (STCPHeader *)(stcpPacket);
-				stcpPacket->th_seq = ntohl(stcpPacket->th_seq);
+				sendHandshakeSegment(sd);
+			}else{
+				ctx->done = true;
+			}
+		}
+		else{
+			stcpPacket->th_ack = ntohl(stcpPacket->th_ack);
+			stcpPacket->th_seq = ntohl(stcpPacket->th_seq);
 
-				if(stcpPacket->th_flags & TH_SYN){
-					#ifdef print
-					printf("\n SYN packet received from the client with seqNum %d\n",stcpPacket->th_seq);
-					#endif
-					//Connection State Changed to SYNRCVD
-					ctx->connection_state = CSTATE_SYNRCVD;
-					remoteSeqNumber = stcpPacket->th_seq;
-					free(stcpPacket);
-					stcpPacket = NULL;
-
-					while( retries < MAX_RETRIES && success == 0)
-					{
-						//Building the SYN-ACK Packet to send
-						stcpPacket = (STCPHeader*) calloc(1, sizeof(STCPHeader));
-						assert(stcpPacket);
-
-						stcpPacket->th_flags = (0 | TH_ACK | TH_SYN);
-						stcpPacket->th_seq = htonl(localSeqNumber++);
-						stcpPacket->th_off = 0;
-						stcpPacket->th_win = htons(MAX_WINDOW_SIZE);
-						stcpPacket->th_ack = htonl(++remoteSeqNumber);
-
-						// Sending the SYN-ACK Packet
-						if(stcp_network_send(sd, stcpPacket, sizeof(STCPHeader), NULL) < 0){
-							#ifdef print
-							printf("\nFailed to send the SYN-ACK packet \n");
-							#endif
-							errno = ECONNREFUSED;
-						}else
-						{
-							#ifdef print
-							printf("SYN-ACK sent with Seq Number %d",stcpPacket->th_seq);
-							#endif
-							//Connection State Changed to SYNACKSENT
-							ctx->connection_state = CSTATE_SYNACKSENT;
-							free(stcpPacket);
-							stcpPacket = NULL;
-						} // End of SYN-ACK PACKET
-
-						//Wait for ACK packet
-						rcvdEvent = stcp_wait_for_event(sd, NETWORK_DATA | TIMEOUT, &waitTime);
-						stcpPacket = (STCPHeader*) calloc(1, sizeof(STCPHeader));
-						assert(stcpPacket);
-
-						if(rcvdEvent & NETWORK_DATA){
-
-							if((recvdDataLength = stcp_network_recv(sd, stcpPacket, sizeof(STCPHeader))) < 0){
-								#ifdef print
-								printf("\n ACK packet of size 0 received from the Network\n");
-								#endif
-							}
-							else{
-								#ifdef print
-								printf("\n Received the ACK Packet from Network Layer after sending SYN-ACK\n");
-								#endif
-
-								stcpPacket = (STCPHeader *)(stcpPacket);
-								stcpPacket->th_ack = ntohl(stcpPacket->th_ack);
-								stcpPacket->th_seq = ntohl(stcpPacket->th_seq);
-
-								if((stcpPacket->th_flags & TH_ACK) && 
-									stcpPacket->th_ack == (localSeqNumber)){
-						
-									success = 1;
-									#ifdef print
-									printf("\n ACK packet received from the client with Seq Number %d in seq field and %d in ack field \n",stcpPacket->th_seq,stcpPacket->th_ack);
-									#endif
-									remoteSeqNumber = stcpPacket->th_seq + 1;
-
-									//Connection State Changed to ACK RCVD
-									ctx->connection_state = CSTATE_ACKRCVD;
-									free(stcpPacket);
-									stcpPacket = NULL;
-								}
-								else{
-									#ifdef print
-									printf("\nWrong Ack Packet Received\n");
-									#endif
-									retries++;
-								}
-							}
-						}else if(rcvdEvent & TIMEOUT){
-							#ifdef print
-							printf("\n Timeout happened for SYN-ACK Packet\n");
-							#endif
-							retries++;
-						}
-					}
-				}
+			if((stcpPacket->th_flags & TH_ACK) && 
+				stcpPacket->th_ack == (ctx->localSeqNumber)){
+				#ifdef print
+				printf("\n ACK packet received from the client with Seq Number %d in seq field and %d in ack field \n",stcpPacket->th_seq,stcpPacket->th_ack);
+				#endif
+				success = true;
+				ctx->remoteSeqNumber = stcpPacket->th_seq + 1;
+
+				//Connection State Changed to ACK RCVD
+				ctx->connection_state = CSTATE_ACKRCVD;
+			}
+			else{
+				#ifdef print
+				printf("\nWrong Ack Packet Received\n");
+				#endif
+				retryHandshake(sd);
 			}
 		}
-	}        
+		free(stcpPacket);
+	}
+	else if(hasTimerExpired()){
+		#ifdef print
+		printf("\n Timeout of handshake packet. Retransmitting it \n");
+		#endif
+		retryHandshake(sd);
+	}
 
-	if(success == 1){
+	if(success){
+		stopTimer();
 		ctx->connection_state = CSTATE_ESTABLISHED;
-		ctx->initial_sequence_num = localSeqNumber;
-		ctx->remote_sequence_num = remoteSeqNumber;
+		ctx->initial_sequence_num = ctx->localSeqNumber;
+		ctx->remote_sequence_num = ctx->remoteSeqNumber;
 		stcp_unblock_application(sd);
 
-		control_loop(sd, ctx);
-	}else{
-		ctx->done = true;
+		initialize_connection(sd, ctx);
 	}
+}
 
-	/* do any cleanup here */
-	if(stcpPacket != NULL){
-		free(stcpPacket);
+// Function to tell the worker which events this connection waits for next.
+// Data from the application is only taken while there's room in the sender
+// buffer, and a timeout is requested while the timer is running
+static void request_next_event(mysocket_t sd)
+{
+	unsigned int flags;
+
+	// The application has closed the connection, so the peer's FIN isn't
+	// waited for forever
+	if(ctx->connection_state == CSTATE_FINWAIT_2 && !isTimerValueSet()){
+		setTimerDeadline(FIN_WAIT_2_TIMEOUT);
 	}
+
+	if(ctx->connection_state < CSTATE_ESTABLISHED){
+		flags = NETWORK_DATA | TIMEOUT;
+	}else if(getEmptySenderBufferSize() == 0){
+		flags = NETWORK_DATA | APP_CLOSE_REQUESTED | TIMEOUT;
+	}else{
+		flags = ANY_EVENT;
+	}
+
+	stcp_request_event(sd, flags, isTimerValueSet() ? &ctx->timerDeadline : NULL);
+}
+
+// Function to finish with the connection once it's done
+static void finish_connection(mysocket_t sd)
+{
 	free(ctx);
+	ctx = NULL;
+	stcp_set_context(sd, NULL);
+	stcp_transport_done(sd);
+}
+
+/* initialise the transport layer for a new connection.  this sends the SYN
+* if is_active; the rest of the handshake, and any data from the peer or
+* the application after it, is handled by transport_handle_event() as the
+* transport worker delivers events for the connection.
+*/
+void transport_init(mysocket_t sd, bool_t is_active)
+{
+	ctx = (context_t *) calloc(1, sizeof(context_t));
+	assert(ctx);
+
+	ctx->done = false;
+	ctx->connection_state = CSTATE_DEFAULT;
+	ctx->isActive = is_active;
+	ctx->handshakeRetries = 0;
+	setTimerForUnackedData(false);
+
+	// Generate the initial Sequence Number
+	generate_initial_seq_num(ctx);
+	ctx->localSeqNumber = ctx->initial_sequence_num;
+
+	stcp_set_context(sd, ctx);
+
+	/* send a SYN packet here if is_active, or wait for one to arrive if
+	* !is_active.  after the handshake completes, the application is
+	* unblocked with stcp_unblock_application(sd); if it fails, errno is
+	* set appropriately (e.g. to ECONNREFUSED) and the worker passes it on.
+	*/
+	if(is_active){
+		sendHandshakeSegment(sd);
+	}else if(stcp_get_syn_ack_sent(sd, &ctx->remoteSeqNumber, &ctx->localSeqNumber)){
+		// The listening socket already answered the SYN (with a SYN cookie),
+		// so pick up as though sendHandshakeSegment() had sent the SYN-ACK;
+		// the first packet is the client's ACK
+		ctx->remoteSeqNumber++;
+		ctx->localSeqNumber++;
+		ctx->connection_state = CSTATE_SYNACKSENT;
+		setTimerDeadline(2);
+	}
+
+	request_next_event(sd);
+}
+
+/* handle the events the transport worker delivers for a connection; the
+* TIMEOUT event (no flags) means the connection's timer has expired.
+*/
+void transport_handle_event(mysocket_t sd, unsigned int event)
+{
+	ctx = (context_t *) stcp_get_context(sd);
+	assert(ctx);
+
+	if(ctx->connection_state < CSTATE_ESTABLISHED)
+		handle_handshake_event(sd, event);
+	else
+		handle_connection_event(sd, event);
+
+	if(ctx->done)
+		finish_connection(sd);
+	else
+		request_next_event(sd);
 }
 
 
@@ -708,31 +1148,12 @@ static void generate_initial_seq_num(context_t *ctx)
 }
 
 
-/* control_loop() is the main STCP loop; it repeatedly waits for one of the
-* following to happen:
-*   - incoming data from the peer
-*   - new data from the application (via mywrite())
-*   - the socket to be closed (via myclose())
-*   - a timeout
+/* initialize_connection() sets up the sender and receiver state once the
+* handshake has completed.
 */
-static void control_loop(mysocket_t sd, context_t *ctx)
+static void initialize_connection(mysocket_t sd, context_t *ctx)
 {
-	char *rcvdAppData = NULL, *rcvdNetworkData = NULL;
-	size_t rcvdAppDataLength = 0, rcvdNetworkDataLength = 0;
 	int iterator = 0;
-	unsigned int numOfPacket, event;
-
-	//Max data bytes sender buffer can receive from APP
-	size_t maxAppDataRcvdLength = 0;
-	size_t startIndex = 0;
-
-	// STCP Segment
-	char* stcpSegment = NULL;
-
-	// STCP Header
-	STCPHeader* segmentHeader = NULL;
-	STCPHeader* ackSegment = NULL;
-	size_t stcpSegmentLength = 0;
 
 	assert(ctx);
 
@@ -757,496 +1178,148 @@ static void control_loop(mysocket_t sd, context_t *ctx)
 	for(;iterator < MAX_WINDOW_SIZE; iterator++){
 		ctx->rcvrWindow[iterator] = -1;
 	}
+}
 
-	while (!ctx->done)
-	{
-		/* see stcp_api.h or stcp_api.c for details of this function */
-		/* XXX: you will need to change some of these arguments! */
-		if(getEmptySenderBufferSize() == 0){
-			event = stcp_wait_for_event(sd, NETWORK_DATA | APP_CLOSE_REQUESTED | TIMEOUT, NULL); 
-		}
-		else{
-			event = stcp_wait_for_event(sd, ANY_EVENT, NULL);
-		}
-		/* check whether it was the network, app, or a close request */
-
-		// NETWORK DATA Received
-		if(event & NETWORK_DATA){
-			// Receive the segment from the network layer
-			stcpSegmentLength = TCP_HEADER_SIZE + STCP_MSS; /* Maximum Data sender can send is MSS i.e. 536*/
-			stcpSegment = (char*) calloc(stcpSegmentLength, sizeof(char));
-
-			// Update the segment length with the length of the data received 
-			stcpSegmentLength = stcp_network_recv(sd, stcpSegment, stcpSegmentLength);
-
-			segmentHeader = (STCPHeader*) stcpSegment;
-			// Endianess Support
-			segmentHeader->th_ack = ntohl(segmentHeader->th_ack);
-			segmentHeader->th_seq = ntohl(segmentHeader->th_seq);
-			segmentHeader->th_win = ntohs(segmentHeader->th_win);
-
-			ctx->currentRcvrWindowSize = (segmentHeader->th_win); /* storing the remote side receiver window */
-
-			/* Here we will first see whether there is any data in tha packet or its just an ACK packet
-			* for data packet we need to send the ACK ASAP */
-
-			if(TCP_OPTIONS_LEN(stcpSegment) == 0){
-				rcvdNetworkDataLength = stcpSegmentLength - TCP_HEADER_SIZE; // There is no options in segment
-			}else{
-				rcvdNetworkDataLength = stcpSegmentLength - TCP_OPTIONS_LEN(stcpSegment) - TCP_HEADER_SIZE;
-			}
-
-			// This will handle DATA Packet with or without ACK 
-			if(rcvdNetworkDataLength != 0){
-
-				// Handle the ACK packet and DATA Packet separately
-				// Here we will update the sequence numbers as per the ACK received
-				if(segmentHeader->th_flags & TH_ACK){
-					if(segmentHeader->th_ack > ctx->sendBase && 
-						segmentHeader->th_ack <= ctx->nextSeqNum)
-					{
-
-						#ifdef print
-						printf("\n Data packet with valid ACK packet received with seq number %u and seq number of ack field %u\n", segmentHeader->th_seq,segmentHeader->th_ack);
-						#endif
-						ctx->sendBufferBaseInfo = (ctx->sendBufferBaseInfo + (segmentHeader->th_ack - ctx->sendBase)) % MAX_WINDOW_SIZE;
-						ctx->sendBase = segmentHeader->th_ack;
-						// Timer Check, if running then stop it`
-						if(isTimerValueSet()){
-							stopTimer();
-						}
-						// Restart the time if there are still some unacked data
-						if(ctx->sendBase < ctx->nextSeqNum){
-							startTimer();
-						}
-					}	
-				}//Handle the DATA Packet along with FIN packet
-				if((segmentHeader->th_flags & TH_FIN) &&
-	                                        (segmentHeader->th_seq == ctx->expectedSeqNumber)) {
-
-						if(ctx->connection_state == CSTATE_ESTABLISHED){
-	                                                // Notify the application
-                                                        stcp_fin_received(sd);
-                                                        // Change the state to CLOSE_WAIT
-                                                        ctx->connection_state = CSTATE_CLOSE_WAIT;
-                                                                                                                                                                                         }
-                                                 else if(ctx->connection_state == CSTATE_FINWAIT_1){
-                                                        // Notify the application       
-                                                        stcp_fin_received(sd);
-                                                                                                                                                                                                //Change the state to CLOSING
-                                                        ctx->connection_state = CSTATE_CLOSING;
-                                                                                                                                                                                         }else if(ctx->connection_state == CSTATE_FINWAIT_2){
-                                                        // Notify the application
-                                                        stcp_fin_received(sd);
-                                                                                                                                                                                                // Change state to TIME_WAIT
-                                                        ctx->connection_state = CSTATE_TIME_WAIT;
-							printf("\n BYE BYE -- M GOING DOWN \n");
-                                                        ctx->done = true;
-							exit(0);
-						}
-				}
-				#ifdef print
-				printf("\n DAta packet received with sequence number %u\n",segmentHeader->th_seq);
-				#endif
-	
-				// check whether the segment is inorder (Receiver's Action)
-				if(segmentHeader->th_seq == ctx->expectedSeqNumber){
-
-					#ifdef print
-					printf("\n In Order Data Received\n");
-					#endif
-					if(rcvdNetworkDataLength > MAX_WINDOW_SIZE){
-						rcvdNetworkDataLength = MAX_WINDOW_SIZE;
-					}
-	   
-					rcvdNetworkData = (char*) calloc(rcvdNetworkDataLength, sizeof(char));
-					memcpy(rcvdNetworkData, stcpSegment+TCP_DATA_START(stcpSegment), rcvdNetworkDataLength);
 
-					// store the received data into the receiver data buffer
-					storeDataIntoBuffer(ctx->rcvrDataBuffer, rcvdNetworkData, 
-					ctx->rcvBufferBaseInfo, rcvdNetworkDataLength);
+/* handle_connection_event() is the main STCP event handler; it's called
+* when one of the following happens:
+*   - incoming data from the peer
+*   - new data from the application (via mywrite())
+*   - the socket to be closed (via myclose())
+*   - a timeout
+*/
+static void handle_connection_event(mysocket_t sd, unsigned int event)
+{
+	char *rcvdAppData = NULL;
+	size_t rcvdAppDataLength = 0;
+	int iterator = 0;
 
-					// switch the bytes on in receiver window which have been received
-					setReceivedBytesInReceiverWindow(ctx->rcvrWindow, ctx->rcvBufferBaseInfo, rcvdNetworkDataLength);
+	// Segments received from the network in one batch
+	unsigned int numOfSegments = 0;
+	size_t rcvdSegmentLengths[NETWORK_BATCH_SIZE];
 
-					// Send Data to Application 
-					sendDataToApplication(sd);
+	//Max data bytes sender buffer can receive from APP
+	size_t maxAppDataRcvdLength = 0;
+	size_t startIndex = 0;
 
-					//Send Ack for the inorder data received
-					sendAcknowledgementPacket(sd);
-		   
-					// Free the memory after storing it inside the receiver buffer
-					if(rcvdNetworkData != NULL){
-						free(rcvdNetworkData);
-						rcvdNetworkData = NULL;
-					}
-				}
-				//Received the out of order data (Receiver Action)
-				else if(segmentHeader->th_seq > ctx->expectedSeqNumber && 
-						segmentHeader->th_seq <= (ctx->expectedSeqNumber + MAX_WINDOW_SIZE -1)){
-						#ifdef print
-						printf("\n Out of Order Data received\n");
-						#endif
-				
-						// check for the buffer space in receivers end. Space should be there
-						// as we are sending the data from sender side only if rcvr window size
-						// is greater than 0. To be double sure we can check here again
-						if(ctx->selfRcvWindowSize > 0){
-							//check for data size is within the window size or not
-							if((segmentHeader->th_seq + rcvdNetworkDataLength) > 
-										(ctx->expectedSeqNumber + MAX_WINDOW_SIZE - 1)){
-								rcvdNetworkDataLength = (ctx->expectedSeqNumber + MAX_WINDOW_SIZE - segmentHeader->th_seq);
-							} 
-							
-							rcvdNetworkData = (char*) calloc(rcvdNetworkDataLength, sizeof(char));
-							memcpy(rcvdNetworkData, stcpSegment+TCP_DATA_START(stcpSegment), rcvdNetworkDataLength);
-
-							startIndex = (ctx->rcvBufferBaseInfo + (segmentHeader->th_seq - ctx->expectedSeqNumber))%MAX_WINDOW_SIZE;
-								
-
-							storeDataIntoBuffer(ctx->rcvrDataBuffer, rcvdNetworkData, startIndex, rcvdNetworkDataLength);
-								
-
-							//switch the bytes on in receiver window which have been received
-							setReceivedBytesInReceiverWindow(ctx->rcvrWindow, startIndex, rcvdNetworkDataLength);
-	
-							//Update the receiver window size 
-							ctx->selfRcvWindowSize = ctx->selfRcvWindowSize - rcvdNetworkDataLength;
-
-							//Send Acknowledgement	
-							sendAcknowledgementPacket(sd);
-
-							//Free the memory after storing it insider the receiver buffer
-							if(rcvdNetworkData != NULL){
-								free(rcvdNetworkData);
-								rcvdNetworkData = NULL;
-							}
-						}
-				}
-				// Data Received contains part of old data and part of expected data (Receiver Action)
-				else if(segmentHeader->th_seq < ctx->expectedSeqNumber && 
-				                           segmentHeader->th_seq >= ctx->expectedSeqNumber - MAX_WINDOW_SIZE){
-
-					// Discard the Data which is already acknowledged
-					if((segmentHeader->th_seq + rcvdNetworkDataLength) >= ctx->expectedSeqNumber){
-					// This means data has part of new data also. Need to store that and send to application
-					        #ifdef print
-						printf("\n Old Segment received may contain some new data\n");
-						#endif
-						// Data Start Position in packet
-						startIndex = ctx->expectedSeqNumber - segmentHeader->th_seq;
-					
-						rcvdNetworkDataLength = (rcvdNetworkDataLength - (ctx->expectedSeqNumber - segmentHeader->th_seq));
+	// STCP Header
+	STCPHeader* segmentHeader = NULL;
 
-						if(rcvdNetworkDataLength > MAX_WINDOW_SIZE){
-							rcvdNetworkDataLength = MAX_WINDOW_SIZE;
-					        }
+	// Retransmit first if the timer has run out
+	if(hasTimerExpired()){
+		#ifdef print
+		printf("\n TIMEOUT EVENT FIRED\n");
+		#endif
+		handleTimerExpiry();
+	}
 
-						//Copy the required portion of data from the segment
-						rcvdNetworkData = (char*) calloc(rcvdNetworkDataLength, sizeof(char));
-						memcpy(rcvdNetworkData, stcpSegment+TCP_DATA_START(stcpSegment)+startIndex, rcvdNetworkDataLength);
+	/* check whether it was the network, app, or a close request */
 
-						// store the received data into the receiver data buffer
-						storeDataIntoBuffer(ctx->rcvrDataBuffer, rcvdNetworkData,
-						ctx->rcvBufferBaseInfo, rcvdNetworkDataLength);
+	// NETWORK DATA Received
+	if(event & NETWORK_DATA){
+		// Drain every segment queued by the network layer in one go
+		numOfSegments = stcp_network_recv_batch(sd, ctx->rcvdSegments,
+		                        TCP_HEADER_SIZE + STCP_MSS, rcvdSegmentLengths, NETWORK_BATCH_SIZE);
 
-						// switch the bytes on in receiver window which have been received
-						setReceivedBytesInReceiverWindow(ctx->rcvrWindow, ctx->rcvBufferBaseInfo, rcvdNetworkDataLength);
+		for(iterator = 0; iterator < (int)numOfSegments; iterator++){
+			handleNetworkSegment(sd, ctx->rcvdSegments[iterator],
+			                     MIN(rcvdSegmentLengths[iterator], sizeof(ctx->rcvdSegments[iterator])));
+		}
 
-						// Send Data to Application 
-						sendDataToApplication(sd);
+		// Pass the in-order data up once and send one cumulative ACK
+		flushReceivedData(sd);
+	}
+	// Application is sending the DATA 
+	else if (event & APP_DATA)
+	{
+		/* the application has requested that data be sent */
+		/* see stcp_app_recv() */
+		#ifdef print
+		printf("\nApplication Data Event Fired\n"); 
+		#endif
+		// Check the empty space in sender buffer
+		maxAppDataRcvdLength  = getEmptySenderBufferSize();
 
-						//Send Ack for the inorder data received
-						sendAcknowledgementPacket(sd);
+		//  Checking the receiver window size with the empty data buffer
+		maxAppDataRcvdLength = MIN(maxAppDataRcvdLength, ctx->currentRcvrWindowSize);
 
-						// Free the memory after storing it inside the receiver buffer
-						if(rcvdNetworkData != NULL){
-							free(rcvdNetworkData);
-							rcvdNetworkData = NULL;
-						}
-					}else
-						sendAcknowledgementPacket(sd);
-				}
-			}
-			// PURE ACK PACKET RECEIVED
-			else if( rcvdNetworkDataLength == 0){
-				// Received the ACK packet (Sender Action)
-				if(segmentHeader->th_flags & TH_ACK){
-					if(ctx->connection_state == CSTATE_ESTABLISHED){
-						if(segmentHeader->th_ack > ctx->sendBase && segmentHeader->th_ack <= ctx->nextSeqNum)
-						{
-							#ifdef print
-							printf("\n Ack packet received with seq number %u and seq number of ack field %u\n", segmentHeader->th_seq,segmentHeader->th_ack);
-							#endif
-							ctx->sendBufferBaseInfo = (ctx->sendBufferBaseInfo + (segmentHeader->th_ack - ctx->sendBase)) % MAX_WINDOW_SIZE;
-							ctx->sendBase = segmentHeader->th_ack;
-						
-					        	// Timer Check, if running then stop it`
-							if(isTimerValueSet()){
-								stopTimer();
-							}
-							// Restart the time if there are still some unacked data
-							if(ctx->sendBase < ctx->nextSeqNum){
-								startTimer();
-							}
-                                                        // ACK received for INORDER Data
-							ctx->numberOfRetransmission = 0;
-						
-						}else{
-							#ifdef print
-							printf("\n ACK Packet with sequence number out of congestion window\n");
-							#endif
-						}
-					}else if(ctx->connection_state == CSTATE_FINWAIT_1){
-						// change the state and send nothing
-						ctx->connection_state = CSTATE_FINWAIT_2;
-						ctx->finRetransmit = 0;
-
-						if(isTimerValueSet()){
-						   stopTimer();
-						}
-					}else if(ctx->connection_state == CSTATE_LAST_ACK){
-					        ctx->finRetransmit = 0;	
-                                                ctx->connection_state = CSTATE_TIME_WAIT;
-						if(isTimerValueSet()){
-						    stopTimer();
-						}
-						// change the state and send nothing
-						printf("\n BYE BYE -- M GOING DOWN \n");
-                                                ctx->done = true;
-						exit(0);
+		// Again wait for event if the buffer on sender side is full
+		if(maxAppDataRcvdLength <= 0){
+			return;
+		}
+		// Allocate memory to receive the data
+		rcvdAppData = (char*) calloc(maxAppDataRcvdLength, sizeof(char));
 
-					}else if(ctx->connection_state == CSTATE_CLOSING){
-						// change the state to time_wait
-						ctx->connection_state = CSTATE_TIME_WAIT;
-						ctx->finRetransmit = 0;
+		// Get the data from application
+		
+	        rcvdAppDataLength = stcp_app_recv(sd, rcvdAppData, maxAppDataRcvdLength);
+		
 
-						 if(isTimerValueSet()){
-						     stopTimer();
-						 }
-					}
-				   
-				}// Received a FIN segment
-				else if((segmentHeader->th_flags & TH_FIN) && 
-				        (segmentHeader->th_seq == ctx->expectedSeqNumber)) {
-
-					if(ctx->connection_state == CSTATE_ESTABLISHED){
-					        // Notify the application
-						stcp_fin_received(sd);
-						// Send the ACK packet
-						ackSegment = (STCPHeader*) calloc(1, sizeof(STCPHeader));
-						createStcpHeader(ackSegment);
-
-						ackSegment->th_ack = htonl(++(ctx->expectedSeqNumber));
-						ackSegment->th_flags = 0|TH_ACK;
-
-						while(stcp_network_send(sd, ackSegment, sizeof(STCPHeader), NULL) < 0){
-						}
-
-						// Change the state to CLOSE_WAIT
-						ctx->connection_state = CSTATE_CLOSE_WAIT;
-					
-					        // free the memory
-						if( ackSegment != NULL){
-						        free(ackSegment);
-							ackSegment = NULL;
-					        }
-					}
-					else if(ctx->connection_state == CSTATE_FINWAIT_1){
-				                // Notify the application	
-						stcp_fin_received(sd);
+		// Buffer the received data
+		startIndex  = (ctx->sendBufferBaseInfo + (ctx->nextSeqNum - ctx->sendBase)) % MAX_WINDOW_SIZE;
+		storeDataIntoBuffer(ctx->sndrDataBuffer, rcvdAppData, startIndex, rcvdAppDataLength);
 
-						// Send the Ack
-						ackSegment = (STCPHeader*) calloc(1, sizeof(STCPHeader));
-                                                createStcpHeader(ackSegment);
-                                                ackSegment->th_ack = htonl(++(ctx->expectedSeqNumber));
-				                ackSegment->th_flags = 0|TH_ACK;
-
-                                                while(stcp_network_send(sd, ackSegment, sizeof(STCPHeader), NULL) < 0){
-                                                }
-						//Change the state to CLOSING
-						ctx->connection_state = CSTATE_CLOSING;
+		// Send data received from the Applicaiton to the receiver in one batch
+		sendDataSegments(sd, rcvdAppData, rcvdAppDataLength, ctx->nextSeqNum);
 
-					}else if(ctx->connection_state == CSTATE_FINWAIT_2){
-						// Notify the application
-						stcp_fin_received(sd);
-						// Send the ACK Packet
-                                                ackSegment = (STCPHeader*) calloc(1, sizeof(STCPHeader));
-                                                createStcpHeader(ackSegment);
-                                                ackSegment->th_ack = htonl(++(ctx->expectedSeqNumber));
-				                ackSegment->th_flags = 0|TH_ACK;
+		// Update the next sequence number
+		ctx->nextSeqNum = ctx->nextSeqNum + rcvdAppDataLength;
 
-				                while(stcp_network_send(sd, ackSegment, sizeof(STCPHeader), NULL) < 0){
-	                                        }
+		free(rcvdAppData);
+		rcvdAppData = NULL;
 
-						// Change state to TIME_WAIT
-						ctx->connection_state = CSTATE_TIME_WAIT;
-						printf("\n BYE BYE -- M GOING DOWN \n");
-						ctx->done = true;
-						exit(0);
-					}
-				}				
-			}
-	
-		        if(segmentHeader != NULL){
-				segmentHeader = NULL;
-			}
-			if(stcpSegment != NULL){
-				free(stcpSegment);
-				stcpSegment = NULL;
-			}
+		// Data has been sent start the timer and set the count to 1
+		if(isTimerValueSet()){
+		       stopTimer();
+			startTimer();
+		}else{
+			startTimer();
 		}
-		// Application is sending the DATA 
-		else if (event & APP_DATA)
-		{
-			/* the application has requested that data be sent */
-			/* see stcp_app_recv() */
-			#ifdef print
-			printf("\nApplication Data Event Fired\n"); 
-			#endif
-			// Check the empty space in sender buffer
-			maxAppDataRcvdLength  = getEmptySenderBufferSize();
-
-			//  Checking the receiver window size with the empty data buffer
-			maxAppDataRcvdLength = MIN(maxAppDataRcvdLength, ctx->currentRcvrWindowSize);
-
-			// Again wait for event if the buffer on sender side is full
-			if(maxAppDataRcvdLength <= 0){
-				continue;
-			}
-			// Allocate memory to receive the data
-			rcvdAppData = (char*) calloc(maxAppDataRcvdLength, sizeof(char));
 
-			// Get the data from application
-			
-		        rcvdAppDataLength = stcp_app_recv(sd, rcvdAppData, maxAppDataRcvdLength);
+	}
+	// Application is requesting to close the connection.  The worker passes
+	// this on only once, so it's handled even alongside network data
+	if(event & APP_CLOSE_REQUESTED){
+		#ifdef print
+		printf("\n APP CLOSED EVENT FIRED\n");
+		#endif
+	   
+		//Create the FIN Packet
+		if(ctx->connection_state == CSTATE_ESTABLISHED){
+			segmentHeader = (STCPHeader*) calloc(1, sizeof(STCPHeader));
+			createStcpHeader(segmentHeader);
+			segmentHeader->th_flags = 0|TH_FIN;
+	        
+			// Send the FIN Packet
+			(void) stcp_network_send(ctx->sd, segmentHeader, sizeof(STCPHeader), NULL);
 			
+			// Change the state to FIN_WAIT_1
+			ctx->connection_state = CSTATE_FINWAIT_1;
+			ctx->nextSeqNum++;
+		}
+		else if(ctx->connection_state == CSTATE_CLOSE_WAIT){
 
-			// Buffer the received data
-			startIndex  = (ctx->sendBufferBaseInfo + (ctx->nextSeqNum - ctx->sendBase)) % MAX_WINDOW_SIZE;
-			storeDataIntoBuffer(ctx->sndrDataBuffer, rcvdAppData, startIndex, rcvdAppDataLength);
-
-			numOfPacket = (int)(rcvdAppDataLength/STCP_MSS);
-
-			if(numOfPacket*STCP_MSS < rcvdAppDataLength){
-				++numOfPacket;
-			}
-
-			// Send data received from the Applicaiton to the receiver 
-			do{
-				// Allocate memory to the segment
-				if(rcvdAppDataLength >= STCP_MSS){
-
-					stcpSegmentLength = TCP_HEADER_SIZE + STCP_MSS;
-					stcpSegment = (char*) calloc(stcpSegmentLength, sizeof(char));
-
-					segmentHeader = (STCPHeader*) stcpSegment;
-					//Fill the header
-					createStcpHeader(segmentHeader);
-
-					//copy the data inside the segment
-					memcpy(stcpSegment+TCP_HEADER_SIZE, rcvdAppData, STCP_MSS);
-
-					// Update the data information from app side
-					rcvdAppData = rcvdAppData + STCP_MSS;
-					rcvdAppDataLength = rcvdAppDataLength - STCP_MSS;
-
-					//Update the next sequence number
-					ctx->nextSeqNum = ctx->nextSeqNum + STCP_MSS;
-				}
-				else
-				{
-
-					stcpSegmentLength = TCP_HEADER_SIZE + rcvdAppDataLength;
-					stcpSegment = (char*) calloc(stcpSegmentLength, sizeof(char));
-					segmentHeader = (STCPHeader*) stcpSegment;
-
-					//Fill the header
-					createStcpHeader(segmentHeader);
-
-					//copy the data inside the segment
-					memcpy(stcpSegment+TCP_HEADER_SIZE, rcvdAppData, rcvdAppDataLength);
-
-					// Update the next sequence number
-					ctx->nextSeqNum = ctx->nextSeqNum + rcvdAppDataLength;
-					rcvdAppDataLength = 0;
-				}
-
-				// Keep on sending till it successfully sents the segment
-				do{
-				}while(stcp_network_send(sd, stcpSegment, stcpSegmentLength, NULL) < 0);
-
-				numOfPacket--;
-
-				//Packet has been sent release the memory
-				if(stcpSegment){
-					free(stcpSegment);
-					stcpSegment = NULL;
-				}
-			}while(rcvdAppDataLength != 0 || numOfPacket != 0);  // End of Data Send
-
-			// Data has been sent start the timer and set the count to 1
-			if(isTimerValueSet()){
-			       stopTimer();
-				startTimer();
-			}else{
-				startTimer();
-			}
+			segmentHeader = (STCPHeader*) calloc(1, sizeof(STCPHeader));
+		        createStcpHeader(segmentHeader);
+			segmentHeader->th_flags = 0|TH_FIN;
 
+			//send the FIN Packet
+			(void) stcp_network_send(ctx->sd, segmentHeader, sizeof(STCPHeader), NULL);
+                        // Change the state to LAST_ACK
+                        ctx->connection_state = CSTATE_LAST_ACK;
+			ctx->nextSeqNum++;
 		}
-		// Application is requesting to close the connection
-		else if(event & APP_CLOSE_REQUESTED){
-			#ifdef print
-			printf("\n APP CLOSED EVENT FIRED\n");
-			#endif
-		   
-			//Create the FIN Packet
-			if(ctx->connection_state == CSTATE_ESTABLISHED){
-				segmentHeader = (STCPHeader*) calloc(1, sizeof(STCPHeader));
-				createStcpHeader(segmentHeader);
-				segmentHeader->th_flags = 0|TH_FIN;
-		        
-				// Send the FIN Packet
-				while(stcp_network_send(ctx->sd, segmentHeader, sizeof(STCPHeader), NULL) < 0){
-				}
-				
-				// Change the state to FIN_WAIT_1
-				ctx->connection_state = CSTATE_FINWAIT_1;
-				ctx->nextSeqNum++;
-			}
-			else if(ctx->connection_state == CSTATE_CLOSE_WAIT){
-
-				segmentHeader = (STCPHeader*) calloc(1, sizeof(STCPHeader));
-			        createStcpHeader(segmentHeader);
-				segmentHeader->th_flags = 0|TH_FIN;
-
-				//send the FIN Packet
-				while(stcp_network_send(ctx->sd, segmentHeader, sizeof(STCPHeader), NULL) < 0){
-                                }
-                                // Change the state to LAST_ACK
-                                ctx->connection_state = CSTATE_LAST_ACK;
-				ctx->nextSeqNum++;
-			}
-                          // Timer set for FIN packet
-                         if(isTimerValueSet()){
+                  // Timer set for FIN packet
+                 if(isTimerValueSet()){
 		            stopTimer();
 		            startTimer();
 		        }else{
 		            startTimer();
 		        }
 
-			if(segmentHeader != NULL){
-				free(segmentHeader);
-				segmentHeader = NULL;
-			}
-						   
-		}
-		else if(event & TIMEOUT){
-			#ifdef print
-			printf("\n TIMEOUT EVENT FIRED\n");
-			#endif
-			continue;
-
+		if(segmentHeader != NULL){
+			free(segmentHeader);
+			segmentHeader = NULL;
 		}
 	}
 }
@@ -117,5 +117,6 @@ typedef struct tcphdr
 #endif
 
 extern void transport_init(mysocket_t sd, bool_t is_active);
+extern void transport_handle_event(mysocket_t sd, unsigned int event);
 
 #endif  /* __TRANSPORT_H__ */